@@ -1,3 +1,6 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#endif
 #include <windows.h>
 #include <GL/glut.h>
 #include <cmath>
@@ -5,10 +8,41 @@
 #include <vector>
 #include <algorithm>
 #include <random>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+#include <string>
+#include <new>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SNOW_SSE2 1
+#endif
+#ifdef _MSC_VER
+#define SNOW_NOINLINE __declspec(noinline)
+#else
+#define SNOW_NOINLINE __attribute__((noinline))
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
 
 
 // --- Animation & navigation state ---
-static float armAnimAngle = 0;
 static float armAnimPhase = 0.0f;
 float snowmanX = 0.0f, snowmanZ = 0.0f;
 float headingDeg = 0.0f; // y-axis, 0 = forward along -Z
@@ -23,6 +57,7 @@ static float scaleFactor = 1.0f;
 // Ground tile parameters
 float groundTileSize = 25.0f;
 int groundRepeat = 10;  // Ensures a big local patch: 7x7=49 tiles
+int groundStrips = 32;  // quads per tile side
 
 float footstepPhase = 0.0f;
 static bool LeftDown = false;
@@ -33,6 +68,7 @@ GLUquadric* quad = nullptr;
 // Controls
 bool keyW = false, keyS = false, keyA = false, keyD = false;
 bool keyH = false;
+bool keyF = false, keyG = false; // one-shot snowball throws
 
 // --- Sword slash fields
 bool swordSlashing = false;
@@ -46,7 +82,1605 @@ struct Particle {
     float age, life;
 };
 static std::vector<Particle> particles;
+static std::vector<Particle> particleSpawns; // joins `particles` after the tick's aging pass
 const float footTrackX = 0.45f;
+int footprintParticles = 1; // puffs emitted per footstep
+
+// Simulation RNG; unlike rand() its state can be saved and restored
+uint32_t simRngState = 12345u;
+int simRand()
+{
+    simRngState = simRngState * 1664525u + 1013904223u;
+    return (int)(simRngState >> 16) & 0x7fff;
+}
+
+void spawnFootprint(float x, float z)
+{
+    Particle p;
+    p.x = x;
+    p.y = 0.0f;
+    p.z = z;
+    p.age = 0.0f;
+    p.life = 0.84f + 0.12f * (simRand() % 100) / 100.f;
+    particleSpawns.push_back(p);
+    // Extra puffs scatter around the print
+    for (int i = 1; i < footprintParticles; ++i) {
+        Particle q = p;
+        q.x = x + (simRand() % 100 - 50) / 200.0f;
+        q.z = z + (simRand() % 100 - 50) / 200.0f;
+        q.life = 0.84f + 0.12f * (simRand() % 100) / 100.f;
+        particleSpawns.push_back(q);
+    }
+}
+
+// --- Snowman simulation ---
+// One step of a snowman's movement, arm swing, slash and footsteps. The
+// local player, networked snowmen and prediction replays all go through it.
+struct SnowmanState {
+    float x = 0, z = 0, heading = 0;
+    float armPhase = 0, footPhase = 0, footRef = 0;
+    bool footLeft = false, slashing = false;
+    float slashTimer = 0;
+};
+enum SnowmanKeyBits { SNOW_KEY_W = 1, SNOW_KEY_S = 2, SNOW_KEY_A = 4, SNOW_KEY_D = 8, SNOW_KEY_H = 16 };
+
+// Returns true and the foot's position when a footstep lands
+bool stepSnowman(SnowmanState& s, unsigned keys, float delta, float& footX, float& footZ)
+{
+    // A/D turn snowman's body (not the camera!)
+    if (keys & SNOW_KEY_A) s.heading += rotSpeed * delta;
+    if (keys & SNOW_KEY_D) s.heading -= rotSpeed * delta;
+
+    // Movement: move in SNOWMAN's heading
+    bool moving = false;
+    float walkDir = 0.0f;
+    if (keys & SNOW_KEY_S) { walkDir += 1.0f; moving = true; }
+    if (keys & SNOW_KEY_W) { walkDir -= 1.0f; moving = true; }
+    if (walkDir != 0.0f) {
+        float rad = -s.heading * 3.1415926f / 180.0f;
+        s.x += sinf(rad) * moveSpeed * delta * walkDir;
+        s.z += -cosf(rad) * moveSpeed * delta * walkDir;
+        s.armPhase += delta * 4.0f;
+        s.footPhase += delta * 2.9f;
+    }
+
+    // Sword slash
+    if ((keys & SNOW_KEY_H) && !s.slashing) {
+        s.slashing = true;
+        s.slashTimer = 0.0f;
+    }
+    if (s.slashing) {
+        s.slashTimer += delta;
+        if (s.slashTimer >= swordSlashDuration) {
+            s.slashing = false;
+            s.slashTimer = 0.0f;
+        }
+    }
+
+    bool footstep = false;
+    float footSin = sinf(s.footPhase * 3.1415f);
+    if (moving && footSin > 0.45f && s.footRef <= 0.45f) {
+        s.footLeft = !s.footLeft;
+        float rad = s.heading * 3.1415926f / 180.0f;
+        float side = s.footLeft ? -footTrackX : footTrackX;
+        footX = s.x + cosf(rad) * side;
+        footZ = s.z + sinf(rad) * side;
+        footstep = true;
+    }
+    s.footRef = footSin;
+    return footstep;
+}
+
+SnowmanState playerStep; // the local player's step state, incl. footstep phase
+
+// --- Animation clips ---
+// Poses come from sampled curves rather than inline sin() math. Every
+// snowman drawn in a frame queues its tracks into one SoA batch, which is
+// then evaluated four tracks at a time.
+const int animSamples = 32; // keys per clip, evenly spaced over its length
+
+enum AnimClipId { ANIM_WALK, ANIM_IDLE, ANIM_SLASH, ANIM_CLIP_COUNT };
+
+struct AnimClip {
+    const char* name;
+    float length; // walk runs on arm phase (radians), the others on seconds
+    bool loop;
+};
+const AnimClip animClips[ANIM_CLIP_COUNT] = {
+    { "walk", 6.2831853f, true },
+    { "idle", 3.0f, true },
+    { "slash", swordSlashDuration, false },
+};
+// One extra key per clip closes the loop or holds the last pose
+float animKeys[ANIM_CLIP_COUNT][animSamples + 1];
+float animInvLength[ANIM_CLIP_COUNT];
+
+// Idle sway control points, resampled over the clip (degrees)
+const float animIdlePoints[] = { 0.0f, 4.0f, 6.0f, 4.0f, 0.0f, -3.0f, -4.0f, -3.0f, 0.0f };
+
+void buildAnimClips()
+{
+    const int idleSpans = sizeof(animIdlePoints) / sizeof(animIdlePoints[0]) - 1;
+    for (int c = 0; c < ANIM_CLIP_COUNT; ++c) animInvLength[c] = 1.0f / animClips[c].length;
+    for (int k = 0; k <= animSamples; ++k) {
+        float u = (float)k / animSamples;
+        animKeys[ANIM_WALK][k] = 28.0f * sinf(u * 6.2831853f);
+        animKeys[ANIM_SLASH][k] = swordSlashMaxAngle * sinf(u * 3.1415927f);
+        float pu = u * idleSpans;
+        int pi = std::min(idleSpans - 1, (int)pu);
+        float f = pu - pi, s = f * f * (3.0f - 2.0f * f);
+        animKeys[ANIM_IDLE][k] = animIdlePoints[pi] + (animIdlePoints[pi + 1] - animIdlePoints[pi]) * s;
+    }
+}
+
+// Each track yields one angle: clip a at its time, cross-faded towards clip
+// b by weight. Times are stored as fractions of the clip's length. The
+// arrays only grow, so a steady frame queues without allocating.
+struct AnimBatch {
+    std::vector<float> phase[2], weight, out;
+    std::vector<int> key[2];      // offset of the layer's clip in animKeys
+    std::vector<int32_t> loop[2]; // ~0 wraps the phase, 0 clamps it
+    size_t count = 0;
+
+    size_t size() const { return count; }
+    void clear() { count = 0; }
+    void grow()
+    {
+        size_t cap = std::max<size_t>(64, count * 2);
+        for (int l = 0; l < 2; ++l) { phase[l].resize(cap); key[l].resize(cap); loop[l].resize(cap); }
+        weight.resize(cap);
+        out.resize(cap);
+    }
+    int add(AnimClipId a, float ta, AnimClipId b, float tb, float w)
+    {
+        if (count == weight.size()) grow();
+        phase[0][count] = ta * animInvLength[a];
+        phase[1][count] = tb * animInvLength[b];
+        key[0][count] = a * (animSamples + 1);
+        key[1][count] = b * (animSamples + 1);
+        loop[0][count] = animClips[a].loop ? ~0 : 0;
+        loop[1][count] = animClips[b].loop ? ~0 : 0;
+        weight[count] = w;
+        return (int)count++;
+    }
+    int add(AnimClipId a, float t) { return add(a, t, a, t, 0.0f); }
+    void evaluate();
+};
+
+static float animSampleLayer(const AnimBatch& b, int l, size_t i)
+{
+    float u = b.phase[l][i];
+    u = b.loop[l][i] ? u - std::floor(u) : std::max(0.0f, std::min(1.0f, u));
+    u *= animSamples;
+    int k = std::min(animSamples - 1, (int)u);
+    const float* keys = &animKeys[0][0] + b.key[l][i] + k;
+    return keys[0] + (u - k) * (keys[1] - keys[0]);
+}
+
+void AnimBatch::evaluate()
+{
+    size_t n = size(), i = 0;
+#ifdef SNOW_SSE2
+    const float* keys = &animKeys[0][0];
+    const __m128 one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps(), samples = _mm_set1_ps((float)animSamples);
+    const __m128i lastKey = _mm_set1_epi32(animSamples - 1);
+    for (; i + 4 <= n; i += 4) {
+        __m128 v[2];
+        for (int l = 0; l < 2; ++l) {
+            __m128 u = _mm_loadu_ps(&phase[l][i]);
+            __m128 whole = _mm_cvtepi32_ps(_mm_cvttps_epi32(u));
+            whole = _mm_sub_ps(whole, _mm_and_ps(_mm_cmpgt_ps(whole, u), one)); // floor
+            __m128 wraps = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)&loop[l][i]));
+            u = _mm_or_ps(_mm_and_ps(wraps, _mm_sub_ps(u, whole)), _mm_andnot_ps(wraps, _mm_min_ps(_mm_max_ps(u, zero), one)));
+            u = _mm_mul_ps(u, samples);
+            __m128i k = _mm_cvttps_epi32(u);
+            __m128i over = _mm_cmpgt_epi32(k, lastKey);
+            k = _mm_or_si128(_mm_and_si128(over, lastKey), _mm_andnot_si128(over, k));
+            __m128 f = _mm_sub_ps(u, _mm_cvtepi32_ps(k));
+            int idx[4];
+            _mm_storeu_si128((__m128i*)idx, _mm_add_epi32(k, _mm_loadu_si128((const __m128i*)&key[l][i])));
+            __m128 k0 = _mm_setr_ps(keys[idx[0]], keys[idx[1]], keys[idx[2]], keys[idx[3]]);
+            __m128 k1 = _mm_setr_ps(keys[idx[0] + 1], keys[idx[1] + 1], keys[idx[2] + 1], keys[idx[3] + 1]);
+            v[l] = _mm_add_ps(k0, _mm_mul_ps(f, _mm_sub_ps(k1, k0)));
+        }
+        __m128 w = _mm_loadu_ps(&weight[i]);
+        _mm_storeu_ps(&out[i], _mm_add_ps(v[0], _mm_mul_ps(w, _mm_sub_ps(v[1], v[0]))));
+    }
+#endif
+    for (; i < n; ++i) {
+        float a = animSampleLayer(*this, 0, i), b = animSampleLayer(*this, 1, i);
+        out[i] = a + weight[i] * (b - a);
+    }
+}
+
+void drawSnowman(float x, float z, float heading, float armAngle, float swordExtra);
+
+struct SnowmanPose { float x, z, heading; int arm, sword; };
+std::vector<SnowmanPose> snowmanPoses;
+AnimBatch animBatch;
+float playerIdle = 0.0f; // idle clip weight, eased in while standing still
+
+// Queues a snowman for drawQueuedSnowmen; idleTime drives the idle clip
+void queueSnowman(float x, float z, float heading, float armPhase, float idleWeight, float idleTime, bool slashing, float slashTimer)
+{
+    SnowmanPose p = { x, z, heading, 0, 0 };
+    p.arm = animBatch.add(ANIM_WALK, armPhase, ANIM_IDLE, idleTime, idleWeight);
+    p.sword = animBatch.add(ANIM_SLASH, slashing ? slashTimer : 0.0f);
+    snowmanPoses.push_back(p);
+}
+
+void drawQueuedSnowmen()
+{
+    animBatch.evaluate();
+    for (const SnowmanPose& p : snowmanPoses)
+        drawSnowman(p.x, p.z, p.heading, animBatch.out[p.arm], animBatch.out[p.sword]);
+    snowmanPoses.clear();
+    animBatch.clear();
+}
+
+// Evaluates the batch for count snowmen against the inline sin() curves it
+// replaced
+void benchAnim(int count)
+{
+    std::vector<float> armPhase(count), idleWeight(count), slashTimer(count), reference(count * 2);
+    for (int i = 0; i < count; ++i) {
+        armPhase[i] = i * 0.731f;
+        idleWeight[i] = (i % 5) == 0 ? 0.5f : 0.0f;
+        slashTimer[i] = (i % 3) == 0 ? (i % 97) / 97.0f * swordSlashDuration : 0.0f;
+    }
+    const int reps = 200;
+    double evalUs = 0.0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < reps; ++r) {
+        animBatch.clear();
+        for (int i = 0; i < count; ++i) {
+            animBatch.add(ANIM_WALK, armPhase[i], ANIM_IDLE, r * 0.016f + i, idleWeight[i]);
+            animBatch.add(ANIM_SLASH, slashTimer[i]);
+        }
+        auto e0 = std::chrono::steady_clock::now();
+        animBatch.evaluate();
+        evalUs += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - e0).count();
+    }
+    double batchUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count() / reps;
+    t0 = std::chrono::steady_clock::now();
+    volatile float sink = 0.0f; // keeps the reference loop from being folded away
+    for (int r = 0; r < reps; ++r) {
+        for (int i = 0; i < count; ++i) {
+            reference[i * 2] = 28.0f * sinf(armPhase[i]);
+            reference[i * 2 + 1] = swordSlashMaxAngle * sinf(slashTimer[i] / swordSlashDuration * 3.14159f);
+        }
+        sink = sink + reference[r % count];
+    }
+    double inlineUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count() / reps;
+    float maxErr = 0.0f;
+    for (int i = 0; i < count; ++i) {
+        if (idleWeight[i] != 0.0f) continue;
+        maxErr = std::max(maxErr, std::fabs(animBatch.out[i * 2] - 28.0f * sinf(armPhase[i])));
+        maxErr = std::max(maxErr, std::fabs(animBatch.out[i * 2 + 1] - swordSlashMaxAngle * sinf(slashTimer[i] / swordSlashDuration * 3.1415927f)));
+    }
+    printf("anim: %d snowmen  batch %.1f us/frame (evaluate %.1f us)  inline sin %.1f us  max error %.3f deg\n",
+        count, batchUs, evalUs / reps, inlineUs, maxErr);
+}
+
+// --- Trace export ---
+// Scoped zones (the profile zones, display's draw stages, the swap, jobs,
+// navigation solves and voxel meshing) are recorded into a ring per thread
+// that only that thread writes, so recording takes no locks. 't' writes
+// every ring (roughly the last minute of frames) as Chrome trace-event
+// JSON for chrome://tracing or ui.perfetto.dev. --no-trace turns it off.
+const int traceCapacity = 1 << 16; // events kept per thread
+const char* traceFile = "snowman_trace.json";
+bool traceEnabled = true;
+
+struct TraceEvent { const char* name; long long startNs, endNs; };
+
+struct TraceBuffer {
+    char name[32];
+    int tid;
+    std::atomic<unsigned long long> head{ 0 };
+    TraceEvent events[traceCapacity];
+};
+
+static std::mutex traceThreadsLock;
+static std::vector<TraceBuffer*> traceThreads; // never freed, so a dump can still read finished threads
+thread_local TraceBuffer* traceLocal = nullptr;
+static const std::chrono::steady_clock::time_point traceEpoch = std::chrono::steady_clock::now();
+
+inline long long traceTime(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t - traceEpoch).count();
+}
+
+// Registers the calling thread's ring, optionally naming it for the dump
+TraceBuffer* traceThread(const char* name = nullptr)
+{
+    if (!traceLocal) {
+        TraceBuffer* b = new TraceBuffer();
+        std::lock_guard<std::mutex> lock(traceThreadsLock);
+        b->tid = (int)traceThreads.size() + 1;
+        snprintf(b->name, sizeof(b->name), "thread %d", b->tid);
+        traceThreads.push_back(b);
+        traceLocal = b;
+    }
+    if (name) snprintf(traceLocal->name, sizeof(traceLocal->name), "%s", name);
+    return traceLocal;
+}
+
+// `name` must outlive the dump; zones use string literals
+inline void traceRecord(const char* name, long long startNs, long long endNs)
+{
+    if (!traceEnabled) return;
+    TraceBuffer* b = traceLocal ? traceLocal : traceThread();
+    unsigned long long h = b->head.load(std::memory_order_relaxed);
+    TraceEvent& e = b->events[h % traceCapacity];
+    e.name = name;
+    e.startNs = startNs;
+    e.endNs = endNs;
+    b->head.store(h + 1, std::memory_order_release);
+}
+
+struct TraceScope {
+    const char* name;
+    long long start;
+    explicit TraceScope(const char* zone) : name(zone), start(traceEnabled ? traceTime(std::chrono::steady_clock::now()) : 0) {}
+    ~TraceScope() { if (traceEnabled) traceRecord(name, start, traceTime(std::chrono::steady_clock::now())); }
+};
+
+void traceDump()
+{
+    FILE* f = fopen(traceFile, "w");
+    if (!f) { printf("trace: cannot write %s\n", traceFile); return; }
+    std::lock_guard<std::mutex> lock(traceThreadsLock);
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    size_t written = 0;
+    std::vector<TraceEvent> copy;
+    for (TraceBuffer* b : traceThreads) {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            written++ ? ",\n" : "", b->tid, b->name);
+        unsigned long long head = b->head.load(std::memory_order_acquire);
+        unsigned long long first = head > (unsigned long long)traceCapacity ? head - traceCapacity : 0;
+        copy.assign(b->events, b->events + traceCapacity);
+        // The owner may have lapped the oldest slots while they were copied,
+        // and may be mid-write on slot `now`, which shares a ring index with
+        // now - traceCapacity
+        std::atomic_thread_fence(std::memory_order_acquire);
+        unsigned long long now = b->head.load(std::memory_order_relaxed);
+        if (now >= (unsigned long long)traceCapacity && now - traceCapacity + 1 > first) first = now - traceCapacity + 1;
+        for (unsigned long long i = first; i < head; ++i) {
+            const TraceEvent& e = copy[i % traceCapacity];
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                e.name, b->tid, e.startNs / 1000.0, (e.endNs - e.startNs) / 1000.0);
+            ++written;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    printf("trace: %zu events from %zu threads written to %s\n", written - traceThreads.size(), traceThreads.size(), traceFile);
+}
+
+// --- Profiler ---
+// Per-frame zone times and counters, averaged and printed once a second
+// while enabled ('p').
+enum ProfileZoneId {
+    PROF_IDLE, PROF_DISPLAY, PROF_OCCLUSION_RASTER, PROF_OCCLUSION_TEST, PROF_LIGHT_BIN, PROF_LIGHT_SHADE,
+    PROF_SNOWMEN, PROF_SNOWBALLS, PROF_PARTICLES, PROF_SHADOWS, PROF_ZONE_COUNT
+};
+enum ProfileCounterId {
+    PROF_OCCLUDERS, PROF_OCC_TESTED, PROF_OCC_CULLED, PROF_FRUSTUM_CULLED, PROF_LIGHTS_VISIBLE, PROF_LIGHT_EVALS,
+    PROF_GL_CALLS, PROF_GL_VERTICES, PROF_GL_STATE, PROF_STREAM_STALLS, PROF_COUNTER_COUNT
+};
+const char* profileZoneNames[PROF_ZONE_COUNT] = {
+    "idle", "display", "occ raster", "occ test", "light bin", "light shade", "snowmen", "snowballs", "particles", "shadows" };
+const char* profileCounterNames[PROF_COUNTER_COUNT] = {
+    "occluders", "tested", "occluded", "offscreen", "lights", "light evals", "gl calls", "gl verts", "gl state", "stream stalls" };
+bool profilerEnabled = false;
+static double profileZoneMs[PROF_ZONE_COUNT];
+static long long profileCounters[PROF_COUNTER_COUNT];
+static int profileFrames = 0;
+thread_local int profileZone = -1; // innermost open zone on this thread, -1 outside any
+
+struct ProfileScope {
+    ProfileZoneId id;
+    int outer;
+    std::chrono::steady_clock::time_point start;
+    explicit ProfileScope(ProfileZoneId zone) : id(zone), outer(profileZone), start(std::chrono::steady_clock::now()) {
+        profileZone = zone;
+    }
+    ~ProfileScope() {
+        auto end = std::chrono::steady_clock::now();
+        profileZoneMs[id] += std::chrono::duration<double, std::milli>(end - start).count();
+        profileZone = outer;
+        if (traceEnabled) traceRecord(profileZoneNames[id], traceTime(start), traceTime(end));
+    }
+};
+
+inline void profileCount(ProfileCounterId id, long long n = 1) { profileCounters[id] += n; }
+
+void profileEndFrame()
+{
+    static auto lastReport = std::chrono::steady_clock::now();
+    ++profileFrames;
+    auto now = std::chrono::steady_clock::now();
+    if (std::chrono::duration<double>(now - lastReport).count() < 1.0) return;
+    if (profilerEnabled) {
+        printf("[%d fps]", profileFrames);
+        for (int i = 0; i < PROF_ZONE_COUNT; ++i) printf(" %s %.3fms", profileZoneNames[i], profileZoneMs[i] / profileFrames);
+        for (int i = 0; i < PROF_COUNTER_COUNT; ++i) printf(" %s %lld", profileCounterNames[i], profileCounters[i] / profileFrames);
+        printf("\n");
+    }
+    memset(profileZoneMs, 0, sizeof(profileZoneMs));
+    memset(profileCounters, 0, sizeof(profileCounters));
+    profileFrames = 0;
+    lastReport = now;
+}
+
+// --- Allocation tracking ---
+// Global operator new counts every heap allocation and its size against the
+// profile zone open on the allocating thread (jobs inherit the zone of the
+// code that created them); allocations outside any zone, such as the
+// navigation and mesher threads, land in "other". Per-frame averages are
+// printed with the profiler ('p'), and --check-allocs fails if a steady
+// walk allocates at all. Allocations made by the C runtime or GL/GLU
+// themselves (malloc) are not seen here.
+static std::atomic<long long> allocCounts[PROF_ZONE_COUNT + 1], allocBytes[PROF_ZONE_COUNT + 1];
+
+inline void allocNote(std::size_t n)
+{
+    int zone = profileZone < 0 ? PROF_ZONE_COUNT : profileZone;
+    allocCounts[zone].fetch_add(1, std::memory_order_relaxed);
+    allocBytes[zone].fetch_add((long long)n, std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t n)
+{
+    allocNote(n);
+    if (void* p = malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t n) { return operator new(n); }
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept { allocNote(n); return malloc(n ? n : 1); }
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept { allocNote(n); return malloc(n ? n : 1); }
+// Kept out of line so callers never see new and free paired directly
+SNOW_NOINLINE void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete(void* p, std::size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, std::size_t) noexcept { operator delete(p); }
+
+// Totals since start per zone (the last entry is "other")
+void allocTotals(long long counts[PROF_ZONE_COUNT + 1], long long bytes[PROF_ZONE_COUNT + 1])
+{
+    for (int i = 0; i <= PROF_ZONE_COUNT; ++i) {
+        counts[i] = allocCounts[i].load(std::memory_order_relaxed);
+        bytes[i] = allocBytes[i].load(std::memory_order_relaxed);
+    }
+}
+
+void allocEndFrame()
+{
+    static auto lastReport = std::chrono::steady_clock::now();
+    static long long lastCounts[PROF_ZONE_COUNT + 1], lastBytes[PROF_ZONE_COUNT + 1];
+    static int frames = 0;
+    ++frames;
+    auto now = std::chrono::steady_clock::now();
+    if (std::chrono::duration<double>(now - lastReport).count() < 1.0) return;
+    long long counts[PROF_ZONE_COUNT + 1], bytes[PROF_ZONE_COUNT + 1];
+    allocTotals(counts, bytes);
+    if (profilerEnabled) {
+        printf("[allocs/frame]");
+        for (int i = 0; i <= PROF_ZONE_COUNT; ++i) {
+            long long n = counts[i] - lastCounts[i];
+            if (n > 0) printf(" %s %.1f (%lld B)", i < PROF_ZONE_COUNT ? profileZoneNames[i] : "other",
+                (double)n / frames, (bytes[i] - lastBytes[i]) / frames);
+        }
+        printf("\n");
+    }
+    memcpy(lastCounts, counts, sizeof(counts));
+    memcpy(lastBytes, bytes, sizeof(bytes));
+    frames = 0;
+    lastReport = now;
+}
+
+// Linear arena for data that lives only within one idle() or display()
+// call. Allocation is a lock-free bump, so jobs may use it too; everything
+// is released when the outermost FrameArenaScope closes. Requests past the
+// block spill to the heap, and the block is regrown to the high-water mark
+// at the next reset so spills stop after the first heavy frame.
+struct FrameArena {
+    std::unique_ptr<char[]> block;
+    size_t capacity = 0;
+    std::atomic<size_t> used{ 0 };
+    size_t peak = 0;
+    std::mutex spillLock;
+    std::vector<std::unique_ptr<char[]>> spills;
+
+    void* alloc(size_t n, size_t align)
+    {
+        size_t start = used.fetch_add(n + align - 1, std::memory_order_relaxed);
+        size_t offset = (start + align - 1) & ~(align - 1);
+        if (offset + n <= capacity) return block.get() + offset;
+        std::lock_guard<std::mutex> lock(spillLock);
+        spills.emplace_back(new char[n + align]);
+        char* p = spills.back().get();
+        return p + ((align - (uintptr_t)p % align) % align);
+    }
+
+    void reset()
+    {
+        peak = std::max(peak, used.load(std::memory_order_relaxed));
+        if (peak > capacity) {
+            capacity = peak + peak / 2;
+            block.reset(new char[capacity]);
+        }
+        spills.clear();
+        used = 0;
+    }
+};
+FrameArena frameArena;
+static int frameArenaDepth = 0;
+
+struct FrameArenaScope {
+    FrameArenaScope() { ++frameArenaDepth; }
+    ~FrameArenaScope() { if (--frameArenaDepth == 0) frameArena.reset(); }
+};
+
+// Uninitialised storage for `count` T's, valid until the enclosing scope ends
+template <typename T>
+T* frameAlloc(size_t count)
+{
+    return static_cast<T*>(frameArena.alloc(count * sizeof(T), alignof(T) < 16 ? 16 : alignof(T)));
+}
+
+// --- Input latency ---
+// Input events are stamped when their callback runs, marked consumed when
+// the state they change is sampled (snowman keys in the player step, orbit
+// and zoom when display() builds the camera), and completed when that
+// frame's swap returns. Percentiles are printed with the profiler ('p').
+// 'k' toggles late latching: the player is stepped at the top of display()
+// up to that moment instead of in idle(), and each frame waits for the GPU
+// after its swap so the next one samples input against a drained queue.
+enum LatencyKind { LAT_KEY, LAT_ORBIT, LAT_KIND_COUNT };
+const char* latencyKindNames[LAT_KIND_COUNT] = { "key", "orbit" };
+const int latencyMaxPending = 64;
+const int latencyMaxSamples = 4096;
+bool lateLatch = false;
+
+struct LatencyQueue {
+    double stamps[latencyMaxPending];
+    int count = 0;
+    void push(double t) { if (count < latencyMaxPending) stamps[count++] = t; }
+};
+LatencyQueue latencyPending[LAT_KIND_COUNT], latencyInFlight[LAT_KIND_COUNT];
+float latencySamples[LAT_KIND_COUNT][latencyMaxSamples];
+int latencySampleCount[LAT_KIND_COUNT] = {};
+
+double latencyNow()
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void noteInput(LatencyKind kind) { latencyPending[kind].push(latencyNow()); }
+
+void consumeInput(LatencyKind kind)
+{
+    LatencyQueue& p = latencyPending[kind];
+    for (int i = 0; i < p.count; ++i) latencyInFlight[kind].push(p.stamps[i]);
+    p.count = 0;
+}
+
+// Called once the frame's swap has returned
+void completeInputs()
+{
+    double now = latencyNow();
+    for (int k = 0; k < LAT_KIND_COUNT; ++k) {
+        LatencyQueue& q = latencyInFlight[k];
+        for (int i = 0; i < q.count && latencySampleCount[k] < latencyMaxSamples; ++i)
+            latencySamples[k][latencySampleCount[k]++] = (float)(now - q.stamps[i]);
+        q.count = 0;
+    }
+}
+
+void latencyEndFrame()
+{
+    static auto lastReport = std::chrono::steady_clock::now();
+    auto now = std::chrono::steady_clock::now();
+    if (std::chrono::duration<double>(now - lastReport).count() < 1.0) return;
+    lastReport = now;
+    for (int k = 0; k < LAT_KIND_COUNT; ++k) {
+        int n = latencySampleCount[k];
+        if (profilerEnabled && n > 0) {
+            float* s = latencySamples[k];
+            std::sort(s, s + n);
+            printf("[latency %s%s] n %d  p50 %.1fms  p95 %.1fms  p99 %.1fms  max %.1fms\n", latencyKindNames[k],
+                lateLatch ? " late-latched" : "", n, s[n / 2], s[n * 95 / 100], s[n * 99 / 100], s[n - 1]);
+        }
+        latencySampleCount[k] = 0;
+    }
+}
+
+// --- Metrics export ---
+// Publishes one sample per frame into a named shared-memory ring so an
+// external reader (--metrics-reader) can watch an unattended kiosk. There is
+// a single writer; each slot carries a sequence number that is odd while the
+// slot is being written, so readers retry instead of taking a lock.
+const uint32_t metricsMagic = 0x534E4F57; // "SNOW"
+const uint32_t metricsVersion = 1;
+const int metricsCapacity = 1024;
+const int metricsBuckets = 64;   // 1 ms frame-time buckets, last one is overflow
+#ifdef _WIN32
+const char* metricsName = "Local\\SnowmanMetrics";
+#else
+const char* metricsName = "/snowman_metrics";
+#endif
+
+struct MetricsSample {
+    std::atomic<uint32_t> seq;
+    uint32_t frame;
+    double timeSec;
+    float frameMs, simMs, displayMs;
+    uint32_t particles, drawnObjects, culledObjects;
+};
+
+struct MetricsShared {
+    uint32_t magic, version, capacity, buckets;
+    std::atomic<uint64_t> head;  // samples published so far
+    std::atomic<uint64_t> histogram[metricsBuckets];
+    MetricsSample ring[metricsCapacity];
+};
+
+bool metricsEnabled = true;
+static MetricsShared* metricsShm = nullptr;
+static float metricsSimMs = 0.0f;
+int frameObjectsDrawn = 0, frameObjectsCulled = 0;
+
+static MetricsShared* mapMetrics(bool create)
+{
+    void* mem = nullptr;
+#ifdef _WIN32
+    HANDLE h = create
+        ? CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(MetricsShared), metricsName)
+        : OpenFileMappingA(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, metricsName);
+    if (!h) return nullptr;
+    mem = MapViewOfFile(h, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, sizeof(MetricsShared));
+#else
+    int fd = shm_open(metricsName, create ? (O_CREAT | O_RDWR) : O_RDWR, 0644);
+    if (fd < 0) return nullptr;
+    if (create && ftruncate(fd, sizeof(MetricsShared)) != 0) { close(fd); return nullptr; }
+    mem = mmap(nullptr, sizeof(MetricsShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) mem = nullptr;
+#endif
+    return (MetricsShared*)mem;
+}
+
+#ifndef _WIN32
+// The segment outlives the process otherwise; a reader still attached keeps
+// its mapping, and the next run creates a fresh one
+static void unlinkMetrics()
+{
+    shm_unlink(metricsName);
+}
+#endif
+
+void initMetrics()
+{
+    if (!metricsEnabled) return;
+    metricsShm = mapMetrics(true);
+    if (!metricsShm) { printf("metrics: could not create shared memory %s\n", metricsName); return; }
+#ifndef _WIN32
+    atexit(unlinkMetrics);
+#endif
+    memset((void*)metricsShm, 0, sizeof(MetricsShared));
+    metricsShm->version = metricsVersion;
+    metricsShm->capacity = metricsCapacity;
+    metricsShm->buckets = metricsBuckets;
+    std::atomic_thread_fence(std::memory_order_release);
+    metricsShm->magic = metricsMagic;
+}
+
+void publishMetrics(float frameMs, float displayMs)
+{
+    static uint32_t frame = 0;
+    if (!metricsShm) return;
+    uint64_t head = metricsShm->head.load(std::memory_order_relaxed);
+    MetricsSample& s = metricsShm->ring[head % metricsCapacity];
+    uint32_t seq = s.seq.load(std::memory_order_relaxed);
+    s.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s.frame = frame++;
+    s.timeSec = glutGet(GLUT_ELAPSED_TIME) / 1000.0;
+    s.frameMs = frameMs;
+    s.simMs = metricsSimMs;
+    s.displayMs = displayMs;
+    s.particles = (uint32_t)particles.size();
+    s.drawnObjects = (uint32_t)frameObjectsDrawn;
+    s.culledObjects = (uint32_t)frameObjectsCulled;
+    s.seq.store(seq + 2, std::memory_order_release);
+    int bucket = std::min(metricsBuckets - 1, (int)frameMs);
+    metricsShm->histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    metricsShm->head.store(head + 1, std::memory_order_release);
+}
+
+// Console reader: latest sample plus frame-time percentiles, twice a second.
+// A writer that died or hung mid-sample leaves its slot's sequence odd, so
+// the copy gives up after a bounded number of tries, and a head that stops
+// advancing is reported as stale rather than reprinting the last sample.
+void runMetricsReader()
+{
+    const int readTries = 1000;
+    const int staleAfterPolls = 4; // two seconds without a new frame
+    MetricsShared* m = mapMetrics(false);
+    if (!m || m->magic != metricsMagic || m->version != metricsVersion) {
+        printf("metrics: no running snowman publishing at %s\n", metricsName);
+        return;
+    }
+    uint64_t lastHead = 0;
+    int idlePolls = 0;
+    for (;; std::this_thread::sleep_for(std::chrono::milliseconds(500))) {
+        uint64_t head = m->head.load(std::memory_order_acquire);
+        if (head == lastHead) {
+            if (++idlePolls >= staleAfterPolls) {
+                printf("metrics: stale - no new frame for %.1f s (last frame count %llu)\n",
+                    idlePolls * 0.5, (unsigned long long)head);
+                fflush(stdout);
+            }
+            continue;
+        }
+        lastHead = head;
+        idlePolls = 0;
+        if (head > 0) {
+            const MetricsSample& src = m->ring[(head - 1) % metricsCapacity];
+            uint32_t frame = 0, particleCount = 0, drawn = 0, culled = 0;
+            float frameMs = 0.0f, simMs = 0.0f, displayMs = 0.0f;
+            bool consistent = false;
+            for (int tries = 0; tries < readTries && !consistent; ++tries) {
+                uint32_t seq = src.seq.load(std::memory_order_acquire);
+                if (seq & 1) { std::this_thread::yield(); continue; }
+                frame = src.frame; frameMs = src.frameMs; simMs = src.simMs; displayMs = src.displayMs;
+                particleCount = src.particles; drawn = src.drawnObjects; culled = src.culledObjects;
+                std::atomic_thread_fence(std::memory_order_acquire);
+                consistent = src.seq.load(std::memory_order_relaxed) == seq;
+            }
+            if (!consistent) {
+                printf("metrics: stale - sample %llu stayed mid-write, writer stalled\n", (unsigned long long)head);
+                fflush(stdout);
+                continue;
+            }
+            uint64_t hist[metricsBuckets], total = 0;
+            for (int i = 0; i < metricsBuckets; ++i) total += hist[i] = m->histogram[i].load(std::memory_order_relaxed);
+            int pct[3] = { 50, 95, 99 }, pctMs[3] = { 0, 0, 0 };
+            for (int k = 0; k < 3; ++k) {
+                uint64_t target = total * pct[k] / 100, seen = 0;
+                for (int i = 0; i < metricsBuckets; ++i) { seen += hist[i]; if (seen > target) { pctMs[k] = i + 1; break; } }
+            }
+            printf("frame %u  %.2f ms (sim %.3f, display %.3f)  particles %u  drawn %u  culled %u  p50<%d p95<%d p99<%d ms\n",
+                frame, frameMs, simMs, displayMs, particleCount, drawn, culled, pctMs[0], pctMs[1], pctMs[2]);
+            fflush(stdout);
+        }
+    }
+}
+
+// --- GL entry points ---
+// GLUT only brings in the GL 1.1 headers, so the handful of newer entry
+// points the optional render paths use are looked up once the context
+// exists. Each path checks its glHas* flag and keeps its fixed-function
+// fallback for drivers that lack it.
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+#ifndef GL_VERSION_1_3
+#define GL_TEXTURE0 0x84C0
+#define GL_CLAMP_TO_EDGE 0x812F
+#define SNOW_GL_MULTITEXTURE_ENTRY_POINTS(X) X(void, glActiveTexture, (GLenum texture))
+#else
+#define SNOW_GL_MULTITEXTURE_ENTRY_POINTS(X) // declared by the headers
+#endif
+#ifndef GL_VERSION_2_0
+typedef char GLchar;
+#define GL_FRAGMENT_SHADER 0x8B30
+#define GL_VERTEX_SHADER 0x8B31
+#define GL_COMPILE_STATUS 0x8B81
+#define GL_LINK_STATUS 0x8B82
+#endif
+#ifndef GL_VERSION_1_4
+#define GL_DEPTH_COMPONENT24 0x81A6
+#define GL_TEXTURE_COMPARE_MODE 0x884C
+#define GL_TEXTURE_COMPARE_FUNC 0x884D
+#define GL_COMPARE_R_TO_TEXTURE 0x884E
+#endif
+#ifndef GL_VERSION_1_5
+typedef ptrdiff_t GLsizeiptr;
+typedef ptrdiff_t GLintptr;
+#define GL_ARRAY_BUFFER 0x8892
+#define GL_STATIC_DRAW 0x88E4
+#define GL_STREAM_DRAW 0x88E0
+#define GL_DYNAMIC_COPY 0x88EA
+#define GL_QUERY_RESULT 0x8866
+#endif
+#ifndef GL_VERSION_3_0
+#define GL_FRAMEBUFFER 0x8D40
+#define GL_FRAMEBUFFER_COMPLETE 0x8CD5
+#define GL_COLOR_ATTACHMENT0 0x8CE0
+#define GL_DEPTH_ATTACHMENT 0x8D00
+#define GL_RGBA32F 0x8814
+#define GL_R16UI 0x8234
+#define GL_R32UI 0x8236
+#define GL_MAP_WRITE_BIT 0x0002
+#define GL_MAP_INVALIDATE_RANGE_BIT 0x0004
+#define GL_MAP_UNSYNCHRONIZED_BIT 0x0020
+#endif
+#ifndef GL_VERSION_3_1
+#define GL_TEXTURE_BUFFER 0x8C2A
+#endif
+#ifndef GL_VERSION_3_2
+typedef uint64_t GLuint64;
+typedef struct __GLsync* GLsync;
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x0001
+#define GL_TIMEOUT_EXPIRED 0x911B
+#endif
+#ifndef GL_VERSION_3_3
+#define GL_RASTERIZER_DISCARD 0x8C89
+#define GL_INTERLEAVED_ATTRIBS 0x8C8C
+#define GL_TRANSFORM_FEEDBACK_BUFFER 0x8C8E
+#define GL_COPY_READ_BUFFER 0x8F36
+#define GL_COPY_WRITE_BUFFER 0x8F37
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+#ifndef GL_VERSION_4_4
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+#define SNOW_GL_SHADER_ENTRY_POINTS(X) \
+    SNOW_GL_MULTITEXTURE_ENTRY_POINTS(X) \
+    X(GLuint, glCreateShader, (GLenum type)) \
+    X(void, glShaderSource, (GLuint shader, GLsizei count, const GLchar* const* src, const GLint* len)) \
+    X(void, glCompileShader, (GLuint shader)) \
+    X(void, glGetShaderiv, (GLuint shader, GLenum pname, GLint* v)) \
+    X(void, glGetShaderInfoLog, (GLuint shader, GLsizei size, GLsizei* len, GLchar* log)) \
+    X(void, glDeleteShader, (GLuint shader)) \
+    X(GLuint, glCreateProgram, ()) \
+    X(void, glAttachShader, (GLuint program, GLuint shader)) \
+    X(void, glLinkProgram, (GLuint program)) \
+    X(void, glGetProgramiv, (GLuint program, GLenum pname, GLint* v)) \
+    X(void, glGetProgramInfoLog, (GLuint program, GLsizei size, GLsizei* len, GLchar* log)) \
+    X(void, glUseProgram, (GLuint program)) \
+    X(GLint, glGetUniformLocation, (GLuint program, const GLchar* name)) \
+    X(void, glUniform1i, (GLint loc, GLint v)) \
+    X(void, glUniform1f, (GLint loc, GLfloat v)) \
+    X(void, glUniform2fv, (GLint loc, GLsizei count, const GLfloat* v)) \
+    X(void, glUniform3fv, (GLint loc, GLsizei count, const GLfloat* v)) \
+    X(void, glUniform4fv, (GLint loc, GLsizei count, const GLfloat* v)) \
+    X(void, glUniformMatrix4fv, (GLint loc, GLsizei count, GLboolean transpose, const GLfloat* v)) \
+    X(void, glBindAttribLocation, (GLuint program, GLuint index, const GLchar* name)) \
+    X(void, glVertexAttribPointer, (GLuint index, GLint size, GLenum type, GLboolean norm, GLsizei stride, const void* ptr)) \
+    X(void, glEnableVertexAttribArray, (GLuint index)) \
+    X(void, glDisableVertexAttribArray, (GLuint index))
+
+// Framebuffer objects (GL 3.0)
+#define SNOW_GL_FRAMEBUFFER_ENTRY_POINTS(X) \
+    X(void, glGenFramebuffers, (GLsizei n, GLuint* ids)) \
+    X(void, glDeleteFramebuffers, (GLsizei n, const GLuint* ids)) \
+    X(void, glBindFramebuffer, (GLenum target, GLuint id)) \
+    X(void, glFramebufferTexture2D, (GLenum target, GLenum attachment, GLenum texTarget, GLuint tex, GLint level)) \
+    X(GLenum, glCheckFramebufferStatus, (GLenum target))
+
+// Buffer objects and mapping, transform feedback, instancing, timer queries
+// and fences (GL 3.3)
+#define SNOW_GL_FEEDBACK_ENTRY_POINTS(X) \
+    X(void, glGenBuffers, (GLsizei n, GLuint* buffers)) \
+    X(void, glDeleteBuffers, (GLsizei n, const GLuint* buffers)) \
+    X(void, glBindBuffer, (GLenum target, GLuint buffer)) \
+    X(void, glBufferData, (GLenum target, GLsizeiptr size, const void* data, GLenum usage)) \
+    X(void, glBufferSubData, (GLenum target, GLintptr offset, GLsizeiptr size, const void* data)) \
+    X(void, glCopyBufferSubData, (GLenum read, GLenum write, GLintptr readOffset, GLintptr writeOffset, GLsizeiptr size)) \
+    X(void, glBindBufferRange, (GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size)) \
+    X(void*, glMapBufferRange, (GLenum target, GLintptr offset, GLsizeiptr size, GLbitfield access)) \
+    X(GLboolean, glUnmapBuffer, (GLenum target)) \
+    X(void, glTransformFeedbackVaryings, (GLuint program, GLsizei count, const GLchar* const* varyings, GLenum mode)) \
+    X(void, glBeginTransformFeedback, (GLenum mode)) \
+    X(void, glEndTransformFeedback, ()) \
+    X(void, glVertexAttribIPointer, (GLuint index, GLint size, GLenum type, GLsizei stride, const void* ptr)) \
+    X(void, glVertexAttribDivisor, (GLuint index, GLuint divisor)) \
+    X(void, glTexBuffer, (GLenum target, GLenum format, GLuint buffer)) \
+    X(void, glDrawArraysInstanced, (GLenum mode, GLint first, GLsizei count, GLsizei instances)) \
+    X(void, glGenQueries, (GLsizei n, GLuint* ids)) \
+    X(void, glDeleteQueries, (GLsizei n, const GLuint* ids)) \
+    X(void, glBeginQuery, (GLenum target, GLuint id)) \
+    X(void, glEndQuery, (GLenum target)) \
+    X(void, glGetQueryObjectui64v, (GLuint id, GLenum pname, GLuint64* v)) \
+    X(GLsync, glFenceSync, (GLenum condition, GLbitfield flags)) \
+    X(GLenum, glClientWaitSync, (GLsync sync, GLbitfield flags, GLuint64 timeout)) \
+    X(void, glDeleteSync, (GLsync sync))
+
+// Immutable storage, for persistent mapping (GL 4.4 or ARB_buffer_storage)
+#define SNOW_GL_STORAGE_ENTRY_POINTS(X) \
+    X(void, glBufferStorage, (GLenum target, GLsizeiptr size, const void* data, GLbitfield flags))
+
+#define SNOW_GL_DECLARE(ret, name, args) static ret (APIENTRY* name) args = nullptr;
+SNOW_GL_SHADER_ENTRY_POINTS(SNOW_GL_DECLARE)
+SNOW_GL_FRAMEBUFFER_ENTRY_POINTS(SNOW_GL_DECLARE)
+SNOW_GL_FEEDBACK_ENTRY_POINTS(SNOW_GL_DECLARE)
+SNOW_GL_STORAGE_ENTRY_POINTS(SNOW_GL_DECLARE)
+
+static bool glHasShaders = false;          // GLSL programs (GL 2.0)
+static bool glHasFramebuffers = false;     // plus framebuffer objects (GL 3.0)
+static bool glHasTransformFeedback = false; // plus everything in the GL 3.3 list
+static bool glHasBufferStorage = false;     // plus glBufferStorage
+
+#ifdef _WIN32
+static void* glProc(const char* name) { return (void*)wglGetProcAddress(name); }
+#else
+extern "C" void (*glXGetProcAddressARB(const GLubyte* name))();
+static void* glProc(const char* name) { return (void*)glXGetProcAddressARB((const GLubyte*)name); }
+#endif
+
+// Called from initGL, once a context is current
+static void loadGLEntryPoints()
+{
+    int major = 1, minor = 1;
+    const char* version = (const char*)glGetString(GL_VERSION);
+    if (version) sscanf(version, "%d.%d", &major, &minor);
+    bool ok = true;
+#define SNOW_GL_LOAD(ret, name, args) ok = (name = (ret (APIENTRY*) args)glProc(#name)) != nullptr && ok;
+    SNOW_GL_SHADER_ENTRY_POINTS(SNOW_GL_LOAD)
+    glHasShaders = ok && major >= 2;
+    SNOW_GL_FRAMEBUFFER_ENTRY_POINTS(SNOW_GL_LOAD)
+    glHasFramebuffers = ok && major >= 3;
+    SNOW_GL_FEEDBACK_ENTRY_POINTS(SNOW_GL_LOAD)
+    glHasTransformFeedback = ok && (major > 3 || (major == 3 && minor >= 3));
+    SNOW_GL_STORAGE_ENTRY_POINTS(SNOW_GL_LOAD)
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    glHasBufferStorage = ok && glHasTransformFeedback &&
+        (major > 4 || (major == 4 && minor >= 4) || (extensions && strstr(extensions, "GL_ARB_buffer_storage")));
+#undef SNOW_GL_LOAD
+    printf("gl: %s (%s)  shaders %s  framebuffers %s  transform feedback %s  buffer storage %s\n", version ? version : "?",
+        (const char*)glGetString(GL_RENDERER), glHasShaders ? "yes" : "no", glHasFramebuffers ? "yes" : "no",
+        glHasTransformFeedback ? "yes" : "no", glHasBufferStorage ? "yes" : "no");
+}
+
+// Compiles and links; 0 (with the log printed) if either step fails.
+// attribs[i] is bound to attribute i; feedback lists interleaved outputs
+static GLuint buildGLProgram(const char* name, const char* vertexSrc, const char* fragmentSrc,
+    std::initializer_list<const char*> attribs = {}, std::initializer_list<const char*> feedback = {})
+{
+    GLuint program = glCreateProgram();
+    const char* sources[2] = { vertexSrc, fragmentSrc };
+    const GLenum types[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+    char log[1024];
+    for (int i = 0; i < 2; ++i) {
+        if (!sources[i]) continue;
+        GLuint shader = glCreateShader(types[i]);
+        glShaderSource(shader, 1, &sources[i], nullptr);
+        glCompileShader(shader);
+        GLint ok = 0;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+        if (!ok) {
+            glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+            printf("%s: shader compile failed: %s\n", name, log);
+        }
+        glAttachShader(program, shader);
+        glDeleteShader(shader); // freed with the program
+    }
+    GLuint index = 0;
+    for (const char* a : attribs) glBindAttribLocation(program, index++, a);
+    if (feedback.size()) glTransformFeedbackVaryings(program, (GLsizei)feedback.size(), feedback.begin(), GL_INTERLEAVED_ATTRIBS);
+    glLinkProgram(program);
+    GLint linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        glGetProgramInfoLog(program, sizeof(log), nullptr, log);
+        printf("%s: link failed: %s\n", name, log);
+        return 0;
+    }
+    return program;
+}
+
+// --- GL command capture ---
+// Every GL/GLU/GLUT entry point the renderer uses goes through a thin
+// wrapper (see the #defines at the end of this section) that counts calls,
+// vertices and state changes per frame. When a capture is armed ('c') the
+// next frame's command stream, including vertex-array contents, is also
+// serialised to glCaptureFile; --replay re-issues it in a bare window so raw
+// submission cost can be measured without any of the app's own CPU work.
+enum GLCapOp : uint8_t {
+    OP_PUSH_MATRIX = 1, OP_POP_MATRIX, OP_TRANSLATE, OP_ROTATE, OP_SCALE, OP_ENABLE, OP_DISABLE,
+    OP_COLOR3, OP_COLOR4, OP_VERTEX3, OP_NORMAL3, OP_TEXCOORD2, OP_BEGIN, OP_END, OP_MATRIX_MODE,
+    OP_LOAD_IDENTITY, OP_CLEAR, OP_CLEAR_COLOR, OP_VIEWPORT, OP_POLYGON_OFFSET, OP_DEPTH_FUNC,
+    OP_DEPTH_MASK, OP_BLEND_FUNC, OP_ALPHA_FUNC, OP_LINE_WIDTH, OP_POINT_SIZE, OP_POLYGON_STIPPLE,
+    OP_BIND_TEXTURE, OP_TEX_ENV, OP_LIGHT, OP_MATERIAL, OP_MATERIALF, OP_SHADE_MODEL, OP_DRAW_ARRAYS,
+    OP_ORTHO, OP_PERSPECTIVE, OP_LOOK_AT, OP_CYLINDER, OP_DISK, OP_SOLID_CUBE, OP_WIRE_CUBE,
+    OP_SOLID_SPHERE, OP_SOLID_CONE, OP_SWAP, OP_LOAD_MATRIX
+};
+const uint32_t glCaptureMagic = 0x50434C47; // "GLCP"
+const char* glCaptureFile = "snowman_frame.glcap";
+
+bool glCaptureArmed = false;
+static bool glCaptureActive = false;
+static std::vector<uint8_t> glCaptureBuf;
+static long long glFrameCalls = 0, glFrameVertices = 0, glFrameStateChanges = 0;
+
+// Client array state mirrored so glDrawArrays can copy what it references
+struct CapArray { bool enabled; GLint size; GLenum type; GLsizei stride; const GLvoid* ptr; };
+static CapArray capVertexArray, capNormalArray, capColorArray, capTexCoordArray;
+
+static void capWord(float f) { uint32_t w; memcpy(&w, &f, 4); const uint8_t* b = (const uint8_t*)&w; glCaptureBuf.insert(glCaptureBuf.end(), b, b + 4); }
+static void capWord(double d) { capWord((float)d); }
+static void capWord(GLenum e) { const uint8_t* b = (const uint8_t*)&e; glCaptureBuf.insert(glCaptureBuf.end(), b, b + 4); }
+static void capWord(GLint i) { capWord((GLenum)i); }
+static void capWord(GLboolean b) { capWord((GLenum)b); }
+
+static void capRecord(GLCapOp op) { if (glCaptureActive) glCaptureBuf.push_back(op); }
+template <typename... Args>
+static void capRecord(GLCapOp op, Args... args)
+{
+    if (!glCaptureActive) return;
+    glCaptureBuf.push_back(op);
+    int expand[] = { 0, (capWord(args), 0)... };
+    (void)expand;
+}
+
+static void capCall(long long vertices = 0) { ++glFrameCalls; glFrameVertices += vertices; }
+static void capState() { ++glFrameCalls; ++glFrameStateChanges; }
+
+static void cap_glPushMatrix() { capCall(); capRecord(OP_PUSH_MATRIX); glPushMatrix(); }
+static void cap_glPopMatrix() { capCall(); capRecord(OP_POP_MATRIX); glPopMatrix(); }
+static void cap_glTranslatef(GLfloat x, GLfloat y, GLfloat z) { capCall(); capRecord(OP_TRANSLATE, x, y, z); glTranslatef(x, y, z); }
+static void cap_glRotatef(GLfloat a, GLfloat x, GLfloat y, GLfloat z) { capCall(); capRecord(OP_ROTATE, a, x, y, z); glRotatef(a, x, y, z); }
+static void cap_glScalef(GLfloat x, GLfloat y, GLfloat z) { capCall(); capRecord(OP_SCALE, x, y, z); glScalef(x, y, z); }
+static void cap_glEnable(GLenum cap) { capState(); capRecord(OP_ENABLE, cap); glEnable(cap); }
+static void cap_glDisable(GLenum cap) { capState(); capRecord(OP_DISABLE, cap); glDisable(cap); }
+static void cap_glColor3f(GLfloat r, GLfloat g, GLfloat b) { capCall(); capRecord(OP_COLOR3, r, g, b); glColor3f(r, g, b); }
+static void cap_glColor3fv(const GLfloat* v) { capCall(); capRecord(OP_COLOR3, v[0], v[1], v[2]); glColor3fv(v); }
+static void cap_glVertex3f(GLfloat x, GLfloat y, GLfloat z) { capCall(1); capRecord(OP_VERTEX3, x, y, z); glVertex3f(x, y, z); }
+static void cap_glNormal3f(GLfloat x, GLfloat y, GLfloat z) { capCall(); capRecord(OP_NORMAL3, x, y, z); glNormal3f(x, y, z); }
+static void cap_glTexCoord2f(GLfloat s, GLfloat t) { capCall(); capRecord(OP_TEXCOORD2, s, t); glTexCoord2f(s, t); }
+static void cap_glBegin(GLenum mode) { capCall(); capRecord(OP_BEGIN, mode); glBegin(mode); }
+static void cap_glEnd() { capCall(); capRecord(OP_END); glEnd(); }
+static void cap_glMatrixMode(GLenum mode) { capState(); capRecord(OP_MATRIX_MODE, mode); glMatrixMode(mode); }
+static void cap_glLoadIdentity() { capCall(); capRecord(OP_LOAD_IDENTITY); glLoadIdentity(); }
+static void cap_glClear(GLbitfield mask) { capCall(); capRecord(OP_CLEAR, (GLenum)mask); glClear(mask); }
+static void cap_glClearColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a) { capState(); capRecord(OP_CLEAR_COLOR, r, g, b, a); glClearColor(r, g, b, a); }
+static void cap_glViewport(GLint x, GLint y, GLsizei w, GLsizei h) { capState(); capRecord(OP_VIEWPORT, x, y, (GLint)w, (GLint)h); glViewport(x, y, w, h); }
+static void cap_glPolygonOffset(GLfloat f, GLfloat u) { capState(); capRecord(OP_POLYGON_OFFSET, f, u); glPolygonOffset(f, u); }
+static void cap_glDepthFunc(GLenum f) { capState(); capRecord(OP_DEPTH_FUNC, f); glDepthFunc(f); }
+static void cap_glDepthMask(GLboolean m) { capState(); capRecord(OP_DEPTH_MASK, m); glDepthMask(m); }
+static void cap_glBlendFunc(GLenum s, GLenum d) { capState(); capRecord(OP_BLEND_FUNC, s, d); glBlendFunc(s, d); }
+static void cap_glAlphaFunc(GLenum f, GLclampf r) { capState(); capRecord(OP_ALPHA_FUNC, f, (GLfloat)r); glAlphaFunc(f, r); }
+static void cap_glLineWidth(GLfloat w) { capState(); capRecord(OP_LINE_WIDTH, w); glLineWidth(w); }
+static void cap_glPointSize(GLfloat sz) { capState(); capRecord(OP_POINT_SIZE, sz); glPointSize(sz); }
+static void cap_glPolygonStipple(const GLubyte* mask)
+{
+    capState();
+    if (glCaptureActive) { glCaptureBuf.push_back(OP_POLYGON_STIPPLE); glCaptureBuf.insert(glCaptureBuf.end(), mask, mask + 128); }
+    glPolygonStipple(mask);
+}
+static void cap_glBindTexture(GLenum target, GLuint tex) { capState(); capRecord(OP_BIND_TEXTURE, target, (GLenum)tex); glBindTexture(target, tex); }
+static void cap_glTexEnvi(GLenum target, GLenum pname, GLint v) { capState(); capRecord(OP_TEX_ENV, target, pname, v); glTexEnvi(target, pname, v); }
+static void cap_glLightfv(GLenum light, GLenum pname, const GLfloat* v) { capState(); capRecord(OP_LIGHT, light, pname, v[0], v[1], v[2], v[3]); glLightfv(light, pname, v); }
+static void cap_glMaterialfv(GLenum face, GLenum pname, const GLfloat* v) { capState(); capRecord(OP_MATERIAL, face, pname, v[0], v[1], v[2], v[3]); glMaterialfv(face, pname, v); }
+static void cap_glMaterialf(GLenum face, GLenum pname, GLfloat v) { capState(); capRecord(OP_MATERIALF, face, pname, v); glMaterialf(face, pname, v); }
+static void cap_glShadeModel(GLenum mode) { capState(); capRecord(OP_SHADE_MODEL, mode); glShadeModel(mode); }
+static void cap_glOrtho(GLdouble l, GLdouble r, GLdouble b, GLdouble t, GLdouble n, GLdouble f) { capCall(); capRecord(OP_ORTHO, l, r, b, t, n, f); glOrtho(l, r, b, t, n, f); }
+static void cap_gluPerspective(GLdouble fovy, GLdouble aspect, GLdouble n, GLdouble f) { capCall(); capRecord(OP_PERSPECTIVE, fovy, aspect, n, f); gluPerspective(fovy, aspect, n, f); }
+static void cap_gluLookAt(GLdouble ex, GLdouble ey, GLdouble ez, GLdouble cx, GLdouble cy, GLdouble cz, GLdouble ux, GLdouble uy, GLdouble uz)
+{
+    capCall();
+    capRecord(OP_LOOK_AT, ex, ey, ez, cx, cy, cz, ux, uy, uz);
+    gluLookAt(ex, ey, ez, cx, cy, cz, ux, uy, uz);
+}
+
+static CapArray* capArrayFor(GLenum array)
+{
+    if (array == GL_VERTEX_ARRAY) return &capVertexArray;
+    if (array == GL_NORMAL_ARRAY) return &capNormalArray;
+    if (array == GL_COLOR_ARRAY) return &capColorArray;
+    if (array == GL_TEXTURE_COORD_ARRAY) return &capTexCoordArray;
+    return nullptr;
+}
+static void cap_glEnableClientState(GLenum a) { capState(); if (CapArray* c = capArrayFor(a)) c->enabled = true; glEnableClientState(a); }
+static void cap_glDisableClientState(GLenum a) { capState(); if (CapArray* c = capArrayFor(a)) c->enabled = false; glDisableClientState(a); }
+static void cap_glVertexPointer(GLint size, GLenum type, GLsizei stride, const GLvoid* ptr)
+{
+    capState(); capVertexArray = { capVertexArray.enabled, size, type, stride, ptr }; glVertexPointer(size, type, stride, ptr);
+}
+static void cap_glNormalPointer(GLenum type, GLsizei stride, const GLvoid* ptr)
+{
+    capState(); capNormalArray = { capNormalArray.enabled, 3, type, stride, ptr }; glNormalPointer(type, stride, ptr);
+}
+static void cap_glColorPointer(GLint size, GLenum type, GLsizei stride, const GLvoid* ptr)
+{
+    capState(); capColorArray = { capColorArray.enabled, size, type, stride, ptr }; glColorPointer(size, type, stride, ptr);
+}
+static void cap_glTexCoordPointer(GLint size, GLenum type, GLsizei stride, const GLvoid* ptr)
+{
+    capState(); capTexCoordArray = { capTexCoordArray.enabled, size, type, stride, ptr }; glTexCoordPointer(size, type, stride, ptr);
+}
+
+// Arrays are written packed, each padded to four bytes: vertex, normal,
+// colour, texcoord
+static void cap_glDrawArrays(GLenum mode, GLint first, GLsizei count)
+{
+    capCall(count);
+    if (glCaptureActive) {
+        CapArray* arrays[4] = { &capVertexArray, &capNormalArray, &capColorArray, &capTexCoordArray };
+        GLenum mask = 0;
+        for (int i = 0; i < 4; ++i) if (arrays[i]->enabled) mask |= 1u << i;
+        capRecord(OP_DRAW_ARRAYS, mode, (GLint)count, mask);
+        for (CapArray* a : arrays) {
+            if (!a->enabled) continue;
+            int elem = a->size * (a->type == GL_FLOAT ? 4 : 1);
+            int stride = a->stride ? a->stride : elem;
+            capWord((GLint)a->size);
+            capWord(a->type);
+            const uint8_t* src = (const uint8_t*)a->ptr + (size_t)first * stride;
+            for (GLsizei v = 0; v < count; ++v) glCaptureBuf.insert(glCaptureBuf.end(), src + v * stride, src + v * stride + elem);
+            // Pad the array itself, not the stream: opcodes are single bytes
+            glCaptureBuf.resize(glCaptureBuf.size() + ((4 - (size_t)count * elem % 4) & 3));
+        }
+    }
+    glDrawArrays(mode, first, count);
+}
+
+static void cap_gluCylinder(GLUquadric* q, GLdouble base, GLdouble top, GLdouble h, GLint slices, GLint stacks)
+{
+    capCall((long long)slices * (stacks + 1) * 2); capRecord(OP_CYLINDER, base, top, h, slices, stacks); gluCylinder(q, base, top, h, slices, stacks);
+}
+static void cap_gluDisk(GLUquadric* q, GLdouble inner, GLdouble outer, GLint slices, GLint loops)
+{
+    capCall((long long)slices * (loops + 1) * 2); capRecord(OP_DISK, inner, outer, slices, loops); gluDisk(q, inner, outer, slices, loops);
+}
+static void cap_glutSolidCube(GLdouble size) { capCall(24); capRecord(OP_SOLID_CUBE, size); glutSolidCube(size); }
+static void cap_glutWireCube(GLdouble size) { capCall(24); capRecord(OP_WIRE_CUBE, size); glutWireCube(size); }
+static void cap_glutSolidSphere(GLdouble r, GLint slices, GLint stacks)
+{
+    capCall((long long)slices * stacks * 2); capRecord(OP_SOLID_SPHERE, r, slices, stacks); glutSolidSphere(r, slices, stacks);
+}
+static void cap_glutSolidCone(GLdouble base, GLdouble h, GLint slices, GLint stacks)
+{
+    capCall((long long)slices * (stacks + 1) * 2); capRecord(OP_SOLID_CONE, base, h, slices, stacks); glutSolidCone(base, h, slices, stacks);
+}
+
+static void writeGLCapture()
+{
+    FILE* f = fopen(glCaptureFile, "wb");
+    if (!f) { printf("capture: cannot write %s\n", glCaptureFile); return; }
+    uint32_t header[4] = { glCaptureMagic, 1, (uint32_t)glutGet(GLUT_WINDOW_WIDTH), (uint32_t)glutGet(GLUT_WINDOW_HEIGHT) };
+    fwrite(header, sizeof(header), 1, f);
+    fwrite(glCaptureBuf.data(), 1, glCaptureBuf.size(), f);
+    fclose(f);
+    printf("capture: %zu bytes, %lld calls, %lld vertices -> %s\n",
+        glCaptureBuf.size(), glFrameCalls, glFrameVertices, glCaptureFile);
+}
+
+// Called at the top of display(): hands last frame's counts to the profiler
+// and starts recording if a capture was armed. The projection and viewport
+// are set by reshape(), outside any frame, so a capture opens with them
+void beginGLFrame()
+{
+    profileCount(PROF_GL_CALLS, glFrameCalls);
+    profileCount(PROF_GL_VERTICES, glFrameVertices);
+    profileCount(PROF_GL_STATE, glFrameStateChanges);
+    glFrameCalls = glFrameVertices = glFrameStateChanges = 0;
+    if (glCaptureArmed) {
+        glCaptureArmed = false;
+        glCaptureActive = true;
+        glCaptureBuf.clear();
+        GLint vp[4], mode;
+        GLfloat proj[16];
+        glGetIntegerv(GL_VIEWPORT, vp);
+        glGetIntegerv(GL_MATRIX_MODE, &mode);
+        glGetFloatv(GL_PROJECTION_MATRIX, proj);
+        capRecord(OP_VIEWPORT, vp[0], vp[1], vp[2], vp[3]);
+        capRecord(OP_MATRIX_MODE, (GLenum)GL_PROJECTION);
+        glCaptureBuf.push_back(OP_LOAD_MATRIX);
+        for (GLfloat v : proj) capWord(v);
+        capRecord(OP_MATRIX_MODE, (GLenum)mode);
+    }
+}
+
+static void cap_glutSwapBuffers()
+{
+    capCall();
+    capRecord(OP_SWAP);
+    glutSwapBuffers();
+    if (glCaptureActive) {
+        glCaptureActive = false;
+        writeGLCapture();
+    }
+}
+
+// Re-issues a captured stream through the real entry points; returns the
+// number of commands
+static long long replayGLStream(const std::vector<uint8_t>& buf, GLUquadric* q, GLuint placeholderTex)
+{
+    size_t at = 0;
+    long long commands = 0;
+    auto u = [&]() { uint32_t w; memcpy(&w, &buf[at], 4); at += 4; return w; };
+    auto f = [&]() { float v; memcpy(&v, &buf[at], 4); at += 4; return v; };
+    while (at < buf.size()) {
+        GLCapOp op = (GLCapOp)buf[at++];
+        ++commands;
+        switch (op) {
+        case OP_PUSH_MATRIX: glPushMatrix(); break;
+        case OP_POP_MATRIX: glPopMatrix(); break;
+        case OP_TRANSLATE: { float x = f(), y = f(), z = f(); glTranslatef(x, y, z); break; }
+        case OP_ROTATE: { float a = f(), x = f(), y = f(), z = f(); glRotatef(a, x, y, z); break; }
+        case OP_SCALE: { float x = f(), y = f(), z = f(); glScalef(x, y, z); break; }
+        case OP_ENABLE: glEnable(u()); break;
+        case OP_DISABLE: glDisable(u()); break;
+        case OP_COLOR3: { float r = f(), g = f(), b = f(); glColor3f(r, g, b); break; }
+        case OP_COLOR4: { float r = f(), g = f(), b = f(), a = f(); glColor4f(r, g, b, a); break; }
+        case OP_VERTEX3: { float x = f(), y = f(), z = f(); glVertex3f(x, y, z); break; }
+        case OP_NORMAL3: { float x = f(), y = f(), z = f(); glNormal3f(x, y, z); break; }
+        case OP_TEXCOORD2: { float s0 = f(), t0 = f(); glTexCoord2f(s0, t0); break; }
+        case OP_BEGIN: glBegin(u()); break;
+        case OP_END: glEnd(); break;
+        case OP_MATRIX_MODE: glMatrixMode(u()); break;
+        case OP_LOAD_IDENTITY: glLoadIdentity(); break;
+        case OP_CLEAR: glClear(u()); break;
+        case OP_CLEAR_COLOR: { float r = f(), g = f(), b = f(), a = f(); glClearColor(r, g, b, a); break; }
+        case OP_VIEWPORT: { GLint x = u(), y = u(), w = u(), h = u(); glViewport(x, y, w, h); break; }
+        case OP_POLYGON_OFFSET: { float a = f(), b = f(); glPolygonOffset(a, b); break; }
+        case OP_DEPTH_FUNC: glDepthFunc(u()); break;
+        case OP_DEPTH_MASK: glDepthMask((GLboolean)u()); break;
+        case OP_BLEND_FUNC: { GLenum a = u(), b = u(); glBlendFunc(a, b); break; }
+        case OP_ALPHA_FUNC: { GLenum a = u(); float r = f(); glAlphaFunc(a, r); break; }
+        case OP_LINE_WIDTH: glLineWidth(f()); break;
+        case OP_POINT_SIZE: glPointSize(f()); break;
+        case OP_POLYGON_STIPPLE: glPolygonStipple(&buf[at]); at += 128; break;
+        case OP_BIND_TEXTURE: { GLenum t = u(); GLuint id = u(); glBindTexture(t, id ? placeholderTex : 0); break; }
+        case OP_TEX_ENV: { GLenum t = u(), p = u(); GLint v = (GLint)u(); glTexEnvi(t, p, v); break; }
+        case OP_LIGHT: case OP_MATERIAL: {
+            GLenum a = u(), p = u(); float v[4] = { f(), f(), f(), f() };
+            if (op == OP_LIGHT) glLightfv(a, p, v); else glMaterialfv(a, p, v);
+            break;
+        }
+        case OP_MATERIALF: { GLenum a = u(), p = u(); float v = f(); glMaterialf(a, p, v); break; }
+        case OP_SHADE_MODEL: glShadeModel(u()); break;
+        case OP_DRAW_ARRAYS: {
+            GLenum mode = u(); GLsizei count = (GLsizei)u(); GLenum mask = u();
+            GLenum arrays[4] = { GL_VERTEX_ARRAY, GL_NORMAL_ARRAY, GL_COLOR_ARRAY, GL_TEXTURE_COORD_ARRAY };
+            for (int i = 0; i < 4; ++i) {
+                if (!(mask & (1u << i))) { glDisableClientState(arrays[i]); continue; }
+                GLint size = (GLint)u(); GLenum type = u();
+                const GLvoid* data = &buf[at];
+                if (i == 0) glVertexPointer(size, type, 0, data);
+                else if (i == 1) glNormalPointer(type, 0, data);
+                else if (i == 2) glColorPointer(size, type, 0, data);
+                else glTexCoordPointer(size, type, 0, data);
+                glEnableClientState(arrays[i]);
+                at += ((size_t)count * size * (type == GL_FLOAT ? 4 : 1) + 3) & ~(size_t)3;
+            }
+            glDrawArrays(mode, 0, count);
+            for (GLenum a : arrays) glDisableClientState(a);
+            break;
+        }
+        case OP_ORTHO: { float l = f(), r = f(), b = f(), t = f(), n = f(), fa = f(); glOrtho(l, r, b, t, n, fa); break; }
+        case OP_PERSPECTIVE: { float a = f(), b = f(), c = f(), d = f(); gluPerspective(a, b, c, d); break; }
+        case OP_LOOK_AT: {
+            float v[9]; for (float& x : v) x = f();
+            gluLookAt(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8]);
+            break;
+        }
+        case OP_CYLINDER: { float a = f(), b = f(), c = f(); GLint sl = u(), st = u(); gluCylinder(q, a, b, c, sl, st); break; }
+        case OP_DISK: { float a = f(), b = f(); GLint sl = u(), lo = u(); gluDisk(q, a, b, sl, lo); break; }
+        case OP_SOLID_CUBE: glutSolidCube(f()); break;
+        case OP_WIRE_CUBE: glutWireCube(f()); break;
+        case OP_SOLID_SPHERE: { float r = f(); GLint sl = u(), st = u(); glutSolidSphere(r, sl, st); break; }
+        case OP_SOLID_CONE: { float b = f(), h = f(); GLint sl = u(), st = u(); glutSolidCone(b, h, sl, st); break; }
+        case OP_SWAP: break; // the replay loop swaps once per pass
+        case OP_LOAD_MATRIX: { float m[16]; for (float& x : m) x = f(); glLoadMatrixf(m); break; }
+        default:
+            printf("replay: unknown opcode %d at byte %zu\n", (int)op, at - 1);
+            return commands;
+        }
+    }
+    return commands;
+}
+
+#define glPushMatrix cap_glPushMatrix
+#define glPopMatrix cap_glPopMatrix
+#define glTranslatef cap_glTranslatef
+#define glRotatef cap_glRotatef
+#define glScalef cap_glScalef
+#define glEnable cap_glEnable
+#define glDisable cap_glDisable
+#define glColor3f cap_glColor3f
+#define glColor3fv cap_glColor3fv
+#define glVertex3f cap_glVertex3f
+#define glNormal3f cap_glNormal3f
+#define glTexCoord2f cap_glTexCoord2f
+#define glBegin cap_glBegin
+#define glEnd cap_glEnd
+#define glMatrixMode cap_glMatrixMode
+#define glLoadIdentity cap_glLoadIdentity
+#define glClear cap_glClear
+#define glClearColor cap_glClearColor
+#define glViewport cap_glViewport
+#define glPolygonOffset cap_glPolygonOffset
+#define glDepthFunc cap_glDepthFunc
+#define glDepthMask cap_glDepthMask
+#define glBlendFunc cap_glBlendFunc
+#define glAlphaFunc cap_glAlphaFunc
+#define glLineWidth cap_glLineWidth
+#define glPointSize cap_glPointSize
+#define glPolygonStipple cap_glPolygonStipple
+#define glBindTexture cap_glBindTexture
+#define glTexEnvi cap_glTexEnvi
+#define glLightfv cap_glLightfv
+#define glMaterialfv cap_glMaterialfv
+#define glMaterialf cap_glMaterialf
+#define glShadeModel cap_glShadeModel
+#define glEnableClientState cap_glEnableClientState
+#define glDisableClientState cap_glDisableClientState
+#define glVertexPointer cap_glVertexPointer
+#define glNormalPointer cap_glNormalPointer
+#define glColorPointer cap_glColorPointer
+#define glTexCoordPointer cap_glTexCoordPointer
+#define glDrawArrays cap_glDrawArrays
+#define glOrtho cap_glOrtho
+#define gluPerspective cap_gluPerspective
+#define gluLookAt cap_gluLookAt
+#define gluCylinder cap_gluCylinder
+#define gluDisk cap_gluDisk
+#define glutSolidCube cap_glutSolidCube
+#define glutWireCube cap_glutWireCube
+#define glutSolidSphere cap_glutSolidSphere
+#define glutSolidCone cap_glutSolidCone
+#define glutSwapBuffers cap_glutSwapBuffers
+
+// --- Job system ---
+// Work-stealing scheduler: every thread (the main thread is index 0) owns a
+// deque it pushes and pops at the back, and idle threads steal from the
+// front of the others'. Jobs come from fixed per-thread pools, finish when
+// they and their children have run, and release their successors when they
+// do, so a frame's stages can be declared as a dependency graph. Waiting
+// threads run other jobs instead of blocking. With no workers (one core)
+// parallelFor runs its body inline and costs nothing extra.
+const int jobPoolSize = 4096; // per thread; far more than one frame creates
+
+struct Job {
+    void (*fn)(Job&);
+    void* data;
+    int begin, end;
+    Job* parent;
+    std::atomic<int> unfinished;  // itself plus unfinished children
+    std::atomic<int> waitingOn;   // unfinished dependencies, plus one until submitted
+    Job* successors[8];
+    int successorCount;
+    int zone;                     // creator's profile zone, for allocation tracking
+};
+
+struct JobDeque {
+    std::mutex lock;
+    Job* ring[jobPoolSize];
+    long long top = 0, bottom = 0;
+};
+
+struct JobThread {
+    JobDeque deque;
+    std::unique_ptr<Job[]> pool = std::unique_ptr<Job[]>(new Job[jobPoolSize]);
+    unsigned next = 0;
+};
+
+std::vector<std::unique_ptr<JobThread>> jobThreads;
+std::vector<std::thread> jobWorkers;
+std::atomic<int> jobQueued(0), jobSleepers(0);
+std::mutex jobSleepMutex;
+std::condition_variable jobWake;
+bool jobQuit = false;
+thread_local int jobThreadIndex = 0;
+
+static void jobPush(Job* j)
+{
+    JobDeque& d = jobThreads[jobThreadIndex]->deque;
+    {
+        std::lock_guard<std::mutex> lock(d.lock);
+        d.ring[d.bottom++ % jobPoolSize] = j;
+    }
+    ++jobQueued;
+    if (jobSleepers > 0) {
+        std::lock_guard<std::mutex> lock(jobSleepMutex);
+        jobWake.notify_one();
+    }
+}
+
+// Own deque newest-first, then the others oldest-first
+static Job* jobTake()
+{
+    if (jobQueued == 0) return nullptr;
+    int n = (int)jobThreads.size();
+    for (int k = 0; k < n; ++k) {
+        JobDeque& d = jobThreads[(jobThreadIndex + k) % n]->deque;
+        std::lock_guard<std::mutex> lock(d.lock);
+        if (d.bottom == d.top) continue;
+        --jobQueued;
+        return k == 0 ? d.ring[--d.bottom % jobPoolSize] : d.ring[d.top++ % jobPoolSize];
+    }
+    return nullptr;
+}
+
+static void jobFinish(Job* j)
+{
+    if (--j->unfinished > 0) return;
+    for (int i = 0; i < j->successorCount; ++i)
+        if (--j->successors[i]->waitingOn == 0) jobPush(j->successors[i]);
+    if (j->parent) jobFinish(j->parent);
+}
+
+static void jobExecute(Job* j)
+{
+    TraceScope trace("job");
+    int outer = profileZone;
+    profileZone = j->zone;
+    j->fn(*j);
+    profileZone = outer;
+    jobFinish(j);
+}
+
+static void jobWorkerMain(int index)
+{
+    jobThreadIndex = index;
+    char name[32];
+    snprintf(name, sizeof(name), "job worker %d", index);
+    if (traceEnabled) traceThread(name);
+    for (;;) {
+        if (Job* j = jobTake()) {
+            jobExecute(j);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(jobSleepMutex);
+        ++jobSleepers;
+        jobWake.wait(lock, [] { return jobQuit || jobQueued > 0; });
+        --jobSleepers;
+        if (jobQuit) return;
+    }
+}
+
+void jobStop()
+{
+    {
+        std::lock_guard<std::mutex> lock(jobSleepMutex);
+        jobQuit = true;
+    }
+    jobWake.notify_all();
+    for (std::thread& t : jobWorkers) t.join();
+    jobWorkers.clear();
+    jobQuit = false;
+}
+
+// Starts `workers` threads beside the main one; -1 means one per extra core
+void jobStart(int workers = -1)
+{
+    static bool registered = false;
+    if (!registered) {
+        atexit(jobStop);
+        registered = true;
+    }
+    jobStop();
+    if (workers < 0) workers = (int)std::max(1u, std::thread::hardware_concurrency()) - 1;
+    jobThreads.clear();
+    for (int i = 0; i <= workers; ++i) jobThreads.emplace_back(new JobThread());
+    for (int i = 1; i <= workers; ++i) jobWorkers.emplace_back(jobWorkerMain, i);
+}
+
+Job* jobCreate(void (*fn)(Job&), void* data, Job* parent = nullptr)
+{
+    if (jobThreads.empty()) jobStart();
+    JobThread& t = *jobThreads[jobThreadIndex];
+    Job* j = &t.pool[t.next++ % jobPoolSize];
+    j->fn = fn;
+    j->data = data;
+    j->begin = j->end = 0;
+    j->parent = parent;
+    j->unfinished = 1;
+    j->waitingOn = 1;
+    j->successorCount = 0;
+    j->zone = profileZone;
+    if (parent) ++parent->unfinished;
+    return j;
+}
+
+// Runs a callable (kept alive by the caller until the job is waited on)
+template <typename F>
+Job* jobCreateCall(F& f, Job* parent = nullptr)
+{
+    return jobCreate([](Job& j) { (*static_cast<F*>(j.data))(); }, &f, parent);
+}
+
+// `after` waits for `before`; declare every edge before submitting either
+void jobDepend(Job* before, Job* after)
+{
+    before->successors[before->successorCount++] = after;
+    ++after->waitingOn;
+}
+
+void jobSubmit(Job* j)
+{
+    if (--j->waitingOn == 0) jobPush(j);
+}
+
+void jobWait(Job* j)
+{
+    while (j->unfinished > 0) {
+        if (Job* other = jobTake()) jobExecute(other);
+        else std::this_thread::yield();
+    }
+}
+
+template <typename Body>
+struct ParallelFor {
+    const Body* body;
+    int grain;
+    static void run(Job& j)
+    {
+        const ParallelFor& pf = *static_cast<const ParallelFor*>(j.data);
+        // Hand off the upper halves for others to steal, keep the lowest
+        while (j.end - j.begin > pf.grain) {
+            int mid = j.begin + (j.end - j.begin) / 2;
+            Job* upper = jobCreate(&ParallelFor::run, j.data, &j);
+            upper->begin = mid;
+            upper->end = j.end;
+            jobSubmit(upper);
+            j.end = mid;
+        }
+        (*pf.body)(j.begin, j.end);
+    }
+};
+
+// body(begin, end) over [0, count) in chunks of at least grain
+template <typename Body>
+void parallelFor(int count, int grain, const Body& body)
+{
+    if (count <= 0) return;
+    if (jobThreads.empty()) jobStart();
+    if (jobWorkers.empty() || count <= grain) {
+        body(0, count);
+        return;
+    }
+    ParallelFor<Body> pf = { &body, std::max(1, grain) };
+    Job* root = jobCreate(&ParallelFor<Body>::run, &pf);
+    root->begin = 0;
+    root->end = count;
+    jobSubmit(root);
+    jobWait(root);
+}
+
+// Ages particles in parallel, then drops expired ones keeping their order
+static void stageParticleCohort();
+static void ageParticleCohorts(float delta);
+static void clearParticleCohorts();
+extern bool residentParticles;
+
+void ageParticles(float delta)
+{
+    ageParticleCohorts(delta);
+    parallelFor((int)particles.size(), 4096, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            particles[i].age += delta;
+            particles[i].y += delta * 0.14f;
+        }
+    });
+    particles.erase(std::remove_if(particles.begin(), particles.end(),
+        [](const Particle& p) { return p.age > p.life; }), particles.end());
+}
+
+void flushParticleSpawns()
+{
+    if (residentParticles) {
+        if (!particleSpawns.empty()) stageParticleCohort();
+        return;
+    }
+    particles.insert(particles.end(), particleSpawns.begin(), particleSpawns.end());
+    particleSpawns.clear();
+}
+
+void updateParticles(float delta)
+{
+    ageParticles(delta);
+    flushParticleSpawns();
+}
 
 ///////////////// ENVIRONMENT
 struct Tree { float x, z, h, r; };
@@ -54,55 +1688,6133 @@ struct IceBlock { float x, z, s; };
 std::vector<Tree> trees;
 std::vector<IceBlock> iceblocks;
 
-void generateEnvironment() {
-    trees.clear();
-    iceblocks.clear();
-    std::mt19937 rng(9047);
-    std::uniform_real_distribution<float> dist(-45.0f, 45.0f);
-    std::uniform_real_distribution<float> rad(1.6f, 3.7f);
-    std::uniform_real_distribution<float> hgt(2.6f, 5.5f);
-    for (int i = 0; i < 38; ++i) {
-        float x = dist(rng), z = dist(rng);
-        if (std::sqrt(x * x + z * z) < 7.5f) continue; // keep open clearing
-        Tree t; t.x = x; t.z = z; t.h = hgt(rng); t.r = rad(rng);
-        trees.push_back(t);
+// Placement parameters; counts are targets, spacing comes from each object's footprint
+struct EnvironmentParams {
+    float extent = 45.0f;      // world spans [-extent, extent] on x and z
+    int treeCount = 38;
+    int iceCount = 12;
+    float treeClearing = 7.5f; // keep open clearing around the origin
+    float iceClearing = 8.5f;
+    unsigned seed = 9047;
+    int threads = 0;           // 0 = one per hardware thread
+};
+EnvironmentParams envParams;
+
+// --- Poisson-disk sampler ---
+// Two objects may not be closer than the sum of their footprint radii.
+// The background grid uses cells at least one max pair distance wide, so a
+// candidate only has to look at its 3x3 cell neighbourhood. Cells are grouped
+// into tiles that are filled in four checkerboard phases: tiles in the same
+// phase never share a neighbourhood, so they run in parallel, and every tile
+// draws from its own seeded RNG, which keeps the output identical at any
+// thread count.
+const float treeMaxRadius = 3.7f;
+const float iceMaxRadius = 3.2f * 0.7072f; // half diagonal of the largest block
+const int poissonCellsPerTile = 4;
+const int poissonAttempts = 30;
+
+struct EnvPoint {
+    float x, z, rad;
+    float a, b;  // tree: h, r  ice: s
+    int type;    // 0 = tree, 1 = ice block
+    int next;    // next point in the same cell (index into the owning tile)
+};
+
+struct PoissonGrid {
+    float origin, cellSize;
+    int cellsPerAxis, tilesPerAxis;
+    std::vector<int> cellHead;
+    std::vector<std::vector<EnvPoint>> tilePoints;
+
+    int tileOf(int cx, int cz) const {
+        return (cz / poissonCellsPerTile) * tilesPerAxis + cx / poissonCellsPerTile;
+    }
+};
+
+static uint32_t tileSeed(unsigned seed, int tx, int tz)
+{
+    uint64_t h = seed * 0x9E3779B97F4A7C15ull ^ ((uint64_t)(uint32_t)tx << 32 | (uint32_t)tz);
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return (uint32_t)(h ^ (h >> 31));
+}
+
+static bool poissonFits(const PoissonGrid& g, float x, float z, float rad)
+{
+    int cx = std::min(g.cellsPerAxis - 1, (int)((x - g.origin) / g.cellSize));
+    int cz = std::min(g.cellsPerAxis - 1, (int)((z - g.origin) / g.cellSize));
+    for (int nz = std::max(0, cz - 1); nz <= std::min(g.cellsPerAxis - 1, cz + 1); ++nz) {
+        for (int nx = std::max(0, cx - 1); nx <= std::min(g.cellsPerAxis - 1, cx + 1); ++nx) {
+            const std::vector<EnvPoint>& pts = g.tilePoints[g.tileOf(nx, nz)];
+            for (int i = g.cellHead[nz * g.cellsPerAxis + nx]; i >= 0; i = pts[i].next) {
+                float dx = pts[i].x - x, dz = pts[i].z - z;
+                float minDist = pts[i].rad + rad;
+                if (dx * dx + dz * dz < minDist * minDist) return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Quota of `total` owned by the cells [before, before + cells) out of `all`
+static int tileQuota(int total, int64_t before, int64_t cells, int64_t all)
+{
+    return (int)((before + cells) * total / all - before * total / all);
+}
+
+static void poissonFillTile(PoissonGrid& g, const EnvironmentParams& p, int tx, int tz)
+{
+    int cx0 = tx * poissonCellsPerTile, cz0 = tz * poissonCellsPerTile;
+    int cx1 = std::min(g.cellsPerAxis, cx0 + poissonCellsPerTile);
+    int cz1 = std::min(g.cellsPerAxis, cz0 + poissonCellsPerTile);
+    int64_t allCells = (int64_t)g.cellsPerAxis * g.cellsPerAxis;
+    int64_t before = (int64_t)cz0 * g.cellsPerAxis + (int64_t)(cz1 - cz0) * cx0;
+    int64_t cells = (int64_t)(cx1 - cx0) * (cz1 - cz0);
+
+    std::minstd_rand rng(tileSeed(p.seed, tx, tz)); // cheap to seed, one per tile
+    std::uniform_real_distribution<float> px(g.origin + cx0 * g.cellSize, g.origin + cx1 * g.cellSize);
+    std::uniform_real_distribution<float> pz(g.origin + cz0 * g.cellSize, g.origin + cz1 * g.cellSize);
+    std::uniform_real_distribution<float> rad(1.6f, 3.7f);
+    std::uniform_real_distribution<float> hgt(2.6f, 5.5f);
+    std::uniform_real_distribution<float> bs(2.0f, 3.2f);
+    std::vector<EnvPoint>& out = g.tilePoints[g.tileOf(cx0, cz0)];
+
+    for (int type = 0; type < 2; ++type) {
+        int quota = tileQuota(type == 0 ? p.treeCount : p.iceCount, before, cells, allCells);
+        float clearing = type == 0 ? p.treeClearing : p.iceClearing;
+        for (int q = 0; q < quota; ++q) {
+            for (int attempt = 0; attempt < poissonAttempts; ++attempt) {
+                EnvPoint e;
+                e.x = px(rng); e.z = pz(rng); e.type = type;
+                if (type == 0) { e.a = hgt(rng); e.b = rad(rng); e.rad = e.b; }
+                else { e.a = bs(rng); e.b = 0.0f; e.rad = e.a * 0.7072f; }
+                if (std::sqrt(e.x * e.x + e.z * e.z) < clearing) continue;
+                if (!poissonFits(g, e.x, e.z, e.rad)) continue;
+                // Clamp so float rounding never files a point under a neighbouring tile
+                int cx = std::max(cx0, std::min(cx1 - 1, (int)((e.x - g.origin) / g.cellSize)));
+                int cz = std::max(cz0, std::min(cz1 - 1, (int)((e.z - g.origin) / g.cellSize)));
+                int& head = g.cellHead[cz * g.cellsPerAxis + cx];
+                e.next = head;
+                head = (int)out.size();
+                out.push_back(e);
+                break;
+            }
+        }
+    }
+}
+
+void generateEnvironment(const EnvironmentParams& p, std::vector<Tree>& outTrees, std::vector<IceBlock>& outIce)
+{
+    PoissonGrid g;
+    g.origin = -p.extent;
+    g.cellsPerAxis = std::max(1, (int)(2.0f * p.extent / (2.0f * std::max(treeMaxRadius, iceMaxRadius))));
+    g.cellSize = 2.0f * p.extent / g.cellsPerAxis;
+    g.tilesPerAxis = (g.cellsPerAxis + poissonCellsPerTile - 1) / poissonCellsPerTile;
+    g.cellHead.assign((size_t)g.cellsPerAxis * g.cellsPerAxis, -1);
+    g.tilePoints.resize((size_t)g.tilesPerAxis * g.tilesPerAxis);
+
+    int threads = p.threads > 0 ? p.threads : (int)std::max(1u, std::thread::hardware_concurrency());
+    for (int phase = 0; phase < 4; ++phase) {
+        int ptx = phase & 1, ptz = phase >> 1;
+        int perAxisX = (g.tilesPerAxis - ptx + 1) / 2, perAxisZ = (g.tilesPerAxis - ptz + 1) / 2;
+        int jobs = perAxisX * perAxisZ;
+        std::atomic<int> nextJob(0);
+        auto worker = [&]() {
+            for (int j = nextJob++; j < jobs; j = nextJob++)
+                poissonFillTile(g, p, ptx + 2 * (j % perAxisX), ptz + 2 * (j / perAxisX));
+        };
+        std::vector<std::thread> pool;
+        for (int t = 1; t < std::min(threads, jobs); ++t) pool.emplace_back(worker);
+        worker();
+        for (std::thread& t : pool) t.join();
+    }
+
+    outTrees.clear();
+    outIce.clear();
+    outTrees.reserve(p.treeCount);
+    outIce.reserve(p.iceCount);
+    for (const std::vector<EnvPoint>& pts : g.tilePoints) {
+        for (const EnvPoint& e : pts) {
+            if (e.type == 0) { Tree t; t.x = e.x; t.z = e.z; t.h = e.a; t.r = e.b; outTrees.push_back(t); }
+            else { IceBlock b; b.x = e.x; b.z = e.z; b.s = e.a; outIce.push_back(b); }
+        }
+    }
+}
+
+int environmentVersion = 0; // bumped whenever trees/iceblocks are replaced
+
+void generateEnvironment() {
+    generateEnvironment(envParams, trees, iceblocks);
+    ++environmentVersion;
+}
+
+// Times placement of `count` objects at several thread counts and checks
+// that every run produced the same layout
+void benchPoisson(int count)
+{
+    EnvironmentParams p;
+    p.treeCount = count * 38 / 50;
+    p.iceCount = count - p.treeCount;
+    p.extent = std::sqrt(count * 150.0f) / 2.0f; // ~150 square units per object
+    int hw = (int)std::max(1u, std::thread::hardware_concurrency());
+    int counts[] = { 1, 2, 4, 8, hw };
+    uint64_t refHash = 0;
+    bool identical = true;
+    for (int i = 0; i < 5; ++i) {
+        if (i > 0 && counts[i] <= counts[i - 1]) continue;
+        p.threads = counts[i];
+        std::vector<Tree> t;
+        std::vector<IceBlock> b;
+        auto start = std::chrono::steady_clock::now();
+        generateEnvironment(p, t, b);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        uint64_t hash = 1469598103934665603ull;
+        auto mix = [&](const void* data, size_t n) {
+            for (size_t k = 0; k < n; ++k) hash = (hash ^ ((const unsigned char*)data)[k]) * 1099511628211ull;
+        };
+        if (!t.empty()) mix(t.data(), t.size() * sizeof(Tree));
+        if (!b.empty()) mix(b.data(), b.size() * sizeof(IceBlock));
+        if (i == 0) refHash = hash;
+        identical = identical && hash == refHash;
+        printf("poisson: %d threads  %zu trees + %zu ice blocks  %.1f ms  hash %016llx\n",
+            counts[i], t.size(), b.size(), ms, (unsigned long long)hash);
+    }
+    printf("poisson: output %s across thread counts\n", identical ? "identical" : "DIFFERS");
+}
+
+void drawPineTree(float h, float r) {
+    // Brown trunk
+    glColor3f(0.33f, 0.20f, 0.12f);
+    glPushMatrix();
+    glTranslatef(0, h * 0.15f, 0);
+    glRotatef(270, 1, 0, 0);
+    gluCylinder(quad, r * 0.20, r * 0.12, h * 0.3f, 8, 2);
+    // Green cone
+    glColor3f(0.19f, 0.41f, 0.1f); // deep pine
+    glTranslatef(0, h * 0.1f, 1); // Move to top of trunk
+    glRotatef(360, 1, 0, 0);
+    glutSolidCone(r, h * 0.78, 16, 3);
+    glPopMatrix();
+}
+
+// --- Spatial hash ---
+// Items are filed under every cell their footprint overlaps, so a point
+// query only reads one bucket. Buckets are stored CSR-style (offsets + one
+// flat item array) and rebuilt wholesale; cells that collide in the table
+// share a bucket and are filtered by the caller's exact shape test.
+struct SpatialHash {
+    float cell = 8.0f;
+    uint32_t mask = 0;
+    std::vector<uint32_t> start; // mask + 2 prefix sums
+    std::vector<int> items;
+
+    uint32_t bucket(int cx, int cz) const { return ((uint32_t)cx * 73856093u ^ (uint32_t)cz * 19349663u) & mask; }
+    int cellOf(float v) const { return (int)std::floor(v / cell); }
+
+    // footprint(i, x0, z0, x1, z1) gives item i's bounds
+    template <typename Footprint>
+    void build(int count, Footprint footprint)
+    {
+        uint32_t entries = 0;
+        for (int i = 0; i < count; ++i) {
+            float x0, z0, x1, z1;
+            footprint(i, x0, z0, x1, z1);
+            entries += (uint32_t)((cellOf(x1) - cellOf(x0) + 1) * (cellOf(z1) - cellOf(z0) + 1));
+        }
+        uint32_t size = 64;
+        while (size < entries * 4) size <<= 1; // sparse enough that few cells share a bucket
+        mask = size - 1;
+        start.assign(size + 1, 0);
+        for (int pass = 0; pass < 2; ++pass) {
+            static std::vector<uint32_t> cursor;
+            if (pass == 1) {
+                for (uint32_t b = 0; b < size; ++b) start[b + 1] += start[b];
+                items.resize(start[size]);
+                cursor.assign(start.begin(), start.end() - 1);
+            }
+            for (int i = 0; i < count; ++i) {
+                float x0, z0, x1, z1;
+                footprint(i, x0, z0, x1, z1);
+                for (int cz = cellOf(z0); cz <= cellOf(z1); ++cz)
+                    for (int cx = cellOf(x0); cx <= cellOf(x1); ++cx) {
+                        if (pass == 0) ++start[bucket(cx, cz) + 1];
+                        else items[cursor[bucket(cx, cz)]++] = i;
+                    }
+            }
+        }
+    }
+
+    void queryCell(int cx, int cz, const int*& begin, const int*& end) const
+    {
+        uint32_t b = bucket(cx, cz);
+        begin = items.data() + start[b];
+        end = items.data() + start[b + 1];
+    }
+    void query(float x, float z, const int*& begin, const int*& end) const { queryCell(cellOf(x), cellOf(z), begin, end); }
+};
+
+// --- Camera collision ---
+// The orbit camera is a sphere swept from the snowman out to where it wants
+// to be; the first contact pulls it in. Trees and ice blocks sit in a
+// bounding-volume hierarchy that is built top-down when the environment is
+// regenerated and patched (leaf insert/remove plus refit) when single ice
+// blocks come and go. Inserts clustered in one spot chain into a deep
+// spine, so an insert that leaves a leaf deeper than 2*log2(N) rebuilds
+// the hierarchy top-down from its current leaves.
+const float camCollisionRadius = 0.4f;
+const float camMinDist = 2.0f; // never closer to the snowman than this
+
+struct BvhNode {
+    float lo[3], hi[3];
+    int parent, child[2];
+    int item; // leaves only, -1 for inner nodes
+};
+
+struct EnvBvh {
+    std::vector<BvhNode> nodes;
+    std::vector<int> freeNodes, leafOf; // leafOf[item] is the item's leaf
+    int root = -1;
+    int leafCount = 0;
+    int maxDepth = 0; // deepest leaf (edges from the root); removals only ever make it an overestimate
+
+    // Traversal stack bound: a sweep holds at most maxDepth + 1 nodes, and
+    // inserts rebalance before any leaf gets deeper than 2*ceil(log2(N)),
+    // which stays under 64 for any int count
+    static const int sweepStackSize = 128;
+
+    static int depthLimit(int count)
+    {
+        int log2 = 0;
+        while ((1 << log2) < count && log2 < 31) ++log2;
+        return 2 * std::max(1, log2);
+    }
+
+    static float area(const float lo[3], const float hi[3])
+    {
+        float x = hi[0] - lo[0], y = hi[1] - lo[1], z = hi[2] - lo[2];
+        return x * y + y * z + z * x;
+    }
+    int allocNode()
+    {
+        if (!freeNodes.empty()) { int n = freeNodes.back(); freeNodes.pop_back(); return n; }
+        nodes.push_back(BvhNode());
+        return (int)nodes.size() - 1;
+    }
+    void refit(int n)
+    {
+        for (; n >= 0; n = nodes[n].parent) {
+            BvhNode& b = nodes[n];
+            const BvhNode& l = nodes[b.child[0]];
+            const BvhNode& r = nodes[b.child[1]];
+            for (int a = 0; a < 3; ++a) { b.lo[a] = std::min(l.lo[a], r.lo[a]); b.hi[a] = std::max(l.hi[a], r.hi[a]); }
+        }
+    }
+
+    // box(i, lo, hi) gives item i's bounds
+    template <typename Box>
+    void build(int count, Box box)
+    {
+        std::vector<int> order(count);
+        std::vector<float> bounds((size_t)count * 6);
+        for (int i = 0; i < count; ++i) {
+            order[i] = i;
+            box(i, &bounds[i * 6], &bounds[i * 6 + 3]);
+        }
+        buildFrom(order, bounds, count);
+    }
+    // Top-down over the listed items; bounds holds six floats per item id
+    // and ids run below idCount
+    void buildFrom(std::vector<int>& items, const std::vector<float>& bounds, int idCount)
+    {
+        nodes.clear();
+        freeNodes.clear();
+        leafOf.assign(idCount, -1);
+        root = -1;
+        leafCount = (int)items.size();
+        maxDepth = 0;
+        if (items.empty()) return;
+        nodes.reserve(items.size() * 2);
+        root = buildRange(items.data(), items.data() + items.size(), bounds, -1, 0);
+    }
+    // Rebuilds from the current leaves' boxes
+    void rebalance()
+    {
+        std::vector<int> items;
+        std::vector<float> bounds(leafOf.size() * 6);
+        for (int i = 0; i < (int)leafOf.size(); ++i) {
+            if (leafOf[i] < 0) continue;
+            const BvhNode& l = nodes[leafOf[i]];
+            memcpy(&bounds[i * 6], l.lo, sizeof(l.lo));
+            memcpy(&bounds[i * 6 + 3], l.hi, sizeof(l.hi));
+            items.push_back(i);
+        }
+        buildFrom(items, bounds, (int)leafOf.size());
+    }
+    int buildRange(int* first, int* last, const std::vector<float>& bounds, int parent, int depth)
+    {
+        int n = allocNode();
+        BvhNode& b = nodes[n];
+        b.parent = parent;
+        b.child[0] = b.child[1] = -1;
+        b.item = -1;
+        float clo[3] = { 1e30f, 1e30f, 1e30f }, chi[3] = { -1e30f, -1e30f, -1e30f };
+        for (int a = 0; a < 3; ++a) { b.lo[a] = 1e30f; b.hi[a] = -1e30f; }
+        for (int* it = first; it != last; ++it) {
+            const float* lo = &bounds[*it * 6];
+            for (int a = 0; a < 3; ++a) {
+                b.lo[a] = std::min(b.lo[a], lo[a]); b.hi[a] = std::max(b.hi[a], lo[a + 3]);
+                float c = lo[a] + lo[a + 3];
+                clo[a] = std::min(clo[a], c); chi[a] = std::max(chi[a], c);
+            }
+        }
+        if (last - first == 1) {
+            b.item = *first;
+            leafOf[*first] = n;
+            maxDepth = std::max(maxDepth, depth);
+            return n;
+        }
+        int axis = 0;
+        for (int a = 1; a < 3; ++a) if (chi[a] - clo[a] > chi[axis] - clo[axis]) axis = a;
+        int* mid = first + (last - first) / 2;
+        std::nth_element(first, mid, last, [&](int i, int j) {
+            return bounds[i * 6 + axis] + bounds[i * 6 + axis + 3] < bounds[j * 6 + axis] + bounds[j * 6 + axis + 3];
+        });
+        int l = buildRange(first, mid, bounds, n, depth + 1);
+        int r = buildRange(mid, last, bounds, n, depth + 1);
+        nodes[n].child[0] = l; // nodes may have moved while recursing
+        nodes[n].child[1] = r;
+        return n;
+    }
+
+    // Walks down towards the sibling whose box grows least, then splices a
+    // new parent in above it; rebalances if that leaf ends up too deep
+    void insert(int item, const float lo[3], const float hi[3])
+    {
+        int leaf = allocNode();
+        BvhNode& nl = nodes[leaf];
+        memcpy(nl.lo, lo, sizeof(nl.lo)); memcpy(nl.hi, hi, sizeof(nl.hi));
+        nl.parent = -1; nl.child[0] = nl.child[1] = -1; nl.item = item;
+        if ((int)leafOf.size() <= item) leafOf.resize(item + 1, -1);
+        leafOf[item] = leaf;
+        ++leafCount;
+        if (root < 0) { root = leaf; return; }
+        int s = root, depth = 1;
+        for (; nodes[s].item < 0; ++depth) {
+            float best = 1e30f;
+            int next = -1;
+            for (int c : nodes[s].child) {
+                float ulo[3], uhi[3];
+                for (int a = 0; a < 3; ++a) { ulo[a] = std::min(nodes[c].lo[a], lo[a]); uhi[a] = std::max(nodes[c].hi[a], hi[a]); }
+                float growth = area(ulo, uhi) - area(nodes[c].lo, nodes[c].hi);
+                if (growth < best) { best = growth; next = c; }
+            }
+            s = next;
+        }
+        int p = allocNode(), grand = nodes[s].parent;
+        nodes[p].parent = grand;
+        nodes[p].child[0] = s; nodes[p].child[1] = leaf;
+        nodes[p].item = -1;
+        nodes[s].parent = p; nodes[leaf].parent = p;
+        if (grand < 0) root = p;
+        else nodes[grand].child[nodes[grand].child[0] == s ? 0 : 1] = p;
+        refit(p);
+        maxDepth = std::max(maxDepth, depth);
+        if (maxDepth > depthLimit(leafCount)) rebalance();
+    }
+
+    // The leaf's sibling takes its parent's place
+    void remove(int item)
+    {
+        int leaf = leafOf[item];
+        leafOf[item] = -1;
+        --leafCount;
+        freeNodes.push_back(leaf);
+        int p = nodes[leaf].parent;
+        if (p < 0) { root = -1; return; }
+        int sibling = nodes[p].child[nodes[p].child[0] == leaf ? 1 : 0], grand = nodes[p].parent;
+        freeNodes.push_back(p);
+        nodes[sibling].parent = grand;
+        if (grand < 0) { root = sibling; return; }
+        nodes[grand].child[nodes[grand].child[0] == p ? 0 : 1] = sibling;
+        refit(grand);
+    }
+
+    // Visits leaves whose box, grown by r, the segment o + d*t (t in 0..tMax)
+    // crosses, nearer child first; hit(item, tMax) may shrink tMax. Keeps
+    // its stack on the C++ stack, so concurrent sweeps are safe as long as
+    // nothing edits the tree meanwhile
+    template <typename Hit>
+    void sweep(const float o[3], const float d[3], float r, float& tMax, Hit hit) const
+    {
+        if (root < 0) return;
+        float inv[3];
+        for (int a = 0; a < 3; ++a) inv[a] = std::fabs(d[a]) > 1e-12f ? 1.0f / d[a] : 1e30f;
+        auto enter = [&](const BvhNode& b) {
+            float t0 = 0.0f, t1 = tMax;
+            for (int a = 0; a < 3; ++a) {
+                float ta = (b.lo[a] - r - o[a]) * inv[a], tb = (b.hi[a] + r - o[a]) * inv[a];
+                if (ta > tb) std::swap(ta, tb);
+                t0 = std::max(t0, ta); t1 = std::min(t1, tb);
+            }
+            return t0 <= t1 ? t0 : -1.0f;
+        };
+        int stack[sweepStackSize], top = 0;
+        if (enter(nodes[root]) >= 0.0f) stack[top++] = root;
+        while (top > 0) {
+            const BvhNode& b = nodes[stack[--top]];
+            if (b.item >= 0) { hit(b.item, tMax); continue; }
+            float t[2] = { enter(nodes[b.child[0]]), enter(nodes[b.child[1]]) };
+            int nearSide = t[1] >= 0.0f && (t[0] < 0.0f || t[1] < t[0]) ? 1 : 0;
+            // Far child first, so the near one is popped next
+            if (t[1 - nearSide] >= 0.0f) stack[top++] = b.child[1 - nearSide];
+            if (t[nearSide] >= 0.0f) stack[top++] = b.child[nearSide];
+        }
+    }
+};
+
+static EnvBvh camBvh;
+static int camBvhVersion = -1;
+
+// Item ids: trees first, then ice blocks
+static void camItemBox(int i, float lo[3], float hi[3])
+{
+    int nt = (int)trees.size();
+    if (i < nt) {
+        const Tree& t = trees[i];
+        lo[0] = t.x - t.r; lo[1] = 0.0f; lo[2] = t.z - t.h * 0.1f - t.r;
+        hi[0] = t.x + t.r; hi[1] = t.h * 0.93f + 1.0f; hi[2] = t.z + t.r;
+    }
+    else {
+        const IceBlock& b = iceblocks[i - nt];
+        lo[0] = b.x - b.s / 2; lo[1] = 0.0f; lo[2] = b.z - b.s / 2;
+        hi[0] = b.x + b.s / 2; hi[1] = b.s; hi[2] = b.z + b.s / 2;
+    }
+}
+
+static void rebuildCamBvh()
+{
+    camBvh.build((int)(trees.size() + iceblocks.size()), camItemBox);
+    camBvhVersion = environmentVersion;
+}
+
+// Keeps the hierarchy current across addIceBlock/removeLastIceBlock, which
+// bump environmentVersion by one
+static void camBvhIceChanged(bool added)
+{
+    if (camBvhVersion != environmentVersion - 1) return; // stale anyway, rebuilt on use
+    int item = (int)(trees.size() + iceblocks.size());
+    if (added) {
+        float lo[3], hi[3];
+        camItemBox(item - 1, lo, hi);
+        camBvh.insert(item - 1, lo, hi);
+    }
+    else camBvh.remove(item);
+    camBvhVersion = environmentVersion;
+}
+
+// Smallest root of a*t^2 + b*t + c in (0, tMax) for which ok(t) holds
+template <typename Ok>
+static float camSmallestRoot(float a, float b, float c, float tMax, Ok ok)
+{
+    if (std::fabs(a) < 1e-12f) {
+        if (std::fabs(b) < 1e-12f) return tMax;
+        float t = -c / b;
+        return t > 0.0f && t < tMax && ok(t) ? t : tMax;
+    }
+    float disc = b * b - 4.0f * a * c;
+    if (disc < 0.0f) return tMax;
+    float s = std::sqrt(disc), t0 = (-b - s) / (2.0f * a), t1 = (-b + s) / (2.0f * a);
+    if (t0 > t1) std::swap(t0, t1);
+    if (t0 > 0.0f && t0 < tMax && ok(t0)) return t0;
+    if (t1 > 0.0f && t1 < tMax && ok(t1)) return t1;
+    return tMax;
+}
+
+// First contact of a sphere of radius r moving along o + d*t with a tree,
+// as trunk cylinder and foliage cone (each grown by r), or tMax. Shapes the
+// sphere starts inside are ignored so the camera never snaps onto the
+// snowman.
+static float camSweepTree(const Tree& tr, const float o[3], const float d[3], float r, float tMax)
+{
+    // Trunk: vertical cylinder, side and caps
+    float trunkR = tr.r * 0.2f + r, y0 = tr.h * 0.15f - r, y1 = tr.h * 0.45f + r;
+    float ox = o[0] - tr.x, oz = o[2] - tr.z;
+    bool inTrunk = ox * ox + oz * oz < trunkR * trunkR && o[1] > y0 && o[1] < y1;
+    if (!inTrunk) {
+        tMax = camSmallestRoot(d[0] * d[0] + d[2] * d[2], 2.0f * (ox * d[0] + oz * d[2]), ox * ox + oz * oz - trunkR * trunkR, tMax,
+            [&](float t) { float y = o[1] + d[1] * t; return y >= y0 && y <= y1; });
+        for (float capY : { y0, y1 }) {
+            if (std::fabs(d[1]) < 1e-12f) break;
+            float t = (capY - o[1]) / d[1];
+            float x = ox + d[0] * t, z = oz + d[2] * t;
+            if (t > 0.0f && t < tMax && x * x + z * z <= trunkR * trunkR) tMax = t;
+        }
+    }
+
+    // Foliage: growing the cone by r is approximated by raising its apex so
+    // the slant moves out by r; the base disc drops by r
+    float base = tr.h * 0.15f + 1.0f, height = tr.h * 0.78f, k = tr.r / height;
+    float apex = base + height + r * std::sqrt(1.0f + k * k) / k, baseY = base - r;
+    float cx = o[0] - tr.x, cz = o[2] - (tr.z - tr.h * 0.1f), cy = apex - o[1];
+    float k2 = k * k;
+    bool inCone = o[1] > baseY && o[1] < apex && cx * cx + cz * cz < k2 * cy * cy;
+    if (inCone) return tMax;
+    float a = d[0] * d[0] + d[2] * d[2] - k2 * d[1] * d[1];
+    float b = 2.0f * (cx * d[0] + cz * d[2]) + 2.0f * k2 * cy * d[1];
+    float c = cx * cx + cz * cz - k2 * cy * cy;
+    tMax = camSmallestRoot(a, b, c, tMax, [&](float t) { float y = o[1] + d[1] * t; return y >= baseY && y <= apex; });
+    if (std::fabs(d[1]) > 1e-12f) {
+        float t = (baseY - o[1]) / d[1], x = cx + d[0] * t, z = cz + d[2] * t, rr = k * (apex - baseY);
+        if (t > 0.0f && t < tMax && x * x + z * z <= rr * rr) tMax = t;
+    }
+    return tMax;
+}
+
+// Box grown by r (square corners: slightly conservative), unless the sphere
+// starts inside it
+static float camSweepBox(const float lo[3], const float hi[3], const float o[3], const float d[3], float r, float tMax)
+{
+    float t0 = 0.0f, t1 = tMax;
+    bool inside = true;
+    for (int a = 0; a < 3; ++a) {
+        float l = lo[a] - r, h = hi[a] + r;
+        if (o[a] <= l || o[a] >= h) inside = false;
+        if (std::fabs(d[a]) < 1e-12f) {
+            if (o[a] < l || o[a] > h) return tMax;
+            continue;
+        }
+        float ta = (l - o[a]) / d[a], tb = (h - o[a]) / d[a];
+        if (ta > tb) std::swap(ta, tb);
+        t0 = std::max(t0, ta); t1 = std::min(t1, tb);
+    }
+    if (inside || t0 > t1 || t0 <= 0.0f) return tMax;
+    return t0;
+}
+
+// Fraction (0..1) of the way from `from` to `to` a sphere of radius r gets
+// before touching a tree, an ice block or the ground
+float cameraSweep(const float from[3], const float to[3], float r)
+{
+    if (camBvhVersion != environmentVersion) rebuildCamBvh();
+    float d[3] = { to[0] - from[0], to[1] - from[1], to[2] - from[2] };
+    float tMax = 1.0f;
+    if (d[1] < 0.0f && from[1] > r) tMax = std::min(tMax, (r - from[1]) / d[1]);
+    int nt = (int)trees.size();
+    camBvh.sweep(from, d, r, tMax, [&](int item, float& t) {
+        if (item < nt) t = camSweepTree(trees[item], from, d, r, t);
+        else {
+            float lo[3], hi[3];
+            camItemBox(item, lo, hi);
+            t = camSweepBox(lo, hi, from, d, r, t);
+        }
+    });
+    return tMax;
+}
+
+// Orbit distance after collision, eased back out once the way is clear
+// again; pulling in is immediate so the camera never sits inside anything
+static float camPulledDist = -1.0f;
+float cameraCollide(const float pivot[3], const float wanted[3], float wantedDist, float delta)
+{
+    float target = std::max(std::min(camMinDist, wantedDist), cameraSweep(pivot, wanted, camCollisionRadius) * wantedDist);
+    if (camPulledDist < 0.0f || target < camPulledDist) camPulledDist = target;
+    else camPulledDist += (target - camPulledDist) * std::min(1.0f, delta * 4.0f);
+    return camPulledDist;
+}
+
+// Builds the hierarchy over 100k objects, then times sweeps of orbit-camera
+// length from random pivots and patches in/out single ice blocks
+void benchCamera()
+{
+    EnvironmentParams p;
+    p.extent = 1000.0f;
+    p.treeCount = 80000;
+    p.iceCount = 20000;
+    generateEnvironment(p, trees, iceblocks);
+    ++environmentVersion;
+    auto t0 = std::chrono::steady_clock::now();
+    rebuildCamBvh();
+    double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    printf("camera: %zu objects  bvh %zu nodes built in %.1f ms\n", trees.size() + iceblocks.size(), camBvh.nodes.size(), buildMs);
+
+    std::mt19937 rng(9);
+    std::uniform_real_distribution<float> pos(-p.extent * 0.9f, p.extent * 0.9f), unit(0.0f, 1.0f);
+    const int sweeps = 100000;
+    int blocked = 0;
+    double pulled = 0.0;
+    t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < sweeps; ++i) {
+        float yaw = unit(rng) * 6.2831853f, pitch = 0.1f + unit(rng) * 0.8f, dist = 9.0f;
+        float from[3] = { pos(rng), 4.0f, pos(rng) };
+        float to[3] = { from[0] - sinf(yaw) * cosf(pitch) * dist, from[1] + sinf(pitch) * dist, from[2] + cosf(yaw) * cosf(pitch) * dist };
+        float f = cameraSweep(from, to, camCollisionRadius);
+        if (f < 1.0f) { ++blocked; pulled += f; }
+    }
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count() / sweeps;
+    printf("camera: sweep %.2f us  %.1f%% blocked (avg pulled to %.0f%% of the distance)\n",
+        us, 100.0 * blocked / sweeps, blocked ? 100.0 * pulled / blocked : 100.0);
+
+    // Against every object directly, without the hierarchy
+    int mismatches = 0, nt = (int)trees.size();
+    for (int i = 0; i < 200; ++i) {
+        float from[3] = { pos(rng) * 0.02f, 4.0f, pos(rng) * 0.02f };
+        float to[3] = { from[0] + pos(rng) * 0.01f, 8.0f, from[2] + pos(rng) * 0.01f };
+        float d[3] = { to[0] - from[0], to[1] - from[1], to[2] - from[2] };
+        float brute = 1.0f;
+        for (int item = 0; item < nt + (int)iceblocks.size(); ++item) {
+            float lo[3], hi[3];
+            camItemBox(item, lo, hi);
+            brute = item < nt ? camSweepTree(trees[item], from, d, camCollisionRadius, brute) : camSweepBox(lo, hi, from, d, camCollisionRadius, brute);
+        }
+        if (std::fabs(brute - cameraSweep(from, to, camCollisionRadius)) > 1e-5f) ++mismatches;
+    }
+    printf("camera: %d mismatches vs brute force over 200 sweeps\n", mismatches);
+
+    t0 = std::chrono::steady_clock::now();
+    const int edits = 1000;
+    for (int i = 0; i < edits; ++i) {
+        IceBlock b = { pos(rng), pos(rng), 2.0f };
+        iceblocks.push_back(b);
+        ++environmentVersion;
+        camBvhIceChanged(true);
+    }
+    for (int i = 0; i < edits; ++i) {
+        iceblocks.pop_back();
+        ++environmentVersion;
+        camBvhIceChanged(false);
+    }
+    double editUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count() / (edits * 2);
+    printf("camera: incremental ice block insert/remove %.2f us each (rebuilt: %s)\n", editUs, camBvhVersion == environmentVersion ? "no" : "yes");
+
+    // 'b' spammed in one spot chains the inserts far deeper than a built tree
+    for (int i = 0; i < 300; ++i) {
+        IceBlock b = { 0.5f + i * 0.01f, 0.0f, 2.0f };
+        iceblocks.push_back(b);
+        ++environmentVersion;
+        camBvhIceChanged(true);
+    }
+    int depth = 0;
+    for (int leaf : camBvh.leafOf) {
+        int d = 0;
+        for (int n = leaf; n >= 0; n = camBvh.nodes[n].parent) ++d;
+        depth = std::max(depth, d);
+    }
+    mismatches = 0;
+    nt = (int)trees.size();
+    for (int i = 0; i < 200; ++i) {
+        float from[3] = { 9.0f, 0.5f + unit(rng) * 2.0f, unit(rng) * 2.0f - 1.0f };
+        float to[3] = { -3.0f, 0.5f + unit(rng) * 2.0f, unit(rng) * 2.0f - 1.0f };
+        float d[3] = { to[0] - from[0], to[1] - from[1], to[2] - from[2] };
+        float brute = 1.0f;
+        for (int item = 0; item < nt + (int)iceblocks.size(); ++item) {
+            float lo[3], hi[3];
+            camItemBox(item, lo, hi);
+            brute = item < nt ? camSweepTree(trees[item], from, d, camCollisionRadius, brute) : camSweepBox(lo, hi, from, d, camCollisionRadius, brute);
+        }
+        if (std::fabs(brute - cameraSweep(from, to, camCollisionRadius)) > 1e-5f) ++mismatches;
+    }
+    printf("camera: 300 blocks dropped in one spot  depth %d (limit %d)  %d mismatches vs brute force over 200 sweeps\n",
+        depth, EnvBvh::depthLimit(camBvh.leafCount) + 1, mismatches);
+}
+
+// --- Snowball projectiles ---
+// Structure-of-arrays storage so integration is a straight SIMD loop.
+// Collisions go through a static hash over trees and ice blocks (rebuilt when
+// the environment changes) and a per-tick hash over snowmen; hits are
+// swap-removed and leave a puff in the footstep particle system.
+struct SnowballSoA {
+    std::vector<float> x, y, z, vx, vy, vz, age;
+    std::vector<int> owner;
+    size_t size() const { return x.size(); }
+};
+struct SnowmanBody { float x, z; int id; };
+
+static SnowballSoA snowballs;
+static SpatialHash envHash, snowmanHash;
+static int envHashVersion = -1;
+static float envMaxHeight = 0.0f; // nothing in envHash reaches above this
+static std::vector<SnowmanBody> snowmanBodies;
+static std::vector<int> snowballHits;
+const float snowballGravity = 9.8f;
+const float snowballRadius = 0.12f;
+const float snowballMaxAge = 8.0f;
+const float snowmanHalfWidth = 1.0f, snowmanHeight = 3.9f;
+bool snowballPuffs = true;
+long long snowballImpacts = 0;
+
+void throwSnowball(float x, float y, float z, float vx, float vy, float vz, int owner)
+{
+    snowballs.x.push_back(x); snowballs.y.push_back(y); snowballs.z.push_back(z);
+    snowballs.vx.push_back(vx); snowballs.vy.push_back(vy); snowballs.vz.push_back(vz);
+    snowballs.age.push_back(0.0f);
+    snowballs.owner.push_back(owner);
+}
+
+static void removeSnowball(size_t i)
+{
+    size_t last = snowballs.size() - 1;
+    std::vector<float>* cols[7] = { &snowballs.x, &snowballs.y, &snowballs.z, &snowballs.vx, &snowballs.vy, &snowballs.vz, &snowballs.age };
+    for (std::vector<float>* c : cols) { (*c)[i] = (*c)[last]; c->pop_back(); }
+    snowballs.owner[i] = snowballs.owner[last];
+    snowballs.owner.pop_back();
+}
+
+static void rebuildEnvHash()
+{
+    int nt = (int)trees.size();
+    envHash.build(nt + (int)iceblocks.size(), [&](int i, float& x0, float& z0, float& x1, float& z1) {
+        if (i < nt) {
+            const Tree& t = trees[i];
+            x0 = t.x - t.r; x1 = t.x + t.r; z0 = t.z - t.h * 0.1f - t.r; z1 = t.z + t.r;
+        }
+        else {
+            const IceBlock& b = iceblocks[i - nt];
+            x0 = b.x - b.s / 2; x1 = b.x + b.s / 2; z0 = b.z - b.s / 2; z1 = b.z + b.s / 2;
+        }
+    });
+    envMaxHeight = 0.0f;
+    for (const Tree& t : trees) envMaxHeight = std::max(envMaxHeight, t.h * 0.93f + 1.0f);
+    for (const IceBlock& b : iceblocks) envMaxHeight = std::max(envMaxHeight, b.s);
+    envMaxHeight += snowballRadius;
+    envHashVersion = environmentVersion;
+}
+
+// Trunk cylinder or foliage cone, matching drawPineTree's layout
+static bool insideTree(const Tree& t, float x, float y, float z)
+{
+    float dx = x - t.x;
+    if (y >= t.h * 0.15f && y <= t.h * 0.45f) {
+        float dz = z - t.z, rr = t.r * 0.2f + snowballRadius;
+        if (dx * dx + dz * dz < rr * rr) return true;
+    }
+    float base = t.h * 0.15f + 1.0f, height = t.h * 0.78f;
+    if (y < base || y > base + height) return false;
+    float dz = z - (t.z - t.h * 0.1f);
+    float rr = t.r * (1.0f - (y - base) / height) + snowballRadius;
+    return dx * dx + dz * dz < rr * rr;
+}
+
+static bool hitsEnvironment(float x, float y, float z)
+{
+    if (y > envMaxHeight) return false;
+    const int *it, *end;
+    envHash.query(x, z, it, end);
+    int nt = (int)trees.size();
+    for (; it != end; ++it) {
+        if (*it < nt) {
+            if (insideTree(trees[*it], x, y, z)) return true;
+        }
+        else {
+            const IceBlock& b = iceblocks[*it - nt];
+            float h = b.s / 2 + snowballRadius;
+            if (std::fabs(x - b.x) < h && std::fabs(z - b.z) < h && y < b.s + snowballRadius) return true;
+        }
+    }
+    return false;
+}
+
+static bool hitsSnowman(float x, float y, float z, int owner)
+{
+    if (y > snowmanHeight) return false;
+    const int *it, *end;
+    snowmanHash.query(x, z, it, end);
+    for (; it != end; ++it) {
+        const SnowmanBody& b = snowmanBodies[*it];
+        if (b.id == owner) continue;
+        if (std::fabs(x - b.x) < snowmanHalfWidth && std::fabs(z - b.z) < snowmanHalfWidth) return true;
+    }
+    return false;
+}
+
+static void integrateSnowballs(float dt)
+{
+    size_t n = snowballs.size(), i = 0;
+    float* x = snowballs.x.data(); float* y = snowballs.y.data(); float* z = snowballs.z.data();
+    float* vx = snowballs.vx.data(); float* vy = snowballs.vy.data(); float* vz = snowballs.vz.data();
+    float* age = snowballs.age.data();
+#ifdef SNOW_SSE2
+    __m128 vdt = _mm_set1_ps(dt), vg = _mm_set1_ps(snowballGravity * dt);
+    for (; i + 4 <= n; i += 4) {
+        __m128 nvy = _mm_sub_ps(_mm_loadu_ps(vy + i), vg);
+        _mm_storeu_ps(vy + i, nvy);
+        _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(nvy, vdt)));
+        _mm_storeu_ps(x + i, _mm_add_ps(_mm_loadu_ps(x + i), _mm_mul_ps(_mm_loadu_ps(vx + i), vdt)));
+        _mm_storeu_ps(z + i, _mm_add_ps(_mm_loadu_ps(z + i), _mm_mul_ps(_mm_loadu_ps(vz + i), vdt)));
+        _mm_storeu_ps(age + i, _mm_add_ps(_mm_loadu_ps(age + i), vdt));
+    }
+#endif
+    for (; i < n; ++i) {
+        vy[i] -= snowballGravity * dt;
+        y[i] += vy[i] * dt;
+        x[i] += vx[i] * dt;
+        z[i] += vz[i] * dt;
+        age[i] += dt;
+    }
+}
+
+void updateSnowballs(float dt)
+{
+    if (envHashVersion != environmentVersion) rebuildEnvHash();
+    snowmanHash.cell = 4.0f;
+    snowmanHash.build((int)snowmanBodies.size(), [&](int i, float& x0, float& z0, float& x1, float& z1) {
+        x0 = snowmanBodies[i].x - snowmanHalfWidth; x1 = snowmanBodies[i].x + snowmanHalfWidth;
+        z0 = snowmanBodies[i].z - snowmanHalfWidth; z1 = snowmanBodies[i].z + snowmanHalfWidth;
+    });
+
+    integrateSnowballs(dt);
+
+    // Hit tests only read the hashes, so they run in parallel; hits are
+    // then gathered in order
+    unsigned char* hitFlags = frameAlloc<unsigned char>(snowballs.size());
+    const float* x = snowballs.x.data(); const float* y = snowballs.y.data(); const float* z = snowballs.z.data();
+    parallelFor((int)snowballs.size(), 2048, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            bool hit = y[i] <= snowballRadius || hitsEnvironment(x[i], y[i], z[i]) || hitsSnowman(x[i], y[i], z[i], snowballs.owner[i]);
+            hitFlags[i] = hit || snowballs.age[i] > snowballMaxAge;
+        }
+    });
+    snowballHits.clear();
+    for (size_t i = 0; i < snowballs.size(); ++i)
+        if (hitFlags[i]) snowballHits.push_back((int)i);
+    // Descending, so swap-removal never moves a pending hit
+    for (size_t k = snowballHits.size(); k-- > 0;) {
+        size_t i = snowballHits[k];
+        if (snowballPuffs && snowballs.age[i] <= snowballMaxAge) {
+            Particle p;
+            p.x = snowballs.x[i]; p.y = std::max(0.0f, snowballs.y[i]); p.z = snowballs.z[i];
+            p.age = 0.0f;
+            p.life = 0.5f;
+            particleSpawns.push_back(p);
+        }
+        ++snowballImpacts;
+        removeSnowball(i);
+    }
+}
+
+void drawSnowballs()
+{
+    if (snowballs.size() == 0) return;
+    glDisable(GL_LIGHTING);
+    glColor3f(1.0f, 1.0f, 1.0f);
+    glPointSize(4.0f);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    // x/y/z live in separate arrays, so interleave into a reused buffer
+    float* xyz = frameAlloc<float>(snowballs.size() * 3);
+    for (size_t i = 0; i < snowballs.size(); ++i) {
+        xyz[i * 3] = snowballs.x[i]; xyz[i * 3 + 1] = snowballs.y[i]; xyz[i * 3 + 2] = snowballs.z[i];
+    }
+    glVertexPointer(3, GL_FLOAT, 0, xyz);
+    glDrawArrays(GL_POINTS, 0, (GLsizei)snowballs.size());
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glPointSize(1.0f);
+    glEnable(GL_LIGHTING);
+}
+
+// Keeps `count` snowballs in flight over the default environment for 600
+// ticks at 60 Hz, respawning on impact, and reports tick times
+void benchSnowballs(int count)
+{
+    generateEnvironment();
+    std::mt19937 rng(77);
+    std::uniform_real_distribution<float> pos(-envParams.extent, envParams.extent);
+    std::uniform_real_distribution<float> vel(-12.0f, 12.0f);
+    std::uniform_real_distribution<float> up(2.0f, 10.0f);
+    snowmanBodies.clear();
+    for (int i = 0; i < 64; ++i) snowmanBodies.push_back({ pos(rng), pos(rng), i + 1 });
+    snowballPuffs = false;
+    const int ticks = 600;
+    const float dt = 1.0f / 60.0f;
+    double totalMs = 0, worstMs = 0;
+    snowballImpacts = 0;
+    for (int t = 0; t < ticks; ++t) {
+        FrameArenaScope arena;
+        while ((int)snowballs.size() < count)
+            throwSnowball(pos(rng), 1.0f + up(rng) * 0.3f, pos(rng), vel(rng), up(rng), vel(rng), 0);
+        auto start = std::chrono::steady_clock::now();
+        updateSnowballs(dt);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        totalMs += ms;
+        worstMs = std::max(worstMs, ms);
+    }
+    printf("snowballs: %d in flight  %.3f ms/tick avg  %.3f ms worst  %.0f impacts/s\n",
+        count, totalMs / ticks, worstMs, snowballImpacts / (ticks * dt));
+}
+
+// --- Flow-field navigation ---
+// Trees and ice blocks are rasterised into an obstacle grid, and a worker
+// thread keeps a Dijkstra flow field toward the goal (the player). Agents
+// read the latest published field lock-free and steer by looking up their
+// cell's direction. Adding or removing an obstacle only re-solves the cells
+// whose shortest path ran through it (or can now improve), not the field.
+const float navCellSize = 1.0f;
+const float navAgentRadius = 0.6f;
+const int navDirX[8] = { 1, -1, 0, 0, 1, 1, -1, -1 };
+const int navDirZ[8] = { 0, 0, 1, -1, 1, -1, 1, -1 };
+const uint8_t navNoDir = 255;
+
+struct FlowSnapshot {
+    float origin, cell;
+    int dim;
+    std::vector<uint8_t> dir; // index into navDirX/Z toward the goal
+};
+
+struct NavRequest {
+    enum Kind { Rebuild, Goal, Obstacle } kind = Goal;
+    float x0 = 0, z0 = 0; // goal
+    IceBlock block = {}; // obstacle added or removed
+    bool blocked = false;
+    std::vector<Tree> trees;
+    std::vector<IceBlock> ice;
+    float extent = 0;
+};
+
+struct NavAgent { float x, z, heading, armPhase, idle; };
+
+int navAgentCount = 0; // 'n' adds agents around the player
+std::vector<NavAgent> navAgents;
+static std::shared_ptr<const FlowSnapshot> navField;
+static std::mutex navMutex;
+static std::condition_variable navWake;
+static std::deque<NavRequest> navQueue;
+static NavRequest navPendingGoal; // only the newest goal matters, so it skips the queue
+static bool navGoalPending = false;
+static std::thread navThread;
+static bool navQuit = false;
+static int navEnvVersion = -1, navGoalCell = -1;
+static long long navCellsSolved = 0; // cells settled by the last solve
+
+// State owned by the nav thread
+static float navOrigin = 0.0f;
+static int navDim = 0, navGoal = -1;
+static std::vector<uint8_t> navBlocked;
+static std::vector<float> navCost;
+static std::vector<int> navParent;
+static std::vector<Tree> navTrees; // the obstacles the grid was rasterised from
+static std::vector<IceBlock> navIce;
+
+struct NavRect { int cx0, cz0, cx1, cz1; };
+
+static NavRect navCellsCovering(float x0, float z0, float x1, float z1)
+{
+    return { std::max(0, (int)((x0 - navOrigin) / navCellSize)), std::max(0, (int)((z0 - navOrigin) / navCellSize)),
+        std::min(navDim - 1, (int)((x1 - navOrigin) / navCellSize)), std::min(navDim - 1, (int)((z1 - navOrigin) / navCellSize)) };
+}
+
+static NavRect navIceCells(const IceBlock& b)
+{
+    float h = b.s / 2 + navAgentRadius;
+    return navCellsCovering(b.x - h, b.z - h, b.x + h, b.z + h);
+}
+
+// Re-derives the cells in r from every obstacle overlapping it: a cell is
+// blocked when its centre lies inside an inflated tree disc or ice square
+static void navStamp(const NavRect& r)
+{
+    if (r.cx0 > r.cx1 || r.cz0 > r.cz1) return;
+    for (int cz = r.cz0; cz <= r.cz1; ++cz)
+        std::fill(navBlocked.begin() + cz * navDim + r.cx0, navBlocked.begin() + cz * navDim + r.cx1 + 1, 0);
+    auto stamp = [&](NavRect o, auto inside) {
+        o.cx0 = std::max(o.cx0, r.cx0); o.cz0 = std::max(o.cz0, r.cz0);
+        o.cx1 = std::min(o.cx1, r.cx1); o.cz1 = std::min(o.cz1, r.cz1);
+        for (int cz = o.cz0; cz <= o.cz1; ++cz)
+            for (int cx = o.cx0; cx <= o.cx1; ++cx)
+                if (inside(navOrigin + (cx + 0.5f) * navCellSize, navOrigin + (cz + 0.5f) * navCellSize))
+                    navBlocked[cz * navDim + cx] = 1;
+    };
+    for (const Tree& t : navTrees) {
+        float rr = t.r * 0.6f + navAgentRadius, cz = t.z - t.h * 0.05f;
+        stamp(navCellsCovering(t.x - rr, cz - rr, t.x + rr, cz + rr), [&](float x, float z) { return (x - t.x) * (x - t.x) + (z - cz) * (z - cz) < rr * rr; });
+    }
+    for (const IceBlock& b : navIce)
+        stamp(navIceCells(b), [](float, float) { return true; });
+}
+
+static void navRasterise(const std::vector<Tree>& ts, const std::vector<IceBlock>& ice, float extent)
+{
+    navOrigin = -extent;
+    navDim = std::max(1, (int)std::ceil(2.0f * extent / navCellSize));
+    navBlocked.assign((size_t)navDim * navDim, 0);
+    navTrees = ts;
+    navIce = ice;
+    navStamp({ 0, 0, navDim - 1, navDim - 1 });
+}
+
+typedef std::pair<float, int> NavEntry;
+typedef std::priority_queue<NavEntry, std::vector<NavEntry>, std::greater<NavEntry>> NavHeap;
+
+// Relaxes outward from whatever is in the heap; only cells that improve are touched
+static void navPropagate(NavHeap& heap)
+{
+    while (!heap.empty()) {
+        NavEntry e = heap.top();
+        heap.pop();
+        int c = e.second;
+        if (e.first > navCost[c]) continue;
+        ++navCellsSolved;
+        int cx = c % navDim, cz = c / navDim;
+        for (int d = 0; d < 8; ++d) {
+            int nx = cx + navDirX[d], nz = cz + navDirZ[d];
+            if (nx < 0 || nz < 0 || nx >= navDim || nz >= navDim) continue;
+            int n = nz * navDim + nx;
+            if (navBlocked[n]) continue;
+            if (d >= 4 && (navBlocked[cz * navDim + nx] || navBlocked[nz * navDim + cx])) continue; // no corner cutting
+            float nc = e.first + (d >= 4 ? 1.41421356f : 1.0f);
+            if (nc < navCost[n]) {
+                navCost[n] = nc;
+                navParent[n] = c;
+                heap.push(NavEntry(nc, n));
+            }
+        }
+    }
+}
+
+static void navSolveFull()
+{
+    navCost.assign(navBlocked.size(), 1e30f);
+    navParent.assign(navBlocked.size(), -1);
+    if (navGoal < 0 || navBlocked.empty()) return;
+    NavHeap heap;
+    navCost[navGoal] = 0.0f;
+    heap.push(NavEntry(0.0f, navGoal));
+    navPropagate(heap);
+}
+
+// Local repair after the cells in [cx0,cx1]x[cz0,cz1] changed
+static void navSolveLocal(int cx0, int cz0, int cx1, int cz1, bool blocked)
+{
+    NavHeap heap;
+    std::vector<int> invalid;
+    std::vector<uint8_t> mark(navBlocked.size(), 0);
+    for (int cz = cz0; cz <= cz1; ++cz) {
+        for (int cx = cx0; cx <= cx1; ++cx) {
+            int c = cz * navDim + cx;
+            invalid.push_back(c);
+            mark[c] = 1;
+        }
+    }
+    if (blocked) {
+        // Everything whose parent chain runs through the new obstacle
+        for (size_t i = 0; i < invalid.size(); ++i) {
+            int c = invalid[i], cx = c % navDim, cz = c / navDim;
+            for (int d = 0; d < 8; ++d) {
+                int nx = cx + navDirX[d], nz = cz + navDirZ[d];
+                if (nx < 0 || nz < 0 || nx >= navDim || nz >= navDim) continue;
+                int n = nz * navDim + nx;
+                if (!mark[n] && navParent[n] == c) { mark[n] = 1; invalid.push_back(n); }
+            }
+        }
+    }
+    for (int c : invalid) { navCost[c] = c == navGoal && !navBlocked[c] ? 0.0f : 1e30f; navParent[c] = -1; }
+    // Reseed from valid neighbours on the boundary of the invalidated region
+    for (int c : invalid) {
+        if (navBlocked[c]) continue;
+        if (c == navGoal) { heap.push(NavEntry(0.0f, c)); continue; }
+        int cx = c % navDim, cz = c / navDim;
+        for (int d = 0; d < 8; ++d) {
+            int nx = cx + navDirX[d], nz = cz + navDirZ[d];
+            if (nx < 0 || nz < 0 || nx >= navDim || nz >= navDim) continue;
+            int n = nz * navDim + nx;
+            if (!mark[n] && !navBlocked[n] && navCost[n] < 1e30f) heap.push(NavEntry(navCost[n], n));
+        }
+    }
+    navPropagate(heap);
+}
+
+// Adds or removes one ice block and re-stamps the cells it covers; cells
+// under it may still be covered by a tree or another block
+static NavRect navApplyObstacle(const IceBlock& b, bool blocked)
+{
+    if (blocked) navIce.push_back(b);
+    else {
+        // Blocks are removed newest first, so search from the back
+        for (size_t i = navIce.size(); i-- > 0;) {
+            if (navIce[i].x == b.x && navIce[i].z == b.z && navIce[i].s == b.s) { navIce.erase(navIce.begin() + i); break; }
+        }
+    }
+    NavRect r = navIceCells(b);
+    navStamp(r);
+    return r;
+}
+
+static void navPublish()
+{
+    std::shared_ptr<FlowSnapshot> snap = std::make_shared<FlowSnapshot>();
+    snap->origin = navOrigin;
+    snap->cell = navCellSize;
+    snap->dim = navDim;
+    snap->dir.assign(navBlocked.size(), navNoDir);
+    for (size_t c = 0; c < navParent.size(); ++c) {
+        int p = navParent[c];
+        if (p < 0) continue;
+        int dx = p % navDim - (int)c % navDim, dz = p / navDim - (int)c / navDim;
+        for (uint8_t d = 0; d < 8; ++d) if (navDirX[d] == dx && navDirZ[d] == dz) { snap->dir[c] = d; break; }
+    }
+    std::atomic_store(&navField, std::shared_ptr<const FlowSnapshot>(snap));
+}
+
+static void navThreadMain()
+{
+    if (traceEnabled) traceThread("navigation");
+    for (;;) {
+        NavRequest req;
+        {
+            std::unique_lock<std::mutex> lock(navMutex);
+            navWake.wait(lock, [] { return navQuit || !navQueue.empty() || navGoalPending; });
+            if (navQuit) return;
+            if (!navQueue.empty()) {
+                req = std::move(navQueue.front());
+                navQueue.pop_front();
+            }
+            else {
+                req = navPendingGoal;
+                navGoalPending = false;
+            }
+        }
+        static const char* const kindNames[] = { "nav rebuild", "nav goal", "nav obstacle" };
+        TraceScope trace(kindNames[req.kind]);
+        navCellsSolved = 0;
+        if (req.kind == NavRequest::Rebuild) {
+            navRasterise(req.trees, req.ice, req.extent);
+            navSolveFull();
+        }
+        else if (req.kind == NavRequest::Goal) {
+            if (navDim == 0) continue;
+            int cx = std::max(0, std::min(navDim - 1, (int)((req.x0 - navOrigin) / navCellSize)));
+            int cz = std::max(0, std::min(navDim - 1, (int)((req.z0 - navOrigin) / navCellSize)));
+            navGoal = cz * navDim + cx;
+            navSolveFull();
+        }
+        else {
+            if (navDim == 0) continue;
+            NavRect r = navApplyObstacle(req.block, req.blocked);
+            if (r.cx0 > r.cx1 || r.cz0 > r.cz1) continue;
+            navSolveLocal(r.cx0, r.cz0, r.cx1, r.cz1, req.blocked);
+        }
+        navPublish();
+    }
+}
+
+// Joined at exit: destroying navWake under a waiting thread can hang
+static void navStop()
+{
+    {
+        std::lock_guard<std::mutex> lock(navMutex);
+        navQuit = true;
+    }
+    navWake.notify_all();
+    if (navThread.joinable()) navThread.join();
+}
+
+static void navSubmit(NavRequest req)
+{
+    if (!navThread.joinable()) {
+        navThread = std::thread(navThreadMain);
+        atexit(navStop);
+    }
+    {
+        std::lock_guard<std::mutex> lock(navMutex);
+        if (req.kind == NavRequest::Goal) {
+            navPendingGoal = req;
+            navGoalPending = true;
+        }
+        else navQueue.push_back(std::move(req));
+    }
+    navWake.notify_one();
+}
+
+// Adds or removes an ice block on the nav thread's grid and repairs the field locally
+void navObstacleChanged(const IceBlock& b, bool blocked)
+{
+    NavRequest req;
+    req.kind = NavRequest::Obstacle;
+    req.block = b;
+    req.blocked = blocked;
+    navSubmit(std::move(req));
+}
+
+// Drops an ice block without regenerating the environment; 'b' uses this
+void addIceBlock(const IceBlock& b)
+{
+    iceblocks.push_back(b);
+    ++environmentVersion;
+    camBvhIceChanged(true);
+    navEnvVersion = environmentVersion; // the nav grid is patched, not rebuilt
+    navObstacleChanged(b, true);
+}
+
+void removeLastIceBlock()
+{
+    if (iceblocks.empty()) return;
+    IceBlock b = iceblocks.back();
+    iceblocks.pop_back();
+    ++environmentVersion;
+    camBvhIceChanged(false);
+    navEnvVersion = environmentVersion;
+    navObstacleChanged(b, false);
+}
+
+// O(1) steering lookup; false if the cell has no path or the field isn't ready
+static bool navSample(const FlowSnapshot& f, float x, float z, float& dx, float& dz)
+{
+    int cx = (int)std::floor((x - f.origin) / f.cell), cz = (int)std::floor((z - f.origin) / f.cell);
+    if (cx < 0 || cz < 0 || cx >= f.dim || cz >= f.dim) return false;
+    uint8_t d = f.dir[cz * f.dim + cx];
+    if (d == navNoDir) return false;
+    float inv = d >= 4 ? 0.70710678f : 1.0f;
+    dx = navDirX[d] * inv;
+    dz = navDirZ[d] * inv;
+    return true;
+}
+
+// Picks a spawn point within 12 of the goal on a cell that has a flow
+// direction, so the agent neither starts inside an obstacle nor in a walled-
+// off pocket. If random picks keep failing, the last pick is moved to the
+// nearest cell that has a direction.
+static void navSpawnPoint(const FlowSnapshot& f, std::mt19937& rng, float goalX, float goalZ, float& x, float& z)
+{
+    std::uniform_real_distribution<float> ring(-12.0f, 12.0f);
+    float dx, dz;
+    for (int tries = 0; tries < 32; ++tries) {
+        x = goalX + ring(rng);
+        z = goalZ + ring(rng);
+        if (navSample(f, x, z, dx, dz)) return;
+    }
+    int cx = (int)std::floor((x - f.origin) / f.cell), cz = (int)std::floor((z - f.origin) / f.cell);
+    for (int r = 1; r < f.dim; ++r) {
+        for (int oz = -r; oz <= r; ++oz) {
+            for (int ox = -r; ox <= r; ox += (oz == -r || oz == r) ? 1 : 2 * r) {
+                int nx = cx + ox, nz = cz + oz;
+                if (nx < 0 || nz < 0 || nx >= f.dim || nz >= f.dim || f.dir[nz * f.dim + nx] == navNoDir) continue;
+                x = f.origin + (nx + 0.5f) * f.cell;
+                z = f.origin + (nz + 0.5f) * f.cell;
+                return;
+            }
+        }
+    }
+    x = goalX; // nothing reachable: wait at the goal
+    z = goalZ;
+}
+
+void updateNavigation(float dt, float goalX, float goalZ)
+{
+    if (navEnvVersion != environmentVersion) {
+        NavRequest req;
+        req.kind = NavRequest::Rebuild;
+        req.trees = trees;
+        req.ice = iceblocks;
+        req.extent = envParams.extent;
+        navSubmit(std::move(req));
+        navEnvVersion = environmentVersion;
+        navGoalCell = -1;
+    }
+    int goalCell = (int)std::floor(goalX / navCellSize) * 65536 + (int)std::floor(goalZ / navCellSize);
+    if (goalCell != navGoalCell) {
+        NavRequest req;
+        req.kind = NavRequest::Goal;
+        req.x0 = goalX; req.z0 = goalZ;
+        navSubmit(std::move(req));
+        navGoalCell = goalCell;
+    }
+
+    if ((int)navAgents.size() > navAgentCount) navAgents.resize(navAgentCount);
+    std::shared_ptr<const FlowSnapshot> field = std::atomic_load(&navField);
+    if (!field) return; // agents spawn once there is a field to check spawn cells against
+    std::mt19937 rng((unsigned)navAgents.size());
+    while ((int)navAgents.size() < navAgentCount) {
+        NavAgent a = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        navSpawnPoint(*field, rng, goalX, goalZ, a.x, a.z);
+        navAgents.push_back(a);
+    }
+    parallelFor((int)navAgents.size(), 256, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            NavAgent& a = navAgents[i];
+            float gx = goalX - a.x, gz = goalZ - a.z;
+            float dx, dz;
+            if (gx * gx + gz * gz < 9.0f || !navSample(*field, a.x, a.z, dx, dz)) {
+                a.idle = std::min(1.0f, a.idle + dt * 2.0f);
+                continue;
+            }
+            a.idle = std::max(0.0f, a.idle - dt * 4.0f);
+            a.x += dx * moveSpeed * dt;
+            a.z += dz * moveSpeed * dt;
+            a.heading = atan2f(dx, dz) * 180.0f / 3.1415926f;
+            a.armPhase += dt * 4.0f;
+        }
+    });
+}
+
+// Solves a large field, then drops and removes an obstacle, comparing the
+// local repair's cost and result against a full re-solve
+void benchNav()
+{
+    EnvironmentParams p;
+    p.extent = 200.0f;
+    p.treeCount = 1500;
+    p.iceCount = 500;
+    std::vector<Tree> ts;
+    std::vector<IceBlock> ice;
+    generateEnvironment(p, ts, ice);
+    navRasterise(ts, ice, p.extent);
+    navGoal = (navDim / 2) * navDim + navDim / 2;
+    auto ms = [](std::chrono::steady_clock::time_point t0) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    };
+    auto t0 = std::chrono::steady_clock::now();
+    navCellsSolved = 0;
+    navSolveFull();
+    printf("nav: %dx%d grid  full solve %.2f ms  %lld cells\n", navDim, navDim, ms(t0), navCellsSolved);
+
+    // A block dropped half over a tree, then removed: the tree's cells must
+    // stay blocked, and both grids must match a rasterise from scratch
+    const Tree& t = ts[0];
+    IceBlock block = { t.x + t.r * 0.5f, t.z, 3.0f };
+    for (int pass = 0; pass < 2; ++pass) {
+        bool blocked = pass == 0;
+        navCellsSolved = 0;
+        t0 = std::chrono::steady_clock::now();
+        NavRect r = navApplyObstacle(block, blocked);
+        navSolveLocal(r.cx0, r.cz0, r.cx1, r.cz1, blocked);
+        double localMs = ms(t0);
+        long long localCells = navCellsSolved;
+        std::vector<float> local = navCost;
+        std::vector<uint8_t> patched = navBlocked;
+        std::vector<IceBlock> current = ice;
+        if (blocked) current.push_back(block);
+        navRasterise(ts, current, p.extent);
+        navSolveFull();
+        size_t mismatches = 0, cellMismatches = 0;
+        for (size_t c = 0; c < local.size(); ++c) if (std::fabs(local[c] - navCost[c]) > 1e-3f) ++mismatches;
+        for (size_t c = 0; c < patched.size(); ++c) cellMismatches += patched[c] != navBlocked[c];
+        printf("nav: %s obstacle  local repair %.2f ms  %lld cells  %zu mismatches vs full solve  %zu grid cells differ from rasterise\n",
+            blocked ? "add" : "remove", localMs, localCells, mismatches, cellMismatches);
+    }
+
+    // Agents spawned around goals across the map must all start on a cell
+    // that has a direction; a plain random pick lands in trees or pockets
+    navPublish();
+    std::shared_ptr<const FlowSnapshot> field = std::atomic_load(&navField);
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> goal(-p.extent * 0.8f, p.extent * 0.8f), ring(-12.0f, 12.0f);
+    int stuck = 0, naiveStuck = 0;
+    const int spawns = 2000;
+    for (int i = 0; i < spawns; ++i) {
+        float gx = goal(rng), gz = goal(rng), x, z, dx, dz;
+        naiveStuck += !navSample(*field, gx + ring(rng), gz + ring(rng), dx, dz);
+        navSpawnPoint(*field, rng, gx, gz, x, z);
+        stuck += !navSample(*field, x, z, dx, dz);
+    }
+    printf("nav: %d spawns  %d without a flow direction (%d with an unchecked random pick)\n", spawns, stuck, naiveStuck);
+    std::atomic_store(&navField, std::shared_ptr<const FlowSnapshot>());
+}
+
+void queueNavAgents(float eyeX, float eyeZ, float time)
+{
+    for (size_t i = 0; i < navAgents.size(); ++i) {
+        const NavAgent& a = navAgents[i];
+        float dx = a.x - eyeX, dz = a.z - eyeZ;
+        if (dx * dx + dz * dz > 70.0f * 70.0f) continue;
+        queueSnowman(a.x, a.z, a.heading, a.armPhase, a.idle, time + i * 0.37f, false, 0.0f);
+    }
+}
+
+// --- Loopback multiplayer ---
+// '--host [port]' runs the authoritative simulation; '--join [port]' clients
+// send their keys and receive quantized snapshots, delta-encoded against the
+// last snapshot they acknowledged. A client predicts its own snowman and
+// draws the others a few ticks in the past.
+enum NetMode { NET_OFF, NET_HOST, NET_CLIENT };
+NetMode netMode = NET_OFF;
+unsigned short netPort = 27960;
+const int netTickRate = 30;
+const int netHistory = 64;         // snapshots kept as delta baselines
+const float netInterpTicks = 3.0f; // remote snowmen are drawn ~100 ms behind
+
+#ifdef _WIN32
+typedef SOCKET NetSocket;
+const NetSocket netBadSocket = INVALID_SOCKET;
+typedef int NetAddrLen;
+#else
+typedef int NetSocket;
+const NetSocket netBadSocket = -1;
+typedef socklen_t NetAddrLen;
+#endif
+
+void netClose(NetSocket s)
+{
+#ifdef _WIN32
+    closesocket(s);
+#else
+    close(s);
+#endif
+}
+
+// Non-blocking UDP socket bound to 127.0.0.1 (port 0 picks a free one)
+NetSocket netOpen(unsigned short port)
+{
+#ifdef _WIN32
+    static bool wsaReady = false;
+    if (!wsaReady) {
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return netBadSocket;
+        wsaReady = true;
+    }
+#endif
+    NetSocket s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == netBadSocket) return s;
+    int rcvbuf = 1 << 20;
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char*)&rcvbuf, sizeof(rcvbuf));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    bool ok = bind(s, (const sockaddr*)&addr, sizeof(addr)) == 0;
+#ifdef _WIN32
+    u_long nonBlocking = 1;
+    ok = ok && ioctlsocket(s, FIONBIO, &nonBlocking) == 0;
+#else
+    ok = ok && fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK) == 0;
+#endif
+    if (!ok) {
+        netClose(s);
+        return netBadSocket;
+    }
+    return s;
+}
+
+sockaddr_in netLocalAddr(NetSocket s)
+{
+    sockaddr_in addr = {};
+    NetAddrLen len = sizeof(addr);
+    getsockname(s, (sockaddr*)&addr, &len);
+    return addr;
+}
+
+bool netSameAddr(const sockaddr_in& a, const sockaddr_in& b)
+{
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+void netSendTo(NetSocket s, const sockaddr_in& to, const std::vector<uint8_t>& data)
+{
+    sendto(s, (const char*)data.data(), (int)data.size(), 0, (const sockaddr*)&to, sizeof(to));
+}
+
+int netRecvFrom(NetSocket s, uint8_t* data, int cap, sockaddr_in& from)
+{
+    NetAddrLen len = sizeof(from);
+    return (int)recvfrom(s, (char*)data, cap, 0, (sockaddr*)&from, &len);
+}
+
+// Byte-oriented packet writer/reader; varints with zigzag for signed deltas.
+// The writer keeps its capacity, so steady-state sends don't allocate.
+struct NetWriter {
+    std::vector<uint8_t> buf;
+    void u8(unsigned v) { buf.push_back((uint8_t)v); }
+    void u16(unsigned v) { u8(v & 255); u8((v >> 8) & 255); }
+    void var(uint32_t v)
+    {
+        while (v >= 0x80) { u8((v & 0x7f) | 0x80); v >>= 7; }
+        u8(v);
+    }
+    void zig(int32_t v) { var(((uint32_t)v << 1) ^ (uint32_t)(v >> 31)); }
+};
+
+struct NetReader {
+    const uint8_t* p;
+    const uint8_t* end;
+    bool ok = true;
+    NetReader(const uint8_t* data, int n) : p(data), end(data + n) {}
+    unsigned u8()
+    {
+        if (p >= end) { ok = false; return 0; }
+        return *p++;
+    }
+    unsigned u16() { unsigned lo = u8(); return lo | (u8() << 8); }
+    uint32_t var()
+    {
+        uint32_t v = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            unsigned b = u8();
+            v |= (uint32_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        ok = false;
+        return 0;
+    }
+    int32_t zig() { uint32_t v = var(); return (int32_t)(v >> 1) ^ -(int32_t)(v & 1); }
+};
+
+enum NetPacketType { NET_SNAPSHOT = 1, NET_INPUT = 2 };
+enum NetEntityFlags { NET_POS = 1, NET_HEADING = 2, NET_ARM = 4, NET_SLASH = 8, NET_FOOT = 16, NET_NEW = 32, NET_GONE = 64 };
+
+// Quantized replicated state: positions in 1/256 units, angles in 1/65536
+// turns, slash progress in 1/254 steps (0 = not slashing). Footprints are
+// replicated as a counter plus the latest foot position.
+struct NetEntity {
+    uint16_t id;
+    int32_t x, z, footX, footZ;
+    uint16_t heading, arm;
+    uint8_t slash, footSeq;
+};
+
+bool operator==(const NetEntity& a, const NetEntity& b)
+{
+    return a.id == b.id && a.x == b.x && a.z == b.z && a.footX == b.footX && a.footZ == b.footZ
+        && a.heading == b.heading && a.arm == b.arm && a.slash == b.slash && a.footSeq == b.footSeq;
+}
+
+struct NetSnapshot {
+    uint32_t tick = 0;             // 0 = empty slot; ticks start at 1
+    std::vector<NetEntity> ents;   // sorted by id
+};
+
+NetEntity netQuantize(uint16_t id, const SnowmanState& s, uint8_t footSeq, float footX, float footZ)
+{
+    NetEntity e;
+    e.id = id;
+    e.x = (int32_t)lroundf(s.x * 256.0f);
+    e.z = (int32_t)lroundf(s.z * 256.0f);
+    e.footX = (int32_t)lroundf(footX * 256.0f);
+    e.footZ = (int32_t)lroundf(footZ * 256.0f);
+    float turns = s.heading / 360.0f;
+    e.heading = (uint16_t)((int32_t)lroundf((turns - std::floor(turns)) * 65536.0f) & 0xffff);
+    turns = s.armPhase / 6.2831853f;
+    e.arm = (uint16_t)((int32_t)lroundf((turns - std::floor(turns)) * 65536.0f) & 0xffff);
+    e.slash = s.slashing ? (uint8_t)std::min(255, 1 + (int)(s.slashTimer / swordSlashDuration * 254.0f)) : 0;
+    e.footSeq = footSeq;
+    return e;
+}
+
+SnowmanState netDequantize(const NetEntity& e)
+{
+    SnowmanState s;
+    s.x = e.x / 256.0f;
+    s.z = e.z / 256.0f;
+    s.heading = e.heading * (360.0f / 65536.0f);
+    s.armPhase = e.arm * (6.2831853f / 65536.0f);
+    s.slashing = e.slash != 0;
+    s.slashTimer = s.slashing ? (e.slash - 1) / 254.0f * swordSlashDuration : 0.0f;
+    return s;
+}
+
+void netWriteFields(NetWriter& w, unsigned flags, const NetEntity& ref, const NetEntity& e)
+{
+    if (flags & NET_POS) { w.zig(e.x - ref.x); w.zig(e.z - ref.z); }
+    if (flags & NET_HEADING) w.zig((int16_t)(e.heading - ref.heading));
+    if (flags & NET_ARM) w.zig((int16_t)(e.arm - ref.arm));
+    if (flags & NET_SLASH) w.u8(e.slash);
+    if (flags & NET_FOOT) { w.u8(e.footSeq); w.zig(e.footX - e.x); w.zig(e.footZ - e.z); }
+}
+
+void netReadFields(NetReader& r, unsigned flags, NetEntity& e)
+{
+    if (flags & NET_POS) { e.x += r.zig(); e.z += r.zig(); }
+    if (flags & NET_HEADING) e.heading = (uint16_t)(e.heading + r.zig());
+    if (flags & NET_ARM) e.arm = (uint16_t)(e.arm + r.zig());
+    if (flags & NET_SLASH) e.slash = (uint8_t)r.u8();
+    if (flags & NET_FOOT) { e.footSeq = (uint8_t)r.u8(); e.footX = e.x + r.zig(); e.footZ = e.z + r.zig(); }
+}
+
+// Entities are written as (id gap, flags, changed fields); unchanged ones
+// are omitted entirely and a zero gap ends the list. base may be null.
+void netEncodeEntities(NetWriter& w, const NetSnapshot* base, const NetSnapshot& cur)
+{
+    static const NetEntity zero = {};
+    size_t nb = base ? base->ents.size() : 0, bi = 0, ci = 0;
+    int prevId = -1;
+    auto header = [&](int id, unsigned flags) {
+        w.var((uint32_t)(id - prevId));
+        w.u8(flags);
+        prevId = id;
+    };
+    while (bi < nb || ci < cur.ents.size()) {
+        const NetEntity* b = bi < nb ? &base->ents[bi] : nullptr;
+        const NetEntity* c = ci < cur.ents.size() ? &cur.ents[ci] : nullptr;
+        if (c && (!b || c->id < b->id)) {
+            unsigned flags = NET_NEW | NET_POS | NET_HEADING | NET_ARM | NET_SLASH | NET_FOOT;
+            header(c->id, flags);
+            netWriteFields(w, flags, zero, *c);
+            ++ci;
+        } else if (!c || b->id < c->id) {
+            header(b->id, NET_GONE);
+            ++bi;
+        } else {
+            unsigned flags = 0;
+            if (c->x != b->x || c->z != b->z) flags |= NET_POS;
+            if (c->heading != b->heading) flags |= NET_HEADING;
+            if (c->arm != b->arm) flags |= NET_ARM;
+            if (c->slash != b->slash) flags |= NET_SLASH;
+            if (c->footSeq != b->footSeq || c->footX != b->footX || c->footZ != b->footZ) flags |= NET_FOOT;
+            if (flags) {
+                header(c->id, flags);
+                netWriteFields(w, flags, *b, *c);
+            }
+            ++bi; ++ci;
+        }
+    }
+    w.var(0);
+}
+
+bool netDecodeEntities(NetReader& r, const NetSnapshot* base, NetSnapshot& out)
+{
+    static const NetEntity zero = {};
+    out.ents.clear();
+    size_t nb = base ? base->ents.size() : 0, bi = 0;
+    int id = -1;
+    for (;;) {
+        uint32_t gap = r.var();
+        if (!r.ok) return false;
+        if (gap == 0) break;
+        id += (int)gap;
+        unsigned flags = r.u8();
+        while (bi < nb && base->ents[bi].id < id) out.ents.push_back(base->ents[bi++]);
+        bool inBase = bi < nb && base->ents[bi].id == id;
+        if (flags & NET_GONE) {
+            if (inBase) ++bi;
+            continue;
+        }
+        NetEntity e = zero;
+        if (flags & NET_NEW) e.id = (uint16_t)id;
+        else if (inBase) e = base->ents[bi];
+        else return false;
+        if (inBase) ++bi;
+        netReadFields(r, flags, e);
+        out.ents.push_back(e);
+    }
+    while (bi < nb) out.ents.push_back(base->ents[bi++]);
+    return r.ok;
+}
+
+const NetEntity* netFindEntity(const NetSnapshot& snap, unsigned id)
+{
+    auto it = std::lower_bound(snap.ents.begin(), snap.ents.end(), id,
+        [](const NetEntity& e, unsigned v) { return e.id < v; });
+    return it != snap.ents.end() && it->id == id ? &*it : nullptr;
+}
+
+// Server side: one remote snowman per client address
+struct NetClient {
+    sockaddr_in addr;
+    uint16_t id;
+    uint16_t lastSeq;
+    uint32_t ackTick;
+    SnowmanState state;
+    uint8_t footSeq;
+    float footX, footZ;
+    float silence;
+};
+
+struct NetServer {
+    NetSocket sock = netBadSocket;
+    std::vector<NetClient> clients; // ascending id
+    NetSnapshot history[netHistory];
+    uint32_t tick = 0;
+    uint16_t nextId = 1;
+    NetWriter w;
+};
+
+// Applies every queued input packet; footprints become local particles
+// when spawnFootprints is set
+void netServerReceive(NetServer& sv, bool spawnFootprints)
+{
+    uint8_t buf[1500];
+    sockaddr_in from;
+    int n;
+    while ((n = netRecvFrom(sv.sock, buf, sizeof(buf), from)) > 0) {
+        NetReader r(buf, n);
+        if (r.u8() != NET_INPUT) continue;
+        uint32_t ackTick = r.var();
+        uint16_t seq = (uint16_t)r.u16();
+        unsigned count = r.u8();
+        if (!r.ok || count == 0 || count > 8) continue;
+        NetClient* c = nullptr;
+        for (NetClient& cl : sv.clients) if (netSameAddr(cl.addr, from)) c = &cl;
+        if (!c) {
+            NetClient cl = {};
+            cl.addr = from;
+            cl.id = sv.nextId++;
+            cl.lastSeq = (uint16_t)(seq - count);
+            sv.clients.push_back(cl);
+            c = &sv.clients.back();
+        }
+        c->silence = 0.0f;
+        if ((int32_t)(ackTick - c->ackTick) > 0) c->ackTick = ackTick;
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned keys = r.u8(), dtMs = r.u8();
+            uint16_t s = (uint16_t)(seq - (count - 1 - i));
+            if (!r.ok || (int16_t)(s - c->lastSeq) <= 0) continue;
+            c->lastSeq = s;
+            float fx, fz;
+            if (stepSnowman(c->state, keys, dtMs / 1000.0f, fx, fz)) {
+                ++c->footSeq;
+                c->footX = fx; c->footZ = fz;
+                if (spawnFootprints) spawnFootprint(fx, fz);
+            }
+        }
+    }
+}
+
+// Captures a tick (the host's own snowman is entity 0 when given) and sends
+// each client a delta against its newest acknowledged snapshot. Returns the
+// payload bytes sent; encodeUs accumulates the time spent encoding.
+size_t netServerSnapshot(NetServer& sv, const NetEntity* host, double* encodeUs = nullptr)
+{
+    NetSnapshot& cur = sv.history[++sv.tick % netHistory];
+    cur.tick = sv.tick;
+    cur.ents.clear();
+    if (host) cur.ents.push_back(*host);
+    for (const NetClient& c : sv.clients)
+        cur.ents.push_back(netQuantize(c.id, c.state, c.footSeq, c.footX, c.footZ));
+
+    size_t bytes = 0;
+    for (const NetClient& c : sv.clients) {
+        auto t0 = std::chrono::steady_clock::now();
+        const NetSnapshot& cand = sv.history[c.ackTick % netHistory];
+        const NetSnapshot* base = c.ackTick && cand.tick == c.ackTick && sv.tick - c.ackTick < netHistory ? &cand : nullptr;
+        sv.w.buf.clear();
+        sv.w.u8(NET_SNAPSHOT);
+        sv.w.var(sv.tick);
+        sv.w.var(base ? base->tick : 0);
+        sv.w.var(c.id);
+        sv.w.u16(c.lastSeq);
+        netEncodeEntities(sv.w, base, cur);
+        if (encodeUs) *encodeUs += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+        netSendTo(sv.sock, c.addr, sv.w.buf);
+        bytes += sv.w.buf.size();
+    }
+    return bytes;
+}
+
+// Client side
+struct NetInput {
+    uint16_t seq;
+    uint8_t keys, dtMs;
+};
+
+struct NetPeer {
+    NetSocket sock = netBadSocket;
+    sockaddr_in server;
+    NetSnapshot history[netHistory];
+    uint32_t latestTick = 0;
+    int id = -1;               // our entity, once the server has replied
+    uint16_t inputSeq = 0;
+    uint16_t ackSeq = 0;
+    float dtCarry = 0.0f;      // keeps quantized input time in step with real time
+    float renderTick = 0.0f;
+    std::deque<NetInput> pending; // inputs the server hasn't acknowledged
+    NetWriter w;
+};
+
+void netClientSendInput(NetPeer& cl, unsigned keys, float dt)
+{
+    float ms = dt * 1000.0f + cl.dtCarry;
+    int dtMs = std::max(0, std::min(100, (int)lroundf(ms)));
+    cl.dtCarry = std::max(-50.0f, std::min(50.0f, ms - dtMs));
+    cl.pending.push_back({ ++cl.inputSeq, (uint8_t)keys, (uint8_t)dtMs });
+    if (cl.pending.size() > 128) cl.pending.pop_front();
+    // The last few inputs ride along so a lost packet costs nothing
+    unsigned count = (unsigned)std::min<size_t>(4, cl.pending.size());
+    cl.w.buf.clear();
+    cl.w.u8(NET_INPUT);
+    cl.w.var(cl.latestTick);
+    cl.w.u16(cl.inputSeq);
+    cl.w.u8(count);
+    for (size_t i = cl.pending.size() - count; i < cl.pending.size(); ++i) {
+        cl.w.u8(cl.pending[i].keys);
+        cl.w.u8(cl.pending[i].dtMs);
+    }
+    netSendTo(cl.sock, cl.server, cl.w.buf);
+}
+
+// Decodes queued snapshots; returns how many were newer than the latest.
+// Footprints of other snowmen become particles when spawnFootprints is set.
+int netClientReceive(NetPeer& cl, bool spawnFootprints, double* decodeUs = nullptr)
+{
+    uint8_t buf[65536];
+    sockaddr_in from;
+    int n, accepted = 0;
+    while ((n = netRecvFrom(cl.sock, buf, sizeof(buf), from)) > 0) {
+        auto t0 = std::chrono::steady_clock::now();
+        NetReader r(buf, n);
+        if (r.u8() != NET_SNAPSHOT) continue;
+        uint32_t tick = r.var(), baseTick = r.var();
+        unsigned id = r.var();
+        uint16_t ackSeq = (uint16_t)r.u16();
+        if (!r.ok || tick == 0 || (int32_t)(tick - cl.latestTick) <= 0) continue;
+        const NetSnapshot* base = nullptr;
+        if (baseTick) {
+            base = &cl.history[baseTick % netHistory];
+            if (base->tick != baseTick) continue;
+        }
+        NetSnapshot& out = cl.history[tick % netHistory];
+        if (&out == base) continue;
+        out.tick = 0;
+        if (!netDecodeEntities(r, base, out)) continue;
+        out.tick = tick;
+        if (decodeUs) *decodeUs += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+
+        const NetSnapshot& prev = cl.history[cl.latestTick % netHistory];
+        if (spawnFootprints && cl.latestTick && prev.tick == cl.latestTick) {
+            for (const NetEntity& e : out.ents) {
+                const NetEntity* old = netFindEntity(prev, e.id);
+                if ((int)e.id != cl.id && old && old->footSeq != e.footSeq)
+                    spawnFootprint(e.footX / 256.0f, e.footZ / 256.0f);
+            }
+        }
+        cl.latestTick = tick;
+        cl.id = (int)id;
+        cl.ackSeq = ackSeq;
+        while (!cl.pending.empty() && (int16_t)(cl.pending.front().seq - ackSeq) <= 0) cl.pending.pop_front();
+        ++accepted;
+    }
+    return accepted;
+}
+
+std::unique_ptr<NetServer> netServer;
+std::unique_ptr<NetPeer> netPeer;
+uint8_t netHostFootSeq = 0;
+float netHostFootX = 0.0f, netHostFootZ = 0.0f;
+
+void netStart()
+{
+    if (netMode == NET_HOST) {
+        netServer.reset(new NetServer());
+        netServer->sock = netOpen(netPort);
+        if (netServer->sock != netBadSocket) {
+            printf("net: hosting on 127.0.0.1:%u\n", netPort);
+            return;
+        }
+        netServer.reset();
+    } else if (netMode == NET_CLIENT) {
+        netPeer.reset(new NetPeer());
+        netPeer->sock = netOpen(0);
+        netPeer->server = {};
+        netPeer->server.sin_family = AF_INET;
+        netPeer->server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        netPeer->server.sin_port = htons(netPort);
+        if (netPeer->sock != netBadSocket) {
+            printf("net: joining 127.0.0.1:%u\n", netPort);
+            return;
+        }
+        netPeer.reset();
+    }
+    if (netMode != NET_OFF) printf("net: could not open a UDP socket, playing offline\n");
+    netMode = NET_OFF;
+}
+
+// The host's own footprints, replicated as entity 0's
+void netNoteFootstep(float footX, float footZ)
+{
+    ++netHostFootSeq;
+    netHostFootX = footX;
+    netHostFootZ = footZ;
+}
+
+// Called from idle after the local snowman has stepped
+void netUpdate(unsigned keys, float delta)
+{
+    if (netServer) {
+        NetServer& sv = *netServer;
+        netServerReceive(sv, true);
+        for (NetClient& c : sv.clients) c.silence += delta;
+        sv.clients.erase(std::remove_if(sv.clients.begin(), sv.clients.end(),
+            [](const NetClient& c) { return c.silence > 5.0f; }), sv.clients.end());
+
+        static float accum = 0.0f;
+        accum += delta;
+        if (accum >= 1.0f / netTickRate) {
+            accum = std::fmod(accum, 1.0f / netTickRate);
+            SnowmanState self;
+            self.x = snowmanX; self.z = snowmanZ; self.heading = headingDeg;
+            self.armPhase = armAnimPhase;
+            self.slashing = swordSlashing; self.slashTimer = swordSlashTimer;
+            NetEntity host = netQuantize(0, self, netHostFootSeq, netHostFootX, netHostFootZ);
+            netServerSnapshot(sv, &host);
+        }
+    } else if (netPeer) {
+        NetPeer& cl = *netPeer;
+        netClientSendInput(cl, keys, delta);
+        cl.renderTick += delta * netTickRate;
+        if (netClientReceive(cl, true) == 0 || cl.id < 0) return;
+
+        // Reconcile: restart from the server's state and replay what it
+        // hasn't seen yet. Arm and foot phases stay local.
+        const NetEntity* own = netFindEntity(cl.history[cl.latestTick % netHistory], cl.id);
+        if (!own) return;
+        SnowmanState s = netDequantize(*own);
+        for (const NetInput& in : cl.pending) {
+            float fx, fz;
+            stepSnowman(s, in.keys, in.dtMs / 1000.0f, fx, fz);
+        }
+        snowmanX = s.x; snowmanZ = s.z; headingDeg = s.heading;
+        swordSlashing = s.slashing; swordSlashTimer = s.slashTimer;
+    }
+}
+
+void queueNetSnowman(const SnowmanState& s)
+{
+    queueSnowman(s.x, s.z, s.heading, s.armPhase, 0.0f, 0.0f, s.slashing, s.slashTimer);
+}
+
+void queueNetSnowmen()
+{
+    if (netServer) {
+        for (const NetClient& c : netServer->clients) queueNetSnowman(c.state);
+        return;
+    }
+    if (!netPeer || !netPeer->latestTick) return;
+    NetPeer& cl = *netPeer;
+    float target = cl.latestTick - netInterpTicks;
+    if (std::fabs(cl.renderTick - target) > 2.0f * netInterpTicks) cl.renderTick = target;
+    cl.renderTick += (target - cl.renderTick) * 0.05f;
+    uint32_t t0 = (uint32_t)std::max(1.0f, std::floor(cl.renderTick));
+    float f = std::max(0.0f, std::min(1.0f, cl.renderTick - t0));
+    const NetSnapshot* a = &cl.history[t0 % netHistory];
+    const NetSnapshot* b = &cl.history[(t0 + 1) % netHistory];
+    if (a->tick != t0) a = &cl.history[cl.latestTick % netHistory];
+    if (b->tick != t0 + 1) b = a;
+    for (const NetEntity& ea : a->ents) {
+        if ((int)ea.id == cl.id) continue;
+        const NetEntity* eb = netFindEntity(*b, ea.id);
+        SnowmanState s = netDequantize(ea);
+        if (eb) {
+            SnowmanState sb = netDequantize(*eb);
+            float dh = std::fmod(sb.heading - s.heading + 540.0f, 360.0f) - 180.0f;
+            float da = std::fmod(sb.armPhase - s.armPhase + 9.4247780f, 6.2831853f) - 3.1415927f;
+            s.x += (sb.x - s.x) * f;
+            s.z += (sb.z - s.z) * f;
+            s.heading += dh * f;
+            s.armPhase += da * f;
+            if (f > 0.5f) { s.slashing = sb.slashing; s.slashTimer = sb.slashTimer; }
+        }
+        queueNetSnowman(s);
+    }
+}
+
+// A server and N simulated clients exchanging real loopback packets;
+// reports per-client bandwidth and codec cost
+void benchNet(int clientCount)
+{
+    const int ticks = 300;
+    NetServer sv;
+    sv.sock = netOpen(0);
+    if (sv.sock == netBadSocket) {
+        printf("net: could not open a UDP socket\n");
+        return;
+    }
+    std::vector<std::unique_ptr<NetPeer>> peers;
+    for (int i = 0; i < clientCount; ++i) {
+        peers.emplace_back(new NetPeer());
+        peers.back()->sock = netOpen(0);
+        peers.back()->server = netLocalAddr(sv.sock);
+        if (peers.back()->sock == netBadSocket) {
+            printf("net: could not open client socket %d\n", i);
+            peers.pop_back();
+            break;
+        }
+    }
+    std::mt19937 rng(1234);
+    std::vector<unsigned> keys(peers.size(), 0);
+    const unsigned keyChoices[] = { 0, 0, SNOW_KEY_W, SNOW_KEY_W | SNOW_KEY_A, SNOW_KEY_W | SNOW_KEY_D, SNOW_KEY_S, SNOW_KEY_H };
+    double encodeUs = 0.0, decodeUs = 0.0;
+    size_t deltaBytes = 0, fullBytes = 0, snapshots = 0, received = 0, mismatches = 0;
+    NetWriter full;
+    for (int t = 0; t < ticks; ++t) {
+        for (size_t i = 0; i < peers.size(); ++i) {
+            if (rng() % 30 == 0) keys[i] = keyChoices[rng() % 7];
+            netClientSendInput(*peers[i], keys[i], 1.0f / netTickRate);
+        }
+        netServerReceive(sv, false);
+        deltaBytes += netServerSnapshot(sv, nullptr, &encodeUs);
+        snapshots += sv.clients.size();
+        const NetSnapshot& cur = sv.history[sv.tick % netHistory];
+        full.buf.clear();
+        netEncodeEntities(full, nullptr, cur);
+        fullBytes += (full.buf.size() + 8) * sv.clients.size();
+        for (auto& p : peers) {
+            received += netClientReceive(*p, false, &decodeUs);
+            const NetSnapshot& got = p->history[p->latestTick % netHistory];
+            if (p->latestTick == sv.tick && got.ents != cur.ents) ++mismatches;
+        }
+    }
+    double perClient = snapshots ? (double)deltaBytes / snapshots : 0.0;
+    printf("net: %zu clients  %d ticks  %zu/%zu snapshots received  %zu mismatches\n",
+        peers.size(), ticks, received, snapshots, mismatches);
+    printf("net: snapshot %.1f B/client delta vs %.1f B full  %.1f kbit/s per client at %d Hz\n",
+        perClient, snapshots ? (double)fullBytes / snapshots : 0.0, perClient * 8.0 * netTickRate / 1000.0, netTickRate);
+    printf("net: encode %.2f us/client  decode %.2f us/client\n",
+        snapshots ? encodeUs / snapshots : 0.0, received ? decodeUs / received : 0.0);
+    for (auto& p : peers) netClose(p->sock);
+    netClose(sv.sock);
+}
+
+// --- Rewind buffer ---
+// The last minute of simulation state (player, footprint particles, RNG),
+// captured at a fixed rate. Each entry is XORed against the previous tick
+// and zero-run compressed; a keyframe every half second bounds a seek to 30
+// small decodes.
+// 'r' pauses and enters rewind, '[' / ']' scrub half a second, 'r' resumes
+// from the shown tick.
+const int rewindRate = 60;                          // captures per second
+const int rewindKeyInterval = 30;                   // ticks per keyframe group
+const uint32_t rewindCapacity = 60 * rewindRate;    // a whole number of groups
+
+struct RewindEntry {
+    uint32_t tick = 0xffffffffu;
+    NetWriter packed;
+};
+
+struct RewindHeader {
+    float snowmanX, snowmanZ, headingDeg, armAnimPhase, footstepPhase;
+    float swordSlashTimer, footRef;
+    uint8_t swordSlashing, footLeft, pad[2];
+    uint32_t rng;
+    uint32_t particleCount;
+};
+
+std::vector<RewindEntry> rewindRing(rewindCapacity);
+uint32_t rewindNextTick = 0;   // ticks captured so far
+uint32_t rewindFirst = 0;      // oldest tick that survived the last resume
+size_t rewindBytes = 0;        // compressed payload held by the ring
+size_t rewindSlotReserve[2] = {}; // delta / keyframe slot size, covers the largest seen
+std::vector<uint8_t> rewindRaw, rewindPrevRaw, rewindSeekPrev;
+bool rewindActive = false;
+uint32_t rewindCursor = 0;
+
+void rewindSerialize(std::vector<uint8_t>& out)
+{
+    RewindHeader h = {};
+    h.snowmanX = snowmanX; h.snowmanZ = snowmanZ; h.headingDeg = headingDeg;
+    h.armAnimPhase = armAnimPhase; h.footstepPhase = footstepPhase;
+    h.swordSlashTimer = swordSlashTimer; h.footRef = playerStep.footRef;
+    h.swordSlashing = swordSlashing; h.footLeft = playerStep.footLeft;
+    h.rng = simRngState;
+    h.particleCount = (uint32_t)particles.size();
+    out.resize(sizeof(h) + particles.size() * sizeof(Particle));
+    memcpy(out.data(), &h, sizeof(h));
+    if (!particles.empty()) memcpy(out.data() + sizeof(h), particles.data(), particles.size() * sizeof(Particle));
+}
+
+void rewindRestore(const std::vector<uint8_t>& raw)
+{
+    RewindHeader h;
+    memcpy(&h, raw.data(), sizeof(h));
+    snowmanX = h.snowmanX; snowmanZ = h.snowmanZ; headingDeg = h.headingDeg;
+    armAnimPhase = h.armAnimPhase; footstepPhase = h.footstepPhase;
+    swordSlashTimer = h.swordSlashTimer; playerStep.footRef = h.footRef;
+    swordSlashing = h.swordSlashing != 0; playerStep.footLeft = h.footLeft != 0;
+    simRngState = h.rng;
+    particles.resize(h.particleCount);
+    particleSpawns.clear();
+    clearParticleCohorts();
+    if (h.particleCount) memcpy(particles.data(), raw.data() + sizeof(h), h.particleCount * sizeof(Particle));
+}
+
+// An entry is an image of 4-byte words: the header XORed with the key's,
+// a bitmask of which key particles are still alive, and the particles as
+// separate x/y/z/age/life arrays, each survivor stored as the difference
+// from its former self's bits (particles are only appended or erased in
+// order, so survivors are a prefix). The image is split into byte planes, so unchanged high bytes of
+// floats line up, then stored as its word count followed by alternating
+// (zero run, literal run) pairs.
+std::vector<uint32_t> rewindImage;
+std::vector<uint8_t> rewindPlanes;
+
+void rewindPack(const std::vector<uint8_t>& raw, const std::vector<uint8_t>* key, NetWriter& w)
+{
+    const size_t headerWords = sizeof(RewindHeader) / 4, fields = sizeof(Particle) / 4;
+    size_t count = (raw.size() - sizeof(RewindHeader)) / sizeof(Particle);
+    size_t keyCount = key ? (key->size() - sizeof(RewindHeader)) / sizeof(Particle) : 0;
+    size_t maskWords = (keyCount + 31) / 32;
+    const uint32_t* cur = (const uint32_t*)raw.data();
+    const uint32_t* ref = key ? (const uint32_t*)key->data() : nullptr;
+    rewindImage.assign(headerWords + maskWords + count * fields, 0);
+    uint32_t* img = rewindImage.data();
+    for (size_t k = 0; k < headerWords; ++k) img[k] = cur[k] ^ (ref ? ref[k] : 0);
+
+    uint32_t* mask = img + headerWords;
+    uint32_t* soa = mask + maskWords;
+    const uint32_t* cp = cur + headerWords;
+    const uint32_t* kp = ref ? ref + headerWords : nullptr;
+    size_t j = 0;
+    bool matching = keyCount > 0;
+    for (size_t i = 0; i < count; ++i) {
+        const uint32_t* p = cp + i * fields;
+        const uint32_t* q = nullptr;
+        if (matching) {
+            // x, z and life never change after a particle spawns
+            while (j < keyCount && !(kp[j * fields] == p[0] && kp[j * fields + 2] == p[2] && kp[j * fields + 4] == p[4])) ++j;
+            if (j < keyCount) {
+                q = kp + j * fields;
+                mask[j >> 5] |= 1u << (j & 31);
+                ++j;
+            } else {
+                matching = false;
+            }
+        }
+        for (size_t f = 0; f < fields; ++f) soa[f * count + i] = p[f] - (q ? q[f] : 0);
+    }
+
+    size_t words = rewindImage.size(), n = words * 4;
+    rewindPlanes.resize(n);
+    const uint8_t* bytes = (const uint8_t*)img;
+    for (size_t i = 0; i < n; ++i) rewindPlanes[(i & 3) * words + (i >> 2)] = bytes[i];
+    const uint8_t* b = rewindPlanes.data();
+    w.var((uint32_t)words);
+    size_t i = 0;
+    while (i < n) {
+        size_t z = i;
+        while (z < n && b[z] == 0) ++z;
+        size_t lit = z;
+        // A literal run ends at the first pair of zero bytes
+        while (lit < n && !(b[lit] == 0 && (lit + 1 == n || b[lit + 1] == 0))) ++lit;
+        w.var((uint32_t)(z - i));
+        w.var((uint32_t)(lit - z));
+        for (size_t k = z; k < lit; ++k) w.u8(b[k]);
+        i = lit;
+    }
+}
+
+bool rewindUnpack(const NetWriter& packed, const std::vector<uint8_t>* key, std::vector<uint8_t>& raw)
+{
+    const size_t headerWords = sizeof(RewindHeader) / 4, fields = sizeof(Particle) / 4;
+    NetReader r(packed.buf.data(), (int)packed.buf.size());
+    size_t words = r.var(), n = words * 4;
+    if (!r.ok || words < headerWords) return false;
+    rewindPlanes.assign(n, 0);
+    size_t i = 0;
+    while (i < n && r.ok) {
+        size_t z = r.var(), lit = r.var();
+        if (i + z + lit > n) return false;
+        i += z;
+        for (size_t k = 0; k < lit; ++k) rewindPlanes[i++] = (uint8_t)r.u8();
+    }
+    if (!r.ok) return false;
+    rewindImage.resize(words);
+    uint8_t* bytes = (uint8_t*)rewindImage.data();
+    for (size_t k = 0; k < n; ++k) bytes[k] = rewindPlanes[(k & 3) * words + (k >> 2)];
+
+    const uint32_t* img = rewindImage.data();
+    const uint32_t* ref = key ? (const uint32_t*)key->data() : nullptr;
+    size_t keyCount = key ? (key->size() - sizeof(RewindHeader)) / sizeof(Particle) : 0;
+    size_t maskWords = (keyCount + 31) / 32;
+    raw.resize(sizeof(RewindHeader));
+    uint32_t* out = (uint32_t*)raw.data();
+    for (size_t k = 0; k < headerWords; ++k) out[k] = img[k] ^ (ref ? ref[k] : 0);
+    RewindHeader h;
+    memcpy(&h, raw.data(), sizeof(h));
+    size_t count = h.particleCount;
+    if (words != headerWords + maskWords + count * fields) return false;
+    raw.resize(sizeof(RewindHeader) + count * sizeof(Particle));
+    out = (uint32_t*)raw.data();
+
+    const uint32_t* mask = img + headerWords;
+    const uint32_t* soa = mask + maskWords;
+    const uint32_t* kp = ref ? ref + headerWords : nullptr;
+    uint32_t* op = out + headerWords;
+    size_t j = 0;
+    for (size_t p = 0; p < count; ++p) {
+        while (j < keyCount && !(mask[j >> 5] & (1u << (j & 31)))) ++j;
+        const uint32_t* q = j < keyCount ? kp + j * fields : nullptr;
+        if (q) ++j;
+        for (size_t f = 0; f < fields; ++f) op[p * fields + f] = soa[f * count + p] + (q ? q[f] : 0);
+    }
+    return true;
+}
+
+void rewindCapture()
+{
+    uint32_t tick = rewindNextTick++;
+    bool keyframe = tick % rewindKeyInterval == 0;
+    rewindSerialize(rewindRaw);
+    RewindEntry& e = rewindRing[tick % rewindCapacity];
+    rewindBytes -= e.packed.buf.size();
+    e.tick = tick;
+    e.packed.buf.clear();
+    // Slots keep their buffers (a slot always holds the same kind of entry),
+    // so once every slot has reached its kind's reserve capturing stops
+    // allocating
+    size_t& reserve = rewindSlotReserve[keyframe];
+    if (e.packed.buf.capacity() < reserve) e.packed.buf.reserve(reserve);
+    rewindPack(rewindRaw, keyframe ? nullptr : &rewindPrevRaw, e.packed);
+    rewindBytes += e.packed.buf.size();
+    // Powers of two, so the occasional slightly larger entry doesn't send
+    // every slot back for a new buffer
+    while (reserve < e.packed.buf.size() + e.packed.buf.size() / 4) reserve = std::max<size_t>(64, reserve * 2);
+    rewindPrevRaw.swap(rewindRaw);
+}
+
+// Oldest and newest seekable ticks; false when nothing has been captured
+bool rewindRange(uint32_t& oldest, uint32_t& newest)
+{
+    if (rewindNextTick == 0) return false;
+    newest = rewindNextTick - 1;
+    oldest = std::max(rewindFirst, rewindNextTick > rewindCapacity ? rewindNextTick - rewindCapacity : 0u);
+    oldest = (oldest + rewindKeyInterval - 1) / rewindKeyInterval * rewindKeyInterval;
+    return oldest <= newest;
+}
+
+bool rewindDecode(uint32_t tick, std::vector<uint8_t>& raw)
+{
+    uint32_t keyTick = tick - tick % rewindKeyInterval;
+    for (uint32_t t = keyTick; t <= tick; ++t) {
+        const RewindEntry& e = rewindRing[t % rewindCapacity];
+        if (e.tick != t) return false;
+        raw.swap(rewindSeekPrev);
+        if (!rewindUnpack(e.packed, t == keyTick ? nullptr : &rewindSeekPrev, raw)) return false;
+    }
+    return true;
+}
+
+void rewindSeek(int ticks)
+{
+    uint32_t oldest, newest;
+    if (!rewindRange(oldest, newest)) return;
+    long long target = (long long)rewindCursor + ticks;
+    rewindCursor = (uint32_t)std::max<long long>(oldest, std::min<long long>(newest, target));
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<uint8_t> raw;
+    if (!rewindDecode(rewindCursor, raw)) return;
+    rewindRestore(raw);
+    printf("rewind: %.2f s ago  decode %.3f ms\n", (newest - rewindCursor) / (float)rewindRate,
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+}
+
+void toggleRewind()
+{
+    if (!rewindActive) {
+        uint32_t oldest, newest;
+        if (!rewindRange(oldest, newest)) return;
+        rewindActive = true;
+        rewindCursor = newest;
+        return;
+    }
+    // Resume from the shown tick; everything captured after it is dropped
+    rewindActive = false;
+    uint32_t abandoned = rewindNextTick;
+    rewindNextTick = rewindCursor + 1;
+    rewindFirst = std::max(rewindFirst, abandoned > rewindCapacity ? abandoned - rewindCapacity : 0u);
+    for (uint32_t t = rewindNextTick; t < abandoned; ++t) {
+        RewindEntry& e = rewindRing[t % rewindCapacity];
+        if (e.tick != t) continue;
+        rewindBytes -= e.packed.buf.size();
+        e.tick = 0xffffffffu;
+        e.packed.buf.clear();
+    }
+    rewindDecode(rewindCursor, rewindPrevRaw);
+}
+
+// Called from idle; captures at rewindRate. Returns false while paused.
+bool updateRewind(float delta)
+{
+    if (rewindActive) return false;
+    static float accum = 0.0f;
+    accum += delta;
+    if (accum >= 1.0f / rewindRate) {
+        accum = std::min(std::fmod(accum, 1.0f / rewindRate), 1.0f / rewindRate);
+        rewindCapture();
+    }
+    return true;
+}
+
+// A minute of walking with footprints and snowball puffs: capture cost,
+// memory, and the worst-case seek
+void benchRewind()
+{
+    const float dt = 1.0f / rewindRate;
+    std::vector<double> captureUs;
+    size_t rawBytes = 0, mismatches = 0;
+    std::vector<uint8_t> check;
+    for (uint32_t t = 0; t < rewindCapacity + rewindCapacity / 4; ++t) {
+        unsigned keys = SNOW_KEY_W | ((t / 90) % 3 == 1 ? SNOW_KEY_A : 0) | (t % 120 < 20 ? SNOW_KEY_H : 0);
+        float fx, fz;
+        if (stepSnowman(playerStep, keys, dt, fx, fz)) spawnFootprint(fx, fz);
+        snowmanX = playerStep.x; snowmanZ = playerStep.z; headingDeg = playerStep.heading;
+        armAnimPhase = playerStep.armPhase; footstepPhase = playerStep.footPhase;
+        swordSlashing = playerStep.slashing; swordSlashTimer = playerStep.slashTimer;
+        for (int k = 0; k < 4; ++k) {
+            Particle p = { snowmanX + (simRand() % 200 - 100) * 0.05f, 1.0f, snowmanZ + (simRand() % 200 - 100) * 0.05f, 0.0f, 0.5f };
+            particles.push_back(p);
+        }
+        updateParticles(dt);
+
+        auto t0 = std::chrono::steady_clock::now();
+        rewindCapture();
+        captureUs.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+        rawBytes += rewindPrevRaw.size();
+        if (!rewindDecode(t, check) || check != rewindPrevRaw) ++mismatches;
+    }
+    uint32_t oldest, newest;
+    rewindRange(oldest, newest);
+    double worstSeek = 0.0, totalSeek = 0.0;
+    std::vector<uint8_t> raw;
+    for (uint32_t t = oldest; t <= newest; ++t) {
+        auto t0 = std::chrono::steady_clock::now();
+        if (!rewindDecode(t, raw)) ++mismatches;
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        worstSeek = std::max(worstSeek, ms);
+        totalSeek += ms;
+    }
+    std::sort(captureUs.begin(), captureUs.end());
+    double sum = 0.0;
+    for (double us : captureUs) sum += us;
+    printf("rewind: %u ticks held (%.1f s)  %zu particles live  avg raw %.0f B/tick\n",
+        newest - oldest + 1, (newest - oldest + 1) / (float)rewindRate, particles.size(),
+        (double)rawBytes / captureUs.size());
+    printf("rewind: ring payload %.2f MB  capture avg %.2f us  p99 %.2f us\n",
+        rewindBytes / (1024.0 * 1024.0), sum / captureUs.size(), captureUs[captureUs.size() * 99 / 100]);
+    printf("rewind: seek avg %.3f ms  worst %.3f ms  %zu mismatches\n",
+        totalSeek / (newest - oldest + 1), worstSeek, mismatches);
+}
+
+// --- Matrix helpers ---
+// Column-major 4x4 matrices laid out like glGetFloatv returns them
+void multiplyMatrix(const float a[16], const float b[16], float out[16])
+{
+    float r[16];
+    for (int c = 0; c < 4; ++c)
+        for (int row = 0; row < 4; ++row)
+            r[c * 4 + row] = a[row] * b[c * 4] + a[4 + row] * b[c * 4 + 1] + a[8 + row] * b[c * 4 + 2] + a[12 + row] * b[c * 4 + 3];
+    memcpy(out, r, sizeof(r));
+}
+
+// General inverse by cofactors; false (out untouched) if m is singular
+bool invertMatrix(const float m[16], float out[16])
+{
+    float inv[16];
+    inv[0] = m[5] * m[10] * m[15] - m[5] * m[11] * m[14] - m[9] * m[6] * m[15] + m[9] * m[7] * m[14] + m[13] * m[6] * m[11] - m[13] * m[7] * m[10];
+    inv[4] = -m[4] * m[10] * m[15] + m[4] * m[11] * m[14] + m[8] * m[6] * m[15] - m[8] * m[7] * m[14] - m[12] * m[6] * m[11] + m[12] * m[7] * m[10];
+    inv[8] = m[4] * m[9] * m[15] - m[4] * m[11] * m[13] - m[8] * m[5] * m[15] + m[8] * m[7] * m[13] + m[12] * m[5] * m[11] - m[12] * m[7] * m[9];
+    inv[12] = -m[4] * m[9] * m[14] + m[4] * m[10] * m[13] + m[8] * m[5] * m[14] - m[8] * m[6] * m[13] - m[12] * m[5] * m[10] + m[12] * m[6] * m[9];
+    inv[1] = -m[1] * m[10] * m[15] + m[1] * m[11] * m[14] + m[9] * m[2] * m[15] - m[9] * m[3] * m[14] - m[13] * m[2] * m[11] + m[13] * m[3] * m[10];
+    inv[5] = m[0] * m[10] * m[15] - m[0] * m[11] * m[14] - m[8] * m[2] * m[15] + m[8] * m[3] * m[14] + m[12] * m[2] * m[11] - m[12] * m[3] * m[10];
+    inv[9] = -m[0] * m[9] * m[15] + m[0] * m[11] * m[13] + m[8] * m[1] * m[15] - m[8] * m[3] * m[13] - m[12] * m[1] * m[11] + m[12] * m[3] * m[9];
+    inv[13] = m[0] * m[9] * m[14] - m[0] * m[10] * m[13] - m[8] * m[1] * m[14] + m[8] * m[2] * m[13] + m[12] * m[1] * m[10] - m[12] * m[2] * m[9];
+    inv[2] = m[1] * m[6] * m[15] - m[1] * m[7] * m[14] - m[5] * m[2] * m[15] + m[5] * m[3] * m[14] + m[13] * m[2] * m[7] - m[13] * m[3] * m[6];
+    inv[6] = -m[0] * m[6] * m[15] + m[0] * m[7] * m[14] + m[4] * m[2] * m[15] - m[4] * m[3] * m[14] - m[12] * m[2] * m[7] + m[12] * m[3] * m[6];
+    inv[10] = m[0] * m[5] * m[15] - m[0] * m[7] * m[13] - m[4] * m[1] * m[15] + m[4] * m[3] * m[13] + m[12] * m[1] * m[7] - m[12] * m[3] * m[5];
+    inv[14] = -m[0] * m[5] * m[14] + m[0] * m[6] * m[13] + m[4] * m[1] * m[14] - m[4] * m[2] * m[13] - m[12] * m[1] * m[6] + m[12] * m[2] * m[5];
+    inv[3] = -m[1] * m[6] * m[11] + m[1] * m[7] * m[10] + m[5] * m[2] * m[11] - m[5] * m[3] * m[10] - m[9] * m[2] * m[7] + m[9] * m[3] * m[6];
+    inv[7] = m[0] * m[6] * m[11] - m[0] * m[7] * m[10] - m[4] * m[2] * m[11] + m[4] * m[3] * m[10] + m[8] * m[2] * m[7] - m[8] * m[3] * m[6];
+    inv[11] = -m[0] * m[5] * m[11] + m[0] * m[7] * m[9] + m[4] * m[1] * m[11] - m[4] * m[3] * m[9] - m[8] * m[1] * m[7] + m[8] * m[3] * m[5];
+    inv[15] = m[0] * m[5] * m[10] - m[0] * m[6] * m[9] - m[4] * m[1] * m[10] + m[4] * m[2] * m[9] + m[8] * m[1] * m[6] - m[8] * m[2] * m[5];
+    float det = m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12];
+    if (det == 0.0f) return false;
+    for (int i = 0; i < 16; ++i) out[i] = inv[i] / det;
+    return true;
+}
+
+// Same matrix gluPerspective builds
+void perspectiveMatrix(float fovYDeg, float aspect, float zNear, float zFar, float out[16])
+{
+    float f = 1.0f / tanf(fovYDeg * 3.1415926f / 360.0f);
+    memset(out, 0, 16 * sizeof(float));
+    out[0] = f / aspect;
+    out[5] = f;
+    out[10] = (zFar + zNear) / (zNear - zFar);
+    out[11] = -1.0f;
+    out[14] = 2.0f * zFar * zNear / (zNear - zFar);
+}
+
+// Same matrix gluLookAt builds, followed by a uniform scale like display()
+void lookAtMatrix(float ex, float ey, float ez, float cx, float cy, float cz, float scale, float out[16])
+{
+    float f[3] = { cx - ex, cy - ey, cz - ez };
+    float fl = std::sqrt(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+    for (float& v : f) v /= fl;
+    float sx = -f[2], sz = f[0]; // f x up(0,1,0)
+    float sl = std::sqrt(sx * sx + sz * sz);
+    sx /= sl; sz /= sl;
+    float u[3] = { -sz * f[1], sz * f[0] - sx * f[2], sx * f[1] };
+    float m[16] = {
+        sx, u[0], -f[0], 0,
+        0,  u[1], -f[1], 0,
+        sz, u[2], -f[2], 0,
+        0,  0,    0,     1 };
+    m[12] = -(sx * ex + sz * ez);
+    m[13] = -(u[0] * ex + u[1] * ey + u[2] * ez);
+    m[14] = f[0] * ex + f[1] * ey + f[2] * ez;
+    for (int i = 0; i < 12; ++i) m[i] *= scale;
+    memcpy(out, m, sizeof(m));
+}
+
+// --- Software occlusion culling ---
+// Each frame a handful of nearby occluders (ice block boxes, inscribed tree
+// cones) are rasterized into a small 1/w buffer on the CPU, four pixels at a
+// time. Every tree and ice block then has its bounding box projected and is
+// dropped if the buffer is nearer across its whole screen rectangle.
+bool occlusionEnabled = true;
+const int occW = 256, occH = 128;
+const int maxOccluders = 48;
+float occluderRange = 30.0f; // eye-space distance within which objects can occlude
+alignas(16) static float occDepth[occW * occH]; // 1/w, 0 = nothing drawn
+static float occMVP[16];
+std::vector<unsigned char> treeVisible, iceVisible;
+
+struct OccVert { float x, y, invW; bool valid; };
+
+static OccVert occProject(float x, float y, float z)
+{
+    const float* m = occMVP;
+    float cx = m[0] * x + m[4] * y + m[8] * z + m[12];
+    float cy = m[1] * x + m[5] * y + m[9] * z + m[13];
+    float cw = m[3] * x + m[7] * y + m[11] * z + m[15];
+    OccVert v;
+    v.valid = cw > 0.1f;
+    float iw = v.valid ? 1.0f / cw : 0.0f;
+    v.x = (cx * iw * 0.5f + 0.5f) * occW;
+    v.y = (cy * iw * 0.5f + 0.5f) * occH;
+    v.invW = iw;
+    return v;
+}
+
+static void occRasterTriangle(OccVert a, OccVert b, OccVert c)
+{
+    if (!a.valid || !b.valid || !c.valid) return; // near-clipped occluders are just skipped
+    float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if (std::fabs(area) < 1e-6f) return;
+    if (area < 0) { std::swap(b, c); area = -area; }
+    int x0 = std::max(0, (int)std::floor(std::min(a.x, std::min(b.x, c.x))));
+    int x1 = std::min(occW - 1, (int)std::ceil(std::max(a.x, std::max(b.x, c.x))));
+    int y0 = std::max(0, (int)std::floor(std::min(a.y, std::min(b.y, c.y))));
+    int y1 = std::min(occH - 1, (int)std::ceil(std::max(a.y, std::max(b.y, c.y))));
+    if (x0 > x1 || y0 > y1) return;
+    x0 &= ~3;
+
+    // Edge functions e(x, y) = A*x + B*y + C, normalised so the three sum to 1
+    float inv = 1.0f / area;
+    float A0 = (b.y - c.y) * inv, B0 = (c.x - b.x) * inv, C0 = (b.x * c.y - b.y * c.x) * inv;
+    float A1 = (c.y - a.y) * inv, B1 = (a.x - c.x) * inv, C1 = (c.x * a.y - c.y * a.x) * inv;
+    float A2 = (a.y - b.y) * inv, B2 = (b.x - a.x) * inv, C2 = (a.x * b.y - a.y * b.x) * inv;
+    // 1/w is affine in screen space
+    float Az = A0 * a.invW + A1 * b.invW + A2 * c.invW;
+    float Bz = B0 * a.invW + B1 * b.invW + B2 * c.invW;
+    float Cz = C0 * a.invW + C1 * b.invW + C2 * c.invW;
+
+    for (int y = y0; y <= y1; ++y) {
+        float py = y + 0.5f;
+        float* row = occDepth + y * occW;
+#ifdef SNOW_SSE2
+        __m128 px = _mm_setr_ps(x0 + 0.5f, x0 + 1.5f, x0 + 2.5f, x0 + 3.5f);
+        __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A0), px), _mm_set1_ps(B0 * py + C0));
+        __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A1), px), _mm_set1_ps(B1 * py + C1));
+        __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A2), px), _mm_set1_ps(B2 * py + C2));
+        __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(Az), px), _mm_set1_ps(Bz * py + Cz));
+        __m128 s0 = _mm_set1_ps(A0 * 4), s1 = _mm_set1_ps(A1 * 4), s2 = _mm_set1_ps(A2 * 4), sz = _mm_set1_ps(Az * 4);
+        __m128 zero = _mm_setzero_ps();
+        for (int x = x0; x <= x1; x += 4) {
+            __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+            if (_mm_movemask_ps(inside)) {
+                __m128 old = _mm_load_ps(row + x);
+                __m128 nearer = _mm_max_ps(old, z);
+                _mm_store_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+            }
+            e0 = _mm_add_ps(e0, s0); e1 = _mm_add_ps(e1, s1); e2 = _mm_add_ps(e2, s2); z = _mm_add_ps(z, sz);
+        }
+#else
+        for (int x = x0; x <= x1; ++x) {
+            float px = x + 0.5f;
+            if (A0 * px + B0 * py + C0 < 0 || A1 * px + B1 * py + C1 < 0 || A2 * px + B2 * py + C2 < 0) continue;
+            row[x] = std::max(row[x], Az * px + Bz * py + Cz);
+        }
+#endif
+    }
+}
+
+static void occRasterBox(float x, float y, float z, float half)
+{
+    OccVert v[8];
+    for (int i = 0; i < 8; ++i)
+        v[i] = occProject(x + ((i & 1) ? half : -half), y + ((i & 2) ? half : -half), z + ((i & 4) ? half : -half));
+    static const int faces[6][4] = { {0,1,3,2}, {4,6,7,5}, {0,4,5,1}, {2,3,7,6}, {0,2,6,4}, {1,5,7,3} };
+    for (const int* f : faces) {
+        occRasterTriangle(v[f[0]], v[f[1]], v[f[2]]);
+        occRasterTriangle(v[f[0]], v[f[2]], v[f[3]]);
+    }
+}
+
+// An 8-sided cone inscribed in the 16-sided one drawPineTree renders
+static void occRasterCone(const Tree& t)
+{
+    float by = t.h * 0.15f + 1.0f, bz = t.z - t.h * 0.1f;
+    OccVert apex = occProject(t.x, by + t.h * 0.78f, bz);
+    OccVert center = occProject(t.x, by, bz);
+    OccVert ring[8];
+    for (int i = 0; i < 8; ++i) {
+        float a = i * 3.1415926f / 4.0f;
+        ring[i] = occProject(t.x + cosf(a) * t.r, by, bz + sinf(a) * t.r);
+    }
+    for (int i = 0; i < 8; ++i) {
+        occRasterTriangle(ring[i], ring[(i + 1) % 8], apex);
+        occRasterTriangle(ring[i], ring[(i + 1) % 8], center);
+    }
+}
+
+// 0 = visible, 1 = occluded, 2 = off screen
+static int occTestBox(float x0, float y0, float z0, float x1, float y1, float z1)
+{
+    float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f, nearest = 0.0f;
+    for (int i = 0; i < 8; ++i) {
+        OccVert v = occProject((i & 1) ? x1 : x0, (i & 2) ? y1 : y0, (i & 4) ? z1 : z0);
+        if (!v.valid) return 0; // straddles the camera plane
+        minX = std::min(minX, v.x); maxX = std::max(maxX, v.x);
+        minY = std::min(minY, v.y); maxY = std::max(maxY, v.y);
+        nearest = std::max(nearest, v.invW);
+    }
+    if (maxX < 0 || maxY < 0 || minX >= occW || minY >= occH) return 2;
+    int ix0 = std::max(0, (int)minX), ix1 = std::min(occW - 1, (int)maxX);
+    int iy0 = std::max(0, (int)minY), iy1 = std::min(occH - 1, (int)maxY);
+    for (int y = iy0; y <= iy1; ++y) {
+        const float* row = occDepth + y * occW;
+        int x = ix0;
+#ifdef SNOW_SSE2
+        __m128 obj = _mm_set1_ps(nearest);
+        for (; x + 3 <= ix1; x += 4)
+            if (_mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(row + x), obj))) return 0;
+#endif
+        for (; x <= ix1; ++x)
+            if (row[x] <= nearest) return 0;
+    }
+    return 1;
+}
+
+// Tests every object against the depth buffer; each chunk tallies locally
+void occTestAll(std::atomic<long long>& occluded, std::atomic<long long>& offscreen)
+{
+    int treeCount = (int)trees.size();
+    parallelFor(treeCount + (int)iceblocks.size(), 512, [&](int begin, int end) {
+        long long hidden = 0, outside = 0;
+        for (int i = begin; i < end; ++i) {
+            int r;
+            if (i < treeCount) {
+                const Tree& t = trees[i];
+                r = occTestBox(t.x - t.r, 0.0f, t.z - t.h * 0.1f - t.r, t.x + t.r, t.h * 0.93f + 1.0f, t.z + t.r);
+                treeVisible[i] = r == 0;
+            }
+            else {
+                const IceBlock& b = iceblocks[i - treeCount];
+                float h = b.s * 0.505f;
+                r = occTestBox(b.x - h, b.s / 2.f - h, b.z - h, b.x + h, b.s / 2.f + h, b.z + h);
+                iceVisible[i - treeCount] = r == 0;
+            }
+            hidden += r == 1; outside += r == 2;
+        }
+        occluded += hidden;
+        offscreen += outside;
+    });
+}
+
+void cullEnvironment(float eyeX, float eyeZ, float scale)
+{
+    treeVisible.assign(trees.size(), 1);
+    iceVisible.assign(iceblocks.size(), 1);
+    frameObjectsDrawn = (int)(trees.size() + iceblocks.size());
+    frameObjectsCulled = 0;
+    if (!occlusionEnabled) return;
+
+    float mv[16], pr[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+    glGetFloatv(GL_PROJECTION_MATRIX, pr);
+    multiplyMatrix(pr, mv, occMVP);
+
+    // Pick the occluders that cover the most screen: size over distance
+    struct Candidate { float score; int index; }; // index >= 0 tree, < 0 ice block ~index
+    Candidate* candidates = frameAlloc<Candidate>(trees.size() + iceblocks.size());
+    size_t candidateCount = 0;
+    float range2 = occluderRange * occluderRange;
+    for (size_t i = 0; i < trees.size(); ++i) {
+        float dx = trees[i].x * scale - eyeX, dz = trees[i].z * scale - eyeZ;
+        float d2 = dx * dx + dz * dz;
+        if (d2 < range2) candidates[candidateCount++] = { trees[i].r * scale / std::sqrt(d2 + 1e-4f), (int)i };
+    }
+    for (size_t i = 0; i < iceblocks.size(); ++i) {
+        float dx = iceblocks[i].x * scale - eyeX, dz = iceblocks[i].z * scale - eyeZ;
+        float d2 = dx * dx + dz * dz;
+        if (d2 < range2) candidates[candidateCount++] = { iceblocks[i].s * scale / std::sqrt(d2 + 1e-4f), ~(int)i };
+    }
+    size_t count = std::min(candidateCount, (size_t)maxOccluders);
+    std::partial_sort(candidates, candidates + count, candidates + candidateCount,
+        [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+
+    {
+        ProfileScope zone(PROF_OCCLUSION_RASTER);
+        memset(occDepth, 0, sizeof(occDepth));
+        for (size_t i = 0; i < count; ++i) {
+            int idx = candidates[i].index;
+            if (idx >= 0) occRasterCone(trees[idx]);
+            else { const IceBlock& b = iceblocks[~idx]; occRasterBox(b.x, b.s / 2.f, b.z, b.s / 2.f); }
+        }
+    }
+    profileCount(PROF_OCCLUDERS, (long long)count);
+
+    ProfileScope zone(PROF_OCCLUSION_TEST);
+    std::atomic<long long> occluded(0), offscreen(0);
+    occTestAll(occluded, offscreen);
+    profileCount(PROF_OCC_TESTED, (long long)(trees.size() + iceblocks.size()));
+    profileCount(PROF_OCC_CULLED, occluded);
+    frameObjectsCulled = (int)(occluded + offscreen);
+    frameObjectsDrawn -= frameObjectsCulled;
+    profileCount(PROF_FRUSTUM_CULLED, offscreen);
+}
+
+// --- Instanced environment ---
+// Fixed-function GL has no instancing, so each object type keeps one unit
+// mesh plus a per-instance table (position, size, colour) that is rebuilt
+// only when environmentVersion changes. Each frame the visible instances
+// are expanded into a reused client-side vertex array and submitted with a
+// single glDrawArrays per mesh, so draw calls stay constant however many
+// objects exist.
+struct EnvVertex { float p[3]; float n[3]; GLubyte c[4]; };
+
+// Tree vertices are affine in (h, r): pos = (x_r*r, y_h*h + y_c, z_r*r + z_h*h)
+// and normal = (nx_h*h, ny_r*r, nz_h*h); GL_NORMALIZE renormalises.
+struct TreeUnitVertex { float x_r, y_h, y_c, z_r, z_h, nx_h, ny_r, nz_h; bool foliage; };
+struct TreeInstance { float x, z, h, r; GLubyte foliage[4]; };
+struct IceInstance { float x, z, s; GLubyte solid[4]; };
+
+static std::vector<TreeUnitVertex> treeUnitMesh;
+static std::vector<EnvVertex> iceUnitMesh; // unit cube, also used for snow cubes
+static std::vector<float> iceUnitUV;      // 0..1 across each face, two per vertex
+static std::vector<TreeInstance> treeInstances;
+static std::vector<IceInstance> iceInstances;
+static int instancesVersion = -1;
+static std::vector<EnvVertex> treeStream, iceStream;
+static std::vector<float> iceUVStream;
+const GLubyte trunkColor[4] = { 84, 51, 31, 255 };
+
+// Same shape as drawPineTree: trunk from 0.15h to 0.45h, cone base raised by
+// one unit and pushed back by 0.1h, cone height 0.78h
+static void buildTreeUnitMesh()
+{
+    const int trunkSlices = 8, coneSlices = 16;
+    auto ring = [](int i, int n, float& c, float& s) {
+        float a = 2.0f * 3.1415926f * i / n; c = cosf(a); s = sinf(a);
+    };
+    for (int i = 0; i < trunkSlices; ++i) {
+        float c0, s0, c1, s1;
+        ring(i, trunkSlices, c0, s0); ring(i + 1, trunkSlices, c1, s1);
+        TreeUnitVertex b0 = { 0.20f * c0, 0.15f, 0, 0.20f * s0, 0, c0 * 0.3f, 0.08f, s0 * 0.3f, false };
+        TreeUnitVertex b1 = { 0.20f * c1, 0.15f, 0, 0.20f * s1, 0, c1 * 0.3f, 0.08f, s1 * 0.3f, false };
+        TreeUnitVertex t0 = { 0.12f * c0, 0.45f, 0, 0.12f * s0, 0, c0 * 0.3f, 0.08f, s0 * 0.3f, false };
+        TreeUnitVertex t1 = { 0.12f * c1, 0.45f, 0, 0.12f * s1, 0, c1 * 0.3f, 0.08f, s1 * 0.3f, false };
+        TreeUnitVertex quadVerts[6] = { b0, b1, t1, b0, t1, t0 };
+        treeUnitMesh.insert(treeUnitMesh.end(), quadVerts, quadVerts + 6);
+    }
+    for (int i = 0; i < coneSlices; ++i) {
+        float c0, s0, c1, s1, cm, sm;
+        ring(i, coneSlices, c0, s0); ring(i + 1, coneSlices, c1, s1);
+        ring(2 * i + 1, 2 * coneSlices, cm, sm);
+        TreeUnitVertex b0 = { c0, 0.15f, 1.0f, s0, -0.1f, c0 * 0.78f, 1.0f, s0 * 0.78f, true };
+        TreeUnitVertex b1 = { c1, 0.15f, 1.0f, s1, -0.1f, c1 * 0.78f, 1.0f, s1 * 0.78f, true };
+        TreeUnitVertex apex = { 0, 0.93f, 1.0f, 0, -0.1f, cm * 0.78f, 1.0f, sm * 0.78f, true };
+        TreeUnitVertex center = { 0, 0.15f, 1.0f, 0, -0.1f, 0, -1.0f, 0, true };
+        TreeUnitVertex base0 = b0, base1 = b1;
+        base0.nx_h = base1.nx_h = 0; base0.ny_r = base1.ny_r = -1.0f; base0.nz_h = base1.nz_h = 0;
+        TreeUnitVertex triVerts[6] = { b1, b0, apex, center, base0, base1 };
+        treeUnitMesh.insert(treeUnitMesh.end(), triVerts, triVerts + 6);
+    }
+}
+
+static void buildIceUnitMesh()
+{
+    static const float faceN[6][3] = { {1,0,0}, {-1,0,0}, {0,1,0}, {0,-1,0}, {0,0,1}, {0,0,-1} };
+    for (int f = 0; f < 6; ++f) {
+        const float* n = faceN[f];
+        // Two tangent axes spanning the face
+        float u[3] = { n[1] + n[2], n[0], 0 }, v[3];
+        if (n[2] != 0) { u[0] = 1; u[1] = 0; u[2] = 0; }
+        v[0] = n[1] * u[2] - n[2] * u[1]; v[1] = n[2] * u[0] - n[0] * u[2]; v[2] = n[0] * u[1] - n[1] * u[0];
+        float corner[4][2] = { {-1,-1}, {1,-1}, {1,1}, {-1,1} };
+        EnvVertex q[4];
+        for (int k = 0; k < 4; ++k) {
+            for (int a = 0; a < 3; ++a) {
+                q[k].p[a] = 0.5f * (n[a] + corner[k][0] * u[a] + corner[k][1] * v[a]);
+                q[k].n[a] = n[a];
+            }
+        }
+        EnvVertex tri[6] = { q[0], q[1], q[2], q[0], q[2], q[3] };
+        iceUnitMesh.insert(iceUnitMesh.end(), tri, tri + 6);
+        for (int k : { 0, 1, 2, 0, 2, 3 }) {
+            iceUnitUV.push_back(0.5f * (corner[k][0] + 1.0f));
+            iceUnitUV.push_back(0.5f * (corner[k][1] + 1.0f));
+        }
+    }
+}
+
+static void setColor(GLubyte out[4], float r, float g, float b)
+{
+    out[0] = (GLubyte)(r * 255.0f + 0.5f); out[1] = (GLubyte)(g * 255.0f + 0.5f);
+    out[2] = (GLubyte)(b * 255.0f + 0.5f); out[3] = 255;
+}
+
+void rebuildEnvironmentInstances()
+{
+    if (treeUnitMesh.empty()) buildTreeUnitMesh();
+    if (iceUnitMesh.empty()) buildIceUnitMesh();
+    treeInstances.resize(trees.size());
+    for (size_t i = 0; i < trees.size(); ++i) {
+        TreeInstance& ti = treeInstances[i];
+        ti.x = trees[i].x; ti.z = trees[i].z; ti.h = trees[i].h; ti.r = trees[i].r;
+        setColor(ti.foliage, 0.19f, 0.41f, 0.1f); // deep pine
+    }
+    iceInstances.resize(iceblocks.size());
+    for (size_t i = 0; i < iceblocks.size(); ++i) {
+        IceInstance& ii = iceInstances[i];
+        ii.x = iceblocks[i].x; ii.z = iceblocks[i].z; ii.s = iceblocks[i].s;
+        setColor(ii.solid, 0.63f, 0.78f, 0.98f);
+    }
+    instancesVersion = environmentVersion;
+}
+
+static void appendTreeInstance(std::vector<EnvVertex>& out, const TreeInstance& t)
+{
+    size_t base = out.size();
+    out.resize(base + treeUnitMesh.size());
+    EnvVertex* dst = &out[base];
+    for (const TreeUnitVertex& u : treeUnitMesh) {
+        dst->p[0] = t.x + u.x_r * t.r;
+        dst->p[1] = u.y_h * t.h + u.y_c;
+        dst->p[2] = t.z + u.z_r * t.r + u.z_h * t.h;
+        dst->n[0] = u.nx_h * t.h; dst->n[1] = u.ny_r * t.r; dst->n[2] = u.nz_h * t.h;
+        memcpy(dst->c, u.foliage ? t.foliage : trunkColor, 4);
+        ++dst;
+    }
+}
+
+// Writes mesh.size() vertices at dst and returns the end
+static EnvVertex* writeScaledMesh(EnvVertex* dst, const std::vector<EnvVertex>& mesh,
+    float x, float y, float z, float s, const GLubyte color[4])
+{
+    for (const EnvVertex& u : mesh) {
+        dst->p[0] = x + u.p[0] * s; dst->p[1] = y + u.p[1] * s; dst->p[2] = z + u.p[2] * s;
+        memcpy(dst->n, u.n, sizeof(dst->n));
+        memcpy(dst->c, color, 4);
+        ++dst;
+    }
+    return dst;
+}
+
+static void appendScaledMesh(std::vector<EnvVertex>& out, const std::vector<EnvVertex>& mesh,
+    float x, float y, float z, float s, const GLubyte color[4])
+{
+    size_t base = out.size();
+    out.resize(base + mesh.size());
+    writeScaledMesh(&out[base], mesh, x, y, z, s, color);
+}
+
+// --- Vertex stream ring ---
+// drawEnvStream copies each draw's vertices into one buffer object and
+// draws from there instead of from client arrays. With buffer storage the
+// buffer is mapped once, persistently, and split into streamRegions
+// regions used in turn. A region is fenced when it fills or its frame ends,
+// and that fence is waited on before the region is written again, so the
+// CPU never overwrites vertices the GPU has yet to read. A wait on a fence
+// that had not signalled yet is a stall ("stream stalls" in the profiler).
+// Without buffer storage each draw maps just its range unsynchronised, and
+// the buffer is orphaned (glBufferData with no data) when it fills, so the
+// driver hands over fresh storage rather than waiting. Below GL 3.3, and
+// in frames being captured, draws keep using client arrays. Per-draw
+// glBufferData is there for --bench-streams to compare against.
+enum StreamPath { STREAM_CLIENT, STREAM_BUFFER_DATA, STREAM_ORPHAN, STREAM_PERSISTENT, STREAM_PATH_COUNT };
+const char* streamPathNames[STREAM_PATH_COUNT] = { "client arrays", "buffer data", "orphan", "persistent" };
+const int streamRegions = 3;
+const size_t streamMinRegion = 1 << 20; // bytes
+static StreamPath streamPath = STREAM_CLIENT;
+static bool streamPathChosen = false;
+static GLuint streamBuffer = 0;
+static uint8_t* streamMapped = nullptr; // persistent mapping of the whole buffer
+static size_t streamRegionBytes = 0, streamHead = 0; // head: next free byte in the buffer
+static int streamRegion = 0;
+static bool streamRegionReady = false; // its fence has been waited on
+static GLsync streamFences[streamRegions];
+static long long streamStalls = 0;
+
+static void releaseStreamRing()
+{
+    for (GLsync& f : streamFences)
+        if (f) { glDeleteSync(f); f = nullptr; }
+    if (streamBuffer) {
+        if (streamMapped) {
+            glBindBuffer(GL_ARRAY_BUFFER, streamBuffer);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+        glDeleteBuffers(1, &streamBuffer);
+    }
+    streamBuffer = 0;
+    streamMapped = nullptr;
+    streamRegionBytes = streamHead = 0;
+    streamRegion = 0;
+    streamRegionReady = false;
+}
+
+static void setStreamPath(StreamPath path)
+{
+    releaseStreamRing();
+    streamPath = path;
+    streamPathChosen = true;
+}
+
+static StreamPath bestStreamPath()
+{
+    return glHasBufferStorage ? STREAM_PERSISTENT : glHasTransformFeedback ? STREAM_ORPHAN : STREAM_CLIENT;
+}
+
+// (Re)creates the buffer once a draw needs more than a region holds. The
+// GPU keeps the old storage alive for draws still reading it
+static void reserveStreamRing(size_t bytes)
+{
+    if (streamBuffer && bytes <= streamRegionBytes) return;
+    size_t region = std::max(streamRegionBytes * 2, streamMinRegion);
+    while (region < bytes) region *= 2;
+    releaseStreamRing();
+    streamRegionBytes = region;
+    GLsizeiptr size = (GLsizeiptr)(region * streamRegions);
+    glGenBuffers(1, &streamBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, streamBuffer);
+    if (streamPath == STREAM_PERSISTENT) {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+        streamMapped = (uint8_t*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+        if (!streamMapped) {
+            printf("stream: persistent mapping failed, orphaning instead\n");
+            setStreamPath(STREAM_ORPHAN);
+            reserveStreamRing(bytes);
+        }
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    }
+}
+
+// Fences the current region and moves to the next; its own fence is
+// waited on at its first write
+static void nextStreamRegion()
+{
+    streamFences[streamRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    streamRegion = (streamRegion + 1) % streamRegions;
+    streamHead = streamRegion * streamRegionBytes;
+    streamRegionReady = false;
+}
+
+static void waitStreamRegion()
+{
+    streamRegionReady = true;
+    GLsync& fence = streamFences[streamRegion];
+    if (!fence) return;
+    if (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED) {
+        ++streamStalls;
+        profileCount(PROF_STREAM_STALLS);
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+    }
+    glDeleteSync(fence);
+    fence = nullptr;
+}
+
+// Claims bytes in the persistent ring's current region, moving to (and
+// waiting for) the next region when they don't fit; returns their offset
+static size_t claimStreamRange(size_t bytes)
+{
+    reserveStreamRing(bytes);
+    if (streamHead + bytes > (streamRegion + 1) * streamRegionBytes) nextStreamRegion();
+    if (!streamRegionReady) waitStreamRegion();
+    size_t at = streamHead;
+    streamHead += (bytes + 15) & ~(size_t)15;
+    return at;
+}
+
+// Room for count vertices, followed by two uvs each when withUV, for the
+// caller to fill and pass straight to drawEnvStream. On the persistent path
+// this is the mapped region itself, so the vertices are written once and
+// drawn in place; otherwise (and while capturing) it is frame-arena memory
+// that drawEnvStream copies. Draw it before the next streamAlloc: a ring
+// that has to grow drops its old mapping.
+static EnvVertex* streamAlloc(size_t count, bool withUV = false)
+{
+    size_t bytes = count * (sizeof(EnvVertex) + (withUV ? 2 * sizeof(float) : 0));
+    if (!streamPathChosen) setStreamPath(bestStreamPath());
+    if (streamPath == STREAM_PERSISTENT && !glCaptureActive) {
+        size_t at = claimStreamRange(bytes);
+        if (streamMapped) return (EnvVertex*)(streamMapped + at);
+    }
+    return (EnvVertex*)frameAlloc<uint8_t>(bytes);
+}
+
+static bool inStreamMapping(const void* p)
+{
+    return streamMapped && (const uint8_t*)p >= streamMapped && (const uint8_t*)p < streamMapped + streamRegions * streamRegionBytes;
+}
+
+// Copies a draw's vertices, then its uvs, into the stream buffer and leaves
+// it bound; returns their offset
+static GLintptr writeEnvStream(const void* vertices, size_t vertexBytes, const void* uv, size_t uvBytes)
+{
+    size_t bytes = vertexBytes + uvBytes;
+    if (streamPath == STREAM_BUFFER_DATA) {
+        if (!streamBuffer) glGenBuffers(1, &streamBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, streamBuffer);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)bytes, uvBytes ? nullptr : vertices, GL_STREAM_DRAW);
+        if (uvBytes) {
+            glBufferSubData(GL_ARRAY_BUFFER, 0, (GLsizeiptr)vertexBytes, vertices);
+            glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)vertexBytes, (GLsizeiptr)uvBytes, uv);
+        }
+        return 0;
+    }
+    if (streamPath == STREAM_PERSISTENT) {
+        size_t at = claimStreamRange(bytes);
+        if (streamMapped) {
+            memcpy(streamMapped + at, vertices, vertexBytes);
+            if (uvBytes) memcpy(streamMapped + at + vertexBytes, uv, uvBytes);
+            glBindBuffer(GL_ARRAY_BUFFER, streamBuffer);
+            return (GLintptr)at;
+        }
+    }
+    reserveStreamRing(bytes);
+    glBindBuffer(GL_ARRAY_BUFFER, streamBuffer);
+    if (streamHead + bytes > streamRegions * streamRegionBytes) {
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(streamRegions * streamRegionBytes), nullptr, GL_STREAM_DRAW);
+        streamHead = 0;
+    }
+    uint8_t* dst = (uint8_t*)glMapBufferRange(GL_ARRAY_BUFFER, (GLintptr)streamHead, (GLsizeiptr)bytes,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    memcpy(dst, vertices, vertexBytes);
+    if (uvBytes) memcpy(dst + vertexBytes, uv, uvBytes);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    GLintptr at = (GLintptr)streamHead;
+    streamHead += (bytes + 15) & ~(size_t)15;
+    return at;
+}
+
+// Called once a frame's draws are issued, so each frame starts in a region
+// of its own
+void endStreamFrame()
+{
+    if (streamPath == STREAM_PERSISTENT && streamBuffer && streamHead != streamRegion * streamRegionBytes) nextStreamRegion();
+}
+
+// uv, when given, holds two texture coordinates per vertex. Vertices from
+// streamAlloc's mapping are drawn where they are (their uvs follow them);
+// anything else is copied into the ring, or drawn from client memory
+static void drawEnvStream(const EnvVertex* v, size_t count, GLenum mode, const float* uv = nullptr)
+{
+    if (!count) return;
+    if (!streamPathChosen) setStreamPath(bestStreamPath());
+    const uint8_t* base = (const uint8_t*)v;
+    const float* uvs = uv;
+    bool buffered = streamPath != STREAM_CLIENT && !glCaptureActive; // capture copies from client arrays
+    if (buffered) {
+        size_t vertexBytes = count * sizeof(EnvVertex);
+        if (inStreamMapping(v)) {
+            glBindBuffer(GL_ARRAY_BUFFER, streamBuffer);
+            base = (const uint8_t*)(uintptr_t)((const uint8_t*)v - streamMapped);
+        } else {
+            base = (const uint8_t*)(uintptr_t)writeEnvStream(v, vertexBytes, uv, uv ? count * 2 * sizeof(float) : 0);
+        }
+        uvs = (const float*)(base + vertexBytes);
+    }
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(EnvVertex), base + offsetof(EnvVertex, p));
+    glNormalPointer(GL_FLOAT, sizeof(EnvVertex), base + offsetof(EnvVertex, n));
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(EnvVertex), base + offsetof(EnvVertex, c));
+    if (uv) {
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glTexCoordPointer(2, GL_FLOAT, 0, uvs);
+    }
+    glDrawArrays(mode, 0, (GLsizei)count);
+    if (uv) glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    if (buffered) glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static void drawEnvStream(const std::vector<EnvVertex>& v, GLenum mode, const float* uv = nullptr)
+{
+    if (!v.empty()) drawEnvStream(v.data(), v.size(), mode, uv);
+}
+
+// Cube outlines are drawn with the faces rather than as wide GL_LINES on
+// top. A fragment program measures each fragment's distance to the face
+// border in pixels (face UV over its screen-space derivative), so the edge
+// is outlinePixels wide on every cube at any size, distance or
+// scaleFactor; the vertex stage stays fixed function. Without GLSL the
+// faces carry a decal whose border band is opaque in the edge colour. It
+// is not mipmapped, so distant cubes keep a thin edge instead of averaging
+// into a tint, but its width follows the cube.
+enum OutlineKind { OUTLINE_SNOW, OUTLINE_ICE, OUTLINE_COUNT };
+const int outlineTexSize = 64, outlineBand = 3; // texels
+const float outlinePixels = 1.5f; // per face, so 3 px where two faces meet like the old wide lines
+static const float outlineEdge[OUTLINE_COUNT][3] = { { 0.86f, 0.95f, 0.98f }, { 0.7f, 0.85f, 1.0f } };
+static GLuint outlineTex[OUTLINE_COUNT];
+static GLuint outlineProgram = 0;
+static GLint outlineEdgeLoc = -1, outlineWidthLoc = -1;
+static bool outlineProgramTried = false;
+
+static const char* outlineFragmentSrc =
+    "uniform vec3 edge;\n"
+    "uniform float halfWidth;\n"
+    "void main() {\n"
+    "    vec2 uv = gl_TexCoord[0].st;\n"
+    "    vec2 d = min(uv, 1.0 - uv) / max(fwidth(uv), vec2(1e-6));\n"
+    "    float cover = clamp(halfWidth + 0.5 - min(d.x, d.y), 0.0, 1.0);\n"
+    "    gl_FragColor = vec4(mix(gl_Color.rgb, edge, cover), gl_Color.a);\n"
+    "}\n";
+
+static void beginOutline(OutlineKind kind)
+{
+    if (!outlineProgramTried) {
+        outlineProgramTried = true;
+        if (glHasShaders && (outlineProgram = buildGLProgram("outline", nullptr, outlineFragmentSrc))) {
+            outlineEdgeLoc = glGetUniformLocation(outlineProgram, "edge");
+            outlineWidthLoc = glGetUniformLocation(outlineProgram, "halfWidth");
+        }
+    }
+    if (outlineProgram) {
+        glUseProgram(outlineProgram);
+        glUniform3fv(outlineEdgeLoc, 1, outlineEdge[kind]);
+        glUniform1f(outlineWidthLoc, outlinePixels);
+        return;
+    }
+    if (!outlineTex[kind]) {
+        const float* edge = outlineEdge[kind];
+        std::vector<GLubyte> texels((size_t)outlineTexSize * outlineTexSize * 4);
+        for (int y = 0; y < outlineTexSize; ++y)
+            for (int x = 0; x < outlineTexSize; ++x) {
+                GLubyte* t = &texels[((size_t)y * outlineTexSize + x) * 4];
+                setColor(t, edge[0], edge[1], edge[2]);
+                int d = std::min(std::min(x, outlineTexSize - 1 - x), std::min(y, outlineTexSize - 1 - y));
+                t[3] = d < outlineBand ? 255 : 0;
+            }
+        glGenTextures(1, &outlineTex[kind]);
+        glBindTexture(GL_TEXTURE_2D, outlineTex[kind]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        // Repeat, so filtering at a face's edge picks up the opposite band
+        // rather than the border colour
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, outlineTexSize, outlineTexSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels.data());
+    }
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, outlineTex[kind]);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
+}
+
+static void endOutline()
+{
+    if (outlineProgram) {
+        glUseProgram(0);
+        return;
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisable(GL_TEXTURE_2D);
+}
+
+// --- Instanced environment ---
+// With GL 3.3 trees and ice blocks are instanced. Each unit mesh sits in a
+// static buffer, and every instance's placement and colour in another, read
+// through a buffer texture as two RGBA32F texels per instance; both are
+// rebuilt only when environmentVersion changes. Per frame the culling loops
+// only compact the indices of the instances to draw. That list goes through
+// the stream ring as a per-instance attribute, and each mesh is a single
+// glDrawArraysInstanced. The vertex stage redoes fixed-function lighting
+// for GL_LIGHT0, and ice keeps the outline fragment program. The point-light
+// pass draws the same instances again with a fragment program that reads
+// the froxel light lists (see Clustered lighting). Without GL 3.3, and in
+// frames being captured (capture records client arrays only), the listed
+// instances are expanded on the CPU into one draw per mesh.
+enum EnvMesh { ENV_TREES, ENV_ICE, ENV_MESH_COUNT };
+enum EnvPass { ENV_PASS_BASE, ENV_PASS_LIGHTS, ENV_PASS_COUNT };
+static GLuint envUnitBuffer[ENV_MESH_COUNT], envInstanceBuffer[ENV_MESH_COUNT], envInstanceTex[ENV_MESH_COUNT];
+static GLuint envProgram[ENV_PASS_COUNT][ENV_MESH_COUNT];
+static GLint envTrunkLoc[ENV_PASS_COUNT] = { -1, -1 }, envIceEdgeLoc = -1, envIceWidthLoc = -1;
+static GLint envClusterGridLoc[ENV_MESH_COUNT] = { -1, -1 }, envClusterNearLoc[ENV_MESH_COUNT] = { -1, -1 };
+static int envInstanceVersion = -1;
+static bool envInstancingTried = false;
+static std::vector<uint32_t> treeDrawList, iceDrawList; // this frame's instances, by index
+
+static const char* envShaderVersion = "#version 150 compatibility\n";
+
+// GL_LIGHT0 as the fixed-function pipeline evaluates it, with the colour
+// standing in for ambient and diffuse (GL_COLOR_MATERIAL)
+static const char* envLightingSrc =
+    "invariant gl_Position;\n"
+    "vec4 lightVertex(vec3 p, vec3 n, vec4 color) {\n"
+    "    vec3 e = (gl_ModelViewMatrix * vec4(p, 1.0)).xyz;\n"
+    "    vec3 N = normalize(gl_NormalMatrix * n);\n"
+    "    vec4 lp = gl_LightSource[0].position;\n"
+    "    vec3 L = normalize(lp.xyz - e * lp.w);\n"
+    "    float ndl = max(dot(N, L), 0.0);\n"
+    "    vec4 c = gl_FrontMaterial.emission + color * (gl_LightModel.ambient + gl_LightSource[0].ambient)\n"
+    "        + ndl * color * gl_LightSource[0].diffuse;\n"
+    "    if (ndl > 0.0)\n"
+    "        c += gl_FrontLightProduct[0].specular * pow(max(dot(N, normalize(L + vec3(0.0, 0.0, 1.0))), 0.0), gl_FrontMaterial.shininess);\n"
+    "    return vec4(clamp(c.rgb, 0.0, 1.0), color.a);\n"
+    "}\n";
+
+// Texels per tree: (x, z, h, r), foliage colour. See TreeUnitVertex
+static const char* envTreeVertexSrc =
+    "in vec4 unitA;\n" // x_r, y_h, y_c, z_r
+    "in vec4 unitB;\n" // z_h, nx_h, ny_r, nz_h
+    "in float foliage;\n"
+    "in int instance;\n"
+    "out vec3 envPos, envNormal, envAlbedo;\n"
+    "uniform samplerBuffer instances;\n"
+    "uniform vec4 trunk;\n"
+    "void main() {\n"
+    "    vec4 t = texelFetch(instances, instance * 2);\n"
+    "    vec4 color = foliage > 0.5 ? texelFetch(instances, instance * 2 + 1) : trunk;\n"
+    "    vec3 p = vec3(t.x + unitA.x * t.w, unitA.y * t.z + unitA.z, t.y + unitA.w * t.w + unitB.x * t.z);\n"
+    "    vec3 n = vec3(unitB.y * t.z, unitB.z * t.w, unitB.w * t.z);\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(p, 1.0);\n"
+    "    gl_FrontColor = lightVertex(p, n, color);\n"
+    "    envPos = p; envNormal = n; envAlbedo = color.rgb;\n"
+    "}\n";
+
+// Texels per block: (x, z, s, 0), colour
+static const char* envIceVertexSrc =
+    "in vec3 unitPos;\n"
+    "in vec3 unitNormal;\n"
+    "in vec2 unitUV;\n"
+    "in int instance;\n"
+    "out vec3 envPos, envNormal, envAlbedo;\n"
+    "uniform samplerBuffer instances;\n"
+    "void main() {\n"
+    "    vec4 b = texelFetch(instances, instance * 2);\n"
+    "    vec4 color = texelFetch(instances, instance * 2 + 1);\n"
+    "    vec3 p = vec3(b.x, b.z * 0.5, b.y) + unitPos * b.z;\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(p, 1.0);\n"
+    "    gl_FrontColor = lightVertex(p, unitNormal, color);\n"
+    "    gl_TexCoord[0] = vec4(unitUV, 0.0, 1.0);\n"
+    "    envPos = p; envNormal = unitNormal; envAlbedo = color.rgb;\n"
+    "}\n";
+
+// Point-light sum per fragment, as shadeVertex does per vertex. Lights are
+// two texels each, (x, y, z, radius) and (r, g, b, inner); offsets and list
+// are clusterOffsets and clusterLightList as binned this frame
+static const char* envLightFragmentSrc =
+    "in vec3 envPos, envNormal, envAlbedo;\n"
+    "uniform samplerBuffer lights;\n"
+    "uniform usamplerBuffer clusterOffsets;\n"
+    "uniform usamplerBuffer clusterLights;\n"
+    "uniform vec4 clusterGrid;\n" // froxels across, down, deep; log(far / near)
+    "uniform float clusterNear;\n"
+    "void main() {\n"
+    "    vec3 e = (gl_ModelViewMatrix * vec4(envPos, 1.0)).xyz;\n"
+    "    float depth = -e.z;\n"
+    "    if (depth < clusterNear) discard;\n"
+    "    vec2 ndc = e.xy * vec2(gl_ProjectionMatrix[0][0], gl_ProjectionMatrix[1][1]) / depth;\n"
+    "    ivec3 dims = ivec3(clusterGrid.xyz);\n"
+    "    ivec2 cxy = ivec2(floor((ndc * 0.5 + 0.5) * clusterGrid.xy));\n"
+    "    if (any(lessThan(cxy, ivec2(0))) || any(greaterThanEqual(cxy, dims.xy))) discard;\n"
+    "    int cz = clamp(int(log(depth / clusterNear) / clusterGrid.w * clusterGrid.z), 0, dims.z - 1);\n"
+    "    int c = (cz * dims.y + cxy.y) * dims.x + cxy.x;\n"
+    "    int begin = int(texelFetch(clusterOffsets, c).r), end = int(texelFetch(clusterOffsets, c + 1).r);\n"
+    "    vec3 n = normalize(envNormal);\n"
+    "    vec3 sum = vec3(0.0);\n"
+    "    for (int i = begin; i < end; ++i) {\n"
+    "        int l = int(texelFetch(clusterLights, i).r);\n"
+    "        vec4 at = texelFetch(lights, l * 2), color = texelFetch(lights, l * 2 + 1);\n"
+    "        vec3 d = at.xyz - envPos;\n"
+    "        float d2 = dot(d, d), r2 = at.w * at.w;\n"
+    "        if (d2 >= r2) continue;\n"
+    "        float ndl = dot(n, d) * inversesqrt(d2 + 1e-6);\n"
+    "        if (all(lessThanEqual(abs(d), vec3(color.w)))) ndl = abs(ndl);\n" // lit from inside
+    "        if (ndl <= 0.0) continue;\n"
+    "        float fall = 1.0 - d2 / r2;\n"
+    "        sum += color.rgb * (fall * fall * ndl);\n"
+    "    }\n"
+    "    gl_FragColor = vec4(envAlbedo * sum, 1.0);\n"
+    "}\n";
+
+static bool envInstancing()
+{
+    if (glCaptureActive) return false;
+    if (!envInstancingTried) {
+        envInstancingTried = true;
+        if (!glHasTransformFeedback) return false;
+        std::string lighting = std::string(envShaderVersion) + envLightingSrc;
+        std::string treeVS = lighting + envTreeVertexSrc, iceVS = lighting + envIceVertexSrc;
+        std::string iceFS = std::string(envShaderVersion) + outlineFragmentSrc;
+        std::string lightFS = std::string(envShaderVersion) + envLightFragmentSrc;
+        std::initializer_list<const char*> treeAttribs = { "unitA", "unitB", "foliage", "instance" };
+        std::initializer_list<const char*> iceAttribs = { "unitPos", "unitNormal", "unitUV", "instance" };
+        GLuint (&base)[ENV_MESH_COUNT] = envProgram[ENV_PASS_BASE], (&lit)[ENV_MESH_COUNT] = envProgram[ENV_PASS_LIGHTS];
+        base[ENV_TREES] = buildGLProgram("tree instances", treeVS.c_str(), nullptr, treeAttribs);
+        base[ENV_ICE] = buildGLProgram("ice instances", iceVS.c_str(), iceFS.c_str(), iceAttribs);
+        lit[ENV_TREES] = buildGLProgram("tree point lights", treeVS.c_str(), lightFS.c_str(), treeAttribs);
+        lit[ENV_ICE] = buildGLProgram("ice point lights", iceVS.c_str(), lightFS.c_str(), iceAttribs);
+        if (!base[ENV_TREES] || !base[ENV_ICE] || !lit[ENV_TREES] || !lit[ENV_ICE]) {
+            base[ENV_TREES] = 0;
+            return false;
+        }
+        for (int pass = 0; pass < ENV_PASS_COUNT; ++pass) {
+            for (GLuint program : envProgram[pass]) {
+                glUseProgram(program);
+                glUniform1i(glGetUniformLocation(program, "instances"), 0);
+                glUniform1i(glGetUniformLocation(program, "lights"), 1);
+                glUniform1i(glGetUniformLocation(program, "clusterOffsets"), 2);
+                glUniform1i(glGetUniformLocation(program, "clusterLights"), 3);
+            }
+            envTrunkLoc[pass] = glGetUniformLocation(envProgram[pass][ENV_TREES], "trunk");
+        }
+        glUseProgram(0);
+        envIceEdgeLoc = glGetUniformLocation(base[ENV_ICE], "edge");
+        envIceWidthLoc = glGetUniformLocation(base[ENV_ICE], "halfWidth");
+        for (int m = 0; m < ENV_MESH_COUNT; ++m) {
+            envClusterGridLoc[m] = glGetUniformLocation(lit[m], "clusterGrid");
+            envClusterNearLoc[m] = glGetUniformLocation(lit[m], "clusterNear");
+        }
+
+        if (treeUnitMesh.empty()) buildTreeUnitMesh();
+        if (iceUnitMesh.empty()) buildIceUnitMesh();
+        std::vector<float> treeUnit, iceUnit;
+        for (const TreeUnitVertex& u : treeUnitMesh) {
+            float v[9] = { u.x_r, u.y_h, u.y_c, u.z_r, u.z_h, u.nx_h, u.ny_r, u.nz_h, u.foliage ? 1.0f : 0.0f };
+            treeUnit.insert(treeUnit.end(), v, v + 9);
+        }
+        for (size_t i = 0; i < iceUnitMesh.size(); ++i) {
+            const EnvVertex& u = iceUnitMesh[i];
+            float v[8] = { u.p[0], u.p[1], u.p[2], u.n[0], u.n[1], u.n[2], iceUnitUV[2 * i], iceUnitUV[2 * i + 1] };
+            iceUnit.insert(iceUnit.end(), v, v + 8);
+        }
+        glGenBuffers(ENV_MESH_COUNT, envUnitBuffer);
+        glGenBuffers(ENV_MESH_COUNT, envInstanceBuffer);
+        glGenTextures(ENV_MESH_COUNT, envInstanceTex);
+        glBindBuffer(GL_ARRAY_BUFFER, envUnitBuffer[ENV_TREES]);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(treeUnit.size() * sizeof(float)), treeUnit.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, envUnitBuffer[ENV_ICE]);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(iceUnit.size() * sizeof(float)), iceUnit.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    if (!envProgram[ENV_PASS_BASE][ENV_TREES]) return false;
+    if (!streamPathChosen) setStreamPath(bestStreamPath());
+    return streamPath != STREAM_CLIENT;
+}
+
+// Refills the instance buffers from treeInstances and iceInstances
+static void uploadEnvInstances()
+{
+    std::vector<float> texels[ENV_MESH_COUNT];
+    for (const TreeInstance& t : treeInstances) {
+        float v[8] = { t.x, t.z, t.h, t.r, t.foliage[0] / 255.0f, t.foliage[1] / 255.0f, t.foliage[2] / 255.0f, t.foliage[3] / 255.0f };
+        texels[ENV_TREES].insert(texels[ENV_TREES].end(), v, v + 8);
+    }
+    for (const IceInstance& b : iceInstances) {
+        float v[8] = { b.x, b.z, b.s, 0.0f, b.solid[0] / 255.0f, b.solid[1] / 255.0f, b.solid[2] / 255.0f, b.solid[3] / 255.0f };
+        texels[ENV_ICE].insert(texels[ENV_ICE].end(), v, v + 8);
+    }
+    for (int m = 0; m < ENV_MESH_COUNT; ++m) {
+        glBindBuffer(GL_ARRAY_BUFFER, envInstanceBuffer[m]);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(texels[m].size() * sizeof(float)), texels[m].data(), GL_STATIC_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, envInstanceTex[m]);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, envInstanceBuffer[m]);
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    envInstanceVersion = environmentVersion;
+}
+
+// One instanced draw of mesh for the listed instances, with pass's program
+static void drawEnvInstances(EnvPass pass, EnvMesh mesh, const std::vector<uint32_t>& list)
+{
+    if (list.empty()) return;
+    if (envInstanceVersion != environmentVersion) uploadEnvInstances();
+    GLintptr at = writeEnvStream(list.data(), list.size() * sizeof(uint32_t), nullptr, 0);
+    glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, 0, (const void*)at);
+    glVertexAttribDivisor(3, 1);
+    glBindBuffer(GL_ARRAY_BUFFER, envUnitBuffer[mesh]);
+    GLsizei count;
+    if (mesh == ENV_TREES) {
+        const GLsizei stride = 9 * sizeof(float);
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, stride, (const void*)0);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, stride, (const void*)(4 * sizeof(float)));
+        glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, stride, (const void*)(8 * sizeof(float)));
+        count = (GLsizei)treeUnitMesh.size();
+    } else {
+        const GLsizei stride = 8 * sizeof(float);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (const void*)0);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (const void*)(3 * sizeof(float)));
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (const void*)(6 * sizeof(float)));
+        count = (GLsizei)iceUnitMesh.size();
+    }
+    for (GLuint a = 0; a < 4; ++a) glEnableVertexAttribArray(a);
+    glUseProgram(envProgram[pass][mesh]);
+    if (mesh == ENV_TREES) {
+        float trunk[4] = { trunkColor[0] / 255.0f, trunkColor[1] / 255.0f, trunkColor[2] / 255.0f, 1.0f };
+        glUniform4fv(envTrunkLoc[pass], 1, trunk);
+    } else if (pass == ENV_PASS_BASE) {
+        glUniform3fv(envIceEdgeLoc, 1, outlineEdge[OUTLINE_ICE]);
+        glUniform1f(envIceWidthLoc, outlinePixels);
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, envInstanceTex[mesh]);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, count, (GLsizei)list.size());
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glUseProgram(0);
+    for (GLuint a = 0; a < 4; ++a) glDisableVertexAttribArray(a);
+    glVertexAttribDivisor(3, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Ice blocks past the far plane are skipped; the rest go out in one
+// outlined draw
+void drawIceBlocks(float eyeX, float eyeZ, float scale)
+{
+    if (instancesVersion != environmentVersion) rebuildEnvironmentInstances();
+    iceDrawList.clear();
+    for (size_t i = 0; i < iceInstances.size(); ++i) {
+        const IceInstance& b = iceInstances[i];
+        if (!iceVisible[i]) continue;
+        float dx = b.x * scale - eyeX, dz = b.z * scale - eyeZ;
+        float reach = 100.0f + b.s * scale;
+        if (dx * dx + dz * dz > reach * reach) continue;
+        iceDrawList.push_back((uint32_t)i);
+    }
+    if (iceDrawList.empty()) return;
+    if (envInstancing()) {
+        drawEnvInstances(ENV_PASS_BASE, ENV_ICE, iceDrawList);
+        return;
+    }
+    iceStream.clear();
+    iceUVStream.clear();
+    for (uint32_t i : iceDrawList) {
+        const IceInstance& b = iceInstances[i];
+        appendScaledMesh(iceStream, iceUnitMesh, b.x, b.s / 2.f, b.z, b.s, b.solid);
+        iceUVStream.insert(iceUVStream.end(), iceUnitUV.begin(), iceUnitUV.end());
+    }
+    beginOutline(OUTLINE_ICE);
+    drawEnvStream(iceStream, GL_TRIANGLES, iceUVStream.data());
+    endOutline();
+}
+
+// Footstep and impact puffs: copies of one cached 8x8 unit sphere (the
+// tessellation glutSolidSphere redid per particle) in a single draw
+static std::vector<EnvVertex> particleUnitMesh;
+
+static void buildParticleUnitMesh()
+{
+    if (particleUnitMesh.empty()) {
+        const int slices = 8, stacks = 8;
+        auto point = [](int slice, int stack) {
+            float a = 2.0f * 3.1415926f * slice / slices, b = 3.1415926f * stack / stacks;
+            EnvVertex v = {};
+            v.n[0] = v.p[0] = sinf(b) * cosf(a); v.n[1] = v.p[1] = cosf(b); v.n[2] = v.p[2] = sinf(b) * sinf(a);
+            return v;
+        };
+        for (int j = 0; j < stacks; ++j)
+            for (int i = 0; i < slices; ++i) {
+                EnvVertex q[6] = { point(i, j), point(i, j + 1), point(i + 1, j + 1), point(i, j), point(i + 1, j + 1), point(i + 1, j) };
+                particleUnitMesh.insert(particleUnitMesh.end(), q, q + 6);
+            }
+    }
+}
+
+static size_t particleStreamSize() { return particles.size() * particleUnitMesh.size(); }
+
+static void writeParticleStream(EnvVertex* dst)
+{
+    for (const Particle& p : particles) {
+        float alpha = 1.0f - (p.age / p.life);
+        GLubyte color[4] = { 245, 242, 232, (GLubyte)(0.38f * alpha * 255.0f + 0.5f) };
+        dst = writeScaledMesh(dst, particleUnitMesh, p.x, p.y + 0.02f, p.z, 0.12f * alpha, color);
+    }
+}
+
+static long long particleBytesToGL = 0; // vertex and record bytes handed to GL, for benchParticles
+
+void drawParticles()
+{
+    if (particles.empty()) return;
+    buildParticleUnitMesh();
+    size_t count = particleStreamSize();
+    EnvVertex* stream = streamAlloc(count);
+    writeParticleStream(stream);
+    particleBytesToGL += (long long)(count * sizeof(EnvVertex));
+    glDisable(GL_LIGHTING);
+    drawEnvStream(stream, count, GL_TRIANGLES);
+    glEnable(GL_LIGHTING);
+}
+
+void drawSnowCube(float size);
+
+// Hands the same particle and snowman-cube vertices to GL each frame by
+// every stream path available: client arrays, glBufferData on every draw,
+// and the ring orphaning or persistently mapped. The draws are
+// drawParticles and drawSnowCube themselves, so on the persistent path the
+// vertices are written straight into the mapping and every other path
+// builds them in the frame arena and copies them. Frame time includes the GPU (each run ends in glFinish); CPU is
+// the time to issue the frame's draws, and stalls are fence waits that
+// blocked.
+void benchStreams(int liveParticles)
+{
+    std::mt19937 rng(21);
+    std::uniform_real_distribution<float> pos(-20.0f, 20.0f), unit(0.0f, 1.0f);
+    particles.clear();
+    for (int i = 0; i < liveParticles; ++i) {
+        Particle p = { pos(rng), 0.1f, pos(rng), 0.0f, 1.0f };
+        p.age = unit(rng) * p.life;
+        particles.push_back(p);
+    }
+    buildParticleUnitMesh();
+    if (iceUnitMesh.empty()) buildIceUnitMesh();
+    const int cubes = 3 * 64; // three per snowman
+    const size_t cubeBytes = iceUnitMesh.size() * (sizeof(EnvVertex) + 2 * sizeof(float));
+    const double mb = (particleStreamSize() * sizeof(EnvVertex) + cubes * cubeBytes) / (1024.0 * 1024.0);
+    const int frames = 120, warmup = 10;
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    gluLookAt(0.0, 30.0, 30.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0);
+    for (int path = 0; path < STREAM_PATH_COUNT; ++path) {
+        if (path == STREAM_PERSISTENT ? !glHasBufferStorage : path != STREAM_CLIENT && !glHasTransformFeedback) continue;
+        setStreamPath((StreamPath)path);
+        double cpuMs = 0.0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int f = 0; f < warmup + frames; ++f) {
+            if (f == warmup) {
+                glFinish();
+                streamStalls = 0;
+                cpuMs = 0.0;
+                t0 = std::chrono::steady_clock::now();
+            }
+            FrameArenaScope arena;
+            auto c0 = std::chrono::steady_clock::now();
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            drawParticles();
+            for (int c = 0; c < cubes; ++c) {
+                glPushMatrix();
+                glTranslatef((c % 16 - 7.5f) * 2.5f, 1.0f, (c / 16 - 5.5f) * 2.5f);
+                drawSnowCube(1.0f + c % 3 * 0.25f);
+                glPopMatrix();
+            }
+            endStreamFrame();
+            cpuMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - c0).count();
+            glutSwapBuffers();
+        }
+        glFinish();
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        printf("streams: %-13s %6.2f MB/frame  %6.2f ms/frame CPU  %6.2f ms/frame  %5.2f GB/s  %lld stalls\n",
+            streamPathNames[path], mb, cpuMs / frames, s * 1000.0 / frames, mb * frames / 1024.0 / s, streamStalls);
+    }
+    setStreamPath(bestStreamPath());
+    particles.clear();
+}
+
+// --- Resident particles ---
+// Alternative backend that keeps particle state on the GPU instead of
+// re-streaming every puff each frame ('u' or --resident-particles).
+// Particles are (x, y, z, age, life) records in a ring inside two buffer
+// objects. Each frame one transform-feedback pass reads the live range from
+// one buffer, ages it and writes it to the other, and the two swap. Puffs
+// are then drawn as instances of one sphere mesh, held in a third buffer,
+// with each record supplying per-instance attributes. The only per-frame
+// upload is the new spawns, appended to the ring with glBufferSubData.
+// Spawns are batched per tick. A batch's slots are released once its
+// longest life has passed, and the shader collapses any puff past its own
+// life. The ring doubles when full.
+//
+// Contexts without GL 3.3 fall back to display-list cohorts. Each tick's
+// spawns are compiled once into a list, and per frame a cohort sends only
+// its age:
+// - a rise translation,
+// - a shrink scale, recompiled into a one-command list its particles call,
+// - a texture-matrix scale turning each particle's 1/life texcoord into
+//   age/life, which indexes a 1D alpha ramp under an alpha test.
+bool residentParticles = false;
+
+struct GpuParticleBatch { int count; float age, maxLife; };
+static GLuint gpuParticleState[2], gpuParticleSphere, gpuParticleSim, gpuParticleDraw;
+static GLint gpuParticleDtLoc = -1, gpuParticleTintLoc = -1;
+static int gpuParticleCurrent = 0; // the buffer holding the newest state
+static int gpuParticleCapacity = 0, gpuParticleTail = 0, gpuParticleLive = 0; // ring slots
+static std::deque<GpuParticleBatch> gpuParticleBatches; // oldest first, in ring order
+static std::vector<Particle> gpuParticleStaged; // spawns waiting for the next draw
+static float gpuParticlePendingDt = 0.0f;       // ticks not yet applied by a feedback pass
+static bool gpuParticlesTried = false;
+
+static const char* gpuParticleSimSrc =
+    "#version 130\n"
+    "in vec3 pos;\n"
+    "in vec2 ageLife;\n"
+    "uniform float dt;\n"
+    "out vec3 outPos;\n"
+    "out vec2 outAgeLife;\n"
+    "void main() {\n"
+    "    outPos = pos + vec3(0.0, dt * 0.14, 0.0);\n"
+    "    outAgeLife = vec2(ageLife.x + dt, ageLife.y);\n"
+    "    gl_Position = vec4(0.0);\n" // required, though rasterisation is discarded
+    "}\n";
+
+// Same shape and fade as writeParticleStream; past its life a puff has no size
+static const char* gpuParticleDrawSrc =
+    "#version 130\n"
+    "in vec3 corner;\n"
+    "in vec3 pos;\n"
+    "in vec2 ageLife;\n"
+    "uniform vec4 tint;\n"
+    "void main() {\n"
+    "    float alpha = 1.0 - ageLife.x / ageLife.y;\n"
+    "    float size = ageLife.x > ageLife.y ? 0.0 : 0.12 * alpha;\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(pos + vec3(0.0, 0.02, 0.0) + corner * size, 1.0);\n"
+    "    gl_FrontColor = vec4(tint.rgb, tint.a * alpha);\n"
+    "}\n";
+
+static bool gpuParticlesReady()
+{
+    if (!gpuParticlesTried) {
+        gpuParticlesTried = true;
+        if (!glHasTransformFeedback) return false;
+        gpuParticleSim = buildGLProgram("particle sim", gpuParticleSimSrc, nullptr, { "pos", "ageLife" }, { "outPos", "outAgeLife" });
+        gpuParticleDraw = buildGLProgram("particle draw", gpuParticleDrawSrc, nullptr, { "corner", "pos", "ageLife" });
+        if (!gpuParticleSim || !gpuParticleDraw) { gpuParticleSim = gpuParticleDraw = 0; return false; }
+        gpuParticleDtLoc = glGetUniformLocation(gpuParticleSim, "dt");
+        gpuParticleTintLoc = glGetUniformLocation(gpuParticleDraw, "tint");
+        buildParticleUnitMesh();
+        std::vector<float> corners;
+        for (const EnvVertex& v : particleUnitMesh) corners.insert(corners.end(), v.p, v.p + 3);
+        glGenBuffers(1, &gpuParticleSphere);
+        glBindBuffer(GL_ARRAY_BUFFER, gpuParticleSphere);
+        glBufferData(GL_ARRAY_BUFFER, corners.size() * sizeof(float), corners.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    return gpuParticleSim != 0;
+}
+
+// Makes room for `needed` live slots, copying the live range to the start
+// of the new ring
+static void growGpuParticleRing(int needed)
+{
+    int capacity = std::max(4096, gpuParticleCapacity);
+    while (capacity < needed) capacity *= 2;
+    if (capacity == gpuParticleCapacity) return;
+    GLuint fresh[2];
+    glGenBuffers(2, fresh);
+    for (GLuint b : fresh) {
+        glBindBuffer(GL_ARRAY_BUFFER, b);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)capacity * sizeof(Particle), nullptr, GL_DYNAMIC_COPY);
+    }
+    if (gpuParticleLive) {
+        glBindBuffer(GL_COPY_READ_BUFFER, gpuParticleState[gpuParticleCurrent]);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, fresh[0]);
+        int first = std::min(gpuParticleLive, gpuParticleCapacity - gpuParticleTail);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (GLintptr)gpuParticleTail * sizeof(Particle), 0, (GLsizeiptr)first * sizeof(Particle));
+        if (first < gpuParticleLive)
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, (GLintptr)first * sizeof(Particle), (GLsizeiptr)(gpuParticleLive - first) * sizeof(Particle));
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+    if (gpuParticleCapacity) glDeleteBuffers(2, gpuParticleState);
+    gpuParticleState[0] = fresh[0]; gpuParticleState[1] = fresh[1];
+    gpuParticleCurrent = 0;
+    gpuParticleTail = 0;
+    gpuParticleCapacity = capacity;
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Calls draw(first, count) for the live range, split where the ring wraps
+template <typename Draw>
+static void forGpuParticleRanges(Draw draw)
+{
+    int first = std::min(gpuParticleLive, gpuParticleCapacity - gpuParticleTail);
+    if (first) draw(gpuParticleTail, first);
+    if (first < gpuParticleLive) draw(0, gpuParticleLive - first);
+}
+
+static void bindParticleRecords(GLuint buffer, int firstSlot, GLuint posAttrib)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    size_t base = (size_t)firstSlot * sizeof(Particle);
+    glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, sizeof(Particle), (const void*)(base + offsetof(Particle, x)));
+    glVertexAttribPointer(posAttrib + 1, 2, GL_FLOAT, GL_FALSE, sizeof(Particle), (const void*)(base + offsetof(Particle, age)));
+}
+
+static void drawGpuParticles()
+{
+    if (gpuParticleStaged.empty() && !gpuParticleLive) return;
+    // Append the spawns
+    if (!gpuParticleStaged.empty()) {
+        int count = (int)gpuParticleStaged.size();
+        if (gpuParticleLive + count > gpuParticleCapacity) growGpuParticleRing(gpuParticleLive + count);
+        glBindBuffer(GL_ARRAY_BUFFER, gpuParticleState[gpuParticleCurrent]);
+        int head = (gpuParticleTail + gpuParticleLive) % gpuParticleCapacity;
+        int first = std::min(count, gpuParticleCapacity - head);
+        glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)head * sizeof(Particle), (GLsizeiptr)first * sizeof(Particle), gpuParticleStaged.data());
+        if (first < count)
+            glBufferSubData(GL_ARRAY_BUFFER, 0, (GLsizeiptr)(count - first) * sizeof(Particle), gpuParticleStaged.data() + first);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        particleBytesToGL += (long long)count * sizeof(Particle);
+        gpuParticleLive += count;
+        gpuParticleStaged.clear();
+    }
+    while (!gpuParticleBatches.empty() && gpuParticleBatches.front().age > gpuParticleBatches.front().maxLife) {
+        gpuParticleTail = (gpuParticleTail + gpuParticleBatches.front().count) % gpuParticleCapacity;
+        gpuParticleLive -= gpuParticleBatches.front().count;
+        gpuParticleBatches.pop_front();
+    }
+    if (!gpuParticleLive) return;
+
+    // The sim reads attributes 0 and 1 only; 2 is enabled just around the
+    // instanced draw, once it points at a live buffer
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    if (gpuParticlePendingDt > 0.0f) {
+        glUseProgram(gpuParticleSim);
+        glUniform1f(gpuParticleDtLoc, gpuParticlePendingDt);
+        glEnable(GL_RASTERIZER_DISCARD);
+        GLuint src = gpuParticleState[gpuParticleCurrent], dst = gpuParticleState[1 - gpuParticleCurrent];
+        forGpuParticleRanges([&](int first, int count) {
+            bindParticleRecords(src, 0, 0);
+            glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, dst, (GLintptr)first * sizeof(Particle), (GLsizeiptr)count * sizeof(Particle));
+            glBeginTransformFeedback(GL_POINTS);
+            glDrawArrays(GL_POINTS, first, count);
+            glEndTransformFeedback();
+        });
+        glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0, 0, 0);
+        glDisable(GL_RASTERIZER_DISCARD);
+        gpuParticleCurrent = 1 - gpuParticleCurrent;
+        gpuParticlePendingDt = 0.0f;
+    }
+
+    static const float tint[4] = { 245 / 255.0f, 242 / 255.0f, 232 / 255.0f, 0.38f };
+    glUseProgram(gpuParticleDraw);
+    glUniform4fv(gpuParticleTintLoc, 1, tint);
+    glBindBuffer(GL_ARRAY_BUFFER, gpuParticleSphere);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+    glVertexAttribDivisor(1, 1);
+    glVertexAttribDivisor(2, 1);
+    forGpuParticleRanges([&](int first, int count) {
+        bindParticleRecords(gpuParticleState[gpuParticleCurrent], first, 1);
+        glEnableVertexAttribArray(2);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, (GLsizei)particleUnitMesh.size(), count);
+    });
+    glVertexAttribDivisor(1, 0);
+    glVertexAttribDivisor(2, 0);
+    glDisableVertexAttribArray(2);
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+}
+
+struct ParticleCohort {
+    std::vector<Particle> staged; // spawns until the next display compiles them
+    GLuint list = 0;              // shrink list, particle list at list + 1
+    int count = 0;
+    float age = 0.0f, maxLife = 0.0f;
+};
+static std::vector<ParticleCohort> particleCohorts;
+static GLuint particleSphereList = 0, particleFadeTex = 0;
+
+// Runs in place of the particles vector when the backend is on. The GPU
+// path's spawns join partway through the time the next feedback pass will
+// apply, so they are back-dated by it and come out of the pass at age 0
+static void stageParticleCohort()
+{
+    float maxLife = 0.0f;
+    for (const Particle& p : particleSpawns) maxLife = std::max(maxLife, p.life);
+    if (gpuParticlesReady()) {
+        for (Particle p : particleSpawns) {
+            p.age -= gpuParticlePendingDt;
+            p.y -= gpuParticlePendingDt * 0.14f;
+            gpuParticleStaged.push_back(p);
+        }
+        gpuParticleBatches.push_back({ (int)particleSpawns.size(), 0.0f, maxLife });
+        particleSpawns.clear();
+        return;
+    }
+    ParticleCohort c;
+    c.staged.swap(particleSpawns);
+    c.count = (int)c.staged.size();
+    c.maxLife = maxLife;
+    particleCohorts.push_back(std::move(c));
+}
+
+static void ageParticleCohorts(float delta)
+{
+    for (ParticleCohort& c : particleCohorts) c.age += delta;
+    for (GpuParticleBatch& b : gpuParticleBatches) b.age += delta;
+    if (!gpuParticleBatches.empty()) gpuParticlePendingDt += delta;
+}
+
+// Rewind and resets drop every cohort; their lists go on the next draw
+static void clearParticleCohorts()
+{
+    for (ParticleCohort& c : particleCohorts) c.age = c.maxLife + 1.0f;
+    gpuParticleBatches.clear();
+    gpuParticleStaged.clear();
+    gpuParticleTail = gpuParticleLive = 0;
+    gpuParticlePendingDt = 0.0f;
+}
+
+static float cohortShrink(const ParticleCohort& c) { return 0.12f * std::max(0.0f, 1.0f - c.age / c.maxLife); }
+
+static void compileParticleCohort(ParticleCohort& c)
+{
+    c.list = glGenLists(2);
+    glNewList(c.list + 1, GL_COMPILE);
+    for (const Particle& p : c.staged) {
+        glTexCoord1f(1.0f / p.life);
+        glPushMatrix();
+        glTranslatef(p.x, p.y + 0.02f, p.z);
+        glCallList(c.list);
+        glCallList(particleSphereList);
+        glPopMatrix();
+    }
+    glEndList();
+    particleBytesToGL += (long long)c.staged.size() * 4 * sizeof(float); // texcoord + translation
+    std::vector<Particle>().swap(c.staged);
+}
+
+void drawResidentParticles()
+{
+    if (gpuParticleSim) drawGpuParticles();
+    size_t live = 0;
+    for (ParticleCohort& c : particleCohorts) {
+        if (c.age > c.maxLife) { if (c.list) glDeleteLists(c.list, 2); }
+        else particleCohorts[live++] = std::move(c);
+    }
+    particleCohorts.resize(live);
+    if (particleCohorts.empty()) return;
+    if (!particleSphereList) {
+        buildParticleUnitMesh();
+        particleSphereList = glGenLists(1);
+        glNewList(particleSphereList, GL_COMPILE);
+        glBegin(GL_TRIANGLES);
+        for (const EnvVertex& v : particleUnitMesh) glVertex3f(v.p[0], v.p[1], v.p[2]);
+        glEnd();
+        glEndList();
+
+        // GL_CLAMP keeps sampling the last texel past s = 1, so that texel
+        // is transparent: a puff drops within half a texel of its life
+        const int rampSize = 64;
+        GLubyte ramp[rampSize];
+        for (int i = 0; i < rampSize; ++i) ramp[i] = (GLubyte)(255.0f * (1.0f - (float)i / (rampSize - 1)) + 0.5f);
+        glGenTextures(1, &particleFadeTex);
+        glBindTexture(GL_TEXTURE_1D, particleFadeTex);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+        glTexImage1D(GL_TEXTURE_1D, 0, GL_ALPHA, rampSize, 0, GL_ALPHA, GL_UNSIGNED_BYTE, ramp);
+    }
+    glDisable(GL_LIGHTING);
+    glEnable(GL_TEXTURE_1D);
+    glBindTexture(GL_TEXTURE_1D, particleFadeTex);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glEnable(GL_ALPHA_TEST);
+    glAlphaFunc(GL_GREATER, 0.0f);
+    glColor3f(245 / 255.0f, 242 / 255.0f, 232 / 255.0f);
+    for (ParticleCohort& c : particleCohorts) {
+        if (!c.list) compileParticleCohort(c);
+        float s = cohortShrink(c);
+        glNewList(c.list, GL_COMPILE);
+        glScalef(s, s, s);
+        glEndList();
+        glMatrixMode(GL_TEXTURE);
+        glLoadIdentity();
+        glScalef(c.age, 1.0f, 1.0f);
+        glMatrixMode(GL_MODELVIEW);
+        glPushMatrix();
+        glTranslatef(0.0f, c.age * 0.14f, 0.0f);
+        glCallList(c.list + 1);
+        glPopMatrix();
+    }
+    glMatrixMode(GL_TEXTURE);
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glDisable(GL_ALPHA_TEST);
+    glBindTexture(GL_TEXTURE_1D, 0);
+    glDisable(GL_TEXTURE_1D);
+    glEnable(GL_LIGHTING);
+}
+
+// Steady footstep traffic through both backends in a live context, viewed
+// from above the field. Per frame: CPU time for the tick plus draw
+// submission, GPU time from a timer query around the draw (the feedback
+// pass included), and the bytes each path hands to GL.
+void benchParticles(int spawnsPerTick)
+{
+    const float dt = 1.0f / 60.0f;
+    const int ticks = 240, warmup = 90; // lives are under a second, so the population is steady after 60
+    std::mt19937 rng(12);
+    std::uniform_real_distribution<float> pos(-20.0f, 20.0f);
+    buildParticleUnitMesh();
+    GLuint query = 0;
+    if (glHasTransformFeedback) glGenQueries(1, &query);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    gluLookAt(0.0, 30.0, 30.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0);
+    for (int backend = 0; backend < 2; ++backend) {
+        residentParticles = backend == 1;
+        particles.clear();
+        particleCohorts.clear();
+        clearParticleCohorts();
+        double us = 0.0, gpuMs = 0.0, bytes = 0.0, live = 0.0;
+        for (int t = 0; t < ticks; ++t) {
+            FrameArenaScope arena;
+            for (int i = 0; i < spawnsPerTick; ++i) {
+                Particle p = { pos(rng), 0.0f, pos(rng), 0.0f, 0.84f + 0.12f * (rng() % 100) / 100.0f };
+                particleSpawns.push_back(p);
+            }
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            particleBytesToGL = 0;
+            auto t0 = std::chrono::steady_clock::now();
+            updateParticles(dt);
+            if (query) glBeginQuery(GL_TIME_ELAPSED, query);
+            drawParticles();
+            drawResidentParticles();
+            endStreamFrame();
+            if (query) glEndQuery(GL_TIME_ELAPSED);
+            double frameUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+            GLuint64 ns = 0;
+            if (query) glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+            else glFinish();
+            if (t < warmup) continue;
+            size_t frameLive = particles.size();
+            for (const GpuParticleBatch& b : gpuParticleBatches) frameLive += b.count;
+            for (const ParticleCohort& c : particleCohorts) frameLive += c.count;
+            us += frameUs; gpuMs += ns / 1e6; bytes += particleBytesToGL; live += frameLive;
+        }
+        int frames = ticks - warmup;
+        const char* name = !residentParticles ? "stream" : gpuParticleSim ? "feedback" : "lists";
+        printf("particles: %-8s %5.0f live  %7.1f us/frame CPU  %6.2f ms/frame GPU  %8.1f KB/frame to GL\n",
+            name, live / frames, us / frames, gpuMs / frames, bytes / 1024.0 / frames);
+    }
+    if (query) glDeleteQueries(1, &query);
+    residentParticles = false;
+}
+
+// --- Minimap ---
+// Overhead map in the top-right corner. Flat proxies (octagons for trees,
+// squares for ice) are drawn into a texture through a framebuffer object,
+// but at most minimapRate times a second and only once the snowman has
+// moved minimapMove units or the environment changed. Every other frame
+// composites the cached texture as one quad, with the snowman's marker
+// drawn live on top. 'm' toggles it. Without framebuffer objects (and in
+// captured frames) the proxies are drawn into the back buffer's corner and
+// copied out instead, which only holds for pixels the window owns and
+// shrinks the map's resolution to fit windows smaller than minimapSize.
+bool minimapEnabled = true;
+float minimapRate = 4.0f;         // refreshes per second at most
+float minimapMove = 2.0f;         // world units walked before a refresh is due
+const int minimapSize = 256;      // texels
+const float minimapSpan = 80.0f;  // world units across
+const int minimapScreenSize = 192; // pixels on screen
+static GLuint minimapTex = 0, minimapFbo = 0;
+static int minimapTexels = minimapSize; // rendered corner of minimapTex, smaller when borrowing a small window
+static bool minimapFboTried = false;
+static float minimapCenterX = 0.0f, minimapCenterZ = 0.0f, minimapLastRefresh = -1e9f;
+static int minimapVersion = -1;
+static std::vector<EnvVertex> minimapStream;
+
+static bool minimapDue(float now)
+{
+    if (minimapVersion != environmentVersion) return true;
+    float dx = snowmanX - minimapCenterX, dz = snowmanZ - minimapCenterZ;
+    return now - minimapLastRefresh >= 1.0f / minimapRate && dx * dx + dz * dz >= minimapMove * minimapMove;
+}
+
+// Map space: x right, world -z up, centred on (cx, cz)
+static void appendMinimapProxies(float cx, float cz)
+{
+    static const GLubyte treeColor[4] = { 48, 105, 26, 255 }, iceColor[4] = { 161, 199, 250, 255 };
+    const float reach = minimapSpan / 2;
+    auto tri = [&](float x0, float y0, float x1, float y1, float x2, float y2, const GLubyte c[4]) {
+        float p[3][2] = { { x0, y0 }, { x1, y1 }, { x2, y2 } };
+        for (auto& q : p) {
+            EnvVertex v = {};
+            v.p[0] = q[0]; v.p[1] = q[1];
+            memcpy(v.c, c, 4);
+            minimapStream.push_back(v);
+        }
+    };
+    for (const IceBlock& b : iceblocks) {
+        float x = b.x - cx, y = cz - b.z, h = b.s / 2;
+        if (std::fabs(x) > reach + h || std::fabs(y) > reach + h) continue;
+        tri(x - h, y - h, x + h, y - h, x + h, y + h, iceColor);
+        tri(x - h, y - h, x + h, y + h, x - h, y + h, iceColor);
+    }
+    static const float ring[9][2] = { {1,0}, {0.7071f,0.7071f}, {0,1}, {-0.7071f,0.7071f}, {-1,0}, {-0.7071f,-0.7071f}, {0,-1}, {0.7071f,-0.7071f}, {1,0} };
+    for (const Tree& t : trees) {
+        // The foliage footprint: centred where drawPineTree pushes the cone
+        float x = t.x - cx, y = cz - (t.z - t.h * 0.1f);
+        if (std::fabs(x) > reach + t.r || std::fabs(y) > reach + t.r) continue;
+        for (int i = 0; i < 8; ++i)
+            tri(x, y, x + ring[i][0] * t.r, y + ring[i][1] * t.r, x + ring[i + 1][0] * t.r, y + ring[i + 1][1] * t.r, treeColor);
+    }
+}
+
+static bool minimapFramebuffer()
+{
+    if (glCaptureActive) return false;
+    if (!minimapFboTried) {
+        minimapFboTried = true;
+        if (!glHasFramebuffers) return false;
+        glGenFramebuffers(1, &minimapFbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, minimapFbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, minimapTex, 0);
+        bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (!complete) {
+            glDeleteFramebuffers(1, &minimapFbo);
+            minimapFbo = 0;
+        }
+    }
+    return minimapFbo != 0;
+}
+
+// Must run before display clears the frame: without a framebuffer object
+// it borrows the back buffer's corner the way buildTreeImpostors does
+void updateMinimap(float now)
+{
+    if (!minimapEnabled || !minimapDue(now)) return;
+    if (!minimapTex) {
+        glGenTextures(1, &minimapTex);
+        glBindTexture(GL_TEXTURE_2D, minimapTex);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, minimapSize, minimapSize, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    bool offscreen = minimapFramebuffer();
+    int texels = minimapSize;
+    if (!offscreen) texels = std::min(minimapSize, std::min(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT)));
+    if (texels <= 0) return;
+    TraceScope trace("minimap");
+    minimapCenterX = snowmanX; minimapCenterZ = snowmanZ;
+    minimapLastRefresh = now;
+    minimapVersion = environmentVersion;
+    minimapStream.clear();
+    appendMinimapProxies(minimapCenterX, minimapCenterZ);
+
+    if (offscreen) glBindFramebuffer(GL_FRAMEBUFFER, minimapFbo);
+    glViewport(0, 0, texels, texels);
+    glClearColor(0.95f, 0.97f, 1.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(-minimapSpan / 2, minimapSpan / 2, -minimapSpan / 2, minimapSpan / 2, -1.0, 1.0);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    drawEnvStream(minimapStream, GL_TRIANGLES);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_LIGHTING);
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glClearColor(0.83f, 0.92f, 1.0f, 1.0f);
+    glViewport(0, 0, glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT));
+    minimapTexels = texels;
+    if (offscreen) {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        return;
+    }
+    glBindTexture(GL_TEXTURE_2D, minimapTex);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, texels, texels);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// The cached map as one quad, plus the snowman's marker at its offset from
+// where the map was last centred
+void drawMinimap()
+{
+    if (!minimapEnabled || minimapVersion < 0) return; // nothing rendered yet
+    int w = glutGet(GLUT_WINDOW_WIDTH), h = glutGet(GLUT_WINDOW_HEIGHT);
+    float x0 = (float)(w - minimapScreenSize - 10), y0 = (float)(h - minimapScreenSize - 10), size = (float)minimapScreenSize;
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, w, 0, h, -1.0, 1.0);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, minimapTex);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+    float t = (float)minimapTexels / minimapSize;
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 0); glVertex3f(x0, y0, 0);
+    glTexCoord2f(t, 0); glVertex3f(x0 + size, y0, 0);
+    glTexCoord2f(t, t); glVertex3f(x0 + size, y0 + size, 0);
+    glTexCoord2f(0, t); glVertex3f(x0, y0 + size, 0);
+    glEnd();
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisable(GL_TEXTURE_2D);
+
+    // Marker: a triangle pointing the way W walks
+    float k = size / minimapSpan, half = size / 2 - 6;
+    float mx = x0 + size / 2 + std::max(-half, std::min(half, (snowmanX - minimapCenterX) * k));
+    float my = y0 + size / 2 + std::max(-half, std::min(half, (minimapCenterZ - snowmanZ) * k));
+    float rad = headingDeg * 3.1415926f / 180.0f, fx = sinf(rad), fy = -cosf(rad);
+    glColor3f(0.85f, 0.2f, 0.1f);
+    glBegin(GL_TRIANGLES);
+    glVertex3f(mx + fx * 7, my + fy * 7, 0);
+    glVertex3f(mx - fx * 4 - fy * 4, my - fy * 4 + fx * 4, 0);
+    glVertex3f(mx - fx * 4 + fy * 4, my - fy * 4 - fx * 4, 0);
+    glEnd();
+
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_LIGHTING);
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+}
+
+// Proxy build cost per refresh, and how often a steady walk at moveSpeed
+// triggers one over a minute of 60 Hz frames
+void benchMinimap()
+{
+    const int counts[3] = { 38, 1500, 20000 };
+    for (int treeCount : counts) {
+        EnvironmentParams p;
+        p.treeCount = treeCount;
+        p.iceCount = treeCount / 4;
+        p.extent = std::max(45.0f, std::sqrt((float)treeCount) * 3.0f);
+        generateEnvironment(p, trees, iceblocks);
+        ++environmentVersion;
+        const int reps = 50;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r) {
+            minimapStream.clear();
+            appendMinimapProxies(r * 0.5f, 0.0f);
+        }
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count() / reps;
+        printf("minimap: %5d trees %4d ice  proxies %6zu vertices  built in %.1f us\n",
+            treeCount, (int)iceblocks.size(), minimapStream.size(), us);
+    }
+    int refreshes = 0;
+    minimapVersion = environmentVersion;
+    minimapLastRefresh = -1e9f;
+    snowmanX = snowmanZ = minimapCenterX = minimapCenterZ = 0.0f;
+    for (int f = 0; f < 3600; ++f) {
+        float now = f / 60.0f;
+        snowmanX = moveSpeed * now;
+        if (minimapDue(now)) {
+            ++refreshes;
+            minimapCenterX = snowmanX; minimapCenterZ = snowmanZ;
+            minimapLastRefresh = now;
+        }
+    }
+    printf("minimap: walking at %.1f units/s: %d refreshes in 3600 frames (%.2f per second)\n", moveSpeed, refreshes, refreshes / 60.0f);
+}
+
+// --- Clustered lighting ---
+// Fixed-function GL stops at eight lights, so lanterns and glowing ice get
+// their own additive pass. Visible point lights are binned into view-space
+// froxels each frame (compact offset + index lists). With the instanced
+// environment the lists go to buffer textures and every fragment loops over
+// its own froxel's lights; otherwise every vertex of the CPU batches does,
+// and the shaded copy goes out as one more draw over the same geometry.
+// A light with `inner` set sits inside its ice block and shines out through
+// all of the block's faces.
+struct PointLight { float x, y, z, radius; float r, g, b; float phase; float inner; };
+int pointLightCount = 0;        // 'l' cycles through the stress counts
+float pointLightRadius = 5.0f;
+std::vector<PointLight> pointLights;
+static int pointLightsVersion = -1, pointLightsBuiltCount = -1;
+
+const int clusterX = 16, clusterY = 9, clusterZ = 24;
+const float clusterNear = 0.1f, clusterFar = 100.0f;
+static std::vector<PointLight> frameLights;    // visible lights, flicker applied
+static std::vector<uint32_t> clusterOffsets;   // clusterCount + 1 prefix sums
+static std::vector<uint16_t> clusterLightList; // indices into frameLights
+static float clusterMV[16], clusterProj[16];
+static std::vector<EnvVertex> lightStream;
+enum ClusterBuffer { CLUSTER_LIGHTS, CLUSTER_OFFSETS, CLUSTER_LIST, CLUSTER_BUFFER_COUNT };
+static GLuint clusterBuffer[CLUSTER_BUFFER_COUNT], clusterTex[CLUSTER_BUFFER_COUNT];
+
+static int clusterIndex(int x, int y, int z) { return (z * clusterY + y) * clusterX + x; }
+
+static int clusterSlice(float depth)
+{
+    int z = (int)(logf(depth / clusterNear) / logf(clusterFar / clusterNear) * clusterZ);
+    return std::max(0, std::min(clusterZ - 1, z));
+}
+
+// Lanterns hang on trees and glow sits inside ice blocks; once those run out
+// the rest are scattered at lantern height across the environment
+void buildPointLights(int count)
+{
+    pointLights.clear();
+    std::mt19937 rng(4242);
+    std::vector<int> slots(trees.size() + iceblocks.size());
+    for (size_t i = 0; i < slots.size(); ++i) slots[i] = (int)i;
+    std::shuffle(slots.begin(), slots.end(), rng);
+    std::uniform_real_distribution<float> pos(-envParams.extent, envParams.extent);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    for (int i = 0; i < count; ++i) {
+        PointLight l;
+        l.radius = pointLightRadius;
+        l.phase = unit(rng) * 6.2831853f;
+        l.inner = 0.0f;
+        if (i < (int)slots.size() && slots[i] < (int)trees.size()) {
+            const Tree& t = trees[slots[i]];
+            l.x = t.x + t.r * 0.55f; l.y = t.h * 0.15f + 1.2f; l.z = t.z;
+            l.r = 1.0f; l.g = 0.68f; l.b = 0.32f;
+        }
+        else if (i < (int)slots.size()) {
+            const IceBlock& b = iceblocks[slots[i] - trees.size()];
+            l.x = b.x; l.y = b.s * 0.5f; l.z = b.z;
+            l.inner = b.s * 0.5f + 0.01f; // the faces count as inside
+            l.r = 0.35f; l.g = 0.75f; l.b = 1.0f;
+        }
+        else {
+            l.x = pos(rng); l.y = 1.0f + 2.0f * unit(rng); l.z = pos(rng);
+            l.r = 0.6f + 0.4f * unit(rng); l.g = 0.6f + 0.4f * unit(rng); l.b = 0.6f + 0.4f * unit(rng);
+        }
+        pointLights.push_back(l);
+    }
+    pointLightsVersion = environmentVersion;
+    pointLightsBuiltCount = count;
+}
+
+void binLights(const float mv[16], const float proj[16], float time)
+{
+    if (pointLightsVersion != environmentVersion || pointLightsBuiltCount != pointLightCount)
+        buildPointLights(pointLightCount);
+    memcpy(clusterMV, mv, sizeof(clusterMV));
+    memcpy(clusterProj, proj, sizeof(clusterProj));
+    const int clusterCount = clusterX * clusterY * clusterZ;
+    float scale = std::sqrt(mv[0] * mv[0] + mv[1] * mv[1] + mv[2] * mv[2]);
+
+    struct Range { int x0, x1, y0, y1, z0, z1; };
+    static std::vector<Range> ranges;
+    frameLights.clear();
+    ranges.clear();
+    clusterOffsets.assign(clusterCount + 1, 0);
+    for (const PointLight& l : pointLights) {
+        float vx = mv[0] * l.x + mv[4] * l.y + mv[8] * l.z + mv[12];
+        float vy = mv[1] * l.x + mv[5] * l.y + mv[9] * l.z + mv[13];
+        float depth = -(mv[2] * l.x + mv[6] * l.y + mv[10] * l.z + mv[14]);
+        float r = l.radius * scale;
+        float dNear = std::max(depth - r, clusterNear), dFar = depth + r;
+        if (dFar < clusterNear || dNear > clusterFar) continue;
+        // Screen bounds of the sphere's view-space box at its nearest depth
+        float nx0 = (vx - r) * proj[0] / (vx - r < 0 ? dNear : dFar), nx1 = (vx + r) * proj[0] / (vx + r > 0 ? dNear : dFar);
+        float ny0 = (vy - r) * proj[5] / (vy - r < 0 ? dNear : dFar), ny1 = (vy + r) * proj[5] / (vy + r > 0 ? dNear : dFar);
+        if (nx1 < -1 || nx0 > 1 || ny1 < -1 || ny0 > 1) continue;
+        Range g;
+        g.x0 = std::max(0, (int)((nx0 * 0.5f + 0.5f) * clusterX)); g.x1 = std::min(clusterX - 1, (int)((nx1 * 0.5f + 0.5f) * clusterX));
+        g.y0 = std::max(0, (int)((ny0 * 0.5f + 0.5f) * clusterY)); g.y1 = std::min(clusterY - 1, (int)((ny1 * 0.5f + 0.5f) * clusterY));
+        g.z0 = clusterSlice(dNear); g.z1 = clusterSlice(dFar);
+        for (int z = g.z0; z <= g.z1; ++z)
+            for (int y = g.y0; y <= g.y1; ++y)
+                for (int x = g.x0; x <= g.x1; ++x) ++clusterOffsets[clusterIndex(x, y, z) + 1];
+        PointLight f = l;
+        float flicker = 0.85f + 0.15f * sinf(time * 7.0f + l.phase);
+        f.r *= flicker; f.g *= flicker; f.b *= flicker;
+        frameLights.push_back(f);
+        ranges.push_back(g);
+    }
+    for (int i = 0; i < clusterCount; ++i) clusterOffsets[i + 1] += clusterOffsets[i];
+    clusterLightList.resize(clusterOffsets[clusterCount]);
+    static std::vector<uint32_t> cursor;
+    cursor.assign(clusterOffsets.begin(), clusterOffsets.end() - 1);
+    for (size_t li = 0; li < ranges.size(); ++li) {
+        const Range& g = ranges[li];
+        for (int z = g.z0; z <= g.z1; ++z)
+            for (int y = g.y0; y <= g.y1; ++y)
+                for (int x = g.x0; x <= g.x1; ++x) clusterLightList[cursor[clusterIndex(x, y, z)]++] = (uint16_t)li;
+    }
+    profileCount(PROF_LIGHTS_VISIBLE, (long long)frameLights.size());
+}
+
+// Point-light sum for one vertex, from its froxel's list only; returns the
+// number of lights evaluated
+static int shadeVertex(const EnvVertex& v, float out[3])
+{
+    out[0] = out[1] = out[2] = 0.0f;
+    const float* m = clusterMV;
+    float vx = m[0] * v.p[0] + m[4] * v.p[1] + m[8] * v.p[2] + m[12];
+    float vy = m[1] * v.p[0] + m[5] * v.p[1] + m[9] * v.p[2] + m[13];
+    float depth = -(m[2] * v.p[0] + m[6] * v.p[1] + m[10] * v.p[2] + m[14]);
+    if (depth < clusterNear) return 0;
+    int cx = (int)((vx * clusterProj[0] / depth * 0.5f + 0.5f) * clusterX);
+    int cy = (int)((vy * clusterProj[5] / depth * 0.5f + 0.5f) * clusterY);
+    if (cx < 0 || cy < 0 || cx >= clusterX || cy >= clusterY) return 0;
+    int c = clusterIndex(cx, cy, clusterSlice(depth));
+    uint32_t begin = clusterOffsets[c], end = clusterOffsets[c + 1];
+    if (begin == end) return 0;
+    float nl = std::sqrt(v.n[0] * v.n[0] + v.n[1] * v.n[1] + v.n[2] * v.n[2]);
+    float inl = nl > 0 ? 1.0f / nl : 0.0f;
+    for (uint32_t i = begin; i < end; ++i) {
+        const PointLight& l = frameLights[clusterLightList[i]];
+        float dx = l.x - v.p[0], dy = l.y - v.p[1], dz = l.z - v.p[2];
+        float d2 = dx * dx + dy * dy + dz * dz, r2 = l.radius * l.radius;
+        if (d2 >= r2) continue;
+        float ndl = (v.n[0] * dx + v.n[1] * dy + v.n[2] * dz) * inl / std::sqrt(d2 + 1e-6f);
+        if (fabsf(dx) <= l.inner && fabsf(dy) <= l.inner && fabsf(dz) <= l.inner) ndl = fabsf(ndl);
+        if (ndl <= 0) continue;
+        float fall = 1.0f - d2 / r2;
+        float k = fall * fall * ndl;
+        out[0] += l.r * k; out[1] += l.g * k; out[2] += l.b * k;
+    }
+    return (int)(end - begin);
+}
+
+// Appends the lit triangles of `in` with colour = albedo * light sum
+static long long shadeStream(const std::vector<EnvVertex>& in, std::vector<EnvVertex>& out)
+{
+    long long evaluated = 0;
+    for (size_t t = 0; t + 2 < in.size(); t += 3) {
+        EnvVertex tri[3];
+        bool lit = false;
+        for (int k = 0; k < 3; ++k) {
+            float acc[3];
+            tri[k] = in[t + k];
+            evaluated += shadeVertex(tri[k], acc);
+            for (int ch = 0; ch < 3; ++ch) {
+                float c = tri[k].c[ch] * acc[ch];
+                tri[k].c[ch] = (GLubyte)std::min(255.0f, c);
+                lit = lit || c >= 1.0f;
+            }
+        }
+        if (lit) out.insert(out.end(), tri, tri + 3);
+    }
+    return evaluated;
+}
+
+// Ground pools: one small grid per visible light carrying only that light's
+// contribution, so overlapping pools add up correctly
+static void appendGroundPool(std::vector<EnvVertex>& out, const PointLight& l)
+{
+    const int n = 8;
+    float reach = std::sqrt(std::max(0.0f, l.radius * l.radius - l.y * l.y));
+    if (reach <= 0) return;
+    float step = 2.0f * reach / n;
+    auto vertex = [&](int i, int j) {
+        EnvVertex v;
+        v.p[0] = l.x - reach + i * step; v.p[1] = -0.02f; v.p[2] = l.z - reach + j * step;
+        v.n[0] = 0; v.n[1] = 1; v.n[2] = 0;
+        float dx = l.x - v.p[0], dy = l.y - v.p[1], dz = l.z - v.p[2];
+        float d2 = dx * dx + dy * dy + dz * dz, r2 = l.radius * l.radius;
+        float fall = d2 < r2 ? 1.0f - d2 / r2 : 0.0f;
+        float k = fall * fall * dy / std::sqrt(d2 + 1e-6f) * 250.0f;
+        v.c[0] = (GLubyte)std::min(255.0f, l.r * k); v.c[1] = (GLubyte)std::min(255.0f, l.g * k);
+        v.c[2] = (GLubyte)std::min(255.0f, l.b * k); v.c[3] = 255;
+        return v;
+    };
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            EnvVertex q[6] = { vertex(i, j), vertex(i + 1, j), vertex(i + 1, j + 1), vertex(i, j), vertex(i + 1, j + 1), vertex(i, j + 1) };
+            out.insert(out.end(), q, q + 6);
+        }
+    }
+}
+
+// Copies this frame's lights and froxel lists into the buffer textures the
+// instanced light programs read
+static void uploadClusters()
+{
+    static std::vector<float> texels;
+    texels.clear();
+    for (const PointLight& l : frameLights) {
+        float v[8] = { l.x, l.y, l.z, l.radius, l.r, l.g, l.b, l.inner };
+        texels.insert(texels.end(), v, v + 8);
+    }
+    if (!clusterBuffer[0]) {
+        glGenBuffers(CLUSTER_BUFFER_COUNT, clusterBuffer);
+        glGenTextures(CLUSTER_BUFFER_COUNT, clusterTex);
+    }
+    // The list can be empty while lights are visible (all outside the grid)
+    static const uint16_t none = 0;
+    const void* data[CLUSTER_BUFFER_COUNT] = { texels.data(), clusterOffsets.data(), clusterLightList.empty() ? &none : clusterLightList.data() };
+    size_t bytes[CLUSTER_BUFFER_COUNT] = { texels.size() * sizeof(float), clusterOffsets.size() * sizeof(uint32_t),
+        std::max<size_t>(1, clusterLightList.size()) * sizeof(uint16_t) };
+    GLenum format[CLUSTER_BUFFER_COUNT] = { GL_RGBA32F, GL_R32UI, GL_R16UI };
+    for (int i = 0; i < CLUSTER_BUFFER_COUNT; ++i) {
+        glBindBuffer(GL_ARRAY_BUFFER, clusterBuffer[i]);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)bytes[i], data[i], GL_STREAM_DRAW);
+        glActiveTexture(GL_TEXTURE0 + 1 + i);
+        glBindTexture(GL_TEXTURE_BUFFER, clusterTex[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, format[i], clusterBuffer[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static void unbindClusters()
+{
+    for (int i = 0; i < CLUSTER_BUFFER_COUNT; ++i) {
+        glActiveTexture(GL_TEXTURE0 + 1 + i);
+        glBindTexture(GL_TEXTURE_BUFFER, 0);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Additive pass over the environment drawn this frame
+void drawPointLights(float time)
+{
+    if (pointLightCount == 0) return;
+    float mv[16], pr[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+    glGetFloatv(GL_PROJECTION_MATRIX, pr);
+    {
+        ProfileScope zone(PROF_LIGHT_BIN);
+        binLights(mv, pr, time);
+    }
+    if (frameLights.empty()) return;
+
+    ProfileScope zone(PROF_LIGHT_SHADE);
+    // The instanced base pass leaves no CPU batches; its light pass shades
+    // per fragment instead
+    bool instanced = envInstancing();
+    lightStream.clear();
+    if (!instanced) {
+        long long evaluated = shadeStream(treeStream, lightStream) + shadeStream(iceStream, lightStream);
+        profileCount(PROF_LIGHT_EVALS, evaluated);
+    }
+    size_t objectVerts = lightStream.size();
+    for (const PointLight& l : frameLights) appendGroundPool(lightStream, l);
+
+    glDisable(GL_LIGHTING);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glDepthMask(GL_FALSE);
+    glDepthFunc(GL_EQUAL); // same vertices as the base pass, so depths match exactly
+    if (instanced) {
+        uploadClusters();
+        float grid[4] = { (float)clusterX, (float)clusterY, (float)clusterZ, logf(clusterFar / clusterNear) };
+        for (int m = 0; m < ENV_MESH_COUNT; ++m) {
+            glUseProgram(envProgram[ENV_PASS_LIGHTS][m]);
+            glUniform4fv(envClusterGridLoc[m], 1, grid);
+            glUniform1f(envClusterNearLoc[m], clusterNear);
+        }
+        drawEnvInstances(ENV_PASS_LIGHTS, ENV_TREES, treeDrawList);
+        drawEnvInstances(ENV_PASS_LIGHTS, ENV_ICE, iceDrawList);
+        unbindClusters();
+    }
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    if (!lightStream.empty()) {
+        glVertexPointer(3, GL_FLOAT, sizeof(EnvVertex), lightStream[0].p);
+        glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(EnvVertex), lightStream[0].c);
+        if (objectVerts) glDrawArrays(GL_TRIANGLES, 0, (GLsizei)objectVerts);
+        glDepthFunc(GL_LEQUAL);
+        glPolygonOffset(-1.0f, -1.0f); // ground pools sit on the ground plane
+        glDrawArrays(GL_TRIANGLES, (GLint)objectVerts, (GLsizei)(lightStream.size() - objectVerts));
+    }
+    glPolygonOffset(1.0f, 1.0f);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+    glDisable(GL_BLEND);
+
+    // The lanterns themselves
+    glPointSize(5.0f);
+    glBegin(GL_POINTS);
+    for (const PointLight& l : frameLights) {
+        glColor3f(std::min(1.0f, l.r + 0.3f), std::min(1.0f, l.g + 0.3f), std::min(1.0f, l.b + 0.3f));
+        glVertex3f(l.x, l.y, l.z);
+    }
+    glEnd();
+    glPointSize(1.0f);
+    glEnable(GL_LIGHTING);
+}
+
+// Sweeps the light count and times binning and shading of the default
+// view's environment batches, without a GL context
+void benchLights()
+{
+    generateEnvironment();
+    rebuildEnvironmentInstances();
+    float mv[16], pr[16];
+    lookAtMatrix(-9.0f * sinf(0.436f) * cosf(0.262f), 4.0f + 9.0f * sinf(0.262f), 9.0f * cosf(0.436f) * cosf(0.262f),
+        0, 4.0f, 0, 1.0f, mv);
+    perspectiveMatrix(60.0f, 1.5f, 0.1f, 100.0f, pr);
+    treeStream.clear();
+    iceStream.clear();
+    for (const TreeInstance& t : treeInstances) appendTreeInstance(treeStream, t);
+    for (const IceInstance& b : iceInstances) appendScaledMesh(iceStream, iceUnitMesh, b.x, b.s / 2.f, b.z, b.s, b.solid);
+    printf("lights: %zu environment vertices\n", treeStream.size() + iceStream.size());
+    for (int count = 1; count <= 1024; count *= 2) {
+        pointLightCount = count;
+        const int reps = 20;
+        double binMs = 0, shadeMs = 0;
+        long long evaluated = 0;
+        for (int r = 0; r < reps; ++r) {
+            auto t0 = std::chrono::steady_clock::now();
+            binLights(mv, pr, r * 0.016f);
+            auto t1 = std::chrono::steady_clock::now();
+            lightStream.clear();
+            evaluated = shadeStream(treeStream, lightStream) + shadeStream(iceStream, lightStream);
+            auto t2 = std::chrono::steady_clock::now();
+            binMs += std::chrono::duration<double, std::milli>(t1 - t0).count();
+            shadeMs += std::chrono::duration<double, std::milli>(t2 - t1).count();
+        }
+        printf("lights: %4d total  %4zu visible  bin %.3f ms  shade %.3f ms  %.2f lights/vertex\n",
+            count, frameLights.size(), binMs / reps, shadeMs / reps,
+            (double)evaluated / std::max<size_t>(1, treeStream.size() + iceStream.size()));
+    }
+}
+
+// --- Tree impostors ---
+// Distant trees are drawn as one camera-facing textured quad each. The atlas
+// holds the reference tree at a few heights (columns) seen from a few
+// elevations (rows); width is scaled per tree by r, which is exact because
+// every horizontal extent of drawPineTree is proportional to r.
+float impostorDistance = 35.0f; // eye-space distance where trees become quads
+float impostorFadeBand = 6.0f;  // crossfade width in front of impostorDistance
+bool impostorsEnabled = true;
+
+const int impostorCell = 128;
+const int impostorHeights = 4;
+const int impostorElevations = 4;
+const float impostorElevationDeg[impostorElevations] = { 0.0f, 12.0f, 24.0f, 36.0f };
+const float impostorMinH = 2.6f, impostorMaxH = 5.5f;
+GLuint treeImpostorTex = 0;
+static float impostorBucketH[impostorHeights];
+static float impostorHalfSize[impostorHeights];
+static GLubyte stipplePatterns[17][128]; // ordered-dither masks, coverage = level/16
+
+static float treeTopY(float h) { return h * 0.93f + 1.0f; }
+
+static void buildStipplePatterns()
+{
+    const int bayer[4][4] = { {0,8,2,10}, {12,4,14,6}, {3,11,1,9}, {15,7,13,5} };
+    for (int level = 0; level <= 16; ++level) {
+        for (int y = 0; y < 32; ++y) {
+            for (int x = 0; x < 32; ++x) {
+                GLubyte& b = stipplePatterns[level][y * 4 + x / 8];
+                if (x % 8 == 0) b = 0;
+                if (bayer[y % 4][x % 4] < level) b |= 0x80 >> (x % 8);
+            }
+        }
+    }
+}
+
+// Renders every atlas cell into the corner of the back buffer and reads it
+// back, keying the clear colour out into alpha (the window has no alpha).
+void buildTreeImpostors()
+{
+    const int atlasW = impostorCell * impostorHeights, atlasH = impostorCell * impostorElevations;
+    std::vector<GLubyte> atlas(atlasW * atlasH * 4, 0);
+    std::vector<GLubyte> cell(impostorCell * impostorCell * 3);
+    buildStipplePatterns();
+
+    glClearColor(1.0f, 0.0f, 1.0f, 1.0f);
+    glViewport(0, 0, impostorCell, impostorCell);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    for (int hb = 0; hb < impostorHeights; ++hb) {
+        float h = impostorMinH + (hb + 0.5f) * (impostorMaxH - impostorMinH) / impostorHeights;
+        float top = treeTopY(h);
+        float maxTilt = sinf(impostorElevationDeg[impostorElevations - 1] * 3.1415926f / 180.0f);
+        float half = std::max(treeMaxRadius + 0.6f, 0.5f * (top + 2.0f * treeMaxRadius * maxTilt)) * 1.02f;
+        impostorBucketH[hb] = h;
+        impostorHalfSize[hb] = half;
+        for (int eb = 0; eb < impostorElevations; ++eb) {
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            glMatrixMode(GL_PROJECTION);
+            glLoadIdentity();
+            glOrtho(-half, half, -half, half, -50.0, 50.0);
+            glMatrixMode(GL_MODELVIEW);
+            glLoadIdentity();
+            glRotatef(impostorElevationDeg[eb], 1, 0, 0);
+            glTranslatef(0, -top / 2.0f, 0);
+            drawPineTree(h, treeMaxRadius);
+            glReadPixels(0, 0, impostorCell, impostorCell, GL_RGB, GL_UNSIGNED_BYTE, cell.data());
+            for (int y = 0; y < impostorCell; ++y) {
+                for (int x = 0; x < impostorCell; ++x) {
+                    const GLubyte* src = &cell[(y * impostorCell + x) * 3];
+                    GLubyte* dst = &atlas[((eb * impostorCell + y) * atlasW + hb * impostorCell + x) * 4];
+                    bool key = src[0] > 250 && src[1] < 5 && src[2] > 250;
+                    dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2];
+                    dst[3] = key ? 0 : 255;
+                }
+            }
+        }
+    }
+    glClearColor(0.83f, 0.92f, 1.0f, 1.0f);
+
+    glGenTextures(1, &treeImpostorTex);
+    glBindTexture(GL_TEXTURE_2D, treeImpostorTex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGBA, atlasW, atlasH, GL_RGBA, GL_UNSIGNED_BYTE, atlas.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    int w = glutGet(GLUT_WINDOW_WIDTH), hgt = glutGet(GLUT_WINDOW_HEIGHT);
+    glViewport(0, 0, w, hgt);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluPerspective(60.0, (double)w / std::max(hgt, 1), 0.1, 100.0);
+    glMatrixMode(GL_MODELVIEW);
+}
+
+// Emits one impostor quad; must be called inside glBegin(GL_QUADS)
+static void emitTreeImpostor(const Tree& t, float eyeX, float eyeY, float eyeZ)
+{
+    int hb = std::max(0, std::min(impostorHeights - 1,
+        (int)((t.h - impostorMinH) / (impostorMaxH - impostorMinH) * impostorHeights)));
+    float k = t.h / impostorBucketH[hb];
+    float half = impostorHalfSize[hb];
+    float cy = treeTopY(impostorBucketH[hb]) * 0.5f * k;
+
+    float dx = eyeX - t.x, dy = eyeY - cy, dz = eyeZ - t.z;
+    float horiz = std::sqrt(dx * dx + dz * dz);
+    if (horiz < 1e-4f) return;
+    dx /= horiz; dz /= horiz;
+    float elev = atan2f(dy, horiz);
+    float elevDeg = std::max(0.0f, elev * 180.0f / 3.1415926f);
+    int eb = 0;
+    for (int i = 1; i < impostorElevations; ++i)
+        if (std::fabs(impostorElevationDeg[i] - elevDeg) < std::fabs(impostorElevationDeg[eb] - elevDeg)) eb = i;
+
+    // Quad faces the eye: right is horizontal, up leans back by the elevation
+    float ce = cosf(std::max(0.0f, elev)), se = sinf(std::max(0.0f, elev));
+    float rx = -dz * half * (t.r / treeMaxRadius), rz = dx * half * (t.r / treeMaxRadius);
+    float ux = -dx * se * half * k, uy = ce * half * k, uz = -dz * se * half * k;
+    float u0 = (float)hb / impostorHeights, u1 = (float)(hb + 1) / impostorHeights;
+    float v0 = (float)eb / impostorElevations, v1 = (float)(eb + 1) / impostorElevations;
+    glTexCoord2f(u0, v0); glVertex3f(t.x - rx - ux, cy - uy, t.z - rz - uz);
+    glTexCoord2f(u1, v0); glVertex3f(t.x + rx - ux, cy - uy, t.z + rz - uz);
+    glTexCoord2f(u1, v1); glVertex3f(t.x + rx + ux, cy + uy, t.z + rz + uz);
+    glTexCoord2f(u0, v1); glVertex3f(t.x - rx + ux, cy + uy, t.z - rz + uz);
+}
+
+static void beginImpostors()
+{
+    glDisable(GL_LIGHTING);
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, treeImpostorTex);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glEnable(GL_ALPHA_TEST);
+    glAlphaFunc(GL_GREATER, 0.5f);
+    glColor3f(1, 1, 1);
+}
+
+static void endImpostors()
+{
+    glDisable(GL_ALPHA_TEST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisable(GL_TEXTURE_2D);
+    glEnable(GL_LIGHTING);
+}
+
+// Near trees get full geometry, far ones a single batched impostor pass.
+// Inside the fade band both are drawn through complementary stipple masks,
+// a screen-door crossfade that needs no sorting.
+void drawTrees(float eyeX, float eyeY, float eyeZ, float scale)
+{
+    if (instancesVersion != environmentVersion) rebuildEnvironmentInstances();
+    float fadeStart = impostorDistance - impostorFadeBand;
+    static std::vector<const Tree*> band;
+    band.clear();
+    treeDrawList.clear();
+    for (size_t i = 0; i < trees.size(); ++i) {
+        const Tree& t = trees[i];
+        if (!treeVisible[i]) continue;
+        float dx = t.x * scale - eyeX, dz = t.z * scale - eyeZ;
+        float d = std::sqrt(dx * dx + dz * dz);
+        if (impostorsEnabled && treeImpostorTex && d >= fadeStart) {
+            if (d < impostorDistance) band.push_back(&t);
+            continue;
+        }
+        treeDrawList.push_back((uint32_t)i);
+    }
+    if (envInstancing()) {
+        drawEnvInstances(ENV_PASS_BASE, ENV_TREES, treeDrawList);
+    } else {
+        treeStream.clear();
+        for (uint32_t i : treeDrawList) appendTreeInstance(treeStream, treeInstances[i]);
+        drawEnvStream(treeStream, GL_TRIANGLES);
+    }
+    if (!impostorsEnabled || !treeImpostorTex) return;
+
+    float objEyeX = eyeX / scale, objEyeY = eyeY / scale, objEyeZ = eyeZ / scale;
+    glEnable(GL_POLYGON_STIPPLE);
+    for (const Tree* t : band) {
+        float dx = t->x * scale - eyeX, dz = t->z * scale - eyeZ;
+        int level = (int)((std::sqrt(dx * dx + dz * dz) - fadeStart) / impostorFadeBand * 16.0f + 0.5f);
+        level = std::max(0, std::min(16, level));
+        GLubyte inverse[128];
+        for (int i = 0; i < 128; ++i) inverse[i] = (GLubyte)~stipplePatterns[level][i];
+        glPolygonStipple(inverse);
+        glPushMatrix();
+        glTranslatef(t->x, 0, t->z);
+        drawPineTree(t->h, t->r);
+        glPopMatrix();
+        glPolygonStipple(stipplePatterns[level]);
+        beginImpostors();
+        glBegin(GL_QUADS);
+        emitTreeImpostor(*t, objEyeX, objEyeY, objEyeZ);
+        glEnd();
+        endImpostors();
+    }
+    glDisable(GL_POLYGON_STIPPLE);
+
+    beginImpostors();
+    glBegin(GL_QUADS);
+    for (size_t i = 0; i < trees.size(); ++i) {
+        const Tree& t = trees[i];
+        float dx = t.x * scale - eyeX, dz = t.z * scale - eyeZ;
+        if (treeVisible[i] && dx * dx + dz * dz >= impostorDistance * impostorDistance)
+            emitTreeImpostor(t, objEyeX, objEyeY, objEyeZ);
+    }
+    glEnd();
+    endImpostors();
+}
+
+
+// --- Ground shadows ---
+// Trees and ice blocks never move, so they go into one static map that is
+// rebuilt only when environmentVersion changes. Snowmen and snowballs are
+// redrawn each frame into a small overlay map that follows the player, and
+// the two never stack. The per-frame cost depends on the overlay size and
+// dynamic casters only, never on the forest. 'j' toggles shadows.
+//
+// With GLSL and framebuffer objects both maps are depth textures rendered
+// from GL_LIGHT0's position, and a screen pass after the opaque scene
+// darkens every pixel either map occludes, so shadows fall on trees,
+// blocks and snowmen as well as the ground. Without them shadows are cast
+// onto the ground plane only: every caster is projected onto y = 0 and its
+// outline rasterised on the CPU into an alpha texture laid over the ground,
+// with texels the static map already darkens cleared from the overlay.
+const float shadowLight[3] = { 30.0f, 80.0f, 33.0f }; // matches initGL's GL_LIGHT0
+const GLubyte shadowStrength = 90;                    // alpha of a shadowed texel
+const float shadowStaticTexel = 0.125f;               // target world units per static texel
+const int shadowStaticMaxSize = 2048;
+const int shadowDynamicSize = 256;
+const float shadowDynamicSpan = 32.0f;                // world units covered by the overlay
+bool shadowsEnabled = true;
+
+struct ShadowMap {
+    std::vector<GLubyte> texels; // size * size, row = z
+    int size = 0;
+    float originX = 0, originZ = 0, texel = 1;
+    GLuint tex = 0;
+};
+ShadowMap shadowStatic, shadowDynamic;
+static int shadowStaticVersion = -1;
+static bool shadowStaticUploaded = false;
+
+struct ShadowPoint { float x, z; };
+
+static void shadowProject(float x, float y, float z, float& px, float& pz)
+{
+    float t = shadowLight[1] / std::max(shadowLight[1] - y, 1e-3f);
+    px = shadowLight[0] + (x - shadowLight[0]) * t;
+    pz = shadowLight[2] + (z - shadowLight[2]) * t;
+}
+
+// Fills a convex polygon (world x/z, either winding) a texel row at a time
+static void shadowFillConvex(ShadowMap& m, const ShadowPoint* poly, int n)
+{
+    float inv = 1.0f / m.texel, minZ = 1e30f, maxZ = -1e30f;
+    ShadowPoint q[32];
+    for (int i = 0; i < n; ++i) {
+        q[i].x = (poly[i].x - m.originX) * inv;
+        q[i].z = (poly[i].z - m.originZ) * inv;
+        minZ = std::min(minZ, q[i].z);
+        maxZ = std::max(maxZ, q[i].z);
+    }
+    int z0 = std::max(0, (int)std::ceil(minZ - 0.5f)), z1 = std::min(m.size - 1, (int)std::floor(maxZ - 0.5f));
+    for (int z = z0; z <= z1; ++z) {
+        float pz = z + 0.5f, left = 1e30f, right = -1e30f;
+        for (int i = 0; i < n; ++i) {
+            const ShadowPoint& a = q[i];
+            const ShadowPoint& b = q[(i + 1) % n];
+            if ((a.z > pz) == (b.z > pz)) continue;
+            float x = a.x + (pz - a.z) / (b.z - a.z) * (b.x - a.x);
+            left = std::min(left, x);
+            right = std::max(right, x);
+        }
+        int x0 = std::max(0, (int)std::ceil(left - 0.5f)), x1 = std::min(m.size - 1, (int)std::floor(right - 0.5f));
+        if (x0 <= x1) memset(&m.texels[(size_t)z * m.size + x0], shadowStrength, x1 - x0 + 1);
+    }
+}
+
+// The shadow of a convex caster is the convex hull of its projected
+// corners; n <= 16
+static void shadowFillHull(ShadowMap& m, ShadowPoint* p, int n)
+{
+    std::sort(p, p + n, [](const ShadowPoint& a, const ShadowPoint& b) { return a.x < b.x || (a.x == b.x && a.z < b.z); });
+    auto cross = [](const ShadowPoint& o, const ShadowPoint& a, const ShadowPoint& b) {
+        return (a.x - o.x) * (b.z - o.z) - (a.z - o.z) * (b.x - o.x);
+    };
+    ShadowPoint hull[32];
+    int k = 0;
+    for (int i = 0; i < n; ++i) { // lower chain, then upper
+        while (k >= 2 && cross(hull[k - 2], hull[k - 1], p[i]) <= 0) --k;
+        hull[k++] = p[i];
+    }
+    for (int i = n - 2, lower = k + 1; i >= 0; --i) {
+        while (k >= lower && cross(hull[k - 2], hull[k - 1], p[i]) <= 0) --k;
+        hull[k++] = p[i];
+    }
+    if (k > 3) shadowFillConvex(m, hull, k - 1); // the last point repeats the first
+}
+
+// A box spun by headingDeg about y, resting at height y0
+static void shadowCastBox(ShadowMap& m, float x, float y0, float z, float half, float height, float headingDeg)
+{
+    float rad = headingDeg * 3.1415926f / 180.0f, c = cosf(rad) * half, s = sinf(rad) * half;
+    ShadowPoint p[8];
+    for (int i = 0; i < 8; ++i) {
+        float lx = (i & 1) ? 1.0f : -1.0f, lz = (i & 4) ? 1.0f : -1.0f;
+        shadowProject(x + lx * c + lz * s, y0 + ((i & 2) ? height : 0.0f), z - lx * s + lz * c, p[i].x, p[i].z);
+    }
+    shadowFillHull(m, p, 8);
+}
+
+// Cone and trunk as drawPineTree lays them out
+static void shadowCastTree(ShadowMap& m, const Tree& t)
+{
+    const int slices = 12;
+    float by = t.h * 0.15f + 1.0f, bz = t.z - t.h * 0.1f;
+    ShadowPoint p[slices + 1];
+    for (int i = 0; i < slices; ++i) {
+        float a = i * 2.0f * 3.1415926f / slices;
+        shadowProject(t.x + cosf(a) * t.r, by, bz + sinf(a) * t.r, p[i].x, p[i].z);
+    }
+    shadowProject(t.x, by + t.h * 0.78f, bz, p[slices].x, p[slices].z);
+    shadowFillHull(m, p, slices + 1);
+    shadowCastBox(m, t.x, t.h * 0.15f, t.z, t.r * 0.16f, t.h * 0.3f, 0.0f);
+}
+
+// Base, body and head cubes of drawSnowman, as (y0, half, height)
+const float snowmanShadowBoxes[3][3] = { { 0.0f, 1.0f, 2.0f }, { 1.88f, 0.75f, 1.5f }, { 3.14f, 0.55f, 1.1f } };
+
+static void shadowCastSnowman(ShadowMap& m, float x, float z, float heading)
+{
+    for (const float* b : snowmanShadowBoxes) shadowCastBox(m, x, b[0], z, b[1], b[2], heading);
+}
+
+// Sizes the static map to every caster's shadow; returns the tallest top
+static float layoutStaticShadows(ShadowMap& m)
+{
+    float minX = 1e30f, minZ = 1e30f, maxX = -1e30f, maxZ = -1e30f;
+    auto grow = [&](float x, float y, float z) {
+        float px, pz;
+        shadowProject(x, y, z, px, pz);
+        minX = std::min(minX, std::min(x, px)); maxX = std::max(maxX, std::max(x, px));
+        minZ = std::min(minZ, std::min(z, pz)); maxZ = std::max(maxZ, std::max(z, pz));
+    };
+    float top = 0.0f;
+    for (const Tree& t : trees) {
+        grow(t.x, treeTopY(t.h), t.z - t.h * 0.1f);
+        top = std::max(top, treeTopY(t.h));
+    }
+    for (const IceBlock& b : iceblocks) {
+        grow(b.x, b.s, b.z);
+        top = std::max(top, b.s);
+    }
+    if (minX > maxX) { minX = minZ = -1.0f; maxX = maxZ = 1.0f; }
+    float span = std::max(maxX - minX, maxZ - minZ) + 2.0f * treeMaxRadius + 4.0f;
+    int size = 64;
+    while (size < shadowStaticMaxSize && span / size > shadowStaticTexel) size *= 2;
+    m.size = size;
+    m.texel = span / size;
+    m.originX = (minX + maxX - span) * 0.5f;
+    m.originZ = (minZ + maxZ - span) * 0.5f;
+    return top;
+}
+
+// Lays out the static map and rasterises every caster into it
+void rasterStaticShadows()
+{
+    ShadowMap& m = shadowStatic;
+    layoutStaticShadows(m);
+    m.texels.assign((size_t)m.size * m.size, 0);
+    for (const Tree& t : trees) shadowCastTree(m, t);
+    for (const IceBlock& b : iceblocks) shadowCastBox(m, b.x, 0.0f, b.z, b.s * 0.5f, b.s, 0.0f);
+    shadowStaticVersion = environmentVersion;
+    shadowStaticUploaded = false;
+}
+
+// Overlay around (x, z): snowmen and snowballs, minus what the static map covers
+void rasterDynamicShadows(float x, float z)
+{
+    ShadowMap& m = shadowDynamic;
+    m.size = shadowDynamicSize;
+    m.texel = shadowDynamicSpan / shadowDynamicSize;
+    // Snapped to whole texels so edges don't crawl as the player walks
+    m.originX = std::floor((x - shadowDynamicSpan * 0.5f) / m.texel) * m.texel;
+    m.originZ = std::floor((z - shadowDynamicSpan * 0.5f) / m.texel) * m.texel;
+    m.texels.assign((size_t)m.size * m.size, 0);
+    float x0 = m.originX - 8.0f, x1 = m.originX + shadowDynamicSpan + 8.0f;
+    float z0 = m.originZ - 8.0f, z1 = m.originZ + shadowDynamicSpan + 8.0f;
+    auto inReach = [&](float px, float pz) { return px > x0 && px < x1 && pz > z0 && pz < z1; };
+
+    shadowCastSnowman(m, snowmanX, snowmanZ, headingDeg);
+    for (const NavAgent& a : navAgents)
+        if (inReach(a.x, a.z)) shadowCastSnowman(m, a.x, a.z, a.heading);
+    float inv = 1.0f / m.texel;
+    for (size_t i = 0; i < snowballs.size(); ++i) {
+        float px, pz;
+        shadowProject(snowballs.x[i], snowballs.y[i], snowballs.z[i], px, pz);
+        int cx = (int)((px - m.originX) * inv), cz = (int)((pz - m.originZ) * inv);
+        if (cx < 0 || cz < 0 || cx >= m.size - 1 || cz >= m.size - 1) continue;
+        GLubyte* t = &m.texels[(size_t)cz * m.size + cx];
+        t[0] = t[1] = t[m.size] = t[m.size + 1] = shadowStrength;
+    }
+
+    const ShadowMap& st = shadowStatic;
+    if (st.size == 0) return;
+    float sInv = 1.0f / st.texel;
+    int column[shadowDynamicSize]; // static texel column of each overlay column, -1 outside
+    for (int xi = 0; xi < m.size; ++xi) {
+        int sx = (int)std::floor((m.originX + (xi + 0.5f) * m.texel - st.originX) * sInv);
+        column[xi] = sx >= 0 && sx < st.size ? sx : -1;
+    }
+    for (int zi = 0; zi < m.size; ++zi) {
+        int sz = (int)std::floor((m.originZ + (zi + 0.5f) * m.texel - st.originZ) * sInv);
+        if (sz < 0 || sz >= st.size) continue;
+        const GLubyte* srow = &st.texels[(size_t)sz * st.size];
+        GLubyte* row = &m.texels[(size_t)zi * m.size];
+        for (int xi = 0; xi < m.size; ++xi)
+            if (row[xi] && column[xi] >= 0 && srow[column[xi]]) row[xi] = 0;
+    }
+}
+
+static void uploadShadowMap(ShadowMap& m, bool full)
+{
+    if (!m.tex) {
+        glGenTextures(1, &m.tex);
+        full = true;
+    }
+    glBindTexture(GL_TEXTURE_2D, m.tex);
+    if (full) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, m.size, m.size, 0, GL_ALPHA, GL_UNSIGNED_BYTE, m.texels.data());
+    }
+    else glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m.size, m.size, GL_ALPHA, GL_UNSIGNED_BYTE, m.texels.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+static void drawShadowQuad(const ShadowMap& m)
+{
+    float span = m.size * m.texel, y = -0.01f; // just above the ground tiles
+    glBindTexture(GL_TEXTURE_2D, m.tex);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 0); glVertex3f(m.originX, y, m.originZ);
+    glTexCoord2f(0, 1); glVertex3f(m.originX, y, m.originZ + span);
+    glTexCoord2f(1, 1); glVertex3f(m.originX + span, y, m.originZ + span);
+    glTexCoord2f(1, 0); glVertex3f(m.originX + span, y, m.originZ);
+    glEnd();
+}
+
+// Depth map as seen from the light. The light looks straight down with a
+// frustum through the map's ground footprint, so a texel covers the same
+// ground as in the planar map
+struct ShadowDepthMap {
+    GLuint tex = 0, fbo = 0;
+    int size = 0;
+    float texel = 1;  // world units per texel on the ground
+    float light[16];  // world to light clip space
+};
+ShadowDepthMap shadowStaticDepth, shadowDynamicDepth;
+static int shadowStaticDepthVersion = -1;
+static GLuint shadowResolveProgram = 0, shadowSceneDepth = 0;
+static int shadowSceneWidth = 0, shadowSceneHeight = 0;
+static GLint shadowToWorldLoc = -1, shadowEyeLoc = -1, shadowViewportLoc = -1, shadowTexelLoc = -1;
+static GLint shadowStaticLightLoc = -1, shadowDynamicLightLoc = -1;
+static bool shadowMapsTried = false, shadowMapsPending = false;
+static float shadowToWorld[16], shadowEye[3];
+
+// World position from scene depth, then the lower of the two maps'
+// lit factors. The normal comes from the neighbouring pixels, taking the
+// shorter step on each axis so silhouettes don't bend it. Each lookup is
+// pushed out along it by a texel to keep surfaces from shadowing
+// themselves; faces turned away from the light are already dark and are
+// left alone
+static const char* shadowResolveSrc =
+    "uniform sampler2D sceneDepth;\n"
+    "uniform sampler2DShadow staticMap, dynamicMap;\n"
+    "uniform mat4 toWorld, staticLight, dynamicLight;\n"
+    "uniform vec3 eye, lightPos;\n"
+    "uniform vec4 viewport;\n"
+    "uniform vec2 texel;\n" // world units per texel of the static and dynamic maps
+    "uniform float strength;\n"
+    "float lit(sampler2DShadow map, mat4 light, vec3 p) {\n"
+    "    vec4 c = light * vec4(p, 1.0);\n"
+    "    vec3 s = c.xyz / c.w * 0.5 + 0.5;\n"
+    "    if (any(lessThan(s, vec3(0.0))) || any(greaterThan(s, vec3(1.0)))) return 1.0;\n"
+    "    return texture(map, s);\n"
+    "}\n"
+    "vec3 worldAt(vec2 at) {\n"
+    "    float d = texelFetch(sceneDepth, clamp(ivec2(at), ivec2(0), ivec2(viewport.zw) - 1), 0).r;\n"
+    "    vec4 w = toWorld * vec4(at / viewport.zw * 2.0 - 1.0, d * 2.0 - 1.0, 1.0);\n"
+    "    return w.xyz / w.w;\n"
+    "}\n"
+    "vec3 shorter(vec3 a, vec3 b) { return dot(a, a) < dot(b, b) ? a : b; }\n"
+    "void main() {\n"
+    "    vec2 at = gl_FragCoord.xy - viewport.xy;\n"
+    "    if (texelFetch(sceneDepth, ivec2(at), 0).r >= 1.0) discard;\n"
+    "    vec3 p = worldAt(at);\n"
+    "    vec3 dx = shorter(p - worldAt(at - vec2(1.0, 0.0)), worldAt(at + vec2(1.0, 0.0)) - p);\n"
+    "    vec3 dy = shorter(p - worldAt(at - vec2(0.0, 1.0)), worldAt(at + vec2(0.0, 1.0)) - p);\n"
+    "    vec3 n = normalize(cross(dx, dy));\n"
+    "    if (dot(n, eye - p) < 0.0) n = -n;\n"
+    "    if (dot(n, normalize(lightPos - p)) <= 0.0) discard;\n"
+    "    float k = min(lit(staticMap, staticLight, p + n * texel.x), lit(dynamicMap, dynamicLight, p + n * texel.y));\n"
+    "    gl_FragColor = vec4(0.0, 0.0, 0.0, (1.0 - k) * strength);\n"
+    "}\n";
+
+static bool shadowMapsAvailable()
+{
+    if (glCaptureActive) return false; // capture records the planar path
+    if (!shadowMapsTried) {
+        shadowMapsTried = true;
+        if (!glHasFramebuffers) return false;
+        std::string fs = std::string(envShaderVersion) + shadowResolveSrc;
+        shadowResolveProgram = buildGLProgram("shadow resolve", nullptr, fs.c_str());
+        if (!shadowResolveProgram) return false;
+        glUseProgram(shadowResolveProgram);
+        glUniform1i(glGetUniformLocation(shadowResolveProgram, "sceneDepth"), 0);
+        glUniform1i(glGetUniformLocation(shadowResolveProgram, "staticMap"), 1);
+        glUniform1i(glGetUniformLocation(shadowResolveProgram, "dynamicMap"), 2);
+        glUniform3fv(glGetUniformLocation(shadowResolveProgram, "lightPos"), 1, shadowLight);
+        glUniform1f(glGetUniformLocation(shadowResolveProgram, "strength"), shadowStrength / 255.0f);
+        glUseProgram(0);
+        shadowToWorldLoc = glGetUniformLocation(shadowResolveProgram, "toWorld");
+        shadowStaticLightLoc = glGetUniformLocation(shadowResolveProgram, "staticLight");
+        shadowDynamicLightLoc = glGetUniformLocation(shadowResolveProgram, "dynamicLight");
+        shadowEyeLoc = glGetUniformLocation(shadowResolveProgram, "eye");
+        shadowViewportLoc = glGetUniformLocation(shadowResolveProgram, "viewport");
+        shadowTexelLoc = glGetUniformLocation(shadowResolveProgram, "texel");
+    }
+    return shadowResolveProgram != 0;
+}
+
+// Light clip space for a map whose ground footprint starts at (x0, z0) and
+// spans `span`, with casters reaching up to `top`
+static void shadowLightMatrix(float x0, float z0, float span, float top, float out[16])
+{
+    const float* L = shadowLight;
+    float n = std::max(0.5f, L[1] - top - 1.0f), f = L[1] + 1.0f, k = n / L[1];
+    float l = (x0 - L[0]) * k, r = (x0 + span - L[0]) * k;
+    float b = (L[2] - z0 - span) * k, t = (L[2] - z0) * k;
+    float proj[16] = {
+        2 * n / (r - l), 0, 0, 0,
+        0, 2 * n / (t - b), 0, 0,
+        (r + l) / (r - l), (t + b) / (t - b), -(f + n) / (f - n), -1,
+        0, 0, -2 * f * n / (f - n), 0 };
+    // Looking down -y with -z up: eye = (x - lx, lz - z, y - ly)
+    float view[16] = {
+        1, 0, 0, 0,
+        0, 0, 1, 0,
+        0, -1, 0, 0,
+        -L[0], L[2], -L[1], 1 };
+    multiplyMatrix(proj, view, out);
+}
+
+// (Re)allocates m's depth texture and framebuffer at size x size
+static bool shadowDepthTarget(ShadowDepthMap& m, int size)
+{
+    if (m.tex && m.size == size) return true;
+    if (!m.tex) {
+        glGenTextures(1, &m.tex);
+        glGenFramebuffers(1, &m.fbo);
+    }
+    glBindTexture(GL_TEXTURE_2D, m.tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, m.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m.tex, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    m.size = size;
+    return complete;
+}
+
+// Depth-only rendering into m with its light matrix; endShadowDepth
+// restores the window's framebuffer, viewport and matrices
+static void beginShadowDepth(const ShadowDepthMap& m)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, m.fbo);
+    glViewport(0, 0, m.size, m.size);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadMatrixf(m.light);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glDisable(GL_LIGHTING);
+    glPolygonOffset(2.0f, 4.0f); // slope-scaled, against acne on steep faces
+}
+
+static void endShadowDepth(const GLint viewport[4])
+{
+    glPolygonOffset(1.0f, 1.0f);
+    glEnable(GL_LIGHTING);
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
+// Trees and ice blocks, once per environment change
+static void renderStaticShadowDepth(const GLint viewport[4])
+{
+    ShadowMap& layout = shadowStatic;
+    float top = layoutStaticShadows(layout);
+    ShadowDepthMap& m = shadowStaticDepth;
+    shadowStaticDepthVersion = environmentVersion;
+    if (!shadowDepthTarget(m, layout.size)) return;
+    m.texel = layout.texel;
+    shadowLightMatrix(layout.originX, layout.originZ, layout.size * layout.texel, top, m.light);
+    if (instancesVersion != environmentVersion) rebuildEnvironmentInstances();
+    std::vector<EnvVertex> casters;
+    for (const TreeInstance& t : treeInstances) appendTreeInstance(casters, t);
+    for (const IceInstance& b : iceInstances) appendScaledMesh(casters, iceUnitMesh, b.x, b.s / 2.f, b.z, b.s, b.solid);
+    beginShadowDepth(m);
+    if (!casters.empty()) {
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(3, GL_FLOAT, sizeof(EnvVertex), casters[0].p);
+        glDrawArrays(GL_TRIANGLES, 0, (GLsizei)casters.size());
+        glDisableClientState(GL_VERTEX_ARRAY);
+    }
+    endShadowDepth(viewport);
+}
+
+// A box spun by headingDeg about y, resting at height y0 (see shadowCastBox)
+static void shadowDepthBox(float x, float y0, float z, float half, float height, float headingDeg)
+{
+    static const int faces[6][4] = { { 0, 1, 3, 2 }, { 4, 6, 7, 5 }, { 0, 2, 6, 4 }, { 1, 5, 7, 3 }, { 0, 4, 5, 1 }, { 2, 3, 7, 6 } };
+    float rad = headingDeg * 3.1415926f / 180.0f, c = cosf(rad) * half, s = sinf(rad) * half;
+    float p[8][3];
+    for (int i = 0; i < 8; ++i) {
+        float lx = (i & 1) ? 1.0f : -1.0f, lz = (i & 4) ? 1.0f : -1.0f;
+        p[i][0] = x + lx * c + lz * s; p[i][1] = y0 + ((i & 2) ? height : 0.0f); p[i][2] = z - lx * s + lz * c;
+    }
+    for (const int* f : faces)
+        for (int k = 0; k < 4; ++k) glVertex3fv(p[f[k]]);
+}
+
+// Snowmen and snowballs around (x, z), every frame
+static void renderDynamicShadowDepth(float x, float z, const GLint viewport[4])
+{
+    ShadowDepthMap& m = shadowDynamicDepth;
+    if (!shadowDepthTarget(m, shadowDynamicSize)) return;
+    m.texel = shadowDynamicSpan / shadowDynamicSize;
+    // Snapped to whole texels so edges don't crawl as the player walks
+    float x0 = std::floor((x - shadowDynamicSpan * 0.5f) / m.texel) * m.texel;
+    float z0 = std::floor((z - shadowDynamicSpan * 0.5f) / m.texel) * m.texel;
+    float top = snowmanShadowBoxes[2][0] + snowmanShadowBoxes[2][2];
+    for (size_t i = 0; i < snowballs.size(); ++i) top = std::max(top, snowballs.y[i] + snowballRadius);
+    shadowLightMatrix(x0, z0, shadowDynamicSpan, top, m.light);
+    float rx0 = x0 - 8.0f, rx1 = x0 + shadowDynamicSpan + 8.0f, rz0 = z0 - 8.0f, rz1 = z0 + shadowDynamicSpan + 8.0f;
+    auto inReach = [&](float px, float pz) { return px > rx0 && px < rx1 && pz > rz0 && pz < rz1; };
+
+    beginShadowDepth(m);
+    glBegin(GL_QUADS);
+    auto snowman = [&](float sx, float sz, float heading) {
+        for (const float* b : snowmanShadowBoxes) shadowDepthBox(sx, b[0], sz, b[1], b[2], heading);
+    };
+    snowman(snowmanX, snowmanZ, headingDeg);
+    for (const NavAgent& a : navAgents)
+        if (inReach(a.x, a.z)) snowman(a.x, a.z, a.heading);
+    glEnd();
+    glPointSize(std::max(1.0f, 2.0f * snowballRadius / m.texel));
+    glBegin(GL_POINTS);
+    for (size_t i = 0; i < snowballs.size(); ++i)
+        if (inReach(snowballs.x[i], snowballs.z[i])) glVertex3f(snowballs.x[i], snowballs.y[i], snowballs.z[i]);
+    glEnd();
+    glPointSize(1.0f);
+    endShadowDepth(viewport);
+}
+
+// Darkens the opaque scene drawn since drawShadows where either depth map
+// occludes it; a no-op unless drawShadows took the depth-map path
+void resolveShadows()
+{
+    if (!shadowMapsPending) return;
+    shadowMapsPending = false;
+    ProfileScope zone(PROF_SHADOWS);
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    if (!shadowSceneDepth) {
+        glGenTextures(1, &shadowSceneDepth);
+        glBindTexture(GL_TEXTURE_2D, shadowSceneDepth);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    glBindTexture(GL_TEXTURE_2D, shadowSceneDepth);
+    if (viewport[2] != shadowSceneWidth || viewport[3] != shadowSceneHeight) {
+        shadowSceneWidth = viewport[2];
+        shadowSceneHeight = viewport[3];
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, shadowSceneWidth, shadowSceneHeight, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+    }
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, viewport[0], viewport[1], viewport[2], viewport[3]);
+    glActiveTexture(GL_TEXTURE0 + 1);
+    glBindTexture(GL_TEXTURE_2D, shadowStaticDepth.tex);
+    glActiveTexture(GL_TEXTURE0 + 2);
+    glBindTexture(GL_TEXTURE_2D, shadowDynamicDepth.tex);
+    glActiveTexture(GL_TEXTURE0);
+
+    glUseProgram(shadowResolveProgram);
+    float vp[4] = { (float)viewport[0], (float)viewport[1], (float)viewport[2], (float)viewport[3] };
+    float texel[2] = { shadowStaticDepth.texel, shadowDynamicDepth.texel };
+    glUniformMatrix4fv(shadowToWorldLoc, 1, GL_FALSE, shadowToWorld);
+    glUniformMatrix4fv(shadowStaticLightLoc, 1, GL_FALSE, shadowStaticDepth.light);
+    glUniformMatrix4fv(shadowDynamicLightLoc, 1, GL_FALSE, shadowDynamicDepth.light);
+    glUniform3fv(shadowEyeLoc, 1, shadowEye);
+    glUniform4fv(shadowViewportLoc, 1, vp);
+    glUniform2fv(shadowTexelLoc, 1, texel);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glBegin(GL_QUADS);
+    glVertex2f(-1, -1); glVertex2f(1, -1); glVertex2f(1, 1); glVertex2f(-1, 1);
+    glEnd();
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_LIGHTING);
+    glUseProgram(0);
+    for (int unit = 2; unit >= 0; --unit) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+}
+
+// Called after the ground is drawn and before anything standing on it, in
+// the space the environment is drawn in
+void drawShadows()
+{
+    if (!shadowsEnabled) return;
+    ProfileScope zone(PROF_SHADOWS);
+    if (shadowMapsAvailable()) {
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        if (shadowStaticDepthVersion != environmentVersion) renderStaticShadowDepth(viewport);
+        renderDynamicShadowDepth(snowmanX, snowmanZ, viewport);
+        float mv[16], pr[16], clip[16], eyeToWorld[16];
+        glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+        glGetFloatv(GL_PROJECTION_MATRIX, pr);
+        multiplyMatrix(pr, mv, clip);
+        shadowMapsPending = invertMatrix(clip, shadowToWorld) && invertMatrix(mv, eyeToWorld);
+        memcpy(shadowEye, eyeToWorld + 12, sizeof(shadowEye));
+        return;
+    }
+    if (shadowStaticVersion != environmentVersion) rasterStaticShadows();
+    if (!shadowStaticUploaded) {
+        uploadShadowMap(shadowStatic, true);
+        shadowStaticUploaded = true;
+    }
+    int dynamicSize = shadowDynamic.size;
+    rasterDynamicShadows(snowmanX, snowmanZ);
+    uploadShadowMap(shadowDynamic, dynamicSize != shadowDynamic.size);
+
+    glDisable(GL_LIGHTING);
+    glEnable(GL_TEXTURE_2D);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glDepthMask(GL_FALSE);
+    glColor3f(0.0f, 0.0f, 0.0f);
+    drawShadowQuad(shadowStatic);
+    drawShadowQuad(shadowDynamic);
+    glDepthMask(GL_TRUE);
+    glDisable(GL_BLEND);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisable(GL_TEXTURE_2D);
+    glEnable(GL_LIGHTING);
+}
+
+// Static build and per-frame overlay cost as the forest grows, with the
+// same dynamic load (player, 64 agents, 2000 snowballs) each time
+void benchShadows()
+{
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<float> ring(-12.0f, 12.0f), up(0.5f, 6.0f);
+    navAgents.clear();
+    for (int i = 0; i < 64; ++i) navAgents.push_back({ ring(rng), ring(rng), ring(rng) * 15.0f, 0.0f, 0.0f });
+    snowballs = SnowballSoA();
+    for (int i = 0; i < 2000; ++i) throwSnowball(ring(rng), up(rng), ring(rng), 0, 0, 0, 0);
+    const int counts[3] = { 38, 1500, 20000 };
+    for (int treeCount : counts) {
+        EnvironmentParams p;
+        p.treeCount = treeCount;
+        p.iceCount = treeCount / 4;
+        p.extent = std::max(45.0f, std::sqrt((float)treeCount) * 3.0f);
+        generateEnvironment(p, trees, iceblocks);
+        ++environmentVersion;
+        auto t0 = std::chrono::steady_clock::now();
+        rasterStaticShadows();
+        double staticMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        const int frames = 200;
+        t0 = std::chrono::steady_clock::now();
+        for (int f = 0; f < frames; ++f) rasterDynamicShadows(f * 0.05f, 0.0f);
+        double dynamicMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count() / frames;
+        printf("shadows: %5zu trees %4zu ice  static map %dx%d rebuilt in %.2f ms (once per change)  overlay %.3f ms/frame\n",
+            trees.size(), iceblocks.size(), shadowStatic.size, shadowStatic.size, staticMs, dynamicMs);
+    }
+}
+
+// --- Voxel world ---
+// Sparse 16^3 chunks; each stores a palette of block types plus packed
+// per-cell indices (0 bits while the chunk is uniform). Meshes are built on
+// worker threads with face culling and greedy merging, and an edit remeshes
+// its chunk plus any neighbour that shares the edited face.
+enum VoxelBlock { VOX_AIR, VOX_SNOW, VOX_PACKED_SNOW, VOX_ICE, VOX_WOOD, VOX_COUNT };
+const GLubyte voxelColors[VOX_COUNT][4] = {
+    { 0, 0, 0, 0 }, { 245, 248, 255, 255 }, { 214, 226, 240, 255 }, { 150, 200, 235, 255 }, { 115, 74, 26, 255 },
+};
+const int voxelChunkSize = 16;
+const int voxelPad = voxelChunkSize + 2; // a chunk plus one cell of each neighbour
+
+struct VoxelChunk {
+    std::vector<uint8_t> palette = std::vector<uint8_t>(1, VOX_AIR);
+    std::vector<uint64_t> packed;
+    int bitsPer = 0;
+    unsigned version = 1;       // bumped by every edit
+    unsigned meshedVersion = 0; // version the current mesh was built from
+    bool dirty = true;
+    std::vector<EnvVertex> mesh;
+
+    uint8_t get(int i) const
+    {
+        if (bitsPer == 0) return palette[0];
+        int perWord = 64 / bitsPer;
+        return palette[(packed[i / perWord] >> ((i % perWord) * bitsPer)) & ((1u << bitsPer) - 1)];
+    }
+    void setIndex(int i, unsigned idx)
+    {
+        int perWord = 64 / bitsPer, shift = (i % perWord) * bitsPer;
+        uint64_t& w = packed[i / perWord];
+        w = (w & ~(((uint64_t(1) << bitsPer) - 1) << shift)) | (uint64_t(idx) << shift);
+    }
+    void set(int i, uint8_t block)
+    {
+        unsigned idx = (unsigned)(std::find(palette.begin(), palette.end(), block) - palette.begin());
+        if (idx == palette.size()) {
+            palette.push_back(block);
+            if (palette.size() > (1u << bitsPer)) {
+                // Widen to the next power-of-two bit count so no index straddles a word
+                std::vector<uint8_t> cells(voxelChunkSize * voxelChunkSize * voxelChunkSize);
+                for (int c = 0; c < (int)cells.size(); ++c) cells[c] = (uint8_t)(bitsPer ? get(c) : 0);
+                if (bitsPer == 0) std::fill(cells.begin(), cells.end(), palette[0]);
+                int bits = bitsPer == 0 ? 1 : bitsPer * 2;
+                std::vector<uint8_t> order = palette;
+                bitsPer = bits;
+                packed.assign((cells.size() + 64 / bits - 1) / (64 / bits), 0);
+                for (int c = 0; c < (int)cells.size(); ++c)
+                    setIndex(c, (unsigned)(std::find(order.begin(), order.end(), cells[c]) - order.begin()));
+            }
+        }
+        if (bitsPer) setIndex(i, idx);
+    }
+};
+
+std::unordered_map<int64_t, std::unique_ptr<VoxelChunk>> voxelChunks;
+std::vector<int64_t> voxelDirty;
+
+int voxelFloorDiv(int v) { return v >= 0 ? v / voxelChunkSize : -((-v + voxelChunkSize - 1) / voxelChunkSize); }
+
+int64_t voxelKey(int cx, int cy, int cz)
+{
+    return ((int64_t)(cx & 0x1fffff) << 42) | ((int64_t)(cy & 0x1fffff) << 21) | (int64_t)(cz & 0x1fffff);
+}
+
+void voxelKeyCoords(int64_t key, int& cx, int& cy, int& cz)
+{
+    auto unpack = [](int64_t v) { int i = (int)(v & 0x1fffff); return i >= 0x100000 ? i - 0x200000 : i; };
+    cx = unpack(key >> 42); cy = unpack(key >> 21); cz = unpack(key);
+}
+
+VoxelChunk* voxelFindChunk(int cx, int cy, int cz)
+{
+    auto it = voxelChunks.find(voxelKey(cx, cy, cz));
+    return it == voxelChunks.end() ? nullptr : it->second.get();
+}
+
+int voxelCellIndex(int lx, int ly, int lz) { return (ly * voxelChunkSize + lz) * voxelChunkSize + lx; }
+
+uint8_t voxelGet(int x, int y, int z)
+{
+    int cx = voxelFloorDiv(x), cy = voxelFloorDiv(y), cz = voxelFloorDiv(z);
+    const VoxelChunk* c = voxelFindChunk(cx, cy, cz);
+    if (!c) return VOX_AIR;
+    return c->get(voxelCellIndex(x - cx * voxelChunkSize, y - cy * voxelChunkSize, z - cz * voxelChunkSize));
+}
+
+void voxelMarkDirty(int cx, int cy, int cz)
+{
+    VoxelChunk* c = voxelFindChunk(cx, cy, cz);
+    if (!c) return;
+    ++c->version;
+    if (!c->dirty) voxelDirty.push_back(voxelKey(cx, cy, cz));
+    c->dirty = true;
+}
+
+void voxelSet(int x, int y, int z, uint8_t block)
+{
+    int cx = voxelFloorDiv(x), cy = voxelFloorDiv(y), cz = voxelFloorDiv(z);
+    int lx = x - cx * voxelChunkSize, ly = y - cy * voxelChunkSize, lz = z - cz * voxelChunkSize;
+    std::unique_ptr<VoxelChunk>& slot = voxelChunks[voxelKey(cx, cy, cz)];
+    if (!slot) {
+        if (block == VOX_AIR) return;
+        slot.reset(new VoxelChunk());
+        voxelDirty.push_back(voxelKey(cx, cy, cz));
+    }
+    int i = voxelCellIndex(lx, ly, lz);
+    if (slot->get(i) == block) return;
+    slot->set(i, block);
+    voxelMarkDirty(cx, cy, cz);
+    const int last = voxelChunkSize - 1;
+    if (lx == 0) voxelMarkDirty(cx - 1, cy, cz);
+    if (lx == last) voxelMarkDirty(cx + 1, cy, cz);
+    if (ly == 0) voxelMarkDirty(cx, cy - 1, cz);
+    if (ly == last) voxelMarkDirty(cx, cy + 1, cz);
+    if (lz == 0) voxelMarkDirty(cx, cy, cz - 1);
+    if (lz == last) voxelMarkDirty(cx, cy, cz + 1);
+}
+
+struct VoxelMeshJob {
+    int64_t key;
+    unsigned version;
+    uint8_t cells[voxelPad * voxelPad * voxelPad]; // padded, index (y*P + z)*P + x
+};
+
+struct VoxelMeshResult {
+    int64_t key;
+    unsigned version;
+    std::vector<EnvVertex> mesh;
+    size_t faces = 0; // visible faces before merging
+};
+
+// Copies a chunk and the facing layers of its six neighbours, so the mesher
+// never touches the live world
+void voxelGather(int64_t key, VoxelMeshJob& job)
+{
+    int cx, cy, cz;
+    voxelKeyCoords(key, cx, cy, cz);
+    job.key = key;
+    memset(job.cells, VOX_AIR, sizeof(job.cells));
+    auto cell = [&](int x, int y, int z) -> uint8_t& { return job.cells[((y + 1) * voxelPad + z + 1) * voxelPad + x + 1]; };
+    const VoxelChunk* c = voxelFindChunk(cx, cy, cz);
+    job.version = c ? c->version : 0;
+    const int n = voxelChunkSize;
+    if (c) {
+        for (int y = 0; y < n; ++y)
+            for (int z = 0; z < n; ++z)
+                for (int x = 0; x < n; ++x) cell(x, y, z) = c->get(voxelCellIndex(x, y, z));
+    }
+    const int dirs[6][3] = { {-1,0,0}, {1,0,0}, {0,-1,0}, {0,1,0}, {0,0,-1}, {0,0,1} };
+    for (const auto& d : dirs) {
+        const VoxelChunk* nb = voxelFindChunk(cx + d[0], cy + d[1], cz + d[2]);
+        if (!nb) continue;
+        for (int a = 0; a < n; ++a)
+            for (int b = 0; b < n; ++b) {
+                int x = d[0] ? (d[0] < 0 ? n - 1 : 0) : a;
+                int y = d[1] ? (d[1] < 0 ? n - 1 : 0) : (d[0] ? a : b);
+                int z = d[2] ? (d[2] < 0 ? n - 1 : 0) : b;
+                cell(d[0] < 0 ? -1 : d[0] > 0 ? n : x, d[1] < 0 ? -1 : d[1] > 0 ? n : y,
+                    d[2] < 0 ? -1 : d[2] > 0 ? n : z) = nb->get(voxelCellIndex(x, y, z));
+            }
+    }
+}
+
+// Greedy meshing: per axis and slice, mark faces between solid and air
+// (signed by which side is solid), then merge equal runs into rectangles
+void voxelMesh(const VoxelMeshJob& job, VoxelMeshResult& out)
+{
+    const int n = voxelChunkSize;
+    int cx, cy, cz;
+    voxelKeyCoords(job.key, cx, cy, cz);
+    const float base[3] = { (float)(cx * n), (float)(cy * n), (float)(cz * n) };
+    out.key = job.key;
+    out.version = job.version;
+    out.mesh.clear();
+    out.faces = 0;
+    int mask[voxelChunkSize * voxelChunkSize];
+    for (int d = 0; d < 3; ++d) {
+        int u = (d + 1) % 3, v = (d + 2) % 3;
+        int x[3] = { 0, 0, 0 };
+        for (x[d] = -1; x[d] < n; ++x[d]) {
+            for (x[v] = 0; x[v] < n; ++x[v])
+                for (x[u] = 0; x[u] < n; ++x[u]) {
+                    int q[3] = { x[0], x[1], x[2] };
+                    ++q[d];
+                    uint8_t a = job.cells[((x[1] + 1) * voxelPad + x[2] + 1) * voxelPad + x[0] + 1];
+                    uint8_t b = job.cells[((q[1] + 1) * voxelPad + q[2] + 1) * voxelPad + q[0] + 1];
+                    int m = 0;
+                    if (a && !b && x[d] >= 0) m = a;
+                    else if (b && !a && x[d] < n - 1) m = -(int)b;
+                    mask[x[v] * n + x[u]] = m;
+                    if (m) ++out.faces;
+                }
+            for (int j = 0; j < n; ++j)
+                for (int i = 0; i < n; ) {
+                    int m = mask[j * n + i];
+                    if (!m) { ++i; continue; }
+                    int w = 1;
+                    while (i + w < n && mask[j * n + i + w] == m) ++w;
+                    int h = 1;
+                    for (; j + h < n; ++h) {
+                        int k = 0;
+                        while (k < w && mask[(j + h) * n + i + k] == m) ++k;
+                        if (k < w) break;
+                    }
+                    for (int l = 0; l < h; ++l)
+                        for (int k = 0; k < w; ++k) mask[(j + l) * n + i + k] = 0;
+
+                    float p[3];
+                    p[d] = base[d] + x[d] + 1;
+                    p[u] = base[u] + i;
+                    p[v] = base[v] + j;
+                    float du[3] = { 0, 0, 0 }, dv[3] = { 0, 0, 0 };
+                    du[u] = (float)w;
+                    dv[v] = (float)h;
+                    EnvVertex vtx;
+                    vtx.n[0] = vtx.n[1] = vtx.n[2] = 0.0f;
+                    vtx.n[d] = m > 0 ? 1.0f : -1.0f;
+                    memcpy(vtx.c, voxelColors[m > 0 ? m : -m], 4);
+                    // Counter-clockwise seen from the side the normal points to
+                    const float* corner[4][2] = { { nullptr, nullptr }, { du, nullptr }, { du, dv }, { nullptr, dv } };
+                    for (int k = 0; k < 4; ++k) {
+                        int c = m > 0 ? k : 3 - k;
+                        for (int e = 0; e < 3; ++e)
+                            vtx.p[e] = p[e] + (corner[c][0] ? corner[c][0][e] : 0.0f) + (corner[c][1] ? corner[c][1][e] : 0.0f);
+                        out.mesh.push_back(vtx);
+                    }
+                    i += w;
+                }
+        }
+    }
+}
+
+// Mesher pool: jobs in, finished meshes out, applied on the main thread
+std::mutex voxelMutex;
+std::condition_variable voxelWake;
+std::deque<std::unique_ptr<VoxelMeshJob>> voxelJobs;
+std::vector<VoxelMeshResult> voxelResults;
+std::atomic<int> voxelOutstanding(0);
+std::vector<std::thread> voxelWorkers;
+bool voxelQuit = false;
+
+static void voxelWorkerMain()
+{
+    if (traceEnabled) traceThread("voxel mesher");
+    VoxelMeshResult result;
+    for (;;) {
+        std::unique_ptr<VoxelMeshJob> job;
+        {
+            std::unique_lock<std::mutex> lock(voxelMutex);
+            voxelWake.wait(lock, [] { return voxelQuit || !voxelJobs.empty(); });
+            if (voxelQuit) return;
+            job = std::move(voxelJobs.front());
+            voxelJobs.pop_front();
+        }
+        {
+            TraceScope trace("voxel mesh");
+            voxelMesh(*job, result);
+        }
+        {
+            std::lock_guard<std::mutex> lock(voxelMutex);
+            voxelResults.push_back(std::move(result));
+        }
+        result = VoxelMeshResult();
+    }
+}
+
+// Registered with atexit so the workers are gone before the mutex and
+// condition variable they wait on are destroyed
+static void voxelStopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(voxelMutex);
+        voxelQuit = true;
+    }
+    voxelWake.notify_all();
+    for (std::thread& t : voxelWorkers) t.join();
+    voxelWorkers.clear();
+}
+
+void voxelSubmit(int64_t key)
+{
+    if (voxelWorkers.empty()) {
+        int count = (int)std::max(2u, std::thread::hardware_concurrency()) - 1;
+        for (int i = 0; i < count; ++i) voxelWorkers.emplace_back(voxelWorkerMain);
+        atexit(voxelStopWorkers);
+    }
+    std::unique_ptr<VoxelMeshJob> job(new VoxelMeshJob());
+    voxelGather(key, *job);
+    ++voxelOutstanding;
+    {
+        std::lock_guard<std::mutex> lock(voxelMutex);
+        voxelJobs.push_back(std::move(job));
+    }
+    voxelWake.notify_one();
+}
+
+// Queues dirty chunks and installs finished meshes; returns meshes installed
+int updateVoxels()
+{
+    for (int64_t key : voxelDirty) {
+        auto it = voxelChunks.find(key);
+        if (it == voxelChunks.end()) continue;
+        it->second->dirty = false;
+        voxelSubmit(key);
+    }
+    voxelDirty.clear();
+
+    std::vector<VoxelMeshResult> done;
+    {
+        std::lock_guard<std::mutex> lock(voxelMutex);
+        done.swap(voxelResults);
+    }
+    int installed = 0;
+    for (VoxelMeshResult& r : done) {
+        --voxelOutstanding;
+        auto it = voxelChunks.find(r.key);
+        // A newer edit has its own job in flight; keep the old mesh until then
+        if (it == voxelChunks.end() || r.version != it->second->version) continue;
+        it->second->mesh.swap(r.mesh);
+        it->second->meshedVersion = r.version;
+        ++installed;
+    }
+    return installed;
+}
+
+void drawVoxels(float eyeX, float eyeZ, float scale)
+{
+    updateVoxels();
+    const float range = 120.0f + voxelChunkSize;
+    for (const auto& kv : voxelChunks) {
+        if (kv.second->mesh.empty()) continue;
+        int cx, cy, cz;
+        voxelKeyCoords(kv.first, cx, cy, cz);
+        float dx = ((cx + 0.5f) * voxelChunkSize) * scale - eyeX, dz = ((cz + 0.5f) * voxelChunkSize) * scale - eyeZ;
+        if (dx * dx + dz * dz > range * range) continue;
+        drawEnvStream(kv.second->mesh, GL_QUADS);
+    }
+}
+
+// A small snow fort north of the spawn clearing
+void generateVoxelWorld()
+{
+    for (int x = -5; x <= 5; ++x)
+        for (int y = 0; y < 3; ++y) {
+            voxelSet(x, y, -9, VOX_PACKED_SNOW);
+            if (y < 2 || (x & 1)) voxelSet(x, y, -8, VOX_SNOW);
+        }
+    for (int y = 0; y < 6; ++y)
+        for (int z = -11; z <= -9; ++z)
+            for (int x = 6; x <= 8; ++x) voxelSet(x, y, z, y == 5 ? VOX_SNOW : VOX_ICE);
+}
+
+// Column in front of the snowman: 'v' stacks a block on it, 'V' takes the top one off
+void editVoxelInFront(bool place)
+{
+    float rad = headingDeg * 3.1415926f / 180.0f;
+    int x = (int)std::floor(snowmanX + sinf(rad) * 3.0f), z = (int)std::floor(snowmanZ + cosf(rad) * 3.0f);
+    int top = 0;
+    while (top < 64 && voxelGet(x, top, z) != VOX_AIR) ++top;
+    if (place) voxelSet(x, top, z, VOX_SNOW);
+    else if (top > 0) voxelSet(x, top - 1, z, VOX_AIR);
+}
+
+// Rolling terrain of 32x4x32 chunks: single-thread and pooled meshing
+// throughput, then the cost of remeshing after single-block edits
+void benchVoxels()
+{
+    const int span = 32 * voxelChunkSize;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int z = 0; z < span; ++z)
+        for (int x = 0; x < span; ++x) {
+            int h = 20 + (int)(10.0f * sinf(x * 0.045f) * cosf(z * 0.06f) + 5.0f * sinf((x + z) * 0.13f));
+            for (int y = 0; y < std::max(h, 16); ++y)
+                voxelSet(x, y, z, y >= h ? VOX_ICE : y == h - 1 ? VOX_SNOW : VOX_PACKED_SNOW);
+        }
+    double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    size_t paletteBytes = 0;
+    for (const auto& kv : voxelChunks) paletteBytes += kv.second->packed.size() * 8 + kv.second->palette.size();
+    printf("voxel: %zu chunks  filled in %.0f ms  %.1f KB packed (%.1f KB as bytes)\n", voxelChunks.size(), buildMs,
+        paletteBytes / 1024.0, voxelChunks.size() * 4096 / 1024.0);
+
+    std::vector<int64_t> keys;
+    for (const auto& kv : voxelChunks) keys.push_back(kv.first);
+    voxelDirty.clear();
+    for (const auto& kv : voxelChunks) kv.second->dirty = false;
+    std::unique_ptr<VoxelMeshJob> job(new VoxelMeshJob());
+    VoxelMeshResult result;
+    size_t faces = 0, quads = 0;
+    double gatherMs = 0.0;
+    t0 = std::chrono::steady_clock::now();
+    for (int64_t key : keys) {
+        auto g0 = std::chrono::steady_clock::now();
+        voxelGather(key, *job);
+        gatherMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - g0).count();
+        voxelMesh(*job, result);
+        faces += result.faces;
+        quads += result.mesh.size() / 4;
+    }
+    double serialMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    printf("voxel: 1 thread   %.0f chunks/s  (gather %.0f ms of %.0f ms)  %zu faces -> %zu greedy quads\n",
+        keys.size() * 1000.0 / serialMs, gatherMs, serialMs, faces, quads);
+
+    t0 = std::chrono::steady_clock::now();
+    for (int64_t key : keys) voxelSubmit(key);
+    while (voxelOutstanding > 0) {
+        updateVoxels();
+        std::this_thread::yield();
+    }
+    double pooledMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    printf("voxel: %d workers %.0f chunks/s  (%.0f ms)\n", (int)voxelWorkers.size(), keys.size() * 1000.0 / pooledMs, pooledMs);
+
+    std::mt19937 rng(77);
+    double worstMs = 0.0, totalMs = 0.0;
+    size_t remeshed = 0;
+    const int edits = 200;
+    for (int e = 0; e < edits; ++e) {
+        int x = (int)(rng() % span), z = (int)(rng() % span), y = 0;
+        while (voxelGet(x, y, z) != VOX_AIR) ++y;
+        t0 = std::chrono::steady_clock::now();
+        voxelSet(x, y - (e & 1), z, (e & 1) ? VOX_AIR : VOX_WOOD);
+        remeshed += voxelDirty.size();
+        updateVoxels();
+        while (voxelOutstanding > 0) {
+            updateVoxels();
+            std::this_thread::yield();
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        worstMs = std::max(worstMs, ms);
+        totalMs += ms;
+    }
+    printf("voxel: edit -> mesh installed avg %.3f ms  worst %.3f ms  %.2f chunks remeshed per edit\n",
+        totalMs / edits, worstMs, (double)remeshed / edits);
+}
+
+// --- Picking ---
+// Rays from the cursor walk the grids the world is already indexed by with
+// Amanatides-Woo DDA: the 2D environment and snowman hashes for trees, ice
+// blocks and snowmen, and the unit voxel grid for blocks. Each walk stops at
+// the nearest hit so far, so cost follows ray length, not world size.
+enum PickKind { PICK_NONE, PICK_GROUND, PICK_TREE, PICK_ICE, PICK_SNOWMAN, PICK_VOXEL };
+
+struct PickHit {
+    PickKind kind = PICK_NONE;
+    int index = -1;               // tree, ice block or snowmanBodies entry
+    float t = 0.0f;               // distance along the (unit) ray
+    float x = 0, y = 0, z = 0;    // hit point
+    int cell[3] = { 0, 0, 0 };    // voxel or ground cell
+    int normal[3] = { 0, 0, 0 };  // voxel face that was entered
+};
+
+// Camera of the last frame, for turning cursor positions into rays
+float pickEye[3] = { 0, 4, 9 }, pickCenter[3] = { 0, 4, 0 }, pickScale = 1.0f;
+PickHit pickHover;
+int pickMouseX = -1, pickMouseY = -1; // last cursor position, -1 until it moves
+
+// Unprojects a window position through the gluLookAt/gluPerspective pair
+// display() and reshape() set up (60 degree fov, far plane 100), returning
+// the ray in world units and how far it may go
+float pickRay(int mx, int my, int w, int h, float origin[3], float dir[3])
+{
+    float f[3] = { pickCenter[0] - pickEye[0], pickCenter[1] - pickEye[1], pickCenter[2] - pickEye[2] };
+    float fl = std::sqrt(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+    for (float& v : f) v /= fl;
+    float sx = -f[2], sz = f[0];
+    float sl = std::sqrt(sx * sx + sz * sz);
+    sx /= sl; sz /= sl;
+    float u[3] = { -sz * f[1], sz * f[0] - sx * f[2], sx * f[1] };
+    float tanHalf = tanf(30.0f * 3.1415926f / 180.0f), aspect = (float)w / std::max(h, 1);
+    float nx = (2.0f * (mx + 0.5f) / w - 1.0f) * tanHalf * aspect;
+    float ny = (1.0f - 2.0f * (my + 0.5f) / h) * tanHalf;
+    float d[3] = { f[0] + sx * nx + u[0] * ny, f[1] + u[1] * ny, f[2] + sz * nx + u[2] * ny };
+    float dl = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    for (int i = 0; i < 3; ++i) {
+        origin[i] = pickEye[i] / pickScale;
+        dir[i] = d[i] / dl;
+    }
+    return 100.0f / pickScale;
+}
+
+// Visits the cells of a 2D grid the ray's xz shadow crosses, in order,
+// until visit(cx, cz, tExit) returns false or t passes tMax
+template <typename Visit>
+void pickWalk2D(float cell, const float o[3], const float d[3], float tMax, Visit visit)
+{
+    int c[2] = { (int)std::floor(o[0] / cell), (int)std::floor(o[2] / cell) };
+    float od[2] = { o[0], o[2] }, dd[2] = { d[0], d[2] };
+    int step[2];
+    float next[2], delta[2];
+    for (int a = 0; a < 2; ++a) {
+        step[a] = dd[a] > 0 ? 1 : -1;
+        delta[a] = dd[a] != 0.0f ? cell / std::fabs(dd[a]) : 1e30f;
+        float edge = (c[a] + (dd[a] > 0 ? 1 : 0)) * cell;
+        next[a] = dd[a] != 0.0f ? (edge - od[a]) / dd[a] : 1e30f;
+    }
+    for (;;) {
+        int a = next[0] < next[1] ? 0 : 1;
+        float tExit = std::min(next[a], tMax);
+        if (!visit(c[0], c[1], tExit) || next[a] >= tMax) return;
+        c[a] += step[a];
+        next[a] += delta[a];
+    }
+}
+
+// Ray against an axis-aligned box; returns the entry distance or -1
+static float pickBox(const float o[3], const float d[3], const float lo[3], const float hi[3])
+{
+    float t0 = 0.0f, t1 = 1e30f;
+    for (int a = 0; a < 3; ++a) {
+        if (std::fabs(d[a]) < 1e-9f) {
+            if (o[a] < lo[a] || o[a] > hi[a]) return -1.0f;
+            continue;
+        }
+        float ta = (lo[a] - o[a]) / d[a], tb = (hi[a] - o[a]) / d[a];
+        t0 = std::max(t0, std::min(ta, tb));
+        t1 = std::min(t1, std::max(ta, tb));
+    }
+    return t0 <= t1 ? t0 : -1.0f;
+}
+
+// Ray against a tree: its bounding box, then a march through insideTree
+static float pickTree(const Tree& t, const float o[3], const float d[3])
+{
+    float lo[3] = { t.x - t.r, 0.0f, t.z - t.h * 0.1f - t.r }, hi[3] = { t.x + t.r, t.h * 0.93f + 1.0f, t.z + t.r };
+    float t0 = pickBox(o, d, lo, hi);
+    if (t0 < 0.0f) return -1.0f;
+    const float stepLen = 0.1f;
+    for (int i = 0; i < 400; ++i) {
+        float s = t0 + i * stepLen;
+        float p[3] = { o[0] + d[0] * s, o[1] + d[1] * s, o[2] + d[2] * s };
+        if (p[0] < lo[0] - stepLen || p[0] > hi[0] + stepLen || p[2] < lo[2] - stepLen || p[2] > hi[2] + stepLen) break;
+        if (insideTree(t, p[0], p[1], p[2])) return s;
+    }
+    return -1.0f;
+}
+
+PickHit pickWorld(const float o[3], const float d[3], float tMax)
+{
+    PickHit best;
+    best.t = tMax;
+    auto take = [&](PickKind kind, int index, float t) {
+        if (t < 0.0f || t >= best.t) return;
+        best.kind = kind;
+        best.index = index;
+        best.t = t;
+    };
+
+    // Ground plane bounds every other walk
+    if (d[1] < 0.0f && o[1] > 0.0f) {
+        float t = -o[1] / d[1];
+        if (t < best.t) {
+            take(PICK_GROUND, -1, t);
+            best.cell[0] = (int)std::floor(o[0] + d[0] * t);
+            best.cell[1] = -1;
+            best.cell[2] = (int)std::floor(o[2] + d[2] * t);
+            best.normal[1] = 1;
+        }
     }
-    std::uniform_real_distribution<float> bs(2.0f, 3.2f);
-    for (int i = 0; i < 12; ++i) {
-        float x = dist(rng), z = dist(rng);
-        if (std::sqrt(x * x + z * z) < 8.5f) continue;
-        IceBlock b; b.x = x; b.z = z; b.s = bs(rng);
-        iceblocks.push_back(b);
+
+    if (envHashVersion != environmentVersion) rebuildEnvHash();
+    int nt = (int)trees.size();
+    const float envTop = envMaxHeight;
+    pickWalk2D(envHash.cell, o, d, best.t, [&](int cx, int cz, float tExit) {
+        const int *it, *end;
+        envHash.queryCell(cx, cz, it, end);
+        for (; it != end; ++it) {
+            if (*it < nt) take(PICK_TREE, *it, pickTree(trees[*it], o, d));
+            else {
+                const IceBlock& b = iceblocks[*it - nt];
+                float lo[3] = { b.x - b.s / 2, 0.0f, b.z - b.s / 2 }, hi[3] = { b.x + b.s / 2, b.s, b.z + b.s / 2 };
+                take(PICK_ICE, *it - nt, pickBox(o, d, lo, hi));
+            }
+        }
+        // Done once something is closer than the cell exit or the ray has climbed out
+        float yExit = o[1] + d[1] * tExit;
+        return best.t > tExit && !(d[1] >= 0.0f && yExit > envTop);
+    });
+    pickWalk2D(snowmanHash.cell, o, d, best.t, [&](int cx, int cz, float tExit) {
+        const int *it, *end;
+        snowmanHash.queryCell(cx, cz, it, end);
+        for (; it != end; ++it) {
+            const SnowmanBody& b = snowmanBodies[*it];
+            float lo[3] = { b.x - snowmanHalfWidth, 0.0f, b.z - snowmanHalfWidth };
+            float hi[3] = { b.x + snowmanHalfWidth, snowmanHeight, b.z + snowmanHalfWidth };
+            take(PICK_SNOWMAN, *it, pickBox(o, d, lo, hi));
+        }
+        float yExit = o[1] + d[1] * tExit;
+        return best.t > tExit && !(d[1] >= 0.0f && yExit > snowmanHeight);
+    });
+
+    // Unit voxel grid, 3D DDA; chunk lookups are cached while the walk
+    // stays inside one chunk
+    if (!voxelChunks.empty()) {
+        int c[3], step[3];
+        float next[3], delta[3];
+        for (int a = 0; a < 3; ++a) {
+            c[a] = (int)std::floor(o[a]);
+            step[a] = d[a] > 0 ? 1 : -1;
+            delta[a] = d[a] != 0.0f ? 1.0f / std::fabs(d[a]) : 1e30f;
+            next[a] = d[a] != 0.0f ? ((c[a] + (d[a] > 0 ? 1 : 0)) - o[a]) / d[a] : 1e30f;
+        }
+        int lastKey[3] = { INT32_MIN, 0, 0 };
+        const VoxelChunk* chunk = nullptr;
+        float t = 0.0f;
+        int entered = -1;
+        while (t < best.t) {
+            int k[3] = { voxelFloorDiv(c[0]), voxelFloorDiv(c[1]), voxelFloorDiv(c[2]) };
+            if (k[0] != lastKey[0] || k[1] != lastKey[1] || k[2] != lastKey[2]) {
+                chunk = voxelFindChunk(k[0], k[1], k[2]);
+                memcpy(lastKey, k, sizeof(k));
+            }
+            if (chunk && chunk->get(voxelCellIndex(c[0] - k[0] * voxelChunkSize, c[1] - k[1] * voxelChunkSize,
+                c[2] - k[2] * voxelChunkSize)) != VOX_AIR) {
+                take(PICK_VOXEL, -1, t);
+                memcpy(best.cell, c, sizeof(c));
+                best.normal[0] = best.normal[1] = best.normal[2] = 0;
+                if (entered >= 0) best.normal[entered] = -step[entered];
+                break;
+            }
+            // Below the ground nothing more can be hit
+            if (c[1] < 0 && d[1] <= 0.0f) break;
+            int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+            t = next[a];
+            c[a] += step[a];
+            next[a] += delta[a];
+            entered = a;
+        }
+    }
+
+    if (best.kind != PICK_NONE) {
+        best.x = o[0] + d[0] * best.t;
+        best.y = o[1] + d[1] * best.t;
+        best.z = o[2] + d[2] * best.t;
     }
+    return best;
 }
 
-void drawPineTree(float h, float r) {
-    // Brown trunk
-    glColor3f(0.33f, 0.20f, 0.12f);
+PickHit pickAtCursor(int mx, int my)
+{
+    float o[3], d[3];
+    float tMax = pickRay(mx, my, glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT), o, d);
+    return pickWorld(o, d, tMax);
+}
+
+// Outline around whatever the cursor is over
+void drawPickHover()
+{
+    const PickHit& h = pickHover;
+    float cx, cy, cz, sx, sy, sz;
+    switch (h.kind) {
+    case PICK_VOXEL:
+    case PICK_GROUND:
+        cx = h.cell[0] + 0.5f; cy = h.cell[1] + 0.5f; cz = h.cell[2] + 0.5f; sx = sy = sz = 1.02f;
+        break;
+    case PICK_ICE: {
+        if (h.index >= (int)iceblocks.size()) return;
+        const IceBlock& b = iceblocks[h.index];
+        cx = b.x; cy = b.s / 2; cz = b.z; sx = sy = sz = b.s * 1.04f;
+        break;
+    }
+    case PICK_TREE: {
+        if (h.index >= (int)trees.size()) return;
+        const Tree& t = trees[h.index];
+        cx = t.x; cy = (t.h * 0.93f + 1.0f) / 2; cz = t.z - t.h * 0.05f;
+        sx = t.r * 2; sy = t.h * 0.93f + 1.0f; sz = t.r * 2 + t.h * 0.1f;
+        break;
+    }
+    case PICK_SNOWMAN: {
+        if (h.index >= (int)snowmanBodies.size()) return;
+        const SnowmanBody& b = snowmanBodies[h.index];
+        cx = b.x; cy = snowmanHeight / 2; cz = b.z; sx = sz = snowmanHalfWidth * 2; sy = snowmanHeight;
+        break;
+    }
+    default:
+        return;
+    }
+    glDisable(GL_LIGHTING);
+    glColor3f(1.0f, 0.85f, 0.2f);
+    glLineWidth(2.0f);
     glPushMatrix();
-    glTranslatef(0, h * 0.15f, 0);
-    glRotatef(270, 1, 0, 0);
-    gluCylinder(quad, r * 0.20, r * 0.12, h * 0.3f, 8, 2);
-    // Green cone
-    glColor3f(0.19f, 0.41f, 0.1f); // deep pine
-    glTranslatef(0, h * 0.1f, 1); // Move to top of trunk
-    glRotatef(360, 1, 0, 0);
-    glutSolidCone(r, h * 0.78, 16, 3);
+    glTranslatef(cx, cy, cz);
+    glScalef(sx, sy, sz);
+    glutWireCube(1.0);
     glPopMatrix();
+    glLineWidth(1.0f);
+    glEnable(GL_LIGHTING);
+}
+
+// Random rays over small and large worlds: per-ray cost should follow ray
+// length, not how much is in the world
+void benchPick()
+{
+    for (int pass = 0; pass < 2; ++pass) {
+        EnvironmentParams p;
+        p.extent = pass == 0 ? 100.0f : 1000.0f;
+        p.treeCount = pass == 0 ? 1000 : 100000;
+        p.iceCount = p.treeCount / 4;
+        generateEnvironment(p, trees, iceblocks);
+        ++environmentVersion;
+        rebuildEnvHash();
+        voxelChunks.clear();
+        int span = pass == 0 ? 64 : 512;
+        for (int z = -span; z < span; z += 3)
+            for (int x = -span; x < span; x += 3)
+                if ((x * 7 + z * 13) % 5 == 0) voxelSet(x, 0, z, VOX_SNOW);
+        snowmanBodies.clear();
+        std::mt19937 rng(5);
+        std::uniform_real_distribution<float> pos(-p.extent, p.extent);
+        for (int i = 0; i < 200 * (pass + 1); ++i) snowmanBodies.push_back({ pos(rng), pos(rng), i });
+        snowmanHash.cell = 4.0f;
+        snowmanHash.build((int)snowmanBodies.size(), [&](int i, float& x0, float& z0, float& x1, float& z1) {
+            x0 = snowmanBodies[i].x - snowmanHalfWidth; x1 = snowmanBodies[i].x + snowmanHalfWidth;
+            z0 = snowmanBodies[i].z - snowmanHalfWidth; z1 = snowmanBodies[i].z + snowmanHalfWidth;
+        });
+
+        const float lengths[3] = { 10.0f, 40.0f, 100.0f };
+        for (float len : lengths) {
+            const int rays = 20000;
+            int hits[PICK_VOXEL + 1] = {};
+            std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+            auto t0 = std::chrono::steady_clock::now();
+            for (int r = 0; r < rays; ++r) {
+                float o[3] = { pos(rng) * 0.9f, 6.0f, pos(rng) * 0.9f };
+                float d[3] = { unit(rng), -0.05f - 0.1f * std::fabs(unit(rng)), unit(rng) };
+                float l = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+                for (float& v : d) v /= l;
+                ++hits[pickWorld(o, d, len).kind];
+            }
+            double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count() / rays;
+            printf("pick: world %4.0f  %6zu objects  ray %3.0f  %.2f us/ray  hits tree %d ice %d snowman %d voxel %d ground %d\n",
+                p.extent * 2, trees.size() + iceblocks.size() + snowmanBodies.size(), len, us,
+                hits[PICK_TREE], hits[PICK_ICE], hits[PICK_SNOWMAN], hits[PICK_VOXEL], hits[PICK_GROUND]);
+        }
+    }
+}
+
+// Times the parallel stages single-threaded and then with `workers` extra
+// threads (default one per extra core); on one core both rows match,
+// showing the scheduler costs nothing when it has no one to share with
+void benchJobs(int workers)
+{
+    EnvironmentParams p;
+    p.extent = 400.0f;
+    p.treeCount = 20000;
+    p.iceCount = 5000;
+    generateEnvironment(p, trees, iceblocks);
+    ++environmentVersion;
+    rebuildEnvHash();
+    treeVisible.assign(trees.size(), 1);
+    iceVisible.assign(iceblocks.size(), 1);
+    float mv[16], pr[16];
+    lookAtMatrix(0.0f, 6.0f, 0.0f, 10.0f, 4.0f, 10.0f, 1.0f, mv);
+    perspectiveMatrix(60.0f, 1.5f, 0.1f, 400.0f, pr);
+    multiplyMatrix(pr, mv, occMVP);
+    memset(occDepth, 0, sizeof(occDepth));
+    for (int i = 0; i < maxOccluders && i < (int)trees.size(); ++i) occRasterCone(trees[i]);
+
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<float> pos(-p.extent, p.extent), vel(-12.0f, 12.0f), up(2.0f, 10.0f);
+    snowmanBodies.clear();
+    for (int i = 0; i < 64; ++i) snowmanBodies.push_back({ pos(rng), pos(rng), i + 1 });
+    snowballPuffs = false;
+
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (int pass = 0; pass < 2; ++pass) {
+        jobStart(pass == 0 ? 0 : workers);
+        const int reps = 60;
+        const float dt = 1.0f / 60.0f;
+        double ballMs = 0, particleMs = 0, occMs = 0;
+        for (int r = 0; r < reps; ++r) {
+            FrameArenaScope arena;
+            while (snowballs.size() < 50000)
+                throwSnowball(pos(rng), 1.0f + up(rng) * 0.3f, pos(rng), vel(rng), up(rng), vel(rng), 0);
+            while (particles.size() < 200000) {
+                Particle q = { pos(rng), 0.05f, pos(rng), 0.0f, 0.5f + (rng() % 100) / 100.0f };
+                particles.push_back(q);
+            }
+            auto t0 = std::chrono::steady_clock::now();
+            updateSnowballs(dt);
+            auto t1 = std::chrono::steady_clock::now();
+            ageParticles(dt);
+            auto t2 = std::chrono::steady_clock::now();
+            std::atomic<long long> occluded(0), offscreen(0);
+            occTestAll(occluded, offscreen);
+            auto t3 = std::chrono::steady_clock::now();
+            ballMs += std::chrono::duration<double, std::milli>(t1 - t0).count();
+            particleMs += std::chrono::duration<double, std::milli>(t2 - t1).count();
+            occMs += std::chrono::duration<double, std::milli>(t3 - t2).count();
+        }
+        printf("jobs: %u threads  snowballs %.3f ms  particles %.3f ms  occlusion tests %.3f ms  (%zu objects)\n",
+            (unsigned)jobThreads.size(), ballMs / reps, particleMs / reps, occMs / reps, trees.size() + iceblocks.size());
+    }
+    printf("jobs: %u hardware threads\n", cores);
 }
 
+// Key repeats don't change anything, so only real transitions are timed
+void setMoveKey(bool& flag, bool down)
+{
+    if (flag != down) noteInput(LAT_KEY);
+    flag = down;
+}
 
 void keyboard(unsigned char key, int x, int y)
 {
     switch (key) {
     case 27: exit(0); break;
-    case 'z': scaleFactor *= 1.1f; break;
-    case 'x': scaleFactor *= 0.9f; break;
-    case 'w': keyW = true; break;
-    case 's': keyS = true; break;
-    case 'a': keyA = true; break;
-    case 'd': keyD = true; break;
-    case 'h': keyH = true; break;
+    case 'z': scaleFactor *= 1.1f; noteInput(LAT_ORBIT); break;
+    case 'x': scaleFactor *= 0.9f; noteInput(LAT_ORBIT); break;
+    case 'w': setMoveKey(keyW, true); break;
+    case 's': setMoveKey(keyS, true); break;
+    case 'a': setMoveKey(keyA, true); break;
+    case 'd': setMoveKey(keyD, true); break;
+    case 'h': setMoveKey(keyH, true); break;
+    case 'k': lateLatch = !lateLatch; break;
+    case 'f': keyF = true; break;
+    case 'g': keyG = true; break;
+    case 'n': navAgentCount += 10; break;
+    case 'b': {
+        float rad = headingDeg * 3.1415926f / 180.0f;
+        addIceBlock({ snowmanX + sinf(rad) * 4.0f, snowmanZ + cosf(rad) * 4.0f, 2.4f });
+        break;
+    }
+    case 'B': removeLastIceBlock(); break;
+    case 'i': impostorsEnabled = !impostorsEnabled; break;
+    case 'o': occlusionEnabled = !occlusionEnabled; break;
+    case 'p': profilerEnabled = !profilerEnabled; break;
+    case 'c': glCaptureArmed = true; break;
+    case 't': traceDump(); break;
+    case 'j': shadowsEnabled = !shadowsEnabled; break;
+    case 'u': residentParticles = !residentParticles; break;
+    case 'm': minimapEnabled = !minimapEnabled; break;
+    case 'r': toggleRewind(); break;
+    case 'v': editVoxelInFront(true); break;
+    case 'V': editVoxelInFront(false); break;
+    case '[': if (rewindActive) rewindSeek(-rewindRate / 2); break;
+    case ']': if (rewindActive) rewindSeek(rewindRate / 2); break;
+    case 'l': pointLightCount = pointLightCount == 0 ? 1 : (pointLightCount >= 1024 ? 0 : pointLightCount * 4); break;
 
     }
     glutPostRedisplay();
@@ -110,11 +7822,11 @@ void keyboard(unsigned char key, int x, int y)
 void keyboardUp(unsigned char key, int x, int y)
 {
     switch (key) {
-    case 'w': keyW = false; break;
-    case 's': keyS = false; break;
-    case 'a': keyA = false; break;
-    case 'd': keyD = false; break;
-    case 'h': keyH = false; break;
+    case 'w': setMoveKey(keyW, false); break;
+    case 's': setMoveKey(keyS, false); break;
+    case 'a': setMoveKey(keyA, false); break;
+    case 'd': setMoveKey(keyD, false); break;
+    case 'h': setMoveKey(keyH, false); break;
 
     }
 }
@@ -132,16 +7844,33 @@ void mouseButton(int button, int state, int x, int y)
             LeftDown = false;
         }
     }
+    // Right button breaks the block under the cursor, middle places one on the face it points at
+    if (state == GLUT_DOWN && (button == GLUT_RIGHT_BUTTON || button == GLUT_MIDDLE_BUTTON)) {
+        PickHit hit = pickAtCursor(x, y);
+        if (button == GLUT_RIGHT_BUTTON && hit.kind == PICK_VOXEL)
+            voxelSet(hit.cell[0], hit.cell[1], hit.cell[2], VOX_AIR);
+        if (button == GLUT_MIDDLE_BUTTON && (hit.kind == PICK_VOXEL || hit.kind == PICK_GROUND))
+            voxelSet(hit.cell[0] + hit.normal[0], hit.cell[1] + hit.normal[1], hit.cell[2] + hit.normal[2], VOX_SNOW);
+    }
     // Mouse wheel zoom (most freeglut/GLUT implementations)
-    if (state == GLUT_DOWN) {
-        if (button == 3) scaleFactor *= 0.9f;
-        if (button == 4) scaleFactor *= 1.1f;
+    if (state == GLUT_DOWN && (button == 3 || button == 4)) {
+        scaleFactor *= button == 3 ? 0.9f : 1.1f;
+        noteInput(LAT_ORBIT);
     }
     glutPostRedisplay();
 }
+void passiveMotion(int x, int y)
+{
+    pickMouseX = x;
+    pickMouseY = y;
+    glutPostRedisplay();
+}
 void motionWithButton(int x, int y)
 {
+    pickMouseX = x;
+    pickMouseY = y;
     if (!LeftDown) return;
+    noteInput(LAT_ORBIT);
     float sensitivity = 0.3f;
     float deltaMouseX = (float)x - clickMouseX;
     float deltaMouseY = (float)y - clickMouseY;
@@ -157,81 +7886,249 @@ void special(int key, int x, int y)
     case GLUT_KEY_RIGHT: angleY += delta; break;
     case GLUT_KEY_UP:    angleX -= delta; break;
     case GLUT_KEY_DOWN:  angleX += delta; break;
-    default: break;
+    default: return;
     }
+    noteInput(LAT_ORBIT);
     glutPostRedisplay();
 }
 
 
+unsigned playerKeys()
+{
+    return (keyW ? SNOW_KEY_W : 0) | (keyS ? SNOW_KEY_S : 0) | (keyA ? SNOW_KEY_A : 0)
+        | (keyD ? SNOW_KEY_D : 0) | (keyH ? SNOW_KEY_H : 0);
+}
+
+// Advances the local player to time (seconds since start) with the keys
+// held now
+float playerStepTime = 0.0f;
+void stepPlayer(float time)
+{
+    float delta = time - playerStepTime;
+    playerStepTime = time;
+    consumeInput(LAT_KEY);
+    playerStep.x = snowmanX; playerStep.z = snowmanZ; playerStep.heading = headingDeg;
+    playerStep.armPhase = armAnimPhase; playerStep.footPhase = footstepPhase;
+    playerStep.slashing = swordSlashing; playerStep.slashTimer = swordSlashTimer;
+    float footX = 0.0f, footZ = 0.0f;
+    bool footstep = stepSnowman(playerStep, playerKeys(), delta, footX, footZ);
+    snowmanX = playerStep.x; snowmanZ = playerStep.z; headingDeg = playerStep.heading;
+    armAnimPhase = playerStep.armPhase; footstepPhase = playerStep.footPhase;
+    swordSlashing = playerStep.slashing; swordSlashTimer = playerStep.slashTimer;
+    bool walking = (playerKeys() & (SNOW_KEY_W | SNOW_KEY_S)) != 0;
+    playerIdle = walking ? std::max(0.0f, playerIdle - delta * 4.0f) : std::min(1.0f, playerIdle + delta * 2.0f);
+
+    if (footstep) {
+        spawnFootprint(footX, footZ);
+        netNoteFootstep(footX, footZ);
+    }
+}
+
+// One simulation tick at time (seconds since start); false while the
+// rewind buffer holds the world paused
+bool simulateTick(float time, float delta)
+{
+    if (!updateRewind(delta)) {
+        playerStepTime = time;
+        return false;
+    }
+
+    // Tick graph: snowmen (player, network, throws, agents) then snowballs;
+    // aging existing particles runs alongside, since new ones are staged
+    auto snowmen = [&] {
+        ProfileScope zone(PROF_SNOWMEN);
+        // Late latching steps the player from display() instead
+        if (!lateLatch) stepPlayer(time);
+        netUpdate(playerKeys(), delta);
+
+        // Snowballs: 'f' throws one from the sword hand, 'g' a stress volley
+        if (keyF || keyG) {
+            float rad = headingDeg * 3.1415926f / 180.0f;
+            float fx = sinf(rad), fz = cosf(rad);
+            int volley = keyF ? 1 : 500;
+            for (int i = 0; i < volley; ++i) {
+                float spread = keyG ? (simRand() % 200 - 100) / 100.0f * 4.0f : 0.0f;
+                throwSnowball(snowmanX + fx * 1.2f, 3.0f, snowmanZ + fz * 1.2f,
+                    fx * 14.0f + fz * spread, 5.0f + (keyG ? (simRand() % 100) / 25.0f : 0.0f), fz * 14.0f - fx * spread, 0);
+            }
+            keyF = keyG = false;
+        }
+        updateNavigation(delta, snowmanX, snowmanZ);
+        snowmanBodies.clear();
+        snowmanBodies.push_back({ snowmanX, snowmanZ, 0 });
+        for (size_t i = 0; i < navAgents.size(); ++i)
+            snowmanBodies.push_back({ navAgents[i].x, navAgents[i].z, (int)i + 1 });
+    };
+    auto balls = [&] { ProfileScope zone(PROF_SNOWBALLS); updateSnowballs(delta); };
+    auto aging = [&] { ProfileScope zone(PROF_PARTICLES); ageParticles(delta); };
+    auto nothing = [] {};
+    Job* done = jobCreateCall(nothing);
+    Job* snowmanJob = jobCreateCall(snowmen);
+    Job* ballJob = jobCreateCall(balls);
+    Job* agingJob = jobCreateCall(aging);
+    jobDepend(snowmanJob, ballJob);
+    jobDepend(ballJob, done);
+    jobDepend(agingJob, done);
+    jobSubmit(snowmanJob);
+    jobSubmit(ballJob);
+    jobSubmit(agingJob);
+    jobSubmit(done);
+    jobWait(done);
+    flushParticleSpawns();
+    return true;
+}
+
 void idle()
 {
+    ProfileScope zone(PROF_IDLE);
+    FrameArenaScope arena;
+    auto simStart = std::chrono::steady_clock::now();
     static float lastTime = 0;
     float time = glutGet(GLUT_ELAPSED_TIME) / 1000.0f;
     float delta = time - lastTime;
     lastTime = time;
 
-    // A/D turn snowman's body (not the camera!)
-    if (keyA) headingDeg += rotSpeed * delta;
-    if (keyD) headingDeg -= rotSpeed * delta;
-
-    // Movement: move in SNOWMAN's heading
-    bool moving = false;
-    float walkDir = 0.0f;
-    if (keyS) { walkDir += 1.0f; moving = true; }
-    if (keyW) { walkDir -= 1.0f; moving = true; }
-    if (walkDir != 0.0f) {
-        float rad = -headingDeg * 3.1415926f / 180.0f;
-        snowmanX += sinf(rad) * moveSpeed * delta * walkDir;
-        snowmanZ += -cosf(rad) * moveSpeed * delta * walkDir;
-        armAnimPhase += delta * 4.0f;
-        footstepPhase += delta * 2.9f;
+    if (!simulateTick(time, delta)) {
+        glutPostRedisplay();
+        return;
     }
+    metricsSimMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - simStart).count();
+    glutPostRedisplay();
+}
 
-    armAnimAngle = 28.0f * sinf(armAnimPhase);
+// --- Scene presets ---
+// Every workload knob can be set as --<option> <value>, from a config file
+// (--config <file>, one "option = value" per line, '#' comments) or by
+// naming a preset (--scene <name>, or "scene = <name>" in a file). Later
+// settings override earlier ones, so a preset can be used as a base.
+struct ScenePreset { const char* name; const char* options; };
+const ScenePreset scenePresets[] = {
+    { "default", "extent=45 trees=38 ice=12 seed=9047 ground-repeat=10 ground-strips=32 footprint-particles=1 snowmen=0 lights=0" },
+    { "light",   "extent=45 trees=38 ice=12 seed=9047 ground-repeat=4 ground-strips=8 footprint-particles=1 snowmen=0 lights=0" },
+    { "medium",  "extent=150 trees=1500 ice=400 seed=9047 ground-repeat=10 ground-strips=32 footprint-particles=8 snowmen=50 lights=64" },
+    { "extreme", "extent=400 trees=20000 ice=5000 seed=9047 ground-repeat=16 ground-strips=64 footprint-particles=64 snowmen=500 lights=1024" },
+};
 
-    // Sword slash
-    if (keyH && !swordSlashing) {
-        swordSlashing = true;
-        swordSlashTimer = 0.0f;
-    }
-    if (swordSlashing) {
-        swordSlashTimer += delta;
-        if (swordSlashTimer >= swordSlashDuration) {
-            swordSlashing = false;
-            swordSlashTimer = 0.0f;
+bool setSceneOption(const char* name, const char* value);
+
+bool applyScenePreset(const char* name)
+{
+    for (const ScenePreset& p : scenePresets) {
+        if (strcmp(p.name, name) != 0) continue;
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%s", p.options);
+        for (char* tok = strtok(buf, " "); tok; tok = strtok(nullptr, " ")) {
+            char* eq = strchr(tok, '=');
+            *eq = 0;
+            setSceneOption(tok, eq + 1);
         }
+        return true;
     }
+    printf("scene: no preset '%s' (", name);
+    for (const ScenePreset& p : scenePresets) printf(" %s", p.name);
+    printf(" )\n");
+    return false;
+}
 
-    static float phaseRef = 0.0f;
-    static bool lastFootLeft = false;
-    float footSin = sinf(footstepPhase * 3.1415f);
-    if (moving && footSin > 0.45f && phaseRef <= 0.45f) {
-        Particle p;
-        lastFootLeft = !lastFootLeft;
-        float rad = headingDeg * 3.1415926f / 180.0f;
-        float side = lastFootLeft ? -footTrackX : footTrackX;
-        p.x = snowmanX + cosf(rad) * side;
-        p.y = 0.0f;
-        p.z = snowmanZ + sinf(rad) * side;
-        p.age = 0.0f;
-        p.life = 0.84f + 0.12f * (rand() % 100) / 100.f;
-        particles.push_back(p);
+// False if `name` is not a scene option
+bool setSceneOption(const char* name, const char* value)
+{
+    if (strcmp(name, "scene") == 0) applyScenePreset(value);
+    else if (strcmp(name, "extent") == 0) envParams.extent = std::max(5.0f, (float)atof(value));
+    else if (strcmp(name, "trees") == 0) envParams.treeCount = std::max(0, atoi(value));
+    else if (strcmp(name, "ice") == 0) envParams.iceCount = std::max(0, atoi(value));
+    else if (strcmp(name, "seed") == 0) envParams.seed = (unsigned)strtoul(value, nullptr, 10);
+    else if (strcmp(name, "ground-repeat") == 0) groundRepeat = std::max(0, atoi(value));
+    else if (strcmp(name, "ground-strips") == 0) groundStrips = std::max(1, atoi(value));
+    else if (strcmp(name, "footprint-particles") == 0) footprintParticles = std::max(0, atoi(value));
+    else if (strcmp(name, "snowmen") == 0) navAgentCount = std::max(0, atoi(value));
+    else if (strcmp(name, "lights") == 0) pointLightCount = std::max(0, atoi(value));
+    else if (strcmp(name, "minimap-rate") == 0) minimapRate = std::max(0.1f, (float)atof(value));
+    else if (strcmp(name, "minimap-move") == 0) minimapMove = std::max(0.0f, (float)atof(value));
+    else return false;
+    return true;
+}
+
+bool loadSceneConfig(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) { printf("scene: cannot open %s\n", path); return false; }
+    char line[256];
+    int lineNo = 0;
+    while (fgets(line, sizeof(line), f)) {
+        ++lineNo;
+        if (char* hash = strchr(line, '#')) *hash = 0;
+        char name[64], value[128];
+        if (sscanf(line, " %63[^= \t] = %127s", name, value) != 2) {
+            if (sscanf(line, " %63s", name) == 1) printf("scene: %s:%d: expected option = value\n", path, lineNo);
+            continue;
+        }
+        if (!setSceneOption(name, value)) printf("scene: %s:%d: unknown option '%s'\n", path, lineNo, name);
     }
-    phaseRef = footSin;
+    fclose(f);
+    return true;
+}
 
-    for (size_t i = 0; i < particles.size(); ) {
-        particles[i].age += delta;
-        particles[i].y += delta * 0.14f;
+void printScene()
+{
+    printf("scene: extent %.0f  trees %d  ice %d  seed %u  ground %dx%d tiles of %dx%d  footprint particles %d  snowmen %d  lights %d\n",
+        envParams.extent, envParams.treeCount, envParams.iceCount, envParams.seed, groundRepeat / 2 * 2 + 1, groundRepeat / 2 * 2 + 1,
+        groundStrips, groundStrips, footprintParticles, navAgentCount, pointLightCount);
+}
 
-        if (particles[i].age > particles[i].life) {
-            particles.erase(particles.begin() + i);
-        }
-        else {
-            ++i;
-        }
+// One 60 Hz step of the --check-allocs walk: circles, with a snowball
+// thrown every half second
+static float allocWalkTime = 0.0f;
+static void allocWalkTick(int t)
+{
+    const float dt = 1.0f / 60.0f;
+    keyA = t % 600 < 300; // alternate straight runs and turns
+    if (t % 30 == 0) keyF = true;
+    allocWalkTime += dt;
+    ProfileScope zone(PROF_IDLE);
+    FrameArenaScope arena;
+    simulateTick(allocWalkTime, dt);
+}
+
+// Prints each zone that allocated since the start totals; returns the count
+static long long reportAllocs(const long long startCounts[PROF_ZONE_COUNT + 1], const long long startBytes[PROF_ZONE_COUNT + 1],
+    int measured, const char* unit)
+{
+    long long counts[PROF_ZONE_COUNT + 1], bytes[PROF_ZONE_COUNT + 1];
+    allocTotals(counts, bytes);
+    long long total = 0;
+    for (int i = 0; i < PROF_ZONE_COUNT; ++i) {
+        long long n = counts[i] - startCounts[i];
+        total += n;
+        if (n > 0) printf("allocs: %-10s %lld allocations  %lld bytes over %d %s\n",
+            profileZoneNames[i], n, bytes[i] - startBytes[i], measured, unit);
     }
+    printf("allocs: other (background threads) %lld allocations\n", counts[PROF_ZONE_COUNT] - startCounts[PROF_ZONE_COUNT]);
+    return total;
+}
 
-    glutPostRedisplay();
+// Walks the player through the configured scene with agents following (64
+// unless the scene sets snowmen), and fails (exit code 1) if any tick past
+// the warm-up allocates. The warm-up covers two laps of the rewind ring:
+// one to find the entry sizes and one to size every slot for them.
+// checkDisplayAllocs then does the same for drawn frames
+int checkAllocs()
+{
+    printScene();
+    generateEnvironment();
+    if (navAgentCount == 0) navAgentCount = 64;
+    keyW = true;
+    const int warmup = 2 * rewindCapacity + 600, measured = 1800;
+    long long startCounts[PROF_ZONE_COUNT + 1], startBytes[PROF_ZONE_COUNT + 1];
+    for (int t = 0; t < warmup + measured; ++t) {
+        if (t == warmup) allocTotals(startCounts, startBytes);
+        allocWalkTick(t);
+    }
+    long long tickAllocs = reportAllocs(startCounts, startBytes, measured, "ticks");
+    printf("allocs: %d particles  %d agents  %zu snowballs  arena %zu bytes\n",
+        (int)particles.size(), (int)navAgents.size(), snowballs.size(), frameArena.capacity);
+    printf("allocs: ticks %s\n", tickAllocs == 0 ? "PASS" : "FAIL");
+    return tickAllocs == 0 ? 0 : 1;
 }
 
 void initGL()
@@ -256,6 +8153,7 @@ void initGL()
     glLightfv(GL_LIGHT0, GL_POSITION, pos);
     glEnable(GL_LIGHTING);
     quad = gluNewQuadric();
+    loadGLEntryPoints();
 }
 
 
@@ -323,18 +8221,19 @@ void drawMinecraftDiamondSword(float voxel = 0.13f, int thickness = 2, int holdX
     glPopMatrix();
 }
 
-// White cube with edge
+// White cube with edge, outlined in the same draw
 void drawSnowCube(float size)
 {
-    glPushMatrix();
-    glColor3f(1, 1, 1);
-    glutSolidCube(size);
-    glColor3f(0.86f, 0.95f, 0.98f);
-    glLineWidth(3.0f);
-    glutWireCube(size + 0.001f);
-
-    glLineWidth(1.0f);
-    glPopMatrix();
+    static const GLubyte white[4] = { 255, 255, 255, 255 };
+    if (iceUnitMesh.empty()) buildIceUnitMesh();
+    size_t count = iceUnitMesh.size();
+    EnvVertex* stream = streamAlloc(count, true);
+    float* uv = (float*)(stream + count);
+    writeScaledMesh(stream, iceUnitMesh, 0.0f, 0.0f, 0.0f, size, white);
+    memcpy(uv, iceUnitUV.data(), count * 2 * sizeof(float));
+    beginOutline(OUTLINE_SNOW);
+    drawEnvStream(stream, count, GL_TRIANGLES, uv);
+    endOutline();
 }
 
 // Carrot
@@ -398,78 +8297,13 @@ void drawIceField(float size, int strips)
     }
 }
 
-void display()
+// One snowman at (x, z) facing `heading` degrees, arms swung by `armAngle`
+// and the sword swept back by `swordExtra`
+void drawSnowman(float x, float z, float heading, float armAngle, float swordExtra)
 {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-    // --- Camera: orbit (angleX/Y, mouse) ---
-    float camY = 4.0f;
-    float camDist = 9.0f * scaleFactor;
-    float cameraOrbitYaw = angleY;
-    float camOrbitRad = cameraOrbitYaw * 3.1415926f / 180.0f;
-    float camPitchRad = angleX * 3.1415926f / 180.0f;
-    float camX = snowmanX - sinf(camOrbitRad) * cosf(camPitchRad) * camDist;
-    float camZ = snowmanZ + cosf(camOrbitRad) * cosf(camPitchRad) * camDist;
-    float camH = camY + sinf(camPitchRad) * camDist;
-
-    glLoadIdentity();
-    gluLookAt(
-        camX, camH, camZ,
-        snowmanX, camY, snowmanZ,
-        0, 1, 0);
-
-    glScalef(scaleFactor, scaleFactor, scaleFactor);
-
-    // --- Endless ground tiles ---
-    float nearTileX = groundTileSize * std::round(snowmanX / groundTileSize);
-    float nearTileZ = groundTileSize * std::round(snowmanZ / groundTileSize);
-    for (int gx = -groundRepeat / 2; gx <= groundRepeat / 2; ++gx) {
-        for (int gz = -groundRepeat / 2; gz <= groundRepeat / 2; ++gz) {
-            glPushMatrix();
-            glTranslatef(
-                nearTileX + gx * groundTileSize,
-                -0.02f,
-                nearTileZ + gz * groundTileSize
-            );
-            drawIceField(groundTileSize, 32);
-            glPopMatrix();
-        }
-    }
-
-    // --- Draw trees & iceblocks
-    for (const Tree& t : trees) {
-        glPushMatrix();
-        glTranslatef(t.x, 0, t.z);
-        drawPineTree(t.h, t.r);
-        glPopMatrix();
-    }
-    for (const IceBlock& b : iceblocks) {
-        glPushMatrix();
-        glColor3f(0.63f, 0.78f, 0.98f);
-        glTranslatef(b.x, b.s / 2.f, b.z);
-        glutSolidCube(b.s);
-        glColor3f(0.7f, 0.85f, 1.0f);
-        glutWireCube(b.s * 1.01f);
-        glPopMatrix();
-    }
-
-
-    for (const Particle& p : particles) {
-        float alpha = 1.0f - (p.age / p.life);
-        glPushMatrix();
-        glTranslatef(p.x, p.y + 0.02f, p.z);
-        glDisable(GL_LIGHTING);
-        glColor4f(0.96f, 0.95f, 0.91f, 0.38f * alpha);
-
-        glutSolidSphere(0.12f * alpha, 8, 8);
-        glEnable(GL_LIGHTING);
-        glPopMatrix();
-    }
-
-    // --- Sno
     glPushMatrix();
-    glTranslatef(snowmanX, 0.0f, snowmanZ);
-    glRotatef(headingDeg, 0, 1, 0);
+    glTranslatef(x, 0.0f, z);
+    glRotatef(heading, 0, 1, 0);
 
     float baseSize = 2.0f;
     float bodySize = 1.5f;
@@ -510,7 +8344,7 @@ void display()
     drawCarrotNose(noseLen, noseRadius);
     glPopMatrix();
 
-float armY = baseSize + bodySize * 0.5f - 0.05f;
+    float armY = baseSize + bodySize * 0.5f - 0.05f;
     float armLeftX = -(bodySize / 2 + 0.01f);
     float armRightX = (bodySize / 2 + 0.01f);
     float armZ = 0;
@@ -520,7 +8354,7 @@ float armY = baseSize + bodySize * 0.5f - 0.05f;
     glPushMatrix();
     glTranslatef(armLeftX, armY, armZ);
     glRotatef(180-outwardAngle, -1, 1, 0);        // Outward
-    glRotatef(armAnimAngle, -1, 1, 0);           // Animate
+    glRotatef(armAngle, -1, 1, 0);           // Animate
     drawBranchHand(1.25f, 0.09f);
     glPopMatrix();
 
@@ -528,7 +8362,7 @@ float armY = baseSize + bodySize * 0.5f - 0.05f;
     glPushMatrix();
     glTranslatef(armRightX, armY, armZ);
     glRotatef(outwardAngle,1 , 1, 0);         // Outward
-    glRotatef(armAnimAngle, 1, 1, 0);          // Animate
+    glRotatef(armAngle, 1, 1, 0);          // Animate
     glScalef(1, 1, -1);                         // Mirror
 
     // Sword under branch
@@ -537,12 +8371,6 @@ float armY = baseSize + bodySize * 0.5f - 0.05f;
     glRotatef(-40, 0, 0, 1);
     glRotatef(270, 1, 0, 0);
 
-    float swordExtra = 0.0f;
-    if (swordSlashing) {
-        float t = swordSlashTimer / swordSlashDuration;
-        float curve = std::sin(t * 3.14159f);
-        swordExtra = swordSlashMaxAngle * curve;
-    }
     glRotatef(-swordExtra, 0, 1, 0);
     drawMinecraftDiamondSword(0.14f);
     glPopMatrix();
@@ -569,9 +8397,116 @@ float armY = baseSize + bodySize * 0.5f - 0.05f;
     glPopMatrix();
 
     glPopMatrix(); // End of snowman
+}
 
+void display()
+{
+    if (!treeImpostorTex) buildTreeImpostors();
+    beginGLFrame();
+    ProfileScope zone(PROF_DISPLAY);
+    FrameArenaScope arena;
+    auto displayStart = std::chrono::steady_clock::now();
+    if (lateLatch && !rewindActive) stepPlayer(glutGet(GLUT_ELAPSED_TIME) / 1000.0f);
+    consumeInput(LAT_ORBIT);
+    updateMinimap(glutGet(GLUT_ELAPSED_TIME) / 1000.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    glutSwapBuffers();
+    // --- Camera: orbit (angleX/Y, mouse) ---
+    float camY = 4.0f;
+    float camDist = 9.0f * scaleFactor;
+    float cameraOrbitYaw = angleY;
+    float camOrbitRad = cameraOrbitYaw * 3.1415926f / 180.0f;
+    float camPitchRad = angleX * 3.1415926f / 180.0f;
+    {
+        // Swept in world units, i.e. eye coordinates over scaleFactor
+        static float lastCamTime = 0.0f;
+        float now = glutGet(GLUT_ELAPSED_TIME) / 1000.0f;
+        float pivot[3] = { snowmanX / scaleFactor, camY / scaleFactor, snowmanZ / scaleFactor };
+        float wanted[3] = {
+            (snowmanX - sinf(camOrbitRad) * cosf(camPitchRad) * camDist) / scaleFactor,
+            (camY + sinf(camPitchRad) * camDist) / scaleFactor,
+            (snowmanZ + cosf(camOrbitRad) * cosf(camPitchRad) * camDist) / scaleFactor };
+        camDist = cameraCollide(pivot, wanted, camDist / scaleFactor, now - lastCamTime) * scaleFactor;
+        lastCamTime = now;
+    }
+    float camX = snowmanX - sinf(camOrbitRad) * cosf(camPitchRad) * camDist;
+    float camZ = snowmanZ + cosf(camOrbitRad) * cosf(camPitchRad) * camDist;
+    float camH = camY + sinf(camPitchRad) * camDist;
+
+    glLoadIdentity();
+    gluLookAt(
+        camX, camH, camZ,
+        snowmanX, camY, snowmanZ,
+        0, 1, 0);
+
+    glScalef(scaleFactor, scaleFactor, scaleFactor);
+    // Re-specified in world space each frame so shading agrees with the
+    // ground shadows (initGL's call left it fixed to the camera)
+    const GLfloat lightPos[4] = { shadowLight[0], shadowLight[1], shadowLight[2], 1.0f };
+    glLightfv(GL_LIGHT0, GL_POSITION, lightPos);
+    pickEye[0] = camX; pickEye[1] = camH; pickEye[2] = camZ;
+    pickCenter[0] = snowmanX; pickCenter[1] = camY; pickCenter[2] = snowmanZ;
+    pickScale = scaleFactor;
+
+    // --- Endless ground tiles ---
+    {
+        TraceScope trace("ground");
+        float nearTileX = groundTileSize * std::round(snowmanX / groundTileSize);
+        float nearTileZ = groundTileSize * std::round(snowmanZ / groundTileSize);
+        for (int gx = -groundRepeat / 2; gx <= groundRepeat / 2; ++gx) {
+            for (int gz = -groundRepeat / 2; gz <= groundRepeat / 2; ++gz) {
+                glPushMatrix();
+                glTranslatef(
+                    nearTileX + gx * groundTileSize,
+                    -0.02f,
+                    nearTileZ + gz * groundTileSize
+                );
+                drawIceField(groundTileSize, groundStrips);
+                glPopMatrix();
+            }
+        }
+    }
+
+    drawShadows();
+
+    // --- Draw trees & iceblocks
+    { TraceScope trace("cull"); cullEnvironment(camX, camZ, scaleFactor); }
+    { TraceScope trace("trees"); drawTrees(camX, camH, camZ, scaleFactor); }
+    { TraceScope trace("ice blocks"); drawIceBlocks(camX, camZ, scaleFactor); }
+    { TraceScope trace("voxels"); drawVoxels(camX, camZ, scaleFactor); }
+    { TraceScope trace("point lights"); drawPointLights(glutGet(GLUT_ELAPSED_TIME) / 1000.0f); }
+    { TraceScope trace("snowballs"); drawSnowballs(); }
+    { TraceScope trace("particles"); drawParticles(); drawResidentParticles(); }
+
+    // --- Snowmen
+    {
+        TraceScope trace("snowmen");
+        float animTime = glutGet(GLUT_ELAPSED_TIME) / 1000.0f;
+        queueSnowman(snowmanX, snowmanZ, headingDeg, armAnimPhase, playerIdle, animTime, swordSlashing, swordSlashTimer);
+        queueNavAgents(camX / scaleFactor, camZ / scaleFactor, animTime);
+        queueNetSnowmen();
+        drawQueuedSnowmen();
+    }
+    { TraceScope trace("shadows"); resolveShadows(); }
+    if (pickMouseX >= 0) {
+        TraceScope trace("pick");
+        pickHover = pickAtCursor(pickMouseX, pickMouseY);
+        drawPickHover();
+    }
+    { TraceScope trace("minimap"); drawMinimap(); }
+    endStreamFrame();
+
+    { TraceScope trace("swap"); glutSwapBuffers(); }
+    if (lateLatch) { TraceScope trace("finish"); glFinish(); }
+    completeInputs();
+    static auto lastFrameEnd = displayStart;
+    auto frameEnd = std::chrono::steady_clock::now();
+    publishMetrics(std::chrono::duration<float, std::milli>(frameEnd - lastFrameEnd).count(),
+        std::chrono::duration<float, std::milli>(frameEnd - displayStart).count());
+    lastFrameEnd = frameEnd;
+    profileEndFrame();
+    latencyEndFrame();
+    allocEndFrame();
 }
 
 void reshape(int w, int h)
@@ -584,8 +8519,217 @@ void reshape(int w, int h)
     glMatrixMode(GL_MODELVIEW);
 }
 
+// --- Replay tool ---
+// --replay <file> [passes]: re-issues a captured frame in a bare window with
+// the app's initial GL state and reports raw submission cost, then exits.
+// The window is a real on-screen GLUT window: GLUT has no offscreen context,
+// so the numbers include presenting to the desktop compositor
+static std::vector<uint8_t> replayStream;
+static int replayPasses = 200;
+
+void replayDisplay()
+{
+    static GLuint placeholder = 0;
+    if (!placeholder) {
+        std::vector<GLubyte> grey(64 * 64 * 4, 160);
+        glGenTextures(1, &placeholder);
+        glBindTexture(GL_TEXTURE_2D, placeholder);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 64, 64, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey.data());
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    long long commands = replayGLStream(replayStream, quad, placeholder); // warm-up
+    glFinish();
+    double submitMs = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < replayPasses; ++i) {
+        auto passStart = std::chrono::steady_clock::now();
+        replayGLStream(replayStream, quad, placeholder);
+        submitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - passStart).count();
+        glutSwapBuffers();
+    }
+    glFinish();
+    double totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("replay: %lld commands, %zu bytes per frame\n", commands, replayStream.size());
+    printf("replay: %d passes  submit %.3f ms/frame  submit+finish %.3f ms/frame\n",
+        replayPasses, submitMs / replayPasses, totalMs / replayPasses);
+    exit(0);
+}
+
+int runReplay(int argc, char** argv, const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    uint32_t header[4];
+    if (!f || fread(header, sizeof(header), 1, f) != 1 || header[0] != glCaptureMagic) {
+        printf("replay: %s is not a capture file\n", path);
+        if (f) fclose(f);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f) - (long)sizeof(header);
+    fseek(f, sizeof(header), SEEK_SET);
+    replayStream.resize(size > 0 ? size : 0);
+    if (size > 0 && fread(replayStream.data(), 1, size, f) != (size_t)size) replayStream.clear();
+    fclose(f);
+
+    glutInit(&argc, argv);
+    glutInitDisplayMode(GLUT_DOUBLE | GLUT_DEPTH | GLUT_RGB);
+    glutInitWindowSize((int)header[2], (int)header[3]);
+    glutCreateWindow("Snow Man replay");
+    initGL();
+    // Captures carry their own projection; this covers older files
+    glutReshapeFunc(reshape);
+    glutDisplayFunc(replayDisplay);
+    glutMainLoop();
+    return 0;
+}
+
+// Benchmarks that need a live context run from the first display of a
+// bare window, with the app's initial GL state, then exit
+static void (*glBenchBody)(int) = nullptr;
+static int glBenchArg = 0;
+
+static void glBenchDisplay()
+{
+    glBenchBody(glBenchArg);
+    exit(0);
+}
+
+int runGLBench(int argc, char** argv, void (*body)(int), int arg)
+{
+    glBenchBody = body;
+    glBenchArg = arg;
+    glutInit(&argc, argv);
+    glutInitDisplayMode(GLUT_DOUBLE | GLUT_DEPTH | GLUT_RGB);
+    glutInitWindowSize(900, 600);
+    glutCreateWindow("Snow Man bench");
+    initGL();
+    glutReshapeFunc(reshape);
+    glutDisplayFunc(glBenchDisplay);
+    glutMainLoop();
+    return 0;
+}
+
+// --check-allocs, second pass: the walk goes on in a bench window with a
+// display() after every tick, warming up first so one-off caches (tree
+// impostors, shadow maps, stream ring, minimap) are built. Exits 1 if
+// either pass allocated
+static void checkDisplayAllocs(int tickStatus)
+{
+    const int warmup = 120, measured = 240;
+    long long startCounts[PROF_ZONE_COUNT + 1], startBytes[PROF_ZONE_COUNT + 1];
+    for (int f = 0; f < warmup + measured; ++f) {
+        if (f == warmup) allocTotals(startCounts, startBytes);
+        allocWalkTick(2 * rewindCapacity + 2400 + f);
+        display();
+    }
+    long long frameAllocs = reportAllocs(startCounts, startBytes, measured, "frames");
+    printf("allocs: frames %s\n", frameAllocs == 0 ? "PASS" : "FAIL");
+    bool pass = tickStatus == 0 && frameAllocs == 0;
+    printf("allocs: %s\n", pass ? "PASS - steady state allocates nothing" : "FAIL - steady state allocates");
+    exit(pass ? 0 : 1);
+}
+
+// The optional count after a bench flag; a following flag or file name is
+// left alone for the rest of the command line
+static int numericArg(int argc, char** argv, int i, int fallback)
+{
+    if (i + 1 >= argc || !argv[i + 1][0]) return fallback;
+    char* end = nullptr;
+    long v = strtol(argv[i + 1], &end, 10);
+    return *end == '\0' ? (int)v : fallback;
+}
+
 int main(int argc, char** argv)
 {
+    buildAnimClips();
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            loadSceneConfig(argv[++i]);
+            continue;
+        }
+        if (strncmp(argv[i], "--", 2) == 0 && i + 1 < argc && setSceneOption(argv[i] + 2, argv[i + 1])) {
+            ++i;
+            continue;
+        }
+        if (strcmp(argv[i], "--bench-poisson") == 0) {
+            benchPoisson(numericArg(argc, argv, i, 1000000));
+            return 0;
+        }
+        if (strcmp(argv[i], "--bench-lights") == 0) {
+            benchLights();
+            return 0;
+        }
+        if (strcmp(argv[i], "--bench-snowballs") == 0) {
+            benchSnowballs(numericArg(argc, argv, i, 50000));
+            return 0;
+        }
+        if (strcmp(argv[i], "--bench-nav") == 0) {
+            benchNav();
+            return 0;
+        }
+        if (strcmp(argv[i], "--bench-net") == 0) {
+            benchNet(numericArg(argc, argv, i, 300));
+            return 0;
+        }
+        if ((strcmp(argv[i], "--host") == 0 || strcmp(argv[i], "--join") == 0)) {
+            netMode = argv[i][2] == 'h' ? NET_HOST : NET_CLIENT;
+            int port = numericArg(argc, argv, i, 0);
+            if (port > 0 && port < 65536) { netPort = (unsigned short)port; ++i; }
+            continue;
+        }
+        if (strcmp(argv[i], "--bench-rewind") == 0) {
+            benchRewind();
+            return 0;
+        }
+        if (strcmp(argv[i], "--bench-voxels") == 0) {
+            benchVoxels();
+            return 0;
+        }
+        if (strcmp(argv[i], "--bench-pick") == 0) {
+            benchPick();
+            return 0;
+        }
+        if (strcmp(argv[i], "--bench-jobs") == 0) {
+            benchJobs(numericArg(argc, argv, i, -1));
+            return 0;
+        }
+        if (strcmp(argv[i], "--bench-streams") == 0)
+            return runGLBench(argc, argv, benchStreams, numericArg(argc, argv, i, 2000));
+        if (strcmp(argv[i], "--bench-minimap") == 0) {
+            benchMinimap();
+            return 0;
+        }
+        if (strcmp(argv[i], "--bench-particles") == 0)
+            return runGLBench(argc, argv, benchParticles, numericArg(argc, argv, i, 64));
+        if (strcmp(argv[i], "--bench-camera") == 0) {
+            benchCamera();
+            return 0;
+        }
+        if (strcmp(argv[i], "--bench-anim") == 0) {
+            benchAnim(numericArg(argc, argv, i, 10000));
+            return 0;
+        }
+        if (strcmp(argv[i], "--bench-shadows") == 0) {
+            benchShadows();
+            return 0;
+        }
+        if (strcmp(argv[i], "--check-allocs") == 0)
+            return runGLBench(argc, argv, checkDisplayAllocs, checkAllocs());
+        if (strcmp(argv[i], "--metrics-reader") == 0) {
+            runMetricsReader();
+            return 0;
+        }
+        if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            if (i + 2 < argc) replayPasses = std::max(1, atoi(argv[i + 2]));
+            return runReplay(argc, argv, argv[i + 1]);
+        }
+        if (strcmp(argv[i], "--no-metrics") == 0) metricsEnabled = false;
+        if (strcmp(argv[i], "--no-trace") == 0) traceEnabled = false;
+        if (strcmp(argv[i], "--resident-particles") == 0) residentParticles = true;
+    }
+
+    if (traceEnabled) traceThread("main");
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_DEPTH | GLUT_RGB);
     glutInitWindowSize(900, 600);
@@ -593,7 +8737,11 @@ int main(int argc, char** argv)
 
 
     initGL();
+    initMetrics();
+    netStart();
+    printScene();
     generateEnvironment();
+    generateVoxelWorld();
     glutDisplayFunc(display);
     glutReshapeFunc(reshape);
     glutKeyboardFunc(keyboard);
@@ -601,6 +8749,7 @@ int main(int argc, char** argv)
     glutSpecialFunc(special);
     glutMouseFunc(mouseButton);
     glutMotionFunc(motionWithButton);
+    glutPassiveMotionFunc(passiveMotion);
     glutIdleFunc(idle);
     glutMainLoop();
     // Optional: if (quad) gluDeleteQuadric(quad);